@@ -0,0 +1,141 @@
+#include "analysis.hpp"
+
+#include <map>
+
+namespace {
+
+struct FreeVariables : AstWalker {
+  void visitAssignment(const Assignment &let) override {
+    // The body is evaluated before the name is bound
+    let.get_body().accept(*this);
+    bind(let.get_name());
+  }
+
+  void visitDestructure(const Destructure &destructure) override {
+    destructure.get_body().accept(*this);
+    for (auto &name : destructure.get_names())
+      bind(name);
+  }
+
+  void visitFn(const Fn &fn) override {
+    for (auto &arg : fn.get_args())
+      bind(arg);
+    fn.get_body()->accept(*this);
+    for (auto &arg : fn.get_args())
+      unbind(arg);
+  }
+
+  void visitLoop(const Loop &loop) override {
+    for (auto &init : loop.get_inits())
+      init->accept(*this);
+    for (auto &var : loop.get_vars())
+      bind(var);
+    loop.get_condition().accept(*this);
+    for (auto &step : loop.get_steps())
+      step->accept(*this);
+    for (auto &var : loop.get_vars())
+      unbind(var);
+  }
+
+  void visitIdentifier(const Identifier &id) override {
+    if (!bound.contains(id))
+      free.insert(id);
+  }
+
+  void visitStatementExpr(const StatementExpr &statements) override {
+    std::vector<const Identifier *> lets;
+    for (auto &statement : statements.get_body()) {
+      statement->accept(*this);
+      if (auto let = dynamic_cast<const Assignment *>(statement.get()))
+        lets.push_back(&let->get_name());
+      if (auto let = dynamic_cast<const Destructure *>(statement.get())) {
+        for (auto &name : let->get_names())
+          lets.push_back(&name);
+      }
+    }
+    for (auto let : lets)
+      unbind(*let);
+  }
+
+  void bind(const Identifier &id) { ++bound[id]; }
+
+  void unbind(const Identifier &id) {
+    if (--bound[id] == 0)
+      bound.erase(id);
+  }
+
+  std::map<Identifier, unsigned> bound;
+  std::set<Identifier> free;
+};
+
+struct AssignedVariables : AstWalker {
+  void visitAssignment(const Assignment &let) override {
+    assigned.insert(let.get_name());
+    AstWalker::visitAssignment(let);
+  }
+  void visitDestructure(const Destructure &destructure) override {
+    assigned.insert(destructure.get_names().begin(),
+                    destructure.get_names().end());
+    AstWalker::visitDestructure(destructure);
+  }
+  void visitFn(const Fn &) override {}
+  void visitLoop(const Loop &loop) override {
+    // Only the initial values are evaluated in the enclosing environment
+    for (auto &init : loop.get_inits())
+      init->accept(*this);
+  }
+
+  std::set<Identifier> assigned;
+};
+
+struct Escapes : AstWalker {
+  // Analysed when parsed
+  void visitLazyBody(const LazyBody &) override {}
+
+  void visitApp(const App &app) override {
+    // Shared subtrees (see `nodes.hpp`) are seen again, already analysed
+    if (app.get_frame())
+      return;
+    AstWalker::visitApp(app);
+
+    // The arguments of `( ( fn ( a , b ) body ) x ) y`, innermost last
+    std::vector<const Expression *> args = {&app.get_rhs()};
+    const Expression *function = &app.get_lhs();
+    while (auto inner = dynamic_cast<const App *>(function)) {
+      args.push_back(&inner->get_rhs());
+      function = &inner->get_lhs();
+    }
+    auto fn = dynamic_cast<const Fn *>(function);
+    if (fn == nullptr || fn->get_args().size() != args.size())
+      return;
+    for (auto arg : args) {
+      if (!assigned_variables(*arg).empty())
+        return;
+    }
+
+    auto bindings = assigned_variables(*fn->get_body());
+    bindings.insert(fn->get_args().begin(), fn->get_args().end());
+    app.set_frame(std::make_unique<Frame>(
+        Frame{*fn, {args.rbegin(), args.rend()},
+              {bindings.begin(), bindings.end()}}));
+  }
+};
+
+} // namespace
+
+std::set<Identifier> free_variables(const Ast &ast) {
+  FreeVariables visitor;
+  ast.accept(visitor);
+  return visitor.free;
+}
+
+std::set<Identifier> assigned_variables(const Ast &ast) {
+  AssignedVariables visitor;
+  ast.accept(visitor);
+  return visitor.assigned;
+}
+
+void analyse_escapes(const Ast &ast) {
+  Escapes visitor;
+  ast.accept(visitor);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+/** \file
+ * \brief Static analyses over the syntax-tree
+ */
+
+#include "ast.hpp"
+
+#include <set>
+
+/// The identifiers a tree reads that are not bound inside it, i.e. those it
+/// takes from the environment it is evaluated in. A `let` inside a block binds
+/// its name for the rest of that block only, which over-approximates for lets
+/// that leak out of the block.
+std::set<Identifier> free_variables(const Ast &ast);
+
+/// The identifiers evaluating a tree can `let` into the environment it is
+/// evaluated in. Bodies of nested functions get environments of their own.
+std::set<Identifier> assigned_variables(const Ast &ast);
+
+/// Annotates the applications in a tree which apply a `fn` literal to all of
+/// its arguments with a Frame (see `App::get_frame`). Such a closure is
+/// never seen by anything but the application, so the evaluator can run its
+/// body in place, rather than copy the environment into a closure and then
+/// again to apply it. Arguments which `let` are excluded, as the closure
+/// would not see their bindings.
+void analyse_escapes(const Ast &ast);
@@ -1,18 +1,41 @@
 #include "ast.hpp"
 
 Assignment::Assignment(std::unique_ptr<Identifier> name,
-                       std::unique_ptr<Expression> body)
+                       std::shared_ptr<Expression> body)
     : name(std::move(name)), body(std::move(body)) {}
 void Assignment::accept(Visitor &v) const { v.visitAssignment(*this); }
 const Identifier &Assignment::get_name(void) const { return *name; }
 const Expression &Assignment::get_body(void) const { return *body; }
 
+uint32_t Ast::get_id(void) const { return id; }
+void Ast::set_id(uint32_t id) const { this->id = id; }
+
+Destructure::Destructure(std::vector<Identifier> names,
+                         std::shared_ptr<Expression> body)
+    : names(std::move(names)), body(std::move(body)) {}
+void Destructure::accept(Visitor &v) const { v.visitDestructure(*this); }
+const std::vector<Identifier> &Destructure::get_names(void) const {
+  return names;
+}
+const Expression &Destructure::get_body(void) const { return *body; }
+
+Proven Expression::get_proven(void) const { return proven; }
+void Expression::set_proven(Proven proven) const {
+  if (this->proven == Proven::Unchecked)
+    this->proven = proven;
+  else if (this->proven != proven)
+    this->proven = Proven::Unknown;
+}
+
 Identifier::Identifier(std::string name) : name(name) {}
 void Identifier::accept(Visitor &v) const { v.visitIdentifier(*this); }
 const std::string &Identifier::operator*() const { return name; }
 bool Identifier::operator<(const Identifier &other) const {
   return this->name < other.name;
 }
+bool Identifier::operator==(const Identifier &other) const {
+  return this->name == other.name;
+}
 
 Fn::Fn(std::vector<Identifier> args, std::shared_ptr<Ast> body)
     : args(std::move(args)), body(std::move(body)) {}
@@ -20,9 +43,18 @@ void Fn::accept(Visitor &v) const { v.visitFn(*this); }
 const std::vector<Identifier> &Fn::get_args(void) const { return args; }
 const std::shared_ptr<Ast> &Fn::get_body(void) const { return body; }
 
-IfCond::IfCond(std::unique_ptr<Expression> condition,
-               std::unique_ptr<Expression> true_case,
-               std::unique_ptr<Expression> false_case)
+LazyBody::LazyBody(std::shared_ptr<const std::string> source, size_t begin,
+                   size_t end)
+    : source(std::move(source)), begin(begin), end(end), parsed(false) {}
+void LazyBody::accept(Visitor &v) const { v.visitLazyBody(*this); }
+std::string_view LazyBody::get_source(void) const {
+  return std::string_view(*source).substr(begin, end - begin);
+}
+bool LazyBody::is_parsed(void) const { return parsed; }
+
+IfCond::IfCond(std::shared_ptr<Expression> condition,
+               std::shared_ptr<Expression> true_case,
+               std::shared_ptr<Expression> false_case)
     : condition(std::move(condition)), true_case(std::move(true_case)),
       false_case(std::move(false_case)) {}
 void IfCond::accept(Visitor &v) const { v.visitIfCond(*this); }
@@ -30,27 +62,116 @@ const Expression &IfCond::get_condition() const { return *condition; }
 const Expression &IfCond::get_true_case() const { return *true_case; }
 const Expression &IfCond::get_false_case() const { return *false_case; }
 
-App::App(std::unique_ptr<Expression> lhs, std::unique_ptr<Expression> rhs)
+Loop::Loop(std::vector<Identifier> vars,
+           std::vector<std::shared_ptr<Expression>> inits,
+           std::shared_ptr<Expression> condition,
+           std::vector<std::shared_ptr<Expression>> steps)
+    : vars(std::move(vars)), inits(std::move(inits)),
+      condition(std::move(condition)), steps(std::move(steps)) {}
+void Loop::accept(Visitor &v) const { v.visitLoop(*this); }
+const std::vector<Identifier> &Loop::get_vars(void) const { return vars; }
+const std::vector<std::shared_ptr<Expression>> &
+Loop::get_inits(void) const {
+  return inits;
+}
+const Expression &Loop::get_condition(void) const { return *condition; }
+const std::vector<std::shared_ptr<Expression>> &
+Loop::get_steps(void) const {
+  return steps;
+}
+
+App::App(std::shared_ptr<Expression> lhs, std::shared_ptr<Expression> rhs)
     : lhs(std::move(lhs)), rhs(std::move(rhs)) {}
 void App::accept(Visitor &v) const { v.visitApp(*this); }
 const Expression &App::get_lhs(void) const { return *lhs; }
 const Expression &App::get_rhs(void) const { return *rhs; }
+const Frame *App::get_frame(void) const { return frame.get(); }
+void App::set_frame(std::unique_ptr<Frame> new_frame) const {
+  frame = std::move(new_frame);
+}
 
-Binop::Binop(std::string op, std::unique_ptr<Expression> lhs,
-             std::unique_ptr<Expression> rhs)
+Binop::Binop(std::string op, std::shared_ptr<Expression> lhs,
+             std::shared_ptr<Expression> rhs)
     : op(op), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
 void Binop::accept(Visitor &v) const { v.visitBinop(*this); }
 const std::string &Binop::get_op(void) const { return op; }
 const Expression &Binop::get_lhs(void) const { return *lhs; }
 const Expression &Binop::get_rhs(void) const { return *rhs; }
 
-Number::Number(uint32_t value) : value(value) {}
+Number::Number(Integer value) : value(std::move(value)) {}
 void Number::accept(Visitor &v) const { v.visitNumber(*this); }
-uint32_t Number::operator*() const { return value; }
+const Integer &Number::operator*() const { return value; }
+
+Tuple::Tuple(std::vector<std::shared_ptr<Expression>> fields)
+    : fields(std::move(fields)) {}
+void Tuple::accept(Visitor &v) const { v.visitTuple(*this); }
+const std::vector<std::shared_ptr<Expression>> &
+Tuple::get_fields(void) const {
+  return fields;
+}
 
-StatementExpr::StatementExpr(std::vector<std::unique_ptr<Ast>> body)
+Project::Project(std::shared_ptr<Expression> tuple, uint32_t index)
+    : tuple(std::move(tuple)), index(index) {}
+void Project::accept(Visitor &v) const { v.visitProject(*this); }
+const Expression &Project::get_tuple(void) const { return *tuple; }
+uint32_t Project::get_index(void) const { return index; }
+
+StatementExpr::StatementExpr(std::vector<std::shared_ptr<Ast>> body)
     : body(std::move(body)) {}
 void StatementExpr::accept(Visitor &v) const { v.visitStatementExpr(*this); }
-const std::vector<std::unique_ptr<Ast>> &StatementExpr::get_body(void) const {
+const std::vector<std::shared_ptr<Ast>> &StatementExpr::get_body(void) const {
   return body;
 }
+
+void AstWalker::visitAssignment(const Assignment &let) {
+  let.get_name().accept(*this);
+  let.get_body().accept(*this);
+}
+void AstWalker::visitFn(const Fn &fn) {
+  for (auto &arg : fn.get_args())
+    arg.accept(*this);
+  fn.get_body()->accept(*this);
+}
+void AstWalker::visitIfCond(const IfCond &if_cond) {
+  if_cond.get_condition().accept(*this);
+  if_cond.get_true_case().accept(*this);
+  if_cond.get_false_case().accept(*this);
+}
+void AstWalker::visitLoop(const Loop &loop) {
+  for (auto &var : loop.get_vars())
+    var.accept(*this);
+  for (auto &init : loop.get_inits())
+    init->accept(*this);
+  loop.get_condition().accept(*this);
+  for (auto &step : loop.get_steps())
+    step->accept(*this);
+}
+void AstWalker::visitApp(const App &app) {
+  app.get_lhs().accept(*this);
+  app.get_rhs().accept(*this);
+}
+void AstWalker::visitBinop(const Binop &op) {
+  op.get_lhs().accept(*this);
+  op.get_rhs().accept(*this);
+}
+void AstWalker::visitNumber(const Number &) {}
+void AstWalker::visitIdentifier(const Identifier &) {}
+void AstWalker::visitStatementExpr(const StatementExpr &statements) {
+  for (auto &statement : statements.get_body())
+    statement->accept(*this);
+}
+void AstWalker::visitTuple(const Tuple &tuple) {
+  for (auto &field : tuple.get_fields())
+    field->accept(*this);
+}
+void AstWalker::visitProject(const Project &project) {
+  project.get_tuple().accept(*this);
+}
+void AstWalker::visitDestructure(const Destructure &let) {
+  for (auto &name : let.get_names())
+    name.accept(*this);
+  let.get_body().accept(*this);
+}
+void AstWalker::visitLazyBody(const LazyBody &lazy) {
+  lazy.get().accept(*this);
+}
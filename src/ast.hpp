@@ -4,61 +4,135 @@
  * \brief The abstract syntax-tree of the language
  */
 
+#include "integer.hpp"
+
+#include <atomic>
 #include <cstdint>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
 #include <vector>
 
+/// Tuples have from 2 to this many fields
+#define MAX_TUPLE_SIZE 8
+
 struct Ast;
 struct Assignment;
 struct Expression;
 struct Identifier;
 struct Fn;
 struct IfCond;
+struct Loop;
 struct App;
 struct Binop;
 struct Number;
 struct StatementExpr;
+struct LazyBody;
+struct Tuple;
+struct Project;
+struct Destructure;
 
 struct Visitor {
   virtual void visitAssignment(const Assignment &) = 0;
   virtual void visitFn(const Fn &) = 0;
   virtual void visitIfCond(const IfCond &) = 0;
+  virtual void visitLoop(const Loop &) = 0;
   virtual void visitApp(const App &) = 0;
   virtual void visitBinop(const Binop &) = 0;
   virtual void visitNumber(const Number &) = 0;
   virtual void visitIdentifier(const Identifier &) = 0;
   virtual void visitStatementExpr(const StatementExpr &) = 0;
+  virtual void visitLazyBody(const LazyBody &) = 0;
+  virtual void visitTuple(const Tuple &) = 0;
+  virtual void visitProject(const Project &) = 0;
+  virtual void visitDestructure(const Destructure &) = 0;
+};
+
+/// Visits every node of a tree; override the nodes of interest and call the
+/// base method to keep recursing into their children
+struct AstWalker : Visitor {
+  void visitAssignment(const Assignment &let) override;
+  void visitFn(const Fn &fn) override;
+  void visitIfCond(const IfCond &if_cond) override;
+  void visitLoop(const Loop &loop) override;
+  void visitApp(const App &app) override;
+  void visitBinop(const Binop &op) override;
+  void visitNumber(const Number &n) override;
+  void visitIdentifier(const Identifier &id) override;
+  void visitStatementExpr(const StatementExpr &statements) override;
+  /// Parses the body if it hasn't been
+  void visitLazyBody(const LazyBody &lazy) override;
+  void visitTuple(const Tuple &tuple) override;
+  void visitProject(const Project &project) override;
+  void visitDestructure(const Destructure &let) override;
 };
 
 struct Ast {
   virtual void accept(Visitor &) const = 0;
   virtual ~Ast() = default;
+  /// Nonzero for nodes shared through a NodeTable (see `nodes.hpp`), where
+  /// every occurrence of a subtree is the one node, so caches and profilers
+  /// can key on it
+  uint32_t get_id(void) const;
+  void set_id(uint32_t id) const;
+
+private:
+  mutable uint32_t id = 0;
 };
 
 struct Assignment : Ast {
   Assignment(std::unique_ptr<Identifier> name,
-             std::unique_ptr<Expression> body);
+             std::shared_ptr<Expression> body);
   void accept(Visitor &) const override;
   const Identifier &get_name(void) const;
   const Expression &get_body(void) const;
 
 private:
   const std::unique_ptr<Identifier> name;
-  const std::unique_ptr<Expression> body;
+  const std::shared_ptr<Expression> body;
 };
 
-struct Expression : Ast {};
+/// What type inference (see `types.hpp`) proved about the value of an
+/// expression, wherever it is evaluated
+enum class Proven : uint8_t { Unchecked, Unknown, Number, Function };
+
+struct Expression : Ast {
+  Proven get_proven(void) const;
+  /// Annotations are derived from the tree rather than part of it, so can be
+  /// set on a const tree. A node can be checked more than once, e.g. if it is
+  /// shared, so this only narrows from Unchecked: proving something else
+  /// than before leaves it Unknown.
+  void set_proven(Proven proven) const;
+
+private:
+  mutable Proven proven = Proven::Unchecked;
+};
 
 struct Identifier : Expression {
   Identifier(std::string name);
   void accept(Visitor &) const override;
   const std::string &operator*() const;
   bool operator<(const Identifier &other) const;
+  bool operator==(const Identifier &other) const;
 
 private:
   const std::string name;
 };
 
+/// `let ( a , b ) = t`: binds the names to the fields of a tuple of as many
+/// fields, like a `let` for each
+struct Destructure : Ast {
+  Destructure(std::vector<Identifier> names, std::shared_ptr<Expression> body);
+  void accept(Visitor &) const override;
+  const std::vector<Identifier> &get_names(void) const;
+  const Expression &get_body(void) const;
+
+private:
+  const std::vector<Identifier> names;
+  const std::shared_ptr<Expression> body;
+};
+
 struct Fn : Expression {
   Fn(std::vector<Identifier> args, std::shared_ptr<Ast> body);
   void accept(Visitor &) const override;
@@ -70,35 +144,97 @@ private:
   const std::shared_ptr<Ast> body;
 };
 
+/// The `{ ... }` body of a `fn` parsed lazily (see `parse`), which is only
+/// parsed when something first looks inside it, usually the first call. It
+/// then stands for the parsed body.
+struct LazyBody : Ast {
+  /// The body is `source` from `begin` to `end`
+  LazyBody(std::shared_ptr<const std::string> source, size_t begin,
+           size_t end);
+  void accept(Visitor &) const override;
+  std::string_view get_source(void) const;
+  /// Parses the body the first time, throwing ParseError if it doesn't
+  /// parse. Defined with the parser.
+  const Ast &get(void) const;
+  bool is_parsed(void) const;
+
+private:
+  const std::shared_ptr<const std::string> source;
+  const size_t begin;
+  const size_t end;
+  mutable std::once_flag once;
+  mutable std::atomic<bool> parsed;
+  mutable std::shared_ptr<Ast> body;
+};
+
 struct IfCond : Expression {
-  IfCond(std::unique_ptr<Expression> condition,
-         std::unique_ptr<Expression> true_case,
-         std::unique_ptr<Expression> false_case);
+  IfCond(std::shared_ptr<Expression> condition,
+         std::shared_ptr<Expression> true_case,
+         std::shared_ptr<Expression> false_case);
   void accept(Visitor &) const override;
   const Expression &get_condition(void) const;
   const Expression &get_true_case(void) const;
   const Expression &get_false_case(void) const;
 
 private:
-  const std::unique_ptr<Expression> condition;
-  const std::unique_ptr<Expression> true_case;
-  const std::unique_ptr<Expression> false_case;
+  const std::shared_ptr<Expression> condition;
+  const std::shared_ptr<Expression> true_case;
+  const std::shared_ptr<Expression> false_case;
+};
+
+/// `loop ( i , acc ) = ( 0 , 0 ) while i < n do ( i + 1 , acc + i )`: the
+/// variables start as the values of `inits`, and while `condition` holds,
+/// are all updated at once to the values of `steps`. Its value is the final
+/// value of the last variable. The variables, and any `let`s in the
+/// condition or steps, are local to the loop.
+struct Loop : Expression {
+  Loop(std::vector<Identifier> vars,
+       std::vector<std::shared_ptr<Expression>> inits,
+       std::shared_ptr<Expression> condition,
+       std::vector<std::shared_ptr<Expression>> steps);
+  void accept(Visitor &) const override;
+  const std::vector<Identifier> &get_vars(void) const;
+  /// One for each variable, as are the steps
+  const std::vector<std::shared_ptr<Expression>> &get_inits(void) const;
+  const Expression &get_condition(void) const;
+  const std::vector<std::shared_ptr<Expression>> &get_steps(void) const;
+
+private:
+  const std::vector<Identifier> vars;
+  const std::vector<std::shared_ptr<Expression>> inits;
+  const std::shared_ptr<Expression> condition;
+  const std::vector<std::shared_ptr<Expression>> steps;
+};
+
+/// What escape analysis (see `analysis.hpp`) found about an application of a
+/// `fn` literal to all of its arguments, as in `( ( fn ( a , b ) a ) 1 ) 2`:
+/// the closure can't outlive the application, so it needn't be created
+struct Frame {
+  const Fn &fn;
+  /// In the order they are applied
+  std::vector<const Expression *> args;
+  /// Bound in the body's environment, by the arguments and its `let`s
+  std::vector<Identifier> bindings;
 };
 
 struct App : Expression {
-  App(std::unique_ptr<Expression> lhs, std::unique_ptr<Expression> rhs);
+  App(std::shared_ptr<Expression> lhs, std::shared_ptr<Expression> rhs);
   void accept(Visitor &) const override;
   const Expression &get_lhs(void) const;
   const Expression &get_rhs(void) const;
+  /// Null unless escape analysis found one
+  const Frame *get_frame(void) const;
+  void set_frame(std::unique_ptr<Frame> frame) const;
 
 private:
-  const std::unique_ptr<Expression> lhs;
-  const std::unique_ptr<Expression> rhs;
+  const std::shared_ptr<Expression> lhs;
+  const std::shared_ptr<Expression> rhs;
+  mutable std::unique_ptr<Frame> frame;
 };
 
 struct Binop : Expression {
-  Binop(std::string op, std::unique_ptr<Expression> lhs,
-        std::unique_ptr<Expression> rhs);
+  Binop(std::string op, std::shared_ptr<Expression> lhs,
+        std::shared_ptr<Expression> rhs);
   void accept(Visitor &) const override;
   const std::string &get_op(void) const;
   const Expression &get_lhs(void) const;
@@ -106,24 +242,46 @@ struct Binop : Expression {
 
 private:
   const std::string op;
-  const std::unique_ptr<Expression> lhs;
-  const std::unique_ptr<Expression> rhs;
+  const std::shared_ptr<Expression> lhs;
+  const std::shared_ptr<Expression> rhs;
 };
 
 struct Number : Expression {
-  Number(uint32_t value);
+  Number(Integer value);
+  void accept(Visitor &) const override;
+  const Integer &operator*() const;
+
+private:
+  const Integer value;
+};
+
+/// `( a , b , c )`
+struct Tuple : Expression {
+  Tuple(std::vector<std::shared_ptr<Expression>> fields);
+  void accept(Visitor &) const override;
+  const std::vector<std::shared_ptr<Expression>> &get_fields(void) const;
+
+private:
+  const std::vector<std::shared_ptr<Expression>> fields;
+};
+
+/// `t . 1`: a field of a tuple, counting from zero
+struct Project : Expression {
+  Project(std::shared_ptr<Expression> tuple, uint32_t index);
   void accept(Visitor &) const override;
-  uint32_t operator*() const;
+  const Expression &get_tuple(void) const;
+  uint32_t get_index(void) const;
 
 private:
-  uint32_t value;
+  const std::shared_ptr<Expression> tuple;
+  const uint32_t index;
 };
 
 struct StatementExpr : Expression {
-  StatementExpr(std::vector<std::unique_ptr<Ast>> body);
+  StatementExpr(std::vector<std::shared_ptr<Ast>> body);
   void accept(Visitor &) const override;
-  const std::vector<std::unique_ptr<Ast>> &get_body(void) const;
+  const std::vector<std::shared_ptr<Ast>> &get_body(void) const;
 
 private:
-  const std::vector<std::unique_ptr<Ast>> body;
+  const std::vector<std::shared_ptr<Ast>> body;
 };
@@ -0,0 +1,124 @@
+#include "batch.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <optional>
+
+/// Enough chunks that threads finishing early can take up the slack
+#define CHUNKS_PER_THREAD 8
+/// Few enough that taking a chunk costs little next to running it
+#define MIN_CHUNK_SIZE 256
+
+ThreadPool::ThreadPool(size_t count) : running(0), stopping(false) {
+  for (size_t i = 0; i < std::max<size_t>(count, 1); ++i)
+    threads.emplace_back([this, i] { work(i); });
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard lock(mutex);
+    stopping = true;
+  }
+  queued.notify_all();
+  for (auto &thread : threads)
+    thread.join();
+}
+
+size_t ThreadPool::size(void) const { return threads.size(); }
+
+void ThreadPool::submit(std::function<void(size_t thread)> job) {
+  {
+    std::lock_guard lock(mutex);
+    jobs.push_back(std::move(job));
+  }
+  queued.notify_one();
+}
+
+void ThreadPool::wait(void) {
+  std::unique_lock lock(mutex);
+  finished.wait(lock, [this] { return jobs.empty() && running == 0; });
+}
+
+void ThreadPool::work(size_t thread) {
+  std::unique_lock lock(mutex);
+  while (true) {
+    queued.wait(lock, [this] { return stopping || !jobs.empty(); });
+    if (jobs.empty())
+      return;
+    auto job = std::move(jobs.front());
+    jobs.pop_front();
+    ++running;
+    lock.unlock();
+    job(thread);
+    lock.lock();
+    --running;
+    if (jobs.empty() && running == 0)
+      finished.notify_all();
+  }
+}
+
+namespace {
+
+/// What each thread keeps between chunks
+struct Worker {
+  Worker(const Interpreter &interpreter, const std::string &name)
+      : evaluator(interpreter.get_registry()) {
+    evaluator.set_limits(interpreter.get_evaluator().get_limits());
+    function.emplace(interpreter.prepare(name, evaluator));
+  }
+
+  EvalVisitor evaluator;
+  std::optional<PreparedFunction> function;
+};
+
+} // namespace
+
+std::vector<uint32_t> batch_map(const Interpreter &interpreter,
+                                const std::string &name,
+                                std::span<const uint32_t> inputs,
+                                ThreadPool &pool) {
+  {
+    // Fails early if the function is missing or takes the wrong arguments
+    EvalVisitor evaluator(interpreter.get_registry());
+    if (interpreter.prepare(name, evaluator).get_arity() != 1)
+      throw WrongArity();
+  }
+  // The workers all refer to the function and its environment
+  interpreter.get(name)->share();
+
+  std::vector<uint32_t> results(inputs.size());
+  std::vector<std::unique_ptr<Worker>> workers(pool.size());
+  std::atomic<bool> failed = false;
+  std::exception_ptr error;
+  std::mutex error_mutex;
+
+  size_t chunk = std::max<size_t>(
+      inputs.size() / (pool.size() * CHUNKS_PER_THREAD), MIN_CHUNK_SIZE);
+  for (size_t begin = 0; begin < inputs.size(); begin += chunk) {
+    size_t end = std::min(begin + chunk, inputs.size());
+    pool.submit([&, begin, end](size_t thread) {
+      if (failed.load(std::memory_order_relaxed))
+        return;
+      try {
+        // Only this thread touches its worker
+        auto &worker = workers[thread];
+        if (!worker)
+          worker = std::make_unique<Worker>(interpreter, name);
+        for (size_t i = begin; i < end; ++i)
+          results[i] = (*worker->function)(inputs[i]);
+      } catch (...) {
+        std::lock_guard lock(error_mutex);
+        if (!error)
+          error = std::current_exception();
+        failed = true;
+      }
+    });
+  }
+  pool.wait();
+
+  if (error)
+    std::rethrow_exception(error);
+  return results;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+/** \file
+ * \brief Evaluates one function over many inputs in parallel, e.g.
+ *
+ *     Interpreter interpreter;
+ *     interpreter.load("let square = fn x x * x");
+ *     ThreadPool pool(std::thread::hardware_concurrency());
+ *     auto squares = batch_map(interpreter, "square", inputs, pool);
+ *
+ * The inputs are split into chunks, which the pool's threads take in turn.
+ * Each thread has its own evaluator and PreparedFunction, so threads only
+ * share the (immutable) closure and its environment, whose reference counts
+ * are made atomic for it (see `rc.hpp`). Results are in input order.
+ */
+
+#include "interpreter.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// A fixed set of threads running jobs from a queue
+struct ThreadPool {
+  /// Starts `threads` threads (at least one)
+  ThreadPool(size_t threads);
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+  ~ThreadPool();
+
+  size_t size(void) const;
+  /// Queues a job, which is called with the index of the thread running it
+  void submit(std::function<void(size_t thread)> job);
+  /// Waits until every job submitted so far has finished
+  void wait(void);
+
+private:
+  void work(size_t thread);
+
+  std::vector<std::thread> threads;
+  std::deque<std::function<void(size_t)>> jobs;
+  std::mutex mutex;
+  std::condition_variable queued;
+  std::condition_variable finished;
+  size_t running;
+  bool stopping;
+};
+
+/// Applies the one-argument function bound to `name` to each input, with the
+/// interpreter's limits applying to each call. If any call throws, the
+/// remaining chunks are skipped and the first error is rethrown.
+std::vector<uint32_t> batch_map(const Interpreter &interpreter,
+                                const std::string &name,
+                                std::span<const uint32_t> inputs,
+                                ThreadPool &pool);
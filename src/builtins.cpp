@@ -0,0 +1,196 @@
+#include "builtins.hpp"
+#include "kernels.hpp"
+
+#include <algorithm>
+
+const char *DivisionByZero::what(void) const noexcept {
+  return "Division by zero";
+}
+
+namespace {
+
+typedef std::vector<Rc<Value>> Args;
+
+const Integer &to_number(const Rc<Value> &value) {
+  auto number = dynamic_pointer_cast<NumberValue>(value);
+  if (number == nullptr)
+    throw NotANumber();
+  return number->get_value();
+}
+
+const std::vector<uint32_t> &array_arg(const Rc<Value> &value) {
+  auto array = dynamic_pointer_cast<ArrayValue>(value);
+  if (array == nullptr)
+    throw NotAnArray();
+  return array->get_values();
+}
+
+/// Of a number which has to fit in `T`
+template <typename T> T checked(const Integer &n) {
+  if (!n.fits<T>())
+    throw NumberOutOfRange();
+  return T(n.small());
+}
+
+Rc<Value> range(const Args &args, EvalVisitor &eval) {
+  auto n = checked<uint32_t>(to_number(args[0]));
+  eval.charge(size_t(n) * sizeof(uint32_t));
+  std::vector<uint32_t> values(n);
+  kernels::iota(values.data(), values.size(), 0);
+  return eval.make<ArrayValue>(std::move(values));
+}
+
+Rc<Value> len(const Args &args, EvalVisitor &eval) {
+  return eval.make_number(array_arg(args[0]).size());
+}
+
+Rc<Value> get(const Args &args, EvalVisitor &eval) {
+  auto &values = array_arg(args[0]);
+  auto &index = to_number(args[1]);
+  if (!index.fits<uint32_t>() || index.small() >= int64_t(values.size()))
+    throw IndexOutOfRange();
+  return eval.make_number(values[index.small()]);
+}
+
+Rc<Value> sum(const Args &args, EvalVisitor &eval) {
+  auto &values = array_arg(args[0]);
+  uint64_t total = kernels::sum(values.data(), values.size());
+  // Only beyond 2^31 elements near the maximum
+  if (total > uint64_t(INT64_MAX))
+    return eval.make_number(Integer(INT64_MAX) +
+                            Integer(int64_t(total - uint64_t(INT64_MAX))));
+  return eval.make_number(int64_t(total));
+}
+
+Rc<Value> map(const Args &args, EvalVisitor &eval) {
+  auto &values = array_arg(args[1]);
+  eval.charge(values.size() * sizeof(uint32_t));
+  std::vector<uint32_t> out;
+  out.reserve(values.size());
+  for (auto value : values) {
+    out.push_back(
+        to_number(eval.apply(args[0], eval.make_number(value))).low32());
+  }
+  return eval.make<ArrayValue>(std::move(out));
+}
+
+Rc<Value> filter(const Args &args, EvalVisitor &eval) {
+  auto &values = array_arg(args[1]);
+  std::vector<uint32_t> out;
+  for (auto value : values) {
+    auto keep = dynamic_pointer_cast<NumberValue>(
+        eval.apply(args[0], eval.make_number(value)));
+    if (keep == nullptr || keep->get_value())
+      out.push_back(value);
+  }
+  eval.charge(out.size() * sizeof(uint32_t));
+  return eval.make<ArrayValue>(std::move(out));
+}
+
+Rc<Value> fold(const Args &args, EvalVisitor &eval) {
+  auto &values = array_arg(args[2]);
+  auto acc = args[1];
+  for (auto value : values) {
+    acc = eval.apply(eval.apply(args[0], acc),
+                     eval.make_number(value));
+  }
+  return acc;
+}
+
+} // namespace
+
+const Integer & BuiltinRegistry::number_arg(const Rc<Value> &value) {
+  return to_number(value);
+}
+
+uint32_t BuiltinRegistry::uint32_arg(const Rc<Value> &value) {
+  return checked<uint32_t>(to_number(value));
+}
+
+void BuiltinRegistry::add(std::string name, size_t arity,
+                          BuiltinValue::Function function,
+                          std::string signature) {
+  Identifier id(name);
+  functions[id] = make_rc<BuiltinValue>(name, arity, std::move(function));
+  // Registries are used by evaluators on any thread
+  functions[id]->share();
+  if (signature.empty())
+    signatures.erase(id);
+  else
+    signatures[id] = std::move(signature);
+}
+
+const std::map<Identifier, Rc<Value>> &
+BuiltinRegistry::environment(void) const {
+  return functions;
+}
+
+const std::string *BuiltinRegistry::signature(const Identifier &name) const {
+  auto it = signatures.find(name);
+  return it == signatures.end() ? nullptr : &it->second;
+}
+
+void BuiltinRegistry::install(EvalVisitor &evaluator) const {
+  for (auto &[name, function] : functions)
+    evaluator.bind(name, function);
+}
+
+const BuiltinRegistry &BuiltinRegistry::standard(void) {
+  static const BuiltinRegistry registry = [] {
+    BuiltinRegistry registry;
+    typedef const Integer &Num;
+    registry.add_numeric<2>("add", [](Num a, Num b) { return a + b; });
+    registry.add_numeric<2>("sub", [](Num a, Num b) { return a - b; });
+    registry.add_numeric<2>("mul", [](Num a, Num b) { return a * b; });
+    registry.add_numeric<2>("div", [](Num a, Num b) {
+      if (!b)
+        throw DivisionByZero();
+      return a / b;
+    });
+    registry.add_numeric<2>("mod", [](Num a, Num b) {
+      if (!b)
+        throw DivisionByZero();
+      return a % b;
+    });
+    registry.add_numeric<2>("min",
+                            [](Num a, Num b) { return std::min(a, b); });
+    registry.add_numeric<2>("max",
+                            [](Num a, Num b) { return std::max(a, b); });
+    registry.add_numeric<2>("band", [](Num a, Num b) {
+      return checked<int64_t>(a) & checked<int64_t>(b);
+    });
+    registry.add_numeric<2>("bor", [](Num a, Num b) {
+      return checked<int64_t>(a) | checked<int64_t>(b);
+    });
+    registry.add_numeric<2>("bxor", [](Num a, Num b) {
+      return checked<int64_t>(a) ^ checked<int64_t>(b);
+    });
+    // Multiplies, so that it can give a bignum, by at most 2^MAX_SHIFT
+    registry.add_numeric<2>("shl", [](Num a, Num b) {
+      auto shift = checked<uint32_t>(b);
+      if (shift > MAX_SHIFT)
+        throw NumberOutOfRange();
+      Integer n = a;
+      for (; shift >= 62; shift -= 62)
+        n = n * (int64_t(1) << 62);
+      return n * (int64_t(1) << shift);
+    });
+    // Shifting by the width or more is undefined in C++, here it gives the
+    // sign
+    registry.add_numeric<2>("shr", [](Num a, Num b) {
+      auto n = checked<int64_t>(a);
+      auto shift = checked<uint32_t>(b);
+      return shift < 64 ? n >> shift : n < 0 ? -1 : 0;
+    });
+
+    registry.add("range", 1, range, "num -> array");
+    registry.add("len", 1, len, "array -> num");
+    registry.add("get", 2, get, "array -> num -> num");
+    registry.add("sum", 1, sum, "array -> num");
+    registry.add("map", 2, map, "( num -> num ) -> array -> array");
+    registry.add("filter", 2, filter, "( num -> a ) -> array -> array");
+    registry.add("fold", 3, fold, "( a -> num -> a ) -> a -> array -> a");
+    return registry;
+  }();
+  return registry;
+}
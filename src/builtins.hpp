@@ -0,0 +1,112 @@
+#pragma once
+
+/** \file
+ * \brief Functions implemented in C++, callable from the language. A
+ * BuiltinRegistry collects them with their arity, and binds them in an
+ * evaluator's environment as BuiltinValues, which are applied (and partially
+ * applied) like closures.
+ *
+ * The standard registry, used by default by every EvalVisitor, contains
+ *
+ *     add sub mul div mod min max        -- arithmetic, as for `+`
+ *     band bor bxor shl shr              -- bitwise, on 64-bit numbers
+ *
+ * (`div` and `mod` round towards zero, and `shl` can give a bignum) and
+ * functions on packed arrays, whose elements are 32-bit
+ *
+ *     range n          -- [ 0 , 1 , ... , n - 1 ]
+ *     len xs           -- number of elements
+ *     get xs i         -- element i, counting from 0
+ *     sum xs           -- sum of elements
+ *     map f xs         -- [ f x0 , f x1 , ... ], f has to give numbers,
+ *                         which are truncated to 32 bits
+ *     filter f xs      -- elements for which f is true (as for `if`)
+ *     fold f init xs   -- f ( ... ( f ( f init x0 ) x1 ) ... ) xn
+ *
+ * Application nests to the right, so curried calls need parentheses, e.g.
+ * `( get xs ) 3` or `( map ( fn x x + 1 ) ) xs`.
+ *
+ * The binary operators also work element-wise on arrays, or an array and a
+ * number, see `kernels.hpp`.
+ *
+ * Hosts can register their own functions
+ *
+ *     BuiltinRegistry registry = BuiltinRegistry::standard();
+ *     registry.add_numeric<3>("clamp", [](uint32_t x, uint32_t lo,
+ *                                          uint32_t hi) {
+ *       return std::clamp(x, lo, hi);
+ *     });
+ *     EvalVisitor evaluator(registry);
+ *
+ * Numeric functions take either `Integer`s, or `uint32_t`s, in which case
+ * arguments which don't fit throw NumberOutOfRange.
+ *
+ * Each function can have a type signature for the TypeChecker, e.g.
+ * `( num -> num ) -> array -> array` for `map`, see `types.hpp`. Numeric
+ * functions get one automatically. Statements using a function without one
+ * are not type-checked. A signature is trusted: a function called from
+ * checked code must only call closures with, and return, values of the
+ * types it gives.
+ */
+
+#include "eval.hpp"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+/// The largest shift `shl` takes, which makes a number of about 8KiB
+constexpr uint32_t MAX_SHIFT = 1 << 16;
+
+struct DivisionByZero : EvalError {
+  const char *what(void) const noexcept override;
+};
+
+struct BuiltinRegistry {
+  /// The builtins listed above
+  static const BuiltinRegistry &standard(void);
+
+  /// Adds (or replaces) a function taking `arity` values, with an optional
+  /// type signature
+  void add(std::string name, size_t arity, BuiltinValue::Function function,
+           std::string signature = "");
+
+  /// Adds a function taking `Arity` numbers and giving a number
+  template <size_t Arity, typename F> void add_numeric(std::string name, F f) {
+    std::string signature = "num";
+    for (size_t i = 0; i < Arity; ++i)
+      signature = "num -> " + signature;
+    add(
+        std::move(name), Arity,
+        [f](const std::vector<Rc<Value>> &args, EvalVisitor &eval) {
+          return call_numeric(f, args, eval, std::make_index_sequence<Arity>());
+        },
+        std::move(signature));
+  }
+
+  const std::map<Identifier, Rc<Value>> &environment(void) const;
+  /// The type signature of a function, or nullptr if it has none
+  const std::string *signature(const Identifier &name) const;
+  /// Binds every function in the evaluator's environment, for adding them to
+  /// an existing evaluator
+  void install(EvalVisitor &evaluator) const;
+
+private:
+  template <typename F, size_t... I>
+  static Rc<Value> call_numeric(const F &f, const std::vector<Rc<Value>> &args,
+                                EvalVisitor &eval, std::index_sequence<I...>) {
+    if constexpr (std::is_invocable_v<const F &, decltype(I, Integer())...>)
+      return eval.make_number(Integer(f(number_arg(args[I])...)));
+    else
+      return eval.make_number(Integer(f(uint32_arg(args[I])...)));
+  }
+
+  static const Integer &number_arg(const Rc<Value> &value);
+  static uint32_t uint32_arg(const Rc<Value> &value);
+
+  std::map<Identifier, Rc<Value>> functions;
+  std::map<Identifier, std::string> signatures;
+};
@@ -0,0 +1,316 @@
+#include "cek.hpp"
+#include "builtins.hpp"
+
+#include <array>
+#include <cassert>
+
+/// Takes one step evaluating `control`: leaves give a value straight away,
+/// other nodes push a frame and go on to their first child
+struct CekMachine::Step : Visitor {
+  Step(CekMachine &machine) : machine(machine) {}
+
+  void visitAssignment(const Assignment &let) {
+    machine.push({Kind::Assign, 0, &let, machine.env, nullptr});
+    machine.control = &let.get_body();
+  }
+  void visitFn(const Fn &fn) {
+    machine.value = machine.evaluator.make_closure(fn, *machine.env);
+    machine.control = nullptr;
+  }
+  void visitIfCond(const IfCond &if_cond) {
+    machine.push({Kind::IfBranch, 0, &if_cond, machine.env, nullptr});
+    machine.control = &if_cond.get_condition();
+  }
+  void visitLoop(const Loop &loop) {
+    machine.push({Kind::LoopInit, 0, &loop, machine.env, nullptr});
+    machine.control = loop.get_inits().front().get();
+  }
+  void visitApp(const App &app) {
+    machine.push({Kind::AppRhs, 0, &app, machine.env, nullptr});
+    machine.control = &app.get_lhs();
+  }
+  void visitBinop(const Binop &op) {
+    machine.push({Kind::BinopRhs, 0, &op, machine.env, nullptr});
+    machine.control = &op.get_lhs();
+  }
+  void visitNumber(const Number &number) {
+    machine.value = machine.evaluator.make_number(*number);
+    machine.control = nullptr;
+  }
+  void visitIdentifier(const Identifier &id) {
+    auto it = machine.env->find(id);
+    if (it != machine.env->end()) {
+      machine.value = it->second;
+    } else if (auto builtin = machine.evaluator.lookup(id)) {
+      machine.value = std::move(builtin);
+    } else {
+      throw UnknownVariable();
+    }
+    machine.control = nullptr;
+  }
+  void visitStatementExpr(const StatementExpr &statements) {
+    auto &body = statements.get_body();
+    if (body.empty()) {
+      machine.value = nullptr;
+      machine.control = nullptr;
+      return;
+    }
+    if (body.size() > 1)
+      machine.push({Kind::Statement, 1, &statements, machine.env, nullptr});
+    machine.control = body.front().get();
+  }
+  void visitLazyBody(const LazyBody &lazy) { machine.control = &lazy.get(); }
+  void visitTuple(const Tuple &tuple) {
+    machine.push({Kind::TupleField, 0, &tuple, machine.env, nullptr});
+    machine.control = tuple.get_fields().front().get();
+  }
+  void visitProject(const Project &project) {
+    machine.push({Kind::Project, 0, &project, nullptr, nullptr});
+    machine.control = &project.get_tuple();
+  }
+  void visitDestructure(const Destructure &destructure) {
+    machine.push({Kind::Destructure, 0, &destructure, machine.env, nullptr});
+    machine.control = &destructure.get_body();
+  }
+
+  CekMachine &machine;
+};
+
+CekMachine::CekMachine() : CekMachine(BuiltinRegistry::standard()) {}
+
+CekMachine::CekMachine(const BuiltinRegistry &registry)
+    : evaluator(registry), globals(std::make_shared<Environment>()),
+      control(nullptr) {}
+
+void CekMachine::visitAssignment(const Assignment &let) { run(let); }
+void CekMachine::visitFn(const Fn &fn) { run(fn); }
+void CekMachine::visitIfCond(const IfCond &if_cond) { run(if_cond); }
+void CekMachine::visitLoop(const Loop &loop) { run(loop); }
+void CekMachine::visitApp(const App &app) { run(app); }
+void CekMachine::visitBinop(const Binop &op) { run(op); }
+void CekMachine::visitNumber(const Number &number) { run(number); }
+void CekMachine::visitIdentifier(const Identifier &id) { run(id); }
+void CekMachine::visitLazyBody(const LazyBody &lazy) { run(lazy); }
+void CekMachine::visitTuple(const Tuple &tuple) { run(tuple); }
+void CekMachine::visitProject(const Project &project) { run(project); }
+void CekMachine::visitDestructure(const Destructure &destructure) {
+  run(destructure);
+}
+void CekMachine::visitStatementExpr(const StatementExpr &statements) {
+  run(statements);
+}
+
+void CekMachine::evaluate(const Ast &ast) {
+  evaluator.reset_usage();
+  run(ast);
+}
+
+void CekMachine::run(const Ast &ast) {
+  assert(stack.empty());
+  control = &ast;
+  env = globals;
+  Step step(*this);
+  try {
+    while (true) {
+      if (control) {
+        control->accept(step);
+      } else if (!stack.empty()) {
+        auto frame = std::move(stack.back());
+        stack.pop_back();
+        resume(std::move(frame));
+      } else {
+        break;
+      }
+    }
+  } catch (...) {
+    stack.clear();
+    env = nullptr;
+    throw;
+  }
+  env = nullptr;
+}
+
+void CekMachine::push(Frame frame) {
+  if (stack.size() >= evaluator.get_limits().max_depth)
+    throw CallDepthExceeded();
+  stack.push_back(std::move(frame));
+}
+
+void CekMachine::resume(Frame frame) {
+  switch (frame.kind) {
+  case Kind::AppRhs: {
+    if (!dynamic_pointer_cast<ClosureValue>(value) &&
+        !dynamic_pointer_cast<BuiltinValue>(value))
+      throw NotAFunction();
+    auto &app = static_cast<const App &>(*frame.node);
+    control = &app.get_rhs();
+    env = std::move(frame.env);
+    push({Kind::Apply, 0, nullptr, nullptr, std::move(value)});
+    break;
+  }
+  case Kind::Apply:
+    apply(frame.value, std::move(value));
+    break;
+  case Kind::BinopRhs: {
+    if (!dynamic_pointer_cast<NumberValue>(value) &&
+        !dynamic_pointer_cast<ArrayValue>(value))
+      throw NotANumber();
+    auto &op = static_cast<const Binop &>(*frame.node);
+    control = &op.get_rhs();
+    env = std::move(frame.env);
+    push({Kind::Binop, 0, &op, nullptr, std::move(value)});
+    break;
+  }
+  case Kind::Binop: {
+    auto &op = static_cast<const Binop &>(*frame.node);
+    value = evaluator.binop(op.get_op(), frame.value, value);
+    break;
+  }
+  case Kind::IfBranch: {
+    auto &if_cond = static_cast<const IfCond &>(*frame.node);
+    auto cond = dynamic_pointer_cast<NumberValue>(value);
+    control = cond == nullptr || cond->get_value()
+                  ? &if_cond.get_true_case()
+                  : &if_cond.get_false_case();
+    env = std::move(frame.env);
+    break;
+  }
+  case Kind::Statement: {
+    auto &body = static_cast<const StatementExpr &>(*frame.node).get_body();
+    control = body[frame.index].get();
+    env = frame.env;
+    // The last statement is in tail position
+    if (frame.index + 1 < body.size()) {
+      ++frame.index;
+      push(std::move(frame));
+    }
+    break;
+  }
+  case Kind::Assign: {
+    auto &let = static_cast<const Assignment &>(*frame.node);
+    (*frame.env)[*let.get_name()] = value;
+    break;
+  }
+  case Kind::LoopInit:
+  case Kind::LoopStep: {
+    auto &loop = static_cast<const Loop &>(*frame.node);
+    auto &exprs =
+        frame.kind == Kind::LoopInit ? loop.get_inits() : loop.get_steps();
+    if (frame.index + 1 < exprs.size()) {
+      push({Kind::Hold, 0, nullptr, nullptr, std::move(value)});
+      control = exprs[++frame.index].get();
+      env = frame.env;
+      push(std::move(frame));
+    } else if (frame.kind == Kind::LoopInit) {
+      // The loop runs in a copy of the environment, as in EvalVisitor
+      iterate(loop, std::make_shared<Environment>(*frame.env));
+    } else {
+      iterate(loop, std::move(frame.env));
+    }
+    break;
+  }
+  case Kind::LoopTest: {
+    auto &loop = static_cast<const Loop &>(*frame.node);
+    auto cond = dynamic_pointer_cast<NumberValue>(value);
+    if (cond != nullptr && !cond->get_value()) {
+      value = (*frame.env)[loop.get_vars().back()];
+      break;
+    }
+    control = loop.get_steps().front().get();
+    env = frame.env;
+    frame.kind = Kind::LoopStep;
+    push(std::move(frame));
+    break;
+  }
+  case Kind::TupleField: {
+    auto &fields = static_cast<const Tuple &>(*frame.node).get_fields();
+    if (frame.index + 1 < fields.size()) {
+      push({Kind::Hold, 0, nullptr, nullptr, std::move(value)});
+      control = fields[++frame.index].get();
+      env = frame.env;
+      push(std::move(frame));
+      break;
+    }
+    std::array<Rc<Value>, MAX_TUPLE_SIZE> values;
+    values[fields.size() - 1] = std::move(value);
+    for (size_t i = fields.size() - 1; i-- > 0;) {
+      values[i] = std::move(stack.back().value);
+      stack.pop_back();
+    }
+    value = evaluator.make_tuple(values.data(), fields.size());
+    break;
+  }
+  case Kind::Project: {
+    auto &project = static_cast<const Project &>(*frame.node);
+    value = as_tuple(value).get(project.get_index());
+    break;
+  }
+  case Kind::Destructure: {
+    auto &names = static_cast<const Destructure &>(*frame.node).get_names();
+    auto &tuple = as_tuple(value, names.size());
+    for (size_t i = 0; i < names.size(); ++i)
+      (*frame.env)[names[i]] = tuple.get(i);
+    break;
+  }
+  case Kind::Hold:
+    assert(false);
+    break;
+  }
+}
+
+void CekMachine::iterate(const Loop &loop,
+                         std::shared_ptr<Environment> loop_env) {
+  auto &vars = loop.get_vars();
+  (*loop_env)[vars.back()] = std::move(value);
+  for (size_t i = vars.size() - 1; i-- > 0;) {
+    (*loop_env)[vars[i]] = std::move(stack.back().value);
+    stack.pop_back();
+  }
+  // Each iteration counts as a step, as in EvalVisitor
+  evaluator.step();
+  control = &loop.get_condition();
+  env = loop_env;
+  push({Kind::LoopTest, 0, &loop, std::move(loop_env), nullptr});
+}
+
+void CekMachine::apply(const Rc<Value> &function, Rc<Value> arg) {
+  evaluator.step();
+  if (auto builtin = dynamic_pointer_cast<BuiltinValue>(function)) {
+    value = builtin->apply(std::move(arg), evaluator);
+    return;
+  }
+  auto closure = dynamic_pointer_cast<ClosureValue>(function);
+  if (closure == nullptr)
+    throw NotAFunction();
+  // Partial application doesn't evaluate the body
+  if (closure->get_args().size() > 1) {
+    value = closure->apply(std::move(arg), evaluator);
+    return;
+  }
+  // No frame for the call itself: the body returns straight to the caller's
+  // continuation
+  env = std::make_shared<Environment>(closure->get_environment());
+  (*env)[closure->get_args().front()] = std::move(arg);
+  control = closure->get_body().get();
+}
+
+Rc<Value> CekMachine::get_last(void) const { return value; }
+
+CekMachine::Environment CekMachine::get_environment(void) { return *globals; }
+
+void CekMachine::set_environment(Environment new_environment) {
+  *globals = std::move(new_environment);
+}
+
+Rc<Value> CekMachine::lookup(const Identifier &id) const {
+  auto it = globals->find(id);
+  if (it != globals->end())
+    return it->second;
+  return evaluator.lookup(id);
+}
+
+void CekMachine::bind(const Identifier &id, Rc<Value> value) {
+  (*globals)[id] = std::move(value);
+}
+
+EvalVisitor &CekMachine::get_evaluator(void) { return evaluator; }
@@ -0,0 +1,129 @@
+#pragma once
+
+/** \file
+ * \brief An evaluator which keeps its continuation on a heap-allocated stack
+ * rather than the C++ call stack (a CEK machine: control, environment and
+ * continuation), so recursion is only limited by memory. E.g. with the
+ * `sum_n` from the README, EvalVisitor overflows the C++ stack at a depth of
+ * a few thousand, while
+ *
+ *     CekMachine machine;
+ *     for (auto &node : parse_lines(script))
+ *       node->accept(machine);
+ *
+ * can run `sum_n 10000000`. A pending call takes one small frame, and calls in
+ * tail position take none.
+ *
+ * The machine is a drop-in for EvalVisitor, and produces the same values.
+ * Builtins are run by an EvalVisitor, including the functions passed to
+ * `map`, `filter` and `fold`. That EvalVisitor holds the limits. Its call
+ * depth limit caps the number of frames on the machine's stack instead.
+ */
+
+#include "ast.hpp"
+#include "eval.hpp"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+struct CekMachine : Visitor {
+  typedef std::map<Identifier, Rc<Value>> Environment;
+
+  CekMachine();
+  CekMachine(const BuiltinRegistry &registry);
+
+  // Each evaluates the node as a top-level statement
+  void visitAssignment(const Assignment &let);
+  void visitFn(const Fn &fn);
+  void visitIfCond(const IfCond &if_cond);
+  void visitLoop(const Loop &loop);
+  void visitApp(const App &app);
+  void visitBinop(const Binop &op);
+  void visitNumber(const Number &number);
+  void visitIdentifier(const Identifier &id);
+  void visitStatementExpr(const StatementExpr &statements);
+  void visitLazyBody(const LazyBody &lazy);
+  void visitTuple(const Tuple &tuple);
+  void visitProject(const Project &project);
+  void visitDestructure(const Destructure &destructure);
+
+  /// Evaluates a top-level statement, with the counts for the limits
+  /// starting from zero
+  void evaluate(const Ast &ast);
+
+  Rc<Value> get_last(void) const;
+  Environment get_environment(void);
+  void set_environment(Environment new_environment);
+  Rc<Value> lookup(const Identifier &id) const;
+  void bind(const Identifier &id, Rc<Value> value);
+  /// For setting limits or cancelling
+  EvalVisitor &get_evaluator(void);
+
+private:
+  /// What to do with the value of the node being evaluated
+  enum class Kind : uint32_t {
+    /// Evaluate the argument of an App, with `value` the function
+    AppRhs,
+    /// Apply `value` to it
+    Apply,
+    /// Evaluate the rhs of a Binop
+    BinopRhs,
+    /// Apply the Binop to `value` and it
+    Binop,
+    /// Pick the branch of an IfCond
+    IfBranch,
+    /// Evaluate statement `index` of a StatementExpr
+    Statement,
+    /// Bind it in `env`
+    Assign,
+    /// Evaluate initial value `index` of a Loop, in `env`. The values before
+    /// it are held by the frames beneath.
+    LoopInit,
+    /// Stop the Loop, or evaluate its steps in `env`
+    LoopTest,
+    /// Evaluate step `index` of a Loop, like LoopInit
+    LoopStep,
+    /// Evaluate field `index` of a Tuple in `env`, or make the tuple after
+    /// the last. The fields before it are held by the frames beneath.
+    TupleField,
+    /// Project a field out of it
+    Project,
+    /// Bind its fields to the names of a Destructure in `env`
+    Destructure,
+    /// Holds `value` for the frame above, and is never resumed
+    Hold,
+  };
+
+  struct Frame {
+    Kind kind;
+    uint32_t index;
+    // Points into either the program being evaluated or the body of a
+    // closure, which outlive the frame
+    const Ast *node;
+    std::shared_ptr<Environment> env;
+    Rc<Value> value;
+  };
+
+  struct Step;
+
+  void run(const Ast &ast);
+  void push(Frame frame);
+  /// Passes the value to the top frame
+  void resume(Frame frame);
+  void apply(const Rc<Value> &function, Rc<Value> arg);
+  /// Binds the Loop's variables in `loop_env` to the held values and the
+  /// last in `value`, then tests its condition
+  void iterate(const Loop &loop, std::shared_ptr<Environment> loop_env);
+
+  EvalVisitor evaluator;
+  std::shared_ptr<Environment> globals;
+  std::vector<Frame> stack;
+
+  // Registers: evaluating `control` in `env`, or returning `value` to the
+  // top frame if `control` is null
+  const Ast *control;
+  std::shared_ptr<Environment> env;
+  Rc<Value> value;
+};
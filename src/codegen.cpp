@@ -0,0 +1,428 @@
+#include "codegen.hpp"
+#include "analysis.hpp"
+#include "formatter.hpp"
+#include "runtime.hpp"
+
+namespace {
+
+/// As a C++ string literal
+std::string quote(std::string_view str) {
+  std::string quoted = "\"";
+  for (char c : str) {
+    if (c == '"' || c == '\\')
+      quoted += '\\';
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+const char *runtime_op(const std::string &op) {
+  if (op == "<")
+    return "tiny::Op::Less";
+  if (op == "==")
+    return "tiny::Op::Equal";
+  if (op == ">")
+    return "tiny::Op::Greater";
+  if (op == "+")
+    return "tiny::Op::Add";
+  return "tiny::Op::Sub";
+}
+
+/// Whether a later name in `names` is the same as names[i], so binding them
+/// in order would overwrite it
+bool overwritten(const std::vector<Identifier> &names, size_t i) {
+  for (size_t j = i + 1; j < names.size(); ++j) {
+    if (names[j] == names[i])
+      return true;
+  }
+  return false;
+}
+
+} // namespace
+
+CodeGen::CodeGen(std::string name)
+    : name(std::move(name)), script{nullptr, false, {}, {}}, scope(&script),
+      out(&statements), indent(1), tail(false), result{"", false},
+      temporaries(0), functions(0), locals(0) {}
+
+void CodeGen::add(const Ast &statement) {
+  // Globals are declared when a statement first binds them: closures made
+  // before then can't see them, as in the interpreter
+  declare(assigned_variables(statement));
+  auto value = compile(statement);
+  line("last = " + take(value) + ";");
+}
+
+std::string CodeGen::program(void) const {
+  return "namespace " + name + " {\n\n" + structs + constants + "\n" + bodies +
+         "tiny::Value run(void) {\n  tiny::Value last;\n" + statements +
+         "  return last;\n}\n\n} // namespace " + name + "\n";
+}
+
+std::string CodeGen::unit(void) const {
+  return "// Compiled by tiny-interp, see codegen.hpp\n"
+         "#include \"runtime.hpp\"\n\n" +
+         program() +
+         "\n#ifndef TINY_NO_MAIN\nint main(void) { return tiny::main(" + name +
+         "::run); }\n#endif\n";
+}
+
+void CodeGen::visitAssignment(const Assignment &let) {
+  auto value = compile(let.get_body());
+  // The value of the `let` may be used after the variable is bound again
+  if (!value.temporary)
+    value = temporary(value.expression);
+  line(lookup(let.get_name())->name + " = " + value.expression + ";");
+  result = value;
+}
+
+void CodeGen::visitFn(const Fn &fn) {
+  auto type = "Fn" + std::to_string(functions++);
+  auto &args = fn.get_args();
+  auto &body = fn.get_body();
+
+  Scope function{scope, true, {}, {}};
+  std::string code;
+  auto outer_out = out;
+  auto outer_indent = indent;
+  scope = &function;
+  out = &code;
+  indent = 1;
+
+  auto assigned = assigned_variables(*body);
+  for (size_t i = 0; i < args.size(); ++i) {
+    if (overwritten(args, i))
+      continue;
+    Variable arg{local(args[i]), false};
+    if (i + 1 == args.size())
+      // Tail calls reuse the call
+      line("tiny::Value " + arg.name + " = std::move(call.arg);");
+    else if (assigned.contains(args[i]))
+      line("tiny::Value " + arg.name + " = args[" + std::to_string(i) + "];");
+    else
+      line("const tiny::Value &" + arg.name + " = args[" + std::to_string(i) +
+           "];");
+    function.variables.emplace(args[i], arg);
+  }
+  declare(assigned);
+  auto value = compile(*body, true);
+  line("return " + take(value) + ";");
+
+  scope = function.outer;
+  out = outer_out;
+  indent = outer_indent;
+
+  // How it prints with each number of arguments applied
+  std::string texts;
+  for (size_t i = 0; i < args.size(); ++i) {
+    std::string text;
+    FmtAst formatter([&](std::string_view str) { text += str; });
+    formatter.format_fn({args.begin() + i, args.end()}, body);
+    texts += "      " + quote(text) + ",\n";
+  }
+
+  auto &captures = function.captures;
+  structs += "struct " + type + " final : tiny::Closure<" + type + ", " +
+             std::to_string(args.size()) + "> {\n";
+  if (!captures.empty()) {
+    std::string parameters, initialisers;
+    for (auto &[member, from] : captures) {
+      parameters += (parameters.empty() ? "" : ", ") + ("tiny::Value " + member);
+      initialisers += (initialisers.empty() ? "" : ", ") + member +
+                      "(std::move(" + member + "))";
+    }
+    structs += "  " + type + "(" + parameters + ")\n      : " + initialisers +
+               " {}\n";
+  }
+  structs += "  tiny::Value body(tiny::Call &call) const;\n\n"
+             "  static constexpr const char *TEXT[] = {\n" +
+             texts + "  };\n";
+  for (auto &[member, from] : captures)
+    structs += "  tiny::Value " + member + ";\n";
+  structs += "};\n\n";
+  bodies += "tiny::Value " + type + "::body(tiny::Call &call) const {\n" +
+            code + "}\n\n";
+
+  auto make = "tiny::Value(std::make_shared<const " + type + ">(";
+  if (captures.empty()) {
+    // The same closure every time
+    constants +=
+        "const tiny::Value " + type + "_closure = " + make + "));\n";
+    result = {type + "_closure", false};
+    return;
+  }
+  std::string from;
+  for (auto &capture : captures)
+    from += (from.empty() ? "" : ", ") + capture.second;
+  result = temporary(make + from + "))");
+}
+
+void CodeGen::visitIfCond(const IfCond &if_cond) {
+  bool in_tail = tail;
+  auto condition = compile(if_cond.get_condition());
+  auto value = "t" + std::to_string(temporaries++);
+  line("tiny::Value " + value + ";");
+  line("if (tiny::truthy(" + condition.expression + ")) {");
+  ++indent;
+  auto true_case = compile(if_cond.get_true_case(), in_tail);
+  line(value + " = " + take(true_case) + ";");
+  --indent;
+  line("} else {");
+  ++indent;
+  auto false_case = compile(if_cond.get_false_case(), in_tail);
+  line(value + " = " + take(false_case) + ";");
+  --indent;
+  line("}");
+  result = {value, true};
+}
+
+void CodeGen::visitLoop(const Loop &loop) {
+  auto &vars = loop.get_vars();
+  std::vector<Result> inits;
+  for (auto &init : loop.get_inits())
+    inits.push_back(compile(*init));
+
+  auto value = "t" + std::to_string(temporaries++);
+  line("tiny::Value " + value + ";");
+  line("{");
+  ++indent;
+  Scope body{scope, false, {}, {}};
+  scope = &body;
+  for (size_t i = 0; i < vars.size(); ++i) {
+    if (overwritten(vars, i))
+      continue;
+    Variable var{local(vars[i]), false};
+    line("tiny::Value " + var.name + " = " + take(inits[i]) + ";");
+    body.variables.emplace(vars[i], var);
+  }
+  // `let`s in the condition and steps are local to the loop
+  auto assigned = assigned_variables(loop.get_condition());
+  for (auto &step : loop.get_steps())
+    assigned.merge(assigned_variables(*step));
+  declare(assigned);
+
+  line("while (true) {");
+  ++indent;
+  auto condition = compile(loop.get_condition());
+  line("if (!tiny::truthy(" + condition.expression + "))");
+  line("  break;");
+  std::vector<Result> steps;
+  for (auto &step : loop.get_steps())
+    steps.push_back(compile(*step));
+  // All at once, after evaluating all the new values
+  for (size_t i = 0; i < vars.size(); ++i) {
+    if (!overwritten(vars, i))
+      line(body.variables.at(vars[i]).name + " = " + take(steps[i]) + ";");
+  }
+  --indent;
+  line("}");
+  line(value + " = std::move(" + body.variables.at(vars.back()).name + ");");
+  scope = body.outer;
+  --indent;
+  line("}");
+  result = {value, true};
+}
+
+void CodeGen::visitApp(const App &app) {
+  bool in_tail = tail;
+  if (auto frame = app.get_frame()) {
+    // Inlined: the body runs in a block, with the arguments as its locals
+    auto &formals = frame->fn.get_args();
+    std::vector<Result> args;
+    for (auto arg : frame->args)
+      args.push_back(compile(*arg));
+
+    auto value = "t" + std::to_string(temporaries++);
+    line("tiny::Value " + value + ";");
+    line("{");
+    ++indent;
+    Scope body{scope, false, {}, {}};
+    scope = &body;
+    for (size_t i = 0; i < formals.size(); ++i) {
+      if (overwritten(formals, i))
+        continue;
+      Variable arg{local(formals[i]), false};
+      line("tiny::Value " + arg.name + " = " + take(args[i]) + ";");
+      body.variables.emplace(formals[i], arg);
+    }
+    declare(assigned_variables(*frame->fn.get_body()));
+    auto returned = compile(*frame->fn.get_body(), in_tail);
+    line(value + " = " + take(returned) + ";");
+    scope = body.outer;
+    --indent;
+    line("}");
+    result = {value, true};
+    return;
+  }
+
+  auto function = compile(app.get_lhs());
+  line("tiny::check_function(" + function.expression + ");");
+  auto arg = compile(app.get_rhs());
+  if (in_tail)
+    result = temporary("tiny::tail(call, " + take(function) + ", " +
+                       take(arg) + ")");
+  else
+    result = temporary("tiny::call(" + take(function) + ", " + take(arg) + ")");
+}
+
+void CodeGen::visitBinop(const Binop &op) {
+  auto lhs = compile(op.get_lhs());
+  if (!dynamic_cast<const Number *>(&op.get_lhs()))
+    line("tiny::check_operand(" + lhs.expression + ");");
+  auto rhs = compile(op.get_rhs());
+  result = temporary("tiny::binop<" + std::string(runtime_op(op.get_op())) +
+                     ">(" + lhs.expression + ", " + rhs.expression + ")");
+}
+
+void CodeGen::visitNumber(const Number &n) {
+  auto &value = *n;
+  if (value.is_small()) {
+    result = {"tiny::Value(int64_t(" + value.to_string() + "))", false};
+    return;
+  }
+  // Bignums are parsed once
+  auto constant = "n_" + value.to_string();
+  if (big_numbers.insert(constant).second)
+    constants += "const tiny::Value " + constant + " = Integer::parse(\"" +
+                 value.to_string() + "\");\n";
+  result = {constant, false};
+}
+
+void CodeGen::visitIdentifier(const Identifier &id) {
+  if (auto variable = lookup(id)) {
+    result = temporary(variable->maybe_unbound
+                           ? "tiny::read(" + variable->name + ")"
+                           : variable->name);
+  } else if (auto constant = builtin(id); !constant.empty()) {
+    result = {constant, false};
+  } else {
+    result = temporary("tiny::unknown()");
+  }
+}
+
+void CodeGen::visitStatementExpr(const StatementExpr &statements) {
+  bool in_tail = tail;
+  auto &body = statements.get_body();
+  result = {"tiny::Value()", false};
+  for (size_t i = 0; i < body.size(); ++i)
+    result = compile(*body[i], in_tail && i + 1 == body.size());
+}
+
+void CodeGen::visitLazyBody(const LazyBody &lazy) { lazy.get().accept(*this); }
+
+void CodeGen::visitTuple(const Tuple &tuple) {
+  std::vector<Result> fields;
+  for (auto &field : tuple.get_fields())
+    fields.push_back(compile(*field));
+  std::string args;
+  for (auto &field : fields)
+    args += (args.empty() ? "" : ", ") + take(field);
+  result = temporary("tiny::tuple(" + args + ")");
+}
+
+void CodeGen::visitProject(const Project &project) {
+  auto tuple = compile(project.get_tuple());
+  result = temporary("tiny::project(" + tuple.expression + ", " +
+                     std::to_string(project.get_index()) + ")");
+}
+
+void CodeGen::visitDestructure(const Destructure &destructure) {
+  auto &names = destructure.get_names();
+  auto value = compile(destructure.get_body());
+  if (!value.temporary)
+    value = temporary(value.expression);
+  line("tiny::as_tuple(" + value.expression + ", " +
+       std::to_string(names.size()) + ");");
+  for (size_t i = 0; i < names.size(); ++i) {
+    line(lookup(names[i])->name + " = " + value.expression +
+         ".tuple().fields[" + std::to_string(i) + "];");
+  }
+  result = value;
+}
+
+CodeGen::Result CodeGen::compile(const Ast &ast, bool tail) {
+  bool outer = this->tail;
+  this->tail = tail;
+  ast.accept(*this);
+  this->tail = outer;
+  return result;
+}
+
+std::string CodeGen::take(const Result &result) {
+  return result.temporary ? "std::move(" + result.expression + ")"
+                          : result.expression;
+}
+
+CodeGen::Result CodeGen::temporary(const std::string &expression) {
+  auto name = "t" + std::to_string(temporaries++);
+  line("tiny::Value " + name + " = " + expression + ";");
+  return {name, true};
+}
+
+void CodeGen::line(const std::string &code) {
+  out->append(2 * indent, ' ');
+  *out += code;
+  *out += '\n';
+}
+
+std::string CodeGen::local(const Identifier &id) {
+  return "v_" + *id + "_" + std::to_string(locals++);
+}
+
+const CodeGen::Variable *CodeGen::lookup(const Identifier &id) {
+  return lookup(id, *scope);
+}
+
+const CodeGen::Variable *CodeGen::lookup(const Identifier &id, Scope &scope) {
+  if (auto it = scope.variables.find(id); it != scope.variables.end())
+    return &it->second;
+  if (!scope.outer)
+    return nullptr;
+  auto outer = lookup(id, *scope.outer);
+  if (!outer || !scope.function)
+    return outer;
+  // Copied into the closure when it is made
+  Variable member{"c_" + *id, outer->maybe_unbound};
+  scope.captures.emplace_back(member.name, outer->name);
+  return &scope.variables.emplace(id, member).first->second;
+}
+
+void CodeGen::declare(const std::set<Identifier> &names) {
+  for (auto &id : names) {
+    // E.g. arguments, which the `let`s then assign
+    if (scope->variables.contains(id))
+      continue;
+    Variable variable{local(id), false};
+    std::string initial;
+    if (auto outer = lookup(id)) {
+      initial = outer->name;
+      variable.maybe_unbound = outer->maybe_unbound;
+    } else if (auto constant = builtin(id); !constant.empty()) {
+      initial = constant;
+    } else {
+      initial = "tiny::Value::unbound()";
+      variable.maybe_unbound = true;
+    }
+    line("tiny::Value " + variable.name + " = " + initial + ";");
+    scope->variables.insert_or_assign(id, variable);
+  }
+}
+
+std::string CodeGen::builtin(const Identifier &id) {
+  if (auto it = builtins.find(id); it != builtins.end())
+    return it->second;
+  if (tiny::builtin(*id).kind == tiny::Value::Kind::Unbound)
+    return "";
+  auto constant = "b_" + *id;
+  constants += "const tiny::Value " + constant + " = tiny::builtin(" +
+               quote(*id) + ");\n";
+  builtins.emplace(id, constant);
+  return constant;
+}
+
+std::string compile(const std::vector<std::unique_ptr<Ast>> &program) {
+  CodeGen codegen;
+  for (auto &statement : program)
+    codegen.add(*statement);
+  return codegen.unit();
+}
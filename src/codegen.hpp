@@ -0,0 +1,133 @@
+#pragma once
+
+/** \file
+ * \brief Compiles scripts to C++, for fixed scripts run often enough that
+ * interpreting them is a waste, e.g.
+ *
+ *     $ tiny-interp --compile script.tiny > script.cpp
+ *     $ c++ -std=c++20 -O2 -I src script.cpp -o script
+ *     $ ./script
+ *
+ * prints what `tiny-interp script.tiny` would. The unit includes the runtime
+ * (`runtime.hpp`) and defines `main` unless `TINY_NO_MAIN` is defined, e.g.
+ * to build it as a shared object and call `program::run` from a host.
+ *
+ * Each `fn` becomes a struct holding the variables its body reads from its
+ * environment, copied when the closure is created, and each variable a C++
+ * local; `let`s assign them. Numbers are `Integer`s, unboxed unless they
+ * are bignums, `loop`s are C++ loops, tuples are `tiny::InlineTuple`s,
+ * applications of a `fn` literal to all its arguments (see
+ * `App::get_frame`) are inlined, and calls in tail position become
+ * iterations of the caller's loop in `tiny::call`, rather than nested
+ * calls.
+ *
+ * Compiled scripts have no fuel, memory or depth limits, and use only the
+ * standard builtins.
+ */
+
+#include "ast.hpp"
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+struct CodeGen : Visitor {
+  /// The script is compiled into `namespace name`
+  CodeGen(std::string name = "program");
+
+  /// Compiles the next top-level statement
+  void add(const Ast &statement);
+  /// The namespace, with the closures' structs and a `tiny::Value run(void)`
+  /// which runs the statements and gives the value of the last
+  std::string program(void) const;
+  /// A whole translation unit: the runtime, `program()` and a `main`
+  std::string unit(void) const;
+
+  void visitAssignment(const Assignment &let);
+  void visitFn(const Fn &fn);
+  void visitIfCond(const IfCond &if_cond);
+  void visitLoop(const Loop &loop);
+  void visitApp(const App &app);
+  void visitBinop(const Binop &op);
+  void visitNumber(const Number &n);
+  void visitIdentifier(const Identifier &id);
+  void visitStatementExpr(const StatementExpr &statements);
+  void visitLazyBody(const LazyBody &lazy);
+  void visitTuple(const Tuple &tuple);
+  void visitProject(const Project &project);
+  void visitDestructure(const Destructure &destructure);
+
+private:
+  struct Variable {
+    /// The C++ local or member
+    std::string name;
+    /// Whether it might be read before a `let` binds it
+    bool maybe_unbound;
+  };
+
+  /// Where names are bound: the script, a function body, a loop or an
+  /// inlined application
+  struct Scope {
+    Scope *outer;
+    /// Function bodies capture variables from the scopes outside
+    bool function;
+    std::map<Identifier, Variable> variables;
+    /// Of a function: the outer variable each member is copied from
+    std::vector<std::pair<std::string, std::string>> captures;
+  };
+
+  /// What a visit leaves: a C++ expression for the value
+  struct Result {
+    std::string expression;
+    /// Whether it is a temporary, which can be moved from once
+    bool temporary;
+  };
+
+  Result compile(const Ast &ast, bool tail = false);
+  /// Its expression, moved from if it is a temporary
+  std::string take(const Result &result);
+  /// A temporary holding the value of a C++ expression
+  Result temporary(const std::string &expression);
+  void line(const std::string &code);
+  std::string local(const Identifier &id);
+
+  /// The variable a name refers to in the current scope, capturing it into
+  /// the enclosing functions if need be, or nullptr for builtins and unknown
+  /// names
+  const Variable *lookup(const Identifier &id);
+  const Variable *lookup(const Identifier &id, Scope &scope);
+  /// Declares locals for names that `let`s may bind in a new scope, starting
+  /// as they are outside it
+  void declare(const std::set<Identifier> &names);
+  /// The constant holding the builtin called `id`, or "" if there is none
+  std::string builtin(const Identifier &id);
+
+  std::string name;
+  /// The closures' structs, and the definitions of their bodies
+  std::string structs;
+  std::string bodies;
+  /// The body of `run`
+  std::string statements;
+  /// Builtins, and closures which capture nothing, made once
+  std::string constants;
+  std::map<Identifier, std::string> builtins;
+  /// The constants made for bignum literals
+  std::set<std::string> big_numbers;
+
+  Scope script;
+  Scope *scope;
+  /// Where code currently goes, and how deeply it is indented
+  std::string *out;
+  size_t indent;
+  /// Whether the expression being compiled is in tail position of a body
+  bool tail;
+  Result result;
+  size_t temporaries;
+  size_t functions;
+  size_t locals;
+};
+
+/// Compiles a whole script into a translation unit (see `CodeGen::unit`)
+std::string compile(const std::vector<std::unique_ptr<Ast>> &program);
@@ -1,6 +1,41 @@
 #include "eval.hpp"
+#include "builtins.hpp"
+#include "kernels.hpp"
+#include "metrics.hpp"
+#include "profiler.hpp"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <utility>
+
+namespace {
+
+/// Roughly what one entry of a std::map environment costs, for charging
+/// closures against the memory limit
+const size_t ENVIRONMENT_ENTRY_BYTES =
+    sizeof(std::pair<const Identifier, Rc<Value>>) + 4 * sizeof(void *);
+
+/// Numbers from 0 to below this are shared by make_number
+const int64_t SMALL_NUMBERS = 256;
+
+template <size_t N>
+Rc<TupleValue> make_inline_tuple(EvalVisitor &eval, Rc<Value> *fields) {
+  std::array<Rc<Value>, N> storage;
+  std::move(fields, fields + N, storage.begin());
+  return eval.make<InlineTuple<N>>(std::move(storage));
+}
+
+template <size_t... N>
+constexpr auto make_inline_tuples(std::index_sequence<N...>) {
+  return std::array{&make_inline_tuple<N>...};
+}
+
+/// make_inline_tuple for each size, to pick from at run time
+constexpr auto MAKE_TUPLE =
+    make_inline_tuples(std::make_index_sequence<MAX_TUPLE_SIZE + 1>());
+
+} // namespace
 
 const char *EvalError::what(void) const noexcept {
   return "Unknown error during evaluation";
@@ -18,14 +53,50 @@ const char *UnknownVariable::what(void) const noexcept {
   return "Unknown variable";
 }
 
-NumberValue::NumberValue(uint32_t value) : value(value) {}
+const char *NotAnArray::what(void) const noexcept {
+  return "Value is not an array";
+}
+
+const char *IndexOutOfRange::what(void) const noexcept {
+  return "Index out of range";
+}
+
+const char *LengthMismatch::what(void) const noexcept {
+  return "Arrays have different lengths";
+}
+
+const char *NotATuple::what(void) const noexcept {
+  return "Value is not a tuple of that size";
+}
+
+const char *NumberOutOfRange::what(void) const noexcept {
+  return "Number out of range";
+}
+
+const char *OutOfFuel::what(void) const noexcept {
+  return "Evaluation ran out of fuel";
+}
+
+const char *MemoryLimitExceeded::what(void) const noexcept {
+  return "Evaluation exceeded its memory limit";
+}
+
+const char *CallDepthExceeded::what(void) const noexcept {
+  return "Maximum call depth exceeded";
+}
+
+const char *Cancelled::what(void) const noexcept {
+  return "Evaluation cancelled";
+}
+
+NumberValue::NumberValue(Integer value) : value(std::move(value)) {}
 void NumberValue::accept(ValueVisitor &v) const { v.visitNumber(*this); }
-uint32_t NumberValue::get_value() const { return value; }
+const Integer &NumberValue::get_value() const { return value; }
 
 ClosureValue::ClosureValue(
     const std::vector<Identifier> &args, const std::shared_ptr<Ast> &body,
-    const std::map<Identifier, std::shared_ptr<Value>> environment)
-    : environment(environment), args(args), body(body) {}
+    const std::map<Identifier, Rc<Value>> environment, bool typed)
+    : environment(environment), args(args), body(body), typed(typed) {}
 
 void ClosureValue::accept(ValueVisitor &v) const { v.visitClosure(*this); }
 
@@ -33,8 +104,18 @@ const std::vector<Identifier> &ClosureValue::get_args() const { return args; }
 
 const std::shared_ptr<Ast> &ClosureValue::get_body() const { return body; }
 
-std::shared_ptr<Value> ClosureValue::apply(std::shared_ptr<Value> arg,
-                                           EvalVisitor &eval) const {
+const std::map<Identifier, Rc<Value>> & ClosureValue::get_environment() const {
+  return environment;
+}
+
+bool ClosureValue::is_typed() const { return typed; }
+
+void ClosureValue::share_members(void) const {
+  for (auto &[name, value] : environment)
+    value->share();
+}
+
+Rc<Value> ClosureValue::apply(Rc<Value> arg, EvalVisitor &eval) const {
   auto inner_environment(environment);
   auto formal_begin = args.cbegin();
   auto formal_end = args.cend();
@@ -45,92 +126,376 @@ std::shared_ptr<Value> ClosureValue::apply(std::shared_ptr<Value> arg,
   if (args.size() == 1) {
     auto outer_environment = eval.get_environment();
     eval.set_environment(inner_environment);
-    body->accept(eval);
+    try {
+      body->accept(eval);
+    } catch (...) {
+      eval.set_environment(outer_environment);
+      throw;
+    }
     auto result = eval.get_last();
     eval.set_environment(outer_environment);
     return result;
   } else {
     ++formal_begin;
     std::vector<Identifier> rest_args(formal_begin, formal_end);
-    return std::make_shared<ClosureValue>(rest_args, body, inner_environment);
+    return eval.make<ClosureValue>(rest_args, body, inner_environment, typed);
   }
 }
 
-EvalVisitor::EvalVisitor() : environment({}), last(nullptr) {}
+ArrayValue::ArrayValue(std::vector<uint32_t> values)
+    : values(std::move(values)) {}
+void ArrayValue::accept(ValueVisitor &v) const { v.visitArray(*this); }
+const std::vector<uint32_t> &ArrayValue::get_values() const { return values; }
+
+TupleValue::TupleValue(const Rc<Value> *fields, size_t count)
+    : fields(fields), count(count) {}
+void TupleValue::accept(ValueVisitor &v) const { v.visitTuple(*this); }
+size_t TupleValue::size() const { return count; }
+
+void TupleValue::share_members(void) const {
+  for (size_t i = 0; i < count; ++i)
+    fields[i]->share();
+}
+
+const Rc<Value> &TupleValue::get(size_t index) const {
+  if (index >= count)
+    throw IndexOutOfRange();
+  return fields[index];
+}
+
+const TupleValue &as_tuple(const Rc<Value> &value, size_t size) {
+  auto tuple = dynamic_cast<const TupleValue *>(value.get());
+  if (tuple == nullptr || (size != 0 && tuple->size() != size))
+    throw NotATuple();
+  return *tuple;
+}
+
+BuiltinValue::BuiltinValue(std::string name, size_t arity, Function function,
+                           std::vector<Rc<Value>> bound)
+    : BuiltinValue(std::move(name), arity,
+                   std::make_shared<const Function>(std::move(function)),
+                   std::move(bound)) {}
+
+BuiltinValue::BuiltinValue(std::string name, size_t arity,
+                           std::shared_ptr<const Function> function,
+                           std::vector<Rc<Value>> bound)
+    : name(std::move(name)), arity(arity), function(std::move(function)),
+      bound(std::move(bound)) {
+  assert(arity > 0 && this->bound.size() < arity);
+}
+
+void BuiltinValue::accept(ValueVisitor &v) const { v.visitBuiltin(*this); }
+
+void BuiltinValue::share_members(void) const {
+  for (auto &value : bound)
+    value->share();
+}
+
+const std::string &BuiltinValue::get_name() const { return name; }
+
+size_t BuiltinValue::get_arity() const { return arity; }
+
+const std::vector<Rc<Value>> &BuiltinValue::get_bound() const {
+  return bound;
+}
+
+Rc<Value> BuiltinValue::apply(Rc<Value> arg, EvalVisitor &eval) const {
+  auto args = bound;
+  args.push_back(std::move(arg));
+  if (args.size() == arity)
+    return (*function)(args, eval);
+  eval.charge(sizeof(BuiltinValue));
+  return Rc<BuiltinValue>(
+      new BuiltinValue(name, arity, function, std::move(args)));
+}
+
+EvalVisitor::EvalVisitor() : EvalVisitor(BuiltinRegistry::standard()) {}
+
+EvalVisitor::EvalVisitor(std::map<Identifier, Rc<Value>> other_environment)
+    : environment(other_environment),
+      builtins(&BuiltinRegistry::standard().environment()), last(nullptr),
+      typed(false), steps(0), allocated(0), depth(0), profiler(nullptr),
+      values(0), closures(0), cancelled(false) {}
 
-EvalVisitor::EvalVisitor(
-    std::map<Identifier, std::shared_ptr<Value>> other_environment)
-    : environment(other_environment), last(nullptr) {}
+EvalVisitor::EvalVisitor(const BuiltinRegistry &registry)
+    : environment({}), builtins(&registry.environment()), last(nullptr),
+      typed(false), steps(0), allocated(0), depth(0), profiler(nullptr),
+      values(0), closures(0), cancelled(false) {}
 
 void EvalVisitor::visitAssignment(const Assignment &let) {
   let.get_body().accept(*this);
   environment[*let.get_name()] = last;
+  if (profiler) {
+    if (auto fn = dynamic_cast<const Fn *>(&let.get_body()))
+      profiler->name(*fn->get_body(), *let.get_name());
+  }
 }
 
 void EvalVisitor::visitFn(const Fn &fn) {
   std::vector<Ast> body;
-  last =
-      std::make_shared<ClosureValue>(fn.get_args(), fn.get_body(), environment);
+  last = make_closure(fn, environment);
 }
 
 void EvalVisitor::visitIfCond(const IfCond &if_cond) {
-  if_cond.get_condition().accept(*this);
-  auto cond = std::dynamic_pointer_cast<NumberValue>(last);
-  bool is_true = cond == nullptr || cond->get_value();
-  if (is_true)
+  if (test(if_cond.get_condition()))
     if_cond.get_true_case().accept(*this);
   else
     if_cond.get_false_case().accept(*this);
 }
 
+bool EvalVisitor::test(const Expression &condition) {
+  condition.accept(*this);
+  if (typed && condition.get_proven() == Proven::Number)
+    return bool(static_cast<const NumberValue &>(*last).get_value());
+  auto cond = dynamic_pointer_cast<NumberValue>(last);
+  return cond == nullptr || cond->get_value();
+}
+
+void EvalVisitor::visitLoop(const Loop &loop) {
+  auto &vars = loop.get_vars();
+  auto base = frame_args.size();
+  auto evaluate = [&](const std::vector<std::shared_ptr<Expression>> &exprs) {
+    for (auto &expr : exprs) {
+      expr->accept(*this);
+      frame_args.push_back(std::move(last));
+    }
+  };
+  // All at once, after evaluating all the new values
+  auto bind = [&] {
+    for (size_t i = 0; i < vars.size(); ++i)
+      environment[vars[i]] = std::move(frame_args[base + i]);
+    frame_args.resize(base);
+  };
+
+  try {
+    evaluate(loop.get_inits());
+  } catch (...) {
+    frame_args.resize(base);
+    throw;
+  }
+  // The loop runs in a copy of the environment, like a closure body, so
+  // the enclosing one is untouched
+  auto outer = environment;
+  try {
+    bind();
+    // Each iteration counts as a step, so loops run out of fuel and can be
+    // cancelled like recursion
+    for (step(); test(loop.get_condition()); step()) {
+      evaluate(loop.get_steps());
+      bind();
+    }
+  } catch (...) {
+    frame_args.resize(base);
+    environment.swap(outer);
+    throw;
+  }
+  last = std::move(environment[vars.back()]);
+  environment.swap(outer);
+}
+
 void EvalVisitor::visitApp(const App &app) {
+  if (auto frame = app.get_frame())
+    return apply_frame(*frame);
+
   app.get_lhs().accept(*this);
-  auto lhs = std::dynamic_pointer_cast<ClosureValue>(last);
-  if (lhs == nullptr)
+  auto lhs = last;
+  // `apply` checks again anyway, this only makes the error come before the
+  // argument is evaluated
+  if ((!typed || app.get_lhs().get_proven() != Proven::Function) &&
+      !dynamic_pointer_cast<ClosureValue>(lhs) &&
+      !dynamic_pointer_cast<BuiltinValue>(lhs))
     throw NotAFunction();
 
   app.get_rhs().accept(*this);
   auto rhs = last;
 
-  last = lhs->apply(rhs, *this);
+  last = apply(lhs, rhs);
 }
 
-void EvalVisitor::visitBinop(const Binop &op) {
-  op.get_lhs().accept(*this);
-  auto lhs = std::dynamic_pointer_cast<NumberValue>(last);
-  if (lhs == nullptr)
-    throw NotANumber();
+Rc<Value> EvalVisitor::apply(const Rc<Value> &function, Rc<Value> arg) {
+  step();
+  if (auto closure = dynamic_pointer_cast<ClosureValue>(function)) {
+    Call call(*this, closure->get_body().get());
+    Typing typing(*this, typed && closure->is_typed());
+    return closure->apply(std::move(arg), *this);
+  }
+  if (auto builtin = dynamic_pointer_cast<BuiltinValue>(function))
+    return builtin->apply(std::move(arg), *this);
+  throw NotAFunction();
+}
 
-  op.get_rhs().accept(*this);
-  auto rhs = std::dynamic_pointer_cast<NumberValue>(last);
-  if (rhs == nullptr)
-    throw NotANumber();
+void EvalVisitor::apply_frame(const Frame &frame) {
+  auto args_base = frame_args.size();
+  auto saved_base = saved.size();
+  auto restore = [&] {
+    for (auto it = saved.begin() + saved_base; it != saved.end(); ++it) {
+      if (it->bound)
+        environment[*it->name] = std::move(it->value);
+      else
+        environment.erase(*it->name);
+    }
+    saved.resize(saved_base);
+  };
 
-  auto opname = op.get_op();
-  if (opname == "<") {
-    last = std::make_shared<NumberValue>(lhs->get_value() < rhs->get_value());
+  try {
+    // As when applying the closure one argument at a time, each is
+    // evaluated before the step for applying it
+    for (auto arg : frame.args) {
+      arg->accept(*this);
+      frame_args.push_back(std::move(last));
+      step();
+    }
+    for (auto &name : frame.bindings) {
+      auto it = environment.find(name);
+      if (it == environment.end())
+        saved.push_back({&name, nullptr, false});
+      else
+        saved.push_back({&name, it->second, true});
+    }
+    auto &formals = frame.fn.get_args();
+    for (size_t i = 0; i < formals.size(); ++i)
+      environment[formals[i]] = std::move(frame_args[args_base + i]);
+    frame_args.resize(args_base);
+
+    if (profiler)
+      profiler->add(frame.fn.get_args(), frame.fn.get_body());
+    Call call(*this, frame.fn.get_body().get());
+    frame.fn.get_body()->accept(*this);
+  } catch (...) {
+    frame_args.resize(args_base);
+    restore();
+    throw;
   }
-  if (opname == "==") {
-    last = std::make_shared<NumberValue>(lhs->get_value() == rhs->get_value());
+  restore();
+}
+
+namespace {
+
+kernels::Op kernel_op(const std::string &opname) {
+  if (opname == "<")
+    return kernels::Op::Less;
+  if (opname == "==")
+    return kernels::Op::Equal;
+  if (opname == ">")
+    return kernels::Op::Greater;
+  if (opname == "+")
+    return kernels::Op::Add;
+  return kernels::Op::Sub;
+}
+
+/// A number operand of an array operator, which has to be in the elements'
+/// range rather than be truncated to it
+uint32_t element(const Integer &n) {
+  if (!n.fits<uint32_t>())
+    throw NumberOutOfRange();
+  return uint32_t(n.small());
+}
+
+/// Element-wise operators, where at least one side is an array and the other
+/// is an array of the same length or a number
+Rc<Value> array_binop(const std::string &opname, const Rc<Value> &lhs,
+                      const Rc<Value> &rhs, EvalVisitor &eval) {
+  auto op = kernel_op(opname);
+  auto lhs_array = dynamic_pointer_cast<ArrayValue>(lhs);
+  auto rhs_array = dynamic_pointer_cast<ArrayValue>(rhs);
+  auto lhs_number = dynamic_pointer_cast<NumberValue>(lhs);
+  auto rhs_number = dynamic_pointer_cast<NumberValue>(rhs);
+
+  if (lhs_array && rhs_array) {
+    auto &l = lhs_array->get_values(), &r = rhs_array->get_values();
+    if (l.size() != r.size())
+      throw LengthMismatch();
+    eval.charge(l.size() * sizeof(uint32_t));
+    std::vector<uint32_t> out(l.size());
+    kernels::binop(op, l.data(), r.data(), out.data(), out.size());
+    return eval.make<ArrayValue>(std::move(out));
   }
-  if (opname == ">") {
-    last = std::make_shared<NumberValue>(lhs->get_value() > rhs->get_value());
+  if (lhs_array && rhs_number) {
+    auto &l = lhs_array->get_values();
+    eval.charge(l.size() * sizeof(uint32_t));
+    std::vector<uint32_t> out(l.size());
+    kernels::binop(op, l.data(), element(rhs_number->get_value()), out.data(),
+                   out.size());
+    return eval.make<ArrayValue>(std::move(out));
   }
-  if (opname == "+") {
-    last = std::make_shared<NumberValue>(lhs->get_value() + rhs->get_value());
+  if (lhs_number && rhs_array) {
+    auto &r = rhs_array->get_values();
+    eval.charge(r.size() * sizeof(uint32_t));
+    std::vector<uint32_t> out(r.size());
+    kernels::binop(op, element(lhs_number->get_value()), r.data(), out.data(),
+                   out.size());
+    return eval.make<ArrayValue>(std::move(out));
   }
-  if (opname == "-") {
-    last = std::make_shared<NumberValue>(lhs->get_value() - rhs->get_value());
+  throw NotANumber();
+}
+
+} // namespace
+
+void EvalVisitor::visitBinop(const Binop &op) {
+  if (typed && op.get_lhs().get_proven() == Proven::Number &&
+      op.get_rhs().get_proven() == Proven::Number) {
+    op.get_lhs().accept(*this);
+    auto l = static_cast<const NumberValue &>(*last).get_value();
+    op.get_rhs().accept(*this);
+    auto r = static_cast<const NumberValue &>(*last).get_value();
+    // The operators differ in their first character
+    switch (op.get_op()[0]) {
+    case '<':
+      last = make_number(l < r);
+      break;
+    case '=':
+      last = make_number(l == r);
+      break;
+    case '>':
+      last = make_number(l > r);
+      break;
+    case '+':
+      last = make_number(l + r);
+      break;
+    default:
+      last = make_number(l - r);
+    }
+    return;
   }
+
+  op.get_lhs().accept(*this);
+  auto lhs = last;
+  if (!dynamic_pointer_cast<NumberValue>(lhs) &&
+      !dynamic_pointer_cast<ArrayValue>(lhs))
+    throw NotANumber();
+
+  op.get_rhs().accept(*this);
+  last = binop(op.get_op(), lhs, last);
+}
+
+Rc<Value> EvalVisitor::binop(const std::string &opname, const Rc<Value> &lhs,
+                             const Rc<Value> &rhs) {
+  auto lhs_number = dynamic_pointer_cast<NumberValue>(lhs);
+  auto rhs_number = dynamic_pointer_cast<NumberValue>(rhs);
+  if (lhs_number == nullptr || rhs_number == nullptr)
+    return array_binop(opname, lhs, rhs, *this);
+
+  auto &l = lhs_number->get_value(), &r = rhs_number->get_value();
+  if (opname == "<")
+    return make_number(l < r);
+  if (opname == "==")
+    return make_number(l == r);
+  if (opname == ">")
+    return make_number(l > r);
+  if (opname == "+")
+    return make_number(l + r);
+  return make_number(l - r);
 }
 
 void EvalVisitor::visitNumber(const Number &number) {
-  last = std::make_unique<NumberValue>(*number);
+  last = make_number(*number);
 }
 
 void EvalVisitor::visitIdentifier(const Identifier &id) {
-  if (environment.contains(id)) {
-    last = environment[id];
+  if (auto it = environment.find(id); it != environment.end()) {
+    last = it->second;
+  } else if (auto builtin = builtins->find(id); builtin != builtins->end()) {
+    last = builtin->second;
   } else {
     throw UnknownVariable();
   }
@@ -143,13 +508,186 @@ void EvalVisitor::visitStatementExpr(const StatementExpr &statements) {
   }
 }
 
-std::shared_ptr<Value> EvalVisitor::get_last(void) const { return last; }
+void EvalVisitor::visitLazyBody(const LazyBody &lazy) {
+  lazy.get().accept(*this);
+}
+
+void EvalVisitor::visitTuple(const Tuple &tuple) {
+  std::array<Rc<Value>, MAX_TUPLE_SIZE> fields;
+  auto &exprs = tuple.get_fields();
+  for (size_t i = 0; i < exprs.size(); ++i) {
+    exprs[i]->accept(*this);
+    fields[i] = std::move(last);
+  }
+  last = make_tuple(fields.data(), exprs.size());
+}
+
+void EvalVisitor::visitProject(const Project &project) {
+  project.get_tuple().accept(*this);
+  last = as_tuple(last).get(project.get_index());
+}
+
+void EvalVisitor::visitDestructure(const Destructure &destructure) {
+  destructure.get_body().accept(*this);
+  auto &names = destructure.get_names();
+  auto &tuple = as_tuple(last, names.size());
+  for (size_t i = 0; i < names.size(); ++i)
+    environment[names[i]] = tuple.get(i);
+}
+
+void EvalVisitor::evaluate(const Ast &ast) {
+  reset_usage();
+  run(ast);
+}
+
+void EvalVisitor::evaluate_typed(const Ast &ast) {
+  reset_usage();
+  Typing typing(*this, true);
+  run(ast);
+}
+
+void EvalVisitor::run(const Ast &ast) {
+  auto record = [this] {
+    metrics::add(metrics::Counter::Statements);
+    metrics::add(metrics::Counter::Steps, steps);
+    metrics::add(metrics::Counter::Values, values);
+    metrics::add(metrics::Counter::Closures, closures);
+    metrics::add(metrics::Counter::Bytes, allocated);
+    if (profiler)
+      profiler->drain();
+  };
+  metrics::Timer timer(metrics::Timing::Eval);
+  try {
+    ast.accept(*this);
+  } catch (const std::exception &error) {
+    metrics::record_error(error);
+    record();
+    throw;
+  }
+  record();
+}
+
+void EvalVisitor::reset_usage(void) {
+  steps = 0;
+  allocated = 0;
+  depth.store(0, std::memory_order_relaxed);
+  values = 0;
+  closures = 0;
+}
+
+void EvalVisitor::set_limits(EvalLimits new_limits) { limits = new_limits; }
+
+const EvalLimits &EvalVisitor::get_limits(void) const { return limits; }
+
+void EvalVisitor::cancel(void) {
+  cancelled.store(true, std::memory_order_relaxed);
+}
+
+void EvalVisitor::set_profiler(Profiler *new_profiler) {
+  profiler = new_profiler;
+}
+
+size_t EvalVisitor::get_calls(const Ast **bodies) const {
+  auto n = depth.load(std::memory_order_relaxed);
+  std::atomic_signal_fence(std::memory_order_acquire);
+  for (size_t i = n - std::min<size_t>(n, SAMPLED_CALLS); i < n; ++i)
+    *bodies++ = calls[i % SAMPLED_CALLS];
+  return n;
+}
+
+void EvalVisitor::step(void) {
+  if (++steps > limits.fuel)
+    throw OutOfFuel();
+  if (cancelled.load(std::memory_order_relaxed)) {
+    cancelled.store(false, std::memory_order_relaxed);
+    throw Cancelled();
+  }
+}
+
+Rc<NumberValue> EvalVisitor::make_number(int64_t value) {
+  if (value < 0 || value >= SMALL_NUMBERS)
+    return make<NumberValue>(value);
+  // Per thread, so that their reference counts aren't contended
+  thread_local std::array<Rc<NumberValue>, SMALL_NUMBERS> small;
+  auto &number = small[value];
+  if (!number) number = make_rc<NumberValue>(value);
+  return number;
+}
+
+Rc<NumberValue> EvalVisitor::make_number(Integer value) {
+  if (value.is_small()) [[likely]]
+    return make_number(value.small());
+  charge(value.heap_bytes());
+  return make<NumberValue>(std::move(value));
+}
+
+Rc<TupleValue> EvalVisitor::make_tuple(Rc<Value> *fields, size_t count) {
+  assert(count >= 2 && count <= MAX_TUPLE_SIZE);
+  return MAKE_TUPLE[count](*this, fields);
+}
+
+Rc<ClosureValue>
+EvalVisitor::make_closure(const Fn &fn,
+                          const std::map<Identifier, Rc<Value>> &environment) {
+  charge(environment.size() * ENVIRONMENT_ENTRY_BYTES);
+  ++closures;
+  if (profiler)
+    profiler->add(fn.get_args(), fn.get_body());
+  return make<ClosureValue>(fn.get_args(), fn.get_body(), environment, typed);
+}
+
+void EvalVisitor::charge(size_t bytes) {
+  if (bytes > limits.max_bytes - allocated)
+    throw MemoryLimitExceeded();
+  allocated += bytes;
+}
+
+EvalVisitor::Call::Call(EvalVisitor &eval, const Ast *body) : eval(eval) {
+  auto depth = eval.depth.load(std::memory_order_relaxed);
+  if (depth >= eval.limits.max_depth)
+    throw CallDepthExceeded();
+  eval.calls[depth % SAMPLED_CALLS] = body;
+  // So a profiler's signal handler never sees the depth without the body
+  std::atomic_signal_fence(std::memory_order_release);
+  eval.depth.store(depth + 1, std::memory_order_relaxed);
+}
+
+EvalVisitor::Call::~Call() {
+  eval.depth.store(eval.depth.load(std::memory_order_relaxed) - 1,
+                   std::memory_order_relaxed);
+}
+
+EvalVisitor::Typing::Typing(EvalVisitor &eval, bool typed)
+    : eval(eval), outer(eval.typed) {
+  eval.typed = typed;
+}
 
-std::map<Identifier, std::shared_ptr<Value>>
-EvalVisitor::get_environment(void) {
+EvalVisitor::Typing::~Typing() { eval.typed = outer; }
+
+Rc<Value> EvalVisitor::get_last(void) const { return last; }
+
+std::map<Identifier, Rc<Value>> EvalVisitor::get_environment(void) {
   return environment;
 }
 void EvalVisitor::set_environment(
-    std::map<Identifier, std::shared_ptr<Value>> new_environment) {
+    std::map<Identifier, Rc<Value>> new_environment) {
   environment = new_environment;
 }
+
+void EvalVisitor::swap_environment(std::map<Identifier, Rc<Value>> &other) {
+  environment.swap(other);
+}
+
+Rc<Value> EvalVisitor::lookup(const Identifier &id) const {
+  auto it = environment.find(id);
+  if (it != environment.end())
+    return it->second;
+  it = builtins->find(id);
+  return it == builtins->end() ? nullptr : it->second;
+}
+
+void EvalVisitor::bind(const Identifier &id, Rc<Value> value) {
+  environment[id] = std::move(value);
+}
+
+void EvalVisitor::unset(const Identifier &id) { environment.erase(id); }
@@ -1,7 +1,8 @@
 #pragma once
 
 /** \file
- * \brief Contains values in the language (numbers and closures) and an
+ * \brief Contains values in the language (numbers, arrays, tuples, closures
+ * and builtins) and an
  * evaluator for evaluating a syntax-tree. Function-bodies live beyond their
  * AST, consider
  *
@@ -27,13 +28,28 @@
  * deallocated in the next while loop iteration. But you still want to be able
  * to run `id 2` in another line/evaluation, so we use shared_ptr for function
  * bodies.
+ *
+ * Values themselves are held by `Rc` (see `rc.hpp`), whose counts are only
+ * atomic for values shared between threads.
  */
 
 #include "ast.hpp"
+#include "rc.hpp"
 
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <map>
+#include <string>
 #include <vector>
 
+/// How many of the innermost calls the evaluator keeps for the profiler,
+/// as a power of two
+#define SAMPLED_CALLS 64
+
+struct Profiler;
+
 struct EvalError : std::exception {
   const char *what(void) const noexcept override;
 };
@@ -50,60 +66,327 @@ struct UnknownVariable : EvalError {
   const char *what(void) const noexcept override;
 };
 
+struct NotAnArray : EvalError {
+  const char *what(void) const noexcept override;
+};
+
+struct IndexOutOfRange : EvalError {
+  const char *what(void) const noexcept override;
+};
+
+struct LengthMismatch : EvalError {
+  const char *what(void) const noexcept override;
+};
+
+struct NotATuple : EvalError {
+  const char *what(void) const noexcept override;
+};
+
+/// A number used where it has to fit a narrower type, e.g. an array length
+struct NumberOutOfRange : EvalError {
+  const char *what(void) const noexcept override;
+};
+
+struct OutOfFuel : EvalError {
+  const char *what(void) const noexcept override;
+};
+
+struct MemoryLimitExceeded : EvalError {
+  const char *what(void) const noexcept override;
+};
+
+struct CallDepthExceeded : EvalError {
+  const char *what(void) const noexcept override;
+};
+
+struct Cancelled : EvalError {
+  const char *what(void) const noexcept override;
+};
+
+/// Resource limits for one evaluation (see `EvalVisitor::evaluate`), each
+/// raising its own EvalError when exceeded
+struct EvalLimits {
+  /// Steps, counted at every application (including each element of a
+  /// `map`, `filter` or `fold`)
+  uint64_t fuel = UINT64_MAX;
+  /// Approximate bytes of values allocated
+  size_t max_bytes = SIZE_MAX;
+  /// Nested closure applications, which each take C++ stack
+  size_t max_depth = SIZE_MAX;
+};
+
 struct ValueVisitor;
 struct EvalVisitor;
+struct BuiltinRegistry;
 
-struct Value {
+struct Value : RefCounted {
   virtual void accept(ValueVisitor &) const = 0;
 };
 
+/// An integer of any size, see `integer.hpp`
 struct NumberValue : Value {
-  NumberValue(uint32_t value);
+  NumberValue(Integer value);
   void accept(ValueVisitor &) const override;
-  uint32_t get_value() const;
+  const Integer &get_value() const;
 
 private:
-  uint32_t value;
+  const Integer value;
 };
 
 struct ClosureValue : Value {
   ClosureValue(const std::vector<Identifier> &args,
                const std::shared_ptr<Ast> &body,
-               const std::map<Identifier, std::shared_ptr<Value>> environment);
+               const std::map<Identifier, Rc<Value>> environment,
+               bool typed = false);
   void accept(ValueVisitor &) const override;
   const std::vector<Identifier> &get_args() const;
   const std::shared_ptr<Ast> &get_body() const;
-  std::shared_ptr<Value> apply(std::shared_ptr<Value> arg,
-                               EvalVisitor &eval) const;
+  const std::map<Identifier, Rc<Value>> & get_environment() const;
+  /// Whether it was created evaluating a type-checked statement, so its
+  /// environment has the types its body was checked with
+  bool is_typed() const;
+  Rc<Value> apply(Rc<Value> arg, EvalVisitor &eval) const;
+
+protected:
+  void share_members(void) const override;
 
 private:
-  std::map<Identifier, std::shared_ptr<Value>> environment;
+  std::map<Identifier, Rc<Value>> environment;
   const std::vector<Identifier> args;
   const std::shared_ptr<Ast> body;
+  const bool typed;
+};
+
+/// A packed array of 32-bit numbers, whose arithmetic wraps (see
+/// `kernels.hpp`)
+struct ArrayValue : Value {
+  ArrayValue(std::vector<uint32_t> values);
+  void accept(ValueVisitor &) const override;
+  const std::vector<uint32_t> &get_values() const;
+
+private:
+  const std::vector<uint32_t> values;
+};
+
+/// A tuple of up to MAX_TUPLE_SIZE values. The fields are stored inline in
+/// the value (see `InlineTuple`), so a tuple is one allocation and projecting
+/// a field is an index.
+struct TupleValue : Value {
+  void accept(ValueVisitor &) const override;
+  size_t size() const;
+  /// Throws IndexOutOfRange if `index >= size()`
+  const Rc<Value> &get(size_t index) const;
+
+protected:
+  TupleValue(const Rc<Value> *fields, size_t count);
+  void share_members(void) const override;
+
+private:
+  const Rc<Value> *const fields;
+  const size_t count;
+};
+
+/// A tuple of exactly `N` fields, made by `EvalVisitor::make_tuple`
+template <size_t N> struct InlineTuple : TupleValue {
+  InlineTuple(std::array<Rc<Value>, N> values)
+      : TupleValue(storage.data(), N), storage(std::move(values)) {}
+  // The base points into `storage`
+  InlineTuple(const InlineTuple &) = delete;
+  InlineTuple &operator=(const InlineTuple &) = delete;
+
+private:
+  std::array<Rc<Value>, N> storage;
+};
+
+/// `value` as a tuple, of `size` fields if that is not 0. Throws NotATuple if
+/// it is not one.
+const TupleValue &as_tuple(const Rc<Value> &value, size_t size = 0);
+
+/// A function implemented in C++, taking `arity` curried arguments. Applying
+/// it to fewer gives a new BuiltinValue with the arguments so far bound.
+struct BuiltinValue : Value {
+  typedef std::function<Rc<Value>(
+      const std::vector<Rc<Value>> &args, EvalVisitor &eval)> Function;
+
+  BuiltinValue(std::string name, size_t arity, Function function,
+               std::vector<Rc<Value>> bound = {});
+  void accept(ValueVisitor &) const override;
+  const std::string &get_name() const;
+  size_t get_arity() const;
+  const std::vector<Rc<Value>> &get_bound() const;
+  Rc<Value> apply(Rc<Value> arg, EvalVisitor &eval) const;
+
+protected:
+  void share_members(void) const override;
+
+private:
+  const std::string name;
+  const size_t arity;
+  // Shared between partial applications
+  const std::shared_ptr<const Function> function;
+  const std::vector<Rc<Value>> bound;
+
+  BuiltinValue(std::string name, size_t arity,
+               std::shared_ptr<const Function> function,
+               std::vector<Rc<Value>> bound);
 };
 
 struct ValueVisitor {
   virtual void visitNumber(const NumberValue &) = 0;
   virtual void visitClosure(const ClosureValue &) = 0;
+  virtual void visitArray(const ArrayValue &) = 0;
+  virtual void visitTuple(const TupleValue &) = 0;
+  virtual void visitBuiltin(const BuiltinValue &) = 0;
 };
 
 struct EvalVisitor : Visitor {
+  /// Identifiers not in the environment are looked up in the builtins, by
+  /// default the standard ones, see `builtins.hpp`. The registry has to
+  /// outlive the evaluator.
   EvalVisitor();
-  EvalVisitor(std::map<Identifier, std::shared_ptr<Value>>);
+  EvalVisitor(std::map<Identifier, Rc<Value>>);
+  EvalVisitor(const BuiltinRegistry &builtins);
   void visitAssignment(const Assignment &let);
   void visitFn(const Fn &fn);
   void visitIfCond(const IfCond &if_cond);
+  void visitLoop(const Loop &loop);
   void visitApp(const App &app);
   void visitBinop(const Binop &op);
   void visitNumber(const Number &n);
   void visitIdentifier(const Identifier &id);
   void visitStatementExpr(const StatementExpr &statements);
+  void visitLazyBody(const LazyBody &lazy);
+  void visitTuple(const Tuple &tuple);
+  void visitProject(const Project &project);
+  void visitDestructure(const Destructure &destructure);
+
+  /// Evaluates a top-level statement, with the step and allocation counts
+  /// for the limits starting from zero
+  void evaluate(const Ast &ast);
+  /// Evaluates a top-level statement which a TypeChecker has checked against
+  /// the types of this environment, skipping the run-time checks its
+  /// annotations make redundant (see `types.hpp`)
+  void evaluate_typed(const Ast &ast);
+  /// Starts counting steps and allocations for the limits from zero
+  void reset_usage(void);
+  void set_limits(EvalLimits limits);
+  const EvalLimits &get_limits(void) const;
+  /// Aborts the evaluation in progress with Cancelled, or the next one if
+  /// none is running. Safe to call from other threads and signal handlers.
+  void cancel(void);
+  /// Tells `profiler` about the functions made and named from now on, or
+  /// stops if it is nullptr. Called by the Profiler itself.
+  void set_profiler(Profiler *profiler);
+  /// Copies the bodies of the innermost SAMPLED_CALLS closures (and `fn`
+  /// literals) being applied into `bodies`, outermost first, and returns how
+  /// many are being applied, which may be more. Safe to call from signal
+  /// handlers on this thread.
+  size_t get_calls(const Ast **bodies) const;
+
+  /// Counts a step against the fuel, and checks for cancellation
+  void step(void);
+  /// Counts bytes of allocated values against the memory limit. This is the
+  /// total allocated during the evaluation, whether or not it is still live.
+  void charge(size_t bytes);
+  /// Allocates a value, charging its size
+  template <typename T, typename... Args>
+  Rc<T> make(Args &&...args) {
+    charge(sizeof(T));
+    ++values;
+    return make_rc<T>(std::forward<Args>(args)...);
+  }
+  /// A number value. Small numbers are shared rather than allocated, so that
+  /// e.g. counters and comparisons allocate nothing.
+  Rc<NumberValue> make_number(int64_t value);
+  Rc<NumberValue> make_number(Integer value);
+  /// A tuple of the first `count` values of `fields`, which are moved from.
+  /// `count` is from 2 to MAX_TUPLE_SIZE.
+  Rc<TupleValue> make_tuple(Rc<Value> *fields, size_t count);
+  /// Allocates a closure, charging for its copy of the environment too
+  Rc<ClosureValue>
+  make_closure(const Fn &fn,
+               const std::map<Identifier, Rc<Value>> &environment);
+
+  /// Applies a binary operator to two numbers, or element-wise where either
+  /// side is an array
+  Rc<Value> binop(const std::string &opname, const Rc<Value> &lhs,
+                  const Rc<Value> &rhs);
+
+  /// Applies a closure or builtin to one argument
+  Rc<Value> apply(const Rc<Value> &function, Rc<Value> arg);
 
-  std::shared_ptr<Value> get_last(void) const;
-  std::map<Identifier, std::shared_ptr<Value>> get_environment(void);
-  void set_environment(std::map<Identifier, std::shared_ptr<Value>>);
+  Rc<Value> get_last(void) const;
+  std::map<Identifier, Rc<Value>> get_environment(void);
+  void set_environment(std::map<Identifier, Rc<Value>>);
+  /// Exchanges the environment with `other`, without copying either
+  void swap_environment(std::map<Identifier, Rc<Value>> &other);
+  /// The value bound to `id` (in the environment or the builtins), or nullptr
+  /// if it is unbound
+  Rc<Value> lookup(const Identifier &id) const;
+  void bind(const Identifier &id, Rc<Value> value);
+  void unset(const Identifier &id);
 
 private:
-  std::map<Identifier, std::shared_ptr<Value>> environment;
-  std::shared_ptr<Value> last;
+  /// Evaluates a top-level statement, recording it in the metrics
+  void run(const Ast &ast);
+  /// Evaluates the condition of an `if` or `loop`
+  bool test(const Expression &condition);
+  /// Applies a `fn` literal found not to escape, running its body in this
+  /// environment with the frame's bindings saved and then restored
+  void apply_frame(const Frame &frame);
+
+  std::map<Identifier, Rc<Value>> environment;
+  // Kept out of the environment so closures don't copy them
+  const std::map<Identifier, Rc<Value>> *builtins;
+  Rc<Value> last;
+
+  /// Tracks the nesting of closure applications for the depth limit, and
+  /// the bodies being applied for the profiler
+  struct Call {
+    Call(EvalVisitor &eval, const Ast *body);
+    ~Call();
+
+  private:
+    EvalVisitor &eval;
+  };
+
+  /// Sets whether annotations can be trusted while in scope
+  struct Typing {
+    Typing(EvalVisitor &eval, bool typed);
+    ~Typing();
+
+  private:
+    EvalVisitor &eval;
+    bool outer;
+  };
+
+  /// Whether the code being evaluated was type-checked, with the values in
+  /// the environment of the types it was checked with. Closures are only
+  /// evaluated typed if both they and their caller are.
+  bool typed;
+
+  EvalLimits limits;
+  uint64_t steps;
+  size_t allocated;
+  // Only stored and loaded, not incremented atomically, as only signal
+  // handlers on this thread read it concurrently
+  std::atomic<size_t> depth;
+  /// The bodies being applied, indexed by depth modulo SAMPLED_CALLS
+  std::array<const Ast *, SAMPLED_CALLS> calls;
+  Profiler *profiler;
+  // Since `reset_usage`, for the metrics
+  uint64_t values;
+  uint64_t closures;
+  std::atomic<bool> cancelled;
+
+  /// A binding shadowed by a frame, or one that was unbound if `!bound`
+  struct Saved {
+    const Identifier *name;
+    Rc<Value> value;
+    bool bound;
+  };
+  // Stacks shared by the nested frames and loops, so that once they have
+  // grown, applying a frame or updating a loop allocates nothing
+  std::vector<Rc<Value>> frame_args;
+  std::vector<Saved> saved;
 };
@@ -1,99 +1,419 @@
 #include "formatter.hpp"
 
-#include <iostream>
+#include <charconv>
+#include <deque>
 
-void formatFn(const std::vector<Identifier> &args,
-              const std::shared_ptr<Ast> &body,
-              std::function<void(const std::string &)> output,
-              FmtAst &visitor) {
-  output("fn ");
+#include <unistd.h>
+
+// Output buffer
+
+FmtBuffer::FmtBuffer(int fd) : fd(fd) {}
+
+void FmtBuffer::write(std::string_view str) {
+  buffer.insert(buffer.end(), str.begin(), str.end());
+}
+
+void FmtBuffer::write(uint32_t n) {
+  char digits[10];
+  auto [end, error] = std::to_chars(std::begin(digits), std::end(digits), n);
+  buffer.insert(buffer.end(), digits, end);
+}
+
+void FmtBuffer::write(const Integer &n) {
+  if (!n.is_small()) {
+    write(n.to_string());
+    return;
+  }
+  char digits[20];
+  auto [end, error] =
+      std::to_chars(std::begin(digits), std::end(digits), n.small());
+  buffer.insert(buffer.end(), digits, end);
+}
+
+std::string_view FmtBuffer::view(void) const {
+  return std::string_view(buffer.data(), buffer.size());
+}
+
+void FmtBuffer::clear(void) { buffer.clear(); }
+
+void FmtBuffer::flush(void) {
+  if (fd < 0)
+    return;
+  const char *data = buffer.data();
+  size_t left = buffer.size();
+  while (left > 0) {
+    auto written = ::write(fd, data, left);
+    if (written < 0)
+      break;
+    data += written;
+    left -= written;
+  }
+  buffer.clear();
+}
+
+FmtSink::FmtSink(std::function<void(std::string_view)> output)
+    : output(std::move(output)), buffer(nullptr) {}
+
+FmtSink::FmtSink(FmtBuffer &buffer) : output(nullptr), buffer(&buffer) {}
+
+void FmtSink::operator()(std::string_view str) {
+  if (buffer)
+    buffer->write(str);
+  else
+    output(str);
+}
+
+void FmtSink::operator()(uint32_t n) {
+  if (buffer) {
+    buffer->write(n);
+  } else {
+    char digits[10];
+    auto [end, error] = std::to_chars(std::begin(digits), std::end(digits), n);
+    output(std::string_view(digits, end));
+  }
+}
+
+void FmtSink::operator()(const Integer &n) {
+  if (buffer)
+    buffer->write(n);
+  else
+    output(n.to_string());
+}
+
+// Limited output
+
+FmtLimited::FmtLimited(FmtSink output, FmtLimits limits)
+    : output(std::move(output)), limits(limits), depth(0), length(0),
+      cut(false) {}
+
+FmtLimited::Nested::Nested(FmtLimited &limited) : limited(limited) {
+  if (limited.depth == 0) {
+    limited.length = 0;
+    limited.cut = false;
+  }
+  elided = ++limited.depth > limited.limits.max_depth || limited.cut;
+  if (elided)
+    limited.emit("...");
+}
+
+FmtLimited::Nested::~Nested() { --limited.depth; }
+
+FmtLimited::Nested::operator bool() const { return !elided; }
+
+void FmtLimited::emit(std::string_view str) {
+  if (cut)
+    return;
+  // Output ending exactly at the limit is only cut off if more follows
+  if (str.size() > limits.max_length - length) {
+    output(str.substr(0, limits.max_length - length));
+    output("...");
+    length = limits.max_length;
+    cut = true;
+    return;
+  }
+  length += str.size();
+  output(str);
+}
+
+void FmtLimited::emit(uint32_t n) {
+  char digits[10];
+  auto [end, error] = std::to_chars(std::begin(digits), std::end(digits), n);
+  emit(std::string_view(digits, end));
+}
+
+void FmtLimited::emit(const Integer &n) {
+  if (!n.is_small()) {
+    emit(n.to_string());
+    return;
+  }
+  char digits[20];
+  auto [end, error] =
+      std::to_chars(std::begin(digits), std::end(digits), n.small());
+  emit(std::string_view(digits, end));
+}
+
+const FmtLimits &FmtLimited::get_limits(void) const { return limits; }
+
+bool FmtLimited::is_cut(void) const { return cut; }
+
+// AST formatter
+
+FmtAst::FmtAst(std::function<void(std::string_view)> output, FmtLimits limits)
+    : output(std::move(output), limits) {}
+
+FmtAst::FmtAst(FmtBuffer &buffer, FmtLimits limits) : output(buffer, limits) {}
+
+void FmtAst::emit(std::string_view str) { output.emit(str); }
+
+void FmtAst::emit(uint32_t n) { output.emit(n); }
+
+void FmtAst::emit(const Integer &n) { output.emit(n); }
+
+const FmtLimits &FmtAst::get_limits(void) const {
+  return output.get_limits();
+}
+
+void FmtAst::format_fn(const std::vector<Identifier> &args,
+                       const std::shared_ptr<Ast> &body) {
+  Nested nested(output);
+  if (!nested)
+    return;
+
+  emit("fn ");
 
   if (args.size() == 1) {
-    args[0].accept(visitor);
-    output(" ");
+    args[0].accept(*this);
+    emit(" ");
   } else {
-    output("( ");
+    emit("( ");
     bool first = true;
     for (auto &arg : args) {
       if (!first)
-        output(" , ");
+        emit(" , ");
       first = false;
-      arg.accept(visitor);
+      arg.accept(*this);
     }
-    output(" ) ");
+    emit(" ) ");
   }
 
-  body->accept(visitor);
+  body->accept(*this);
 }
 
-// AST formatter
-
-FmtAst::FmtAst(std::function<void(const std::string &)> output)
-    : output(output) {}
-
 void FmtAst::visitAssignment(const Assignment &let) {
-  output("let ");
-  output(*let.get_name());
-  output(" = ");
+  Nested nested(output);
+  if (!nested)
+    return;
+  emit("let ");
+  emit(*let.get_name());
+  emit(" = ");
   let.get_body().accept(*this);
 }
 
-void FmtAst::visitFn(const Fn &fn) {
-  formatFn(fn.get_args(), fn.get_body(), output, *this);
-};
+void FmtAst::visitFn(const Fn &fn) { format_fn(fn.get_args(), fn.get_body()); };
 
 void FmtAst::visitIfCond(const IfCond &if_cond) {
-  output("if ( ");
+  Nested nested(output);
+  if (!nested)
+    return;
+  emit("if ( ");
   if_cond.get_condition().accept(*this);
-  output(" ) then ( ");
+  emit(" ) then ( ");
   if_cond.get_true_case().accept(*this);
-  output(" ) else ( ");
+  emit(" ) else ( ");
   if_cond.get_false_case().accept(*this);
-  output(" )");
+  emit(" )");
 };
 
+void FmtAst::visitLoop(const Loop &loop) {
+  Nested nested(output);
+  if (!nested)
+    return;
+  // Each as `( e )`, and several as `( ( e ) , ( e ) )`
+  auto exprs = [&](const std::vector<std::shared_ptr<Expression>> &exprs) {
+    if (exprs.size() > 1)
+      emit("( ");
+    bool first = true;
+    for (auto &expr : exprs) {
+      if (!first)
+        emit(" , ");
+      first = false;
+      emit("( ");
+      expr->accept(*this);
+      emit(" )");
+    }
+    if (exprs.size() > 1)
+      emit(" )");
+  };
+
+  emit("loop ");
+  auto &vars = loop.get_vars();
+  if (vars.size() > 1)
+    emit("( ");
+  bool first = true;
+  for (auto &var : vars) {
+    if (!first)
+      emit(" , ");
+    first = false;
+    var.accept(*this);
+  }
+  emit(vars.size() > 1 ? " ) = " : " = ");
+  exprs(loop.get_inits());
+  emit(" while ( ");
+  loop.get_condition().accept(*this);
+  emit(" ) do ");
+  exprs(loop.get_steps());
+}
+
 void FmtAst::visitApp(const App &app) {
-  output("( ");
+  Nested nested(output);
+  if (!nested)
+    return;
+  emit("( ");
   app.get_lhs().accept(*this);
-  output(" ) ( ");
+  emit(" ) ( ");
   app.get_rhs().accept(*this);
-  output(" )");
+  emit(" )");
 };
 
 void FmtAst::visitBinop(const Binop &op) {
-  output("( ");
+  Nested nested(output);
+  if (!nested)
+    return;
+  emit("( ");
   op.get_lhs().accept(*this);
-  output(" ) " + op.get_op() + " ( ");
+  emit(" ) ");
+  emit(op.get_op());
+  emit(" ( ");
   op.get_rhs().accept(*this);
-  output(" )");
+  emit(" )");
 };
 
-void FmtAst::visitNumber(const Number &n) { output(std::to_string(*n)); }
+void FmtAst::visitNumber(const Number &n) {
+  Nested nested(output);
+  if (nested)
+    emit(*n);
+}
 
-void FmtAst::visitIdentifier(const Identifier &id) { output(*id); };
+void FmtAst::visitIdentifier(const Identifier &id) {
+  Nested nested(output);
+  if (nested)
+    emit(*id);
+};
 
 void FmtAst::visitStatementExpr(const StatementExpr &statements) {
-  output("{ ");
+  Nested nested(output);
+  if (!nested)
+    return;
+  emit("{ ");
   bool first = true;
   for (auto &statement : statements.get_body()) {
     if (!first)
-      output(" ; ");
+      emit(" ; ");
     first = false;
     statement->accept(*this);
   }
-  output(" }");
+  emit(" }");
 };
 
+void FmtAst::visitLazyBody(const LazyBody &lazy) { lazy.get().accept(*this); }
+
+void FmtAst::visitTuple(const Tuple &tuple) {
+  Nested nested(output);
+  if (!nested)
+    return;
+  emit("( ");
+  bool first = true;
+  for (auto &field : tuple.get_fields()) {
+    if (!first)
+      emit(" , ");
+    first = false;
+    emit("( ");
+    field->accept(*this);
+    emit(" )");
+  }
+  emit(" )");
+}
+
+void FmtAst::visitProject(const Project &project) {
+  Nested nested(output);
+  if (!nested)
+    return;
+  emit("( ");
+  project.get_tuple().accept(*this);
+  emit(" ) . ");
+  emit(project.get_index());
+}
+
+void FmtAst::visitDestructure(const Destructure &destructure) {
+  Nested nested(output);
+  if (!nested)
+    return;
+  emit("let ( ");
+  bool first = true;
+  for (auto &name : destructure.get_names()) {
+    if (!first)
+      emit(" , ");
+    first = false;
+    emit(*name);
+  }
+  emit(" ) = ");
+  destructure.get_body().accept(*this);
+}
+
 // Value formatter
 
 FmtValue::FmtValue(FmtAst &ast_visitor,
-                   std::function<void(const std::string &)> output)
-    : ast_visitor(ast_visitor), output(output) {}
+                   std::function<void(std::string_view)> output)
+    : ast_visitor(ast_visitor),
+      output(std::move(output), ast_visitor.get_limits()) {}
+
+FmtValue::FmtValue(FmtAst &ast_visitor, FmtBuffer &buffer)
+    : ast_visitor(ast_visitor), output(buffer, ast_visitor.get_limits()) {}
 
 void FmtValue::visitNumber(const NumberValue &n) {
-  output(std::to_string(n.get_value()));
+  Nested nested(output);
+  if (nested)
+    output.emit(n.get_value());
 }
 
 void FmtValue::visitClosure(const ClosureValue &c) {
-  formatFn(c.get_args(), c.get_body(), output, ast_visitor);
+  Nested nested(output);
+  if (nested)
+    ast_visitor.format_fn(c.get_args(), c.get_body());
+}
+
+void FmtValue::visitArray(const ArrayValue &a) {
+  // The elements are part of the array, rather than nested in it
+  Nested nested(output);
+  if (!nested)
+    return;
+  output.emit("[ ");
+  bool first = true;
+  for (auto value : a.get_values()) {
+    if (output.is_cut())
+      break;
+    if (!first)
+      output.emit(" , ");
+    first = false;
+    output.emit(value);
+  }
+  output.emit(first ? "]" : " ]");
+}
+
+void FmtValue::visitTuple(const TupleValue &t) {
+  // Tuples in the last field, e.g. the rest of a list, are printed in this
+  // loop rather than recursively, so long lists don't exhaust the stack
+  std::deque<Nested> open;
+  for (auto tuple = &t; tuple != nullptr;) {
+    if (!open.emplace_back(output))
+      break;
+    output.emit("( ");
+    for (size_t i = 0; i + 1 < tuple->size(); ++i) {
+      if (auto &field = tuple->get(i))
+        field->accept(*this);
+      output.emit(" , ");
+    }
+    auto &last = tuple->get(tuple->size() - 1);
+    tuple = dynamic_cast<const TupleValue *>(last.get());
+    if (tuple == nullptr && last)
+      last->accept(*this);
+  }
+  // Closes the tuples printed, innermost first
+  while (!open.empty()) {
+    if (open.back())
+      output.emit(" )");
+    open.pop_back();
+  }
+}
+
+void FmtValue::visitBuiltin(const BuiltinValue &b) {
+  Nested nested(output);
+  if (!nested)
+    return;
+  output.emit(b.get_name());
+  for (auto &arg : b.get_bound()) {
+    output.emit(" ( ");
+    arg->accept(*this);
+    output.emit(" )");
+  }
 }
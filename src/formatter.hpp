@@ -2,37 +2,144 @@
 
 /** \file
  * \brief Prints an AST
+ *
+ * Output goes either to a callback, or to an FmtBuffer which collects it into
+ * one growable buffer (optionally written straight to a file descriptor), so
+ * printing does not allocate per token.
  */
 
 #include "ast.hpp"
 #include "eval.hpp"
 
+#include <cstdint>
 #include <functional>
+#include <string_view>
+#include <vector>
+
+/// A growable byte buffer for formatted output
+struct FmtBuffer {
+  /// With a file descriptor, `flush` writes the buffer out to it
+  FmtBuffer(int fd = -1);
+
+  void write(std::string_view str);
+  void write(uint32_t n);
+  void write(const Integer &n);
+  std::string_view view(void) const;
+  void clear(void);
+  /// Writes the buffer to the file descriptor (if any) and clears it
+  void flush(void);
+
+private:
+  std::vector<char> buffer;
+  int fd;
+};
+
+/// Where formatted output goes, either a callback or a buffer
+struct FmtSink {
+  FmtSink(std::function<void(std::string_view)> output);
+  FmtSink(FmtBuffer &buffer);
+
+  void operator()(std::string_view str);
+  void operator()(uint32_t n);
+  void operator()(const Integer &n);
+
+private:
+  std::function<void(std::string_view)> output;
+  FmtBuffer *buffer;
+};
+
+/// Limits for printing huge closures, beyond which output is elided with
+/// `...`
+struct FmtLimits {
+  /// Nodes nested deeper than this are printed as `...`
+  size_t max_depth = SIZE_MAX;
+  /// Output of a tree is cut off after this many bytes
+  size_t max_length = SIZE_MAX;
+};
+
+/// Output to a sink with FmtLimits applied, counting from the start of each
+/// outermost node
+struct FmtLimited {
+  FmtLimited(FmtSink output, FmtLimits limits);
+
+  /// Tracks nesting for the depth limit, and whether the node should be
+  /// printed at all: not if it's too deep, or the output was cut off
+  struct Nested {
+    Nested(FmtLimited &limited);
+    Nested(const Nested &) = delete;
+    ~Nested();
+    operator bool() const;
+
+  private:
+    FmtLimited &limited;
+    bool elided;
+  };
+
+  void emit(std::string_view str);
+  void emit(uint32_t n);
+  void emit(const Integer &n);
+
+  const FmtLimits &get_limits(void) const;
+  bool is_cut(void) const;
+
+private:
+  FmtSink output;
+  FmtLimits limits;
+  size_t depth;
+  size_t length;
+  /// Whether output has been cut off, and `...` printed in its place
+  bool cut;
+};
 
 struct FmtAst : Visitor {
-  FmtAst(std::function<void(const std::string &)> output);
+  FmtAst(std::function<void(std::string_view)> output, FmtLimits limits = {});
+  FmtAst(FmtBuffer &buffer, FmtLimits limits = {});
 
   void visitAssignment(const Assignment &let);
   void visitFn(const Fn &fn);
   void visitIfCond(const IfCond &if_cond);
+  void visitLoop(const Loop &loop);
   void visitApp(const App &app);
   void visitBinop(const Binop &op);
   void visitNumber(const Number &n);
   void visitIdentifier(const Identifier &id);
   void visitStatementExpr(const StatementExpr &statements);
+  void visitLazyBody(const LazyBody &lazy);
+  void visitTuple(const Tuple &tuple);
+  void visitProject(const Project &project);
+  void visitDestructure(const Destructure &destructure);
+
+  void format_fn(const std::vector<Identifier> &args,
+                 const std::shared_ptr<Ast> &body);
+
+  const FmtLimits &get_limits(void) const;
 
 private:
-  std::function<void(const std::string &)> output;
+  typedef FmtLimited::Nested Nested;
+
+  void emit(std::string_view str);
+  void emit(uint32_t n);
+  void emit(const Integer &n);
+
+  FmtLimited output;
 };
 
+/// Prints values, with the limits of the AST formatter it prints closures
+/// with
+
 struct FmtValue : ValueVisitor {
-  FmtValue(FmtAst &ast_visitor,
-           std::function<void(const std::string &)> output);
+  FmtValue(FmtAst &ast_visitor, std::function<void(std::string_view)> output);
+  FmtValue(FmtAst &ast_visitor, FmtBuffer &buffer);
 
   void visitNumber(const NumberValue &n) override;
   void visitClosure(const ClosureValue &c) override;
+  void visitArray(const ArrayValue &a) override;
+  void visitTuple(const TupleValue &t) override;
+  void visitBuiltin(const BuiltinValue &b) override;
 
 private:
+  typedef FmtLimited::Nested Nested;
+
   FmtAst &ast_visitor;
-  std::function<void(const std::string &)> output;
+  FmtLimited output;
 };
@@ -0,0 +1,190 @@
+#include "history.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+/// Bytes read of the input at a time
+const size_t READ_SIZE = 64 * 1024;
+
+/// Appends the last `count` lines of the file to `lines`, oldest first,
+/// reading back from the end until it has enough
+void tail_lines(const std::string &path, size_t count,
+                std::vector<std::string> &lines) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return;
+  }
+  size_t size = st.st_size;
+  // Guesses at the length of lines, and doubles until there are enough
+  size_t chunk = std::max<size_t>(count * 64, 4096);
+  std::string text;
+  while (true) {
+    size_t from = size - std::min(size, chunk);
+    text.resize(size - from);
+    auto n = pread(fd, text.data(), text.size(), from);
+    if (n < 0) {
+      close(fd);
+      return;
+    }
+    text.resize(n);
+    // Beyond the first newline, unless reading from the start, and beyond
+    // the last if the file ends with one
+    size_t newlines = std::count(text.begin(), text.end(), '\n');
+    if (from == 0 || newlines > count)
+      break;
+    chunk *= 2;
+  }
+  close(fd);
+
+  std::vector<std::string> tail;
+  size_t line_end = text.size();
+  if (line_end && text[line_end - 1] == '\n')
+    --line_end;
+  while (tail.size() < count) {
+    auto newline = text.rfind('\n', line_end ? line_end - 1 : 0);
+    if (line_end == 0 || newline == std::string::npos) {
+      // The first line of the file, since the file was read from the start
+      // if there wasn't a newline before it
+      if (!text.empty())
+        tail.push_back(text.substr(0, line_end));
+      break;
+    }
+    tail.push_back(text.substr(newline + 1, line_end - newline - 1));
+    line_end = newline;
+  }
+  lines.insert(lines.end(), tail.rbegin(), tail.rend());
+}
+
+} // namespace
+
+std::vector<std::string> load_history(const std::string &path, size_t count) {
+  std::vector<std::string> recent;
+  tail_lines(path, count, recent);
+  if (recent.size() >= count)
+    return recent;
+  std::vector<std::string> lines;
+  tail_lines(path + ".1", count - recent.size(), lines);
+  lines.insert(lines.end(), std::make_move_iterator(recent.begin()),
+               std::make_move_iterator(recent.end()));
+  return lines;
+}
+
+HistoryWriter::HistoryWriter(std::string path)
+    : path(std::move(path)), writing(false), stopping(false),
+      thread([this] { run(); }) {}
+
+HistoryWriter::~HistoryWriter() {
+  {
+    std::lock_guard lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  thread.join();
+}
+
+void HistoryWriter::append(std::string line) {
+  {
+    std::lock_guard lock(mutex);
+    pending.push_back(std::move(line));
+  }
+  wake.notify_one();
+}
+
+void HistoryWriter::flush(void) {
+  std::unique_lock lock(mutex);
+  written.wait(lock, [this] { return pending.empty() && !writing; });
+}
+
+void HistoryWriter::run(void) {
+  std::unique_lock lock(mutex);
+  while (true) {
+    wake.wait(lock, [this] { return stopping || !pending.empty(); });
+    if (pending.empty())
+      return;
+    // Whatever was appended while the last batch was written
+    std::vector<std::string> batch;
+    batch.swap(pending);
+    writing = true;
+    lock.unlock();
+    write(batch);
+    lock.lock();
+    writing = false;
+    written.notify_all();
+  }
+}
+
+void HistoryWriter::write(const std::vector<std::string> &lines) {
+  std::string text;
+  for (auto &line : lines) {
+    text += line;
+    text += '\n';
+  }
+  int fd =
+      open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return;
+  for (size_t at = 0; at < text.size();) {
+    auto n = ::write(fd, text.data() + at, text.size() - at);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    at += n;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && size_t(st.st_size) > HISTORY_MAX_BYTES)
+    std::rename(path.c_str(), (path + ".1").c_str());
+  close(fd);
+}
+
+LineReader::LineReader(int fd)
+    : fd(fd), buffer(READ_SIZE), start(0), end(0), eof(false) {}
+
+std::optional<std::string> LineReader::read(void) {
+  size_t searched = start;
+  while (true) {
+    auto newline = static_cast<const char *>(
+        std::memchr(buffer.data() + searched, '\n', end - searched));
+    if (newline) {
+      size_t at = newline - buffer.data();
+      std::string line(buffer.data() + start, at - start);
+      start = at + 1;
+      return line;
+    }
+    if (eof) {
+      if (start == end)
+        return std::nullopt;
+      std::string line(buffer.data() + start, buffer.data() + end);
+      start = end;
+      return line;
+    }
+
+    // Makes room after the unread bytes, for a line longer than the buffer
+    // if need be
+    std::memmove(buffer.data(), buffer.data() + start, end - start);
+    end -= start;
+    start = 0;
+    searched = end;
+    if (buffer.size() - end < READ_SIZE / 2)
+      buffer.resize(buffer.size() * 2);
+    auto n = ::read(fd, buffer.data() + end, buffer.size() - end);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      eof = true;
+    else
+      end += n;
+  }
+}
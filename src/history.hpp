@@ -0,0 +1,81 @@
+#pragma once
+
+/** \file
+ * \brief The REPL's history file, and a buffered reader for input that isn't
+ * a terminal.
+ *
+ * Lines are appended to the history file by a thread of their own, a batch
+ * at a time, so that the REPL never waits on the disk:
+ *
+ *     HistoryWriter writer(".tiny-interp-history");
+ *     for (auto &line : load_history(".tiny-interp-history"))
+ *       add_history(line.c_str());
+ *     ...
+ *     writer.append(line);
+ *
+ * Once the file grows beyond HISTORY_MAX_BYTES it is moved to `<path>.1`,
+ * replacing the one before, so the history never takes more than twice
+ * that. Loading reads only the end of the files.
+ */
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define HISTORY_MAX_BYTES (1 << 20)
+/// How much of the history is loaded, and kept in memory
+#define HISTORY_LINES 1000
+
+/// The last `count` lines of the history at `path`, going on into `path.1`
+/// if there are too few, oldest first. Missing files have no lines.
+std::vector<std::string> load_history(const std::string &path,
+                                      size_t count = HISTORY_LINES);
+
+struct HistoryWriter {
+  HistoryWriter(std::string path);
+  HistoryWriter(const HistoryWriter &) = delete;
+  HistoryWriter &operator=(const HistoryWriter &) = delete;
+  /// Writes the lines still pending
+  ~HistoryWriter();
+
+  void append(std::string line);
+  /// Waits until the lines appended so far are written
+  void flush(void);
+
+private:
+  void run(void);
+  /// Appends lines to the file, and rotates it if it is full. History is a
+  /// convenience, so lines that can't be written are dropped.
+  void write(const std::vector<std::string> &lines);
+
+  std::string path;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable written;
+  std::vector<std::string> pending;
+  /// Whether the thread has taken lines from `pending` it hasn't written
+  bool writing;
+  bool stopping;
+  std::thread thread;
+};
+
+/// Reads lines from a file descriptor a buffer at a time, for input from
+/// pipes and files
+struct LineReader {
+  LineReader(int fd);
+  /// The next line, without its newline, or nullopt at the end of the input.
+  /// The last line needn't end with a newline.
+  std::optional<std::string> read(void);
+
+private:
+  int fd;
+  std::vector<char> buffer;
+  /// The unread bytes in `buffer`
+  size_t start;
+  size_t end;
+  bool eof;
+};
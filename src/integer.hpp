@@ -0,0 +1,344 @@
+#pragma once
+
+/** \file
+ * \brief Integers of any size, for the language's numbers. Values which fit
+ * in 64 bits are held inline, and arithmetic on them checks for overflow
+ * with a single branch. Only results which don't fit are moved to the heap,
+ * as a BigInt.
+ *
+ *     Integer x = INT64_MAX;
+ *     x = x * x + 1;
+ *     x.to_string(); // "85070591730234615847396907784232501250"
+ *
+ * It is header-only and depends on nothing else in the interpreter, so that
+ * compiled scripts share it (see `runtime.hpp`).
+ */
+
+#include <algorithm>
+#include <charconv>
+#include <compare>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/// An integer too large for 64 bits
+struct BigInt {
+  /// Base 2^32 digits of the magnitude, least significant first, without
+  /// leading zeros
+  std::vector<uint32_t> digits;
+  bool negative = false;
+};
+
+struct Integer {
+  Integer(void) : value(0) {}
+  Integer(int64_t value) : value(value) {}
+
+  /// Parses decimal digits, of any length
+  static Integer parse(std::string_view digits);
+
+  /// Whether it is held inline, rather than as a BigInt
+  bool is_small(void) const { return !big; }
+  /// The value, if it `is_small`
+  int64_t small(void) const { return value; }
+  const BigInt *get_big(void) const { return big.get(); }
+
+  /// Whether it is in the range of `T`
+  template <typename T> bool fits(void) const {
+    if (big)
+      return false;
+    if (value < 0)
+      return std::numeric_limits<T>::is_signed &&
+             value >= int64_t(std::numeric_limits<T>::min());
+    return uint64_t(value) <= uint64_t(std::numeric_limits<T>::max());
+  }
+  /// The low 32 bits, of the two's complement
+  uint32_t low32(void) const;
+
+  explicit operator bool(void) const { return big || value != 0; }
+
+  std::string to_string(void) const;
+  /// Heap bytes held, beyond the Integer itself
+  size_t heap_bytes(void) const {
+    return big ? sizeof(BigInt) + big->digits.size() * sizeof(uint32_t) : 0;
+  }
+
+  friend Integer operator+(const Integer &a, const Integer &b) {
+    int64_t result;
+    if (!a.big && !b.big && !__builtin_add_overflow(a.value, b.value, &result))
+        [[likely]]
+      return result;
+    return slow(a, b, '+');
+  }
+  friend Integer operator-(const Integer &a, const Integer &b) {
+    int64_t result;
+    if (!a.big && !b.big && !__builtin_sub_overflow(a.value, b.value, &result))
+        [[likely]]
+      return result;
+    return slow(a, b, '-');
+  }
+  friend Integer operator*(const Integer &a, const Integer &b) {
+    int64_t result;
+    if (!a.big && !b.big && !__builtin_mul_overflow(a.value, b.value, &result))
+        [[likely]]
+      return result;
+    return slow(a, b, '*');
+  }
+  /// Rounds towards zero, as in C++. `b` must not be 0.
+  friend Integer operator/(const Integer &a, const Integer &b) {
+    // INT64_MIN / -1 overflows
+    if (!a.big && !b.big && (a.value != INT64_MIN || b.value != -1)) [[likely]]
+      return a.value / b.value;
+    return slow(a, b, '/');
+  }
+  /// Has the sign of `a`, as in C++. `b` must not be 0.
+  friend Integer operator%(const Integer &a, const Integer &b) {
+    if (!a.big && !b.big) [[likely]]
+      return b.value == -1 ? 0 : a.value % b.value;
+    return slow(a, b, '%');
+  }
+
+  friend bool operator==(const Integer &a, const Integer &b) {
+    if (!a.big && !b.big) [[likely]]
+      return a.value == b.value;
+    return compare(a, b) == 0;
+  }
+  friend std::strong_ordering operator<=>(const Integer &a,
+                                          const Integer &b) {
+    if (!a.big && !b.big) [[likely]]
+      return a.value <=> b.value;
+    return compare(a, b) <=> 0;
+  }
+
+private:
+  /// Unsigned magnitudes, as in BigInt
+  typedef std::vector<uint32_t> Digits;
+
+  Integer(Digits digits, bool negative);
+
+  static Integer slow(const Integer &a, const Integer &b, char op);
+  static int compare(const Integer &a, const Integer &b);
+  static Digits magnitude(const Integer &n);
+  static bool is_negative(const Integer &n) {
+    return n.big ? n.big->negative : n.value < 0;
+  }
+
+  static int compare(const Digits &a, const Digits &b);
+  static Digits add(const Digits &a, const Digits &b);
+  /// `a` must be at least `b`
+  static Digits subtract(const Digits &a, const Digits &b);
+  static Digits multiply(const Digits &a, const Digits &b);
+  /// Sets `a` to `a * m + c`
+  static void multiply_add(Digits &a, uint32_t m, uint32_t c);
+  /// Divides `a` in place, returning the remainder
+  static uint32_t divide(Digits &a, uint32_t d);
+  /// Long division, one bit at a time; only bignums get here
+  static std::pair<Digits, Digits> divide(const Digits &a, const Digits &b);
+  static void trim(Digits &a);
+
+  int64_t value;
+  std::shared_ptr<const BigInt> big;
+};
+
+inline Integer::Integer(Digits digits, bool negative) : value(0) {
+  trim(digits);
+  // Back inline if it fits, so that equal values are equally represented
+  if (digits.size() <= 2) {
+    uint64_t mag = digits.empty()                ? 0
+                   : digits.size() == 1 ? digits[0]
+                                        : digits[0] | uint64_t(digits[1]) << 32;
+    if (!negative && mag <= uint64_t(INT64_MAX)) {
+      value = int64_t(mag);
+      return;
+    }
+    if (negative && mag <= uint64_t(INT64_MAX) + 1) {
+      value = int64_t(0 - mag);
+      return;
+    }
+  }
+  big = std::make_shared<const BigInt>(BigInt{std::move(digits), negative});
+}
+
+inline Integer Integer::parse(std::string_view digits) {
+  int64_t small;
+  auto [end, error] =
+      std::from_chars(digits.data(), digits.data() + digits.size(), small);
+  if (error == std::errc() && end == digits.data() + digits.size())
+    return small;
+
+  Digits mag;
+  // Nine decimal digits at a time fit in a base 2^32 digit
+  for (size_t i = 0; i < digits.size(); i += 9) {
+    auto chunk = digits.substr(i, 9);
+    uint32_t scale = 1, n = 0;
+    for (char c : chunk) {
+      scale *= 10;
+      n = n * 10 + uint32_t(c - '0');
+    }
+    multiply_add(mag, scale, n);
+  }
+  return Integer(std::move(mag), false);
+}
+
+inline uint32_t Integer::low32(void) const {
+  if (!big)
+    return uint32_t(uint64_t(value));
+  auto low = big->digits[0];
+  return big->negative ? 0 - low : low;
+}
+
+inline std::string Integer::to_string(void) const {
+  if (!big) {
+    char digits[20];
+    auto [end, error] =
+        std::to_chars(std::begin(digits), std::end(digits), value);
+    return std::string(digits, end);
+  }
+  auto mag = big->digits;
+  std::string reversed;
+  while (!mag.empty()) {
+    auto chunk = divide(mag, 1000000000);
+    trim(mag);
+    for (int i = 0; i < 9 && (chunk || !mag.empty()); ++i) {
+      reversed += char('0' + chunk % 10);
+      chunk /= 10;
+    }
+  }
+  if (big->negative)
+    reversed += '-';
+  return std::string(reversed.rbegin(), reversed.rend());
+}
+
+inline Integer Integer::slow(const Integer &a, const Integer &b, char op) {
+  auto x = magnitude(a), y = magnitude(b);
+  bool x_negative = is_negative(a), y_negative = is_negative(b);
+  switch (op) {
+  case '-':
+    y_negative = !y_negative;
+    [[fallthrough]];
+  case '+':
+    if (x_negative == y_negative)
+      return Integer(add(x, y), x_negative);
+    if (compare(x, y) >= 0)
+      return Integer(subtract(x, y), x_negative);
+    return Integer(subtract(y, x), y_negative);
+  case '*':
+    return Integer(multiply(x, y), x_negative != y_negative);
+  case '/':
+    return Integer(divide(x, y).first, x_negative != y_negative);
+  default:
+    return Integer(divide(x, y).second, x_negative);
+  }
+}
+
+inline int Integer::compare(const Integer &a, const Integer &b) {
+  bool a_negative = is_negative(a), b_negative = is_negative(b);
+  if (a_negative != b_negative)
+    return a_negative ? -1 : 1;
+  auto order = compare(magnitude(a), magnitude(b));
+  return a_negative ? -order : order;
+}
+
+inline Integer::Digits Integer::magnitude(const Integer &n) {
+  if (n.big)
+    return n.big->digits;
+  uint64_t mag = n.value < 0 ? 0 - uint64_t(n.value) : uint64_t(n.value);
+  Digits digits = {uint32_t(mag), uint32_t(mag >> 32)};
+  trim(digits);
+  return digits;
+}
+
+inline int Integer::compare(const Digits &a, const Digits &b) {
+  if (a.size() != b.size())
+    return a.size() < b.size() ? -1 : 1;
+  for (size_t i = a.size(); i-- > 0;) {
+    if (a[i] != b[i])
+      return a[i] < b[i] ? -1 : 1;
+  }
+  return 0;
+}
+
+inline Integer::Digits Integer::add(const Digits &a, const Digits &b) {
+  Digits sum(std::max(a.size(), b.size()) + 1);
+  uint64_t carry = 0;
+  for (size_t i = 0; i < sum.size(); ++i) {
+    carry += uint64_t(i < a.size() ? a[i] : 0) + (i < b.size() ? b[i] : 0);
+    sum[i] = uint32_t(carry);
+    carry >>= 32;
+  }
+  return sum;
+}
+
+inline Integer::Digits Integer::subtract(const Digits &a, const Digits &b) {
+  Digits difference(a.size());
+  int64_t borrow = 0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    int64_t d = int64_t(a[i]) - (i < b.size() ? b[i] : 0) - borrow;
+    borrow = d < 0;
+    difference[i] = uint32_t(d + (borrow << 32));
+  }
+  return difference;
+}
+
+inline Integer::Digits Integer::multiply(const Digits &a, const Digits &b) {
+  Digits product(a.size() + b.size());
+  for (size_t i = 0; i < a.size(); ++i) {
+    uint64_t carry = 0;
+    for (size_t j = 0; j < b.size(); ++j) {
+      carry += uint64_t(a[i]) * b[j] + product[i + j];
+      product[i + j] = uint32_t(carry);
+      carry >>= 32;
+    }
+    product[i + b.size()] = uint32_t(carry);
+  }
+  return product;
+}
+
+inline void Integer::multiply_add(Digits &a, uint32_t m, uint32_t c) {
+  uint64_t carry = c;
+  for (auto &digit : a) {
+    carry += uint64_t(digit) * m;
+    digit = uint32_t(carry);
+    carry >>= 32;
+  }
+  if (carry)
+    a.push_back(uint32_t(carry));
+}
+
+inline uint32_t Integer::divide(Digits &a, uint32_t d) {
+  uint64_t remainder = 0;
+  for (size_t i = a.size(); i-- > 0;) {
+    remainder = remainder << 32 | a[i];
+    a[i] = uint32_t(remainder / d);
+    remainder %= d;
+  }
+  return uint32_t(remainder);
+}
+
+inline std::pair<Integer::Digits, Integer::Digits>
+Integer::divide(const Digits &a, const Digits &b) {
+  if (b.size() == 1) {
+    auto quotient = a;
+    auto remainder = divide(quotient, b[0]);
+    return {std::move(quotient), Digits{remainder}};
+  }
+  Digits quotient(a.size()), remainder;
+  for (size_t i = a.size() * 32; i-- > 0;) {
+    // remainder = remainder * 2 + bit i of a
+    multiply_add(remainder, 2, (a[i / 32] >> (i % 32)) & 1);
+    if (compare(remainder, b) >= 0) {
+      remainder = subtract(remainder, b);
+      trim(remainder);
+      quotient[i / 32] |= uint32_t(1) << (i % 32);
+    }
+  }
+  return {std::move(quotient), std::move(remainder)};
+}
+
+inline void Integer::trim(Digits &a) {
+  while (!a.empty() && a.back() == 0)
+    a.pop_back();
+}
@@ -0,0 +1,123 @@
+#include "interpreter.hpp"
+#include "analysis.hpp"
+#include "builtins.hpp"
+#include "parser.hpp"
+
+const char *WrongArity::what(void) const noexcept {
+  return "Wrong number of arguments";
+}
+
+PreparedFunction::PreparedFunction(EvalVisitor &evaluator, Rc<Value> function)
+    : evaluator(&evaluator), function(std::move(function)),
+      closure(dynamic_pointer_cast<ClosureValue>(this->function)),
+      mutates_environment(false), arity(0) {
+  if (closure) {
+    environment = closure->get_environment();
+    for (auto &arg : closure->get_args())
+      environment[arg] = nullptr;
+    arity = closure->get_args().size();
+    mutates_environment = !assigned_variables(*closure->get_body()).empty();
+    if (mutates_environment)
+      pristine = environment;
+  } else if (auto builtin =
+                 dynamic_pointer_cast<BuiltinValue>(this->function)) {
+    arity = builtin->get_arity() - builtin->get_bound().size();
+  } else {
+    throw NotAFunction();
+  }
+}
+
+size_t PreparedFunction::get_arity(void) const { return arity; }
+
+uint32_t PreparedFunction::call(std::span<const uint32_t> args) {
+  if (args.size() != arity)
+    throw WrongArity();
+  auto &eval = *evaluator;
+  eval.reset_usage();
+
+  Rc<Value> result;
+  if (closure) {
+    auto &formals = closure->get_args();
+    for (size_t i = 0; i < arity; ++i)
+      environment[formals[i]] = eval.make_number(args[i]);
+    eval.step();
+    // The body runs in our environment, and the evaluator's own goes back
+    // afterwards, as with ClosureValue::apply but without copying either
+    eval.swap_environment(environment);
+    try {
+      closure->get_body()->accept(eval);
+    } catch (...) {
+      eval.swap_environment(environment);
+      if (mutates_environment)
+        reset_environment();
+      throw;
+    }
+    eval.swap_environment(environment);
+    if (mutates_environment)
+      reset_environment();
+    result = eval.get_last();
+  } else {
+    result = function;
+    for (auto arg : args)
+      result = eval.apply(result, eval.make_number(arg));
+  }
+
+  auto number = dynamic_pointer_cast<NumberValue>(result);
+  if (number == nullptr)
+    throw NotANumber();
+  auto &value = number->get_value();
+  if (!value.fits<uint32_t>())
+    throw NumberOutOfRange();
+  return uint32_t(value.small());
+}
+
+void PreparedFunction::reset_environment(void) {
+  // A `let` only adds or replaces bindings, so this removes the extra ones
+  // and restores the rest in place, rather than copying all of `pristine`
+  auto it = environment.begin();
+  for (auto &[id, value] : pristine) {
+    while (!(it->first == id))
+      it = environment.erase(it);
+    it->second = value;
+    ++it;
+  }
+  environment.erase(it, environment.end());
+}
+
+Interpreter::Interpreter() : Interpreter(BuiltinRegistry::standard()) {}
+
+Interpreter::Interpreter(const BuiltinRegistry &registry)
+    : registry(&registry), evaluator(registry) {}
+
+Rc<Value> Interpreter::load(const std::string &script) {
+  Rc<Value> last;
+  for (auto &node : parse_lines(script)) {
+    evaluator.evaluate(*node);
+    last = evaluator.get_last();
+  }
+  return last;
+}
+
+Rc<Value> Interpreter::get(const std::string &name) const {
+  return evaluator.lookup(Identifier(name));
+}
+
+PreparedFunction Interpreter::prepare(const std::string &name) {
+  return prepare(name, evaluator);
+}
+
+PreparedFunction Interpreter::prepare(const std::string &name,
+                                      EvalVisitor &evaluator) const {
+  auto function = get(name);
+  if (function == nullptr)
+    throw UnknownVariable();
+  return PreparedFunction(evaluator, std::move(function));
+}
+
+EvalVisitor &Interpreter::get_evaluator(void) { return evaluator; }
+
+const EvalVisitor &Interpreter::get_evaluator(void) const { return evaluator; }
+
+const BuiltinRegistry &Interpreter::get_registry(void) const {
+  return *registry;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+/** \file
+ * \brief An API for embedding the language in C++: load definitions once,
+ * then call functions with native numbers, e.g.
+ *
+ *     Interpreter interpreter;
+ *     interpreter.load("let dist = fn ( a , b ) "
+ *                      "if a < b then b - a else a - b");
+ *     auto dist = interpreter.prepare("dist");
+ *     uint32_t d = dist(3, 10); // 7
+ *
+ * A PreparedFunction builds the environment its body runs in once. A call
+ * binds the arguments in it and evaluates the body directly, without
+ * building source, parsing, or copying the environment.
+ */
+
+#include "ast.hpp"
+#include "eval.hpp"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+struct WrongArity : EvalError {
+  const char *what(void) const noexcept override;
+};
+
+struct Interpreter;
+
+/// A function to call repeatedly. It must not outlive its Interpreter.
+struct PreparedFunction {
+  PreparedFunction(PreparedFunction &&other) = default;
+  PreparedFunction &operator=(PreparedFunction &&other) = default;
+
+  size_t get_arity(void) const;
+  /// Calls the function with one number per argument; the result must be a
+  /// number, and throws NumberOutOfRange if it doesn't fit in 32 bits.
+  /// Throws WrongArity if the number of arguments is wrong.
+  uint32_t call(std::span<const uint32_t> args);
+  template <typename... Args> uint32_t operator()(Args... args) {
+    const uint32_t values[] = {uint32_t(args)...};
+    return call(values);
+  }
+
+private:
+  friend Interpreter;
+  PreparedFunction(EvalVisitor &evaluator, Rc<Value> function);
+  void reset_environment(void);
+
+  EvalVisitor *evaluator;
+  Rc<Value> function;
+  /// For closures: the environment the body runs in. Nested calls replace
+  /// the evaluator's environment wholesale, so its nodes can't be held onto.
+  Rc<ClosureValue> closure;
+  std::map<Identifier, Rc<Value>> environment;
+  /// If the body can `let` into its environment, a copy to reset it from
+  std::map<Identifier, Rc<Value>> pristine;
+  bool mutates_environment;
+  size_t arity;
+};
+
+struct Interpreter {
+  Interpreter();
+  Interpreter(const BuiltinRegistry &registry);
+
+  /// Evaluates a script (parsed as by `parse_lines`), returning the value of
+  /// the last statement
+  Rc<Value> load(const std::string &script);
+  /// The value bound to `name`, or nullptr
+  Rc<Value> get(const std::string &name) const;
+  /// Prepares the closure or builtin bound to `name` to be called. Throws
+  /// UnknownVariable or NotAFunction.
+  PreparedFunction prepare(const std::string &name);
+  /// Prepares it to run on another evaluator, e.g. one per thread. Values
+  /// are immutable, so these can run alongside each other as long as nothing
+  /// is loaded meanwhile, and the function has been shared first (see
+  /// `RefCounted::share`), as `batch_map` does.
+  PreparedFunction prepare(const std::string &name,
+                           EvalVisitor &evaluator) const;
+  /// For setting limits, or binding values from C++
+  EvalVisitor &get_evaluator(void);
+  const EvalVisitor &get_evaluator(void) const;
+  const BuiltinRegistry &get_registry(void) const;
+
+private:
+  const BuiltinRegistry *registry;
+  EvalVisitor evaluator;
+};
@@ -0,0 +1,235 @@
+#include "kernels.hpp"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace kernels {
+
+namespace {
+
+#if defined(__AVX2__)
+#define HAVE_VEC 1
+struct Vec {
+  typedef __m256i T;
+  static const size_t width = 8;
+  static T load(const uint32_t *p) {
+    return _mm256_loadu_si256(reinterpret_cast<const T *>(p));
+  }
+  static void store(uint32_t *p, T v) {
+    _mm256_storeu_si256(reinterpret_cast<T *>(p), v);
+  }
+  static T splat(uint32_t x) { return _mm256_set1_epi32(int(x)); }
+  static T steps(void) { return _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7); }
+  static T add(T a, T b) { return _mm256_add_epi32(a, b); }
+  static T sub(T a, T b) { return _mm256_sub_epi32(a, b); }
+  static T ones(T mask) { return _mm256_and_si256(mask, splat(1)); }
+  static T eq(T a, T b) { return ones(_mm256_cmpeq_epi32(a, b)); }
+  /// Unsigned comparison through the signed one, by flipping the sign bits
+  static T gt(T a, T b) {
+    auto bias = splat(0x80000000);
+    return ones(_mm256_cmpgt_epi32(_mm256_xor_si256(a, bias),
+                                   _mm256_xor_si256(b, bias)));
+  }
+  /// The 64-bit zero extensions of half the lanes, in some order
+  static T widen_low(T v) { return _mm256_unpacklo_epi32(v, splat(0)); }
+  static T widen_high(T v) { return _mm256_unpackhi_epi32(v, splat(0)); }
+  static T add64(T a, T b) { return _mm256_add_epi64(a, b); }
+  static uint64_t hsum64(T v) {
+    auto x = _mm_add_epi64(_mm256_castsi256_si128(v),
+                           _mm256_extracti128_si256(v, 1));
+    x = _mm_add_epi64(x, _mm_unpackhi_epi64(x, x));
+    return uint64_t(_mm_cvtsi128_si64(x));
+  }
+};
+const char *ISA = "avx2";
+#elif defined(__SSE2__)
+#define HAVE_VEC 1
+struct Vec {
+  typedef __m128i T;
+  static const size_t width = 4;
+  static T load(const uint32_t *p) {
+    return _mm_loadu_si128(reinterpret_cast<const T *>(p));
+  }
+  static void store(uint32_t *p, T v) {
+    _mm_storeu_si128(reinterpret_cast<T *>(p), v);
+  }
+  static T splat(uint32_t x) { return _mm_set1_epi32(int(x)); }
+  static T steps(void) { return _mm_setr_epi32(0, 1, 2, 3); }
+  static T add(T a, T b) { return _mm_add_epi32(a, b); }
+  static T sub(T a, T b) { return _mm_sub_epi32(a, b); }
+  static T ones(T mask) { return _mm_and_si128(mask, splat(1)); }
+  static T eq(T a, T b) { return ones(_mm_cmpeq_epi32(a, b)); }
+  /// Unsigned comparison through the signed one, by flipping the sign bits
+  static T gt(T a, T b) {
+    auto bias = splat(0x80000000);
+    return ones(
+        _mm_cmpgt_epi32(_mm_xor_si128(a, bias), _mm_xor_si128(b, bias)));
+  }
+  /// The 64-bit zero extensions of half the lanes
+  static T widen_low(T v) { return _mm_unpacklo_epi32(v, splat(0)); }
+  static T widen_high(T v) { return _mm_unpackhi_epi32(v, splat(0)); }
+  static T add64(T a, T b) { return _mm_add_epi64(a, b); }
+  static uint64_t hsum64(T v) {
+    v = _mm_add_epi64(v, _mm_unpackhi_epi64(v, v));
+    return uint64_t(_mm_cvtsi128_si64(v));
+  }
+};
+const char *ISA = "sse2";
+#else
+const char *ISA = "scalar";
+#endif
+
+template <Op op> uint32_t apply(uint32_t a, uint32_t b) {
+  if constexpr (op == Op::Less)
+    return a < b;
+  if constexpr (op == Op::Equal)
+    return a == b;
+  if constexpr (op == Op::Greater)
+    return a > b;
+  if constexpr (op == Op::Add)
+    return a + b;
+  if constexpr (op == Op::Sub)
+    return a - b;
+}
+
+// Operands are either arrays or scalars broadcast over the whole array
+uint32_t element(const uint32_t *p, size_t i) { return p[i]; }
+uint32_t element(uint32_t x, size_t) { return x; }
+
+template <Op op, typename L, typename R>
+void binop_loop(L lhs, R rhs, uint32_t *out, size_t begin, size_t n) {
+  for (size_t i = begin; i < n; ++i)
+    out[i] = apply<op>(element(lhs, i), element(rhs, i));
+}
+
+#ifdef HAVE_VEC
+template <Op op> Vec::T apply(Vec::T a, Vec::T b) {
+  if constexpr (op == Op::Less)
+    return Vec::gt(b, a);
+  if constexpr (op == Op::Equal)
+    return Vec::eq(a, b);
+  if constexpr (op == Op::Greater)
+    return Vec::gt(a, b);
+  if constexpr (op == Op::Add)
+    return Vec::add(a, b);
+  if constexpr (op == Op::Sub)
+    return Vec::sub(a, b);
+}
+
+Vec::T vector(const uint32_t *p, size_t i) { return Vec::load(p + i); }
+Vec::T vector(uint32_t x, size_t) { return Vec::splat(x); }
+
+template <Op op, typename L, typename R>
+void binop_vec(L lhs, R rhs, uint32_t *out, size_t n) {
+  size_t i = 0;
+  for (; i + Vec::width <= n; i += Vec::width)
+    Vec::store(out + i, apply<op>(vector(lhs, i), vector(rhs, i)));
+  binop_loop<op>(lhs, rhs, out, i, n);
+}
+#else
+template <Op op, typename L, typename R>
+void binop_vec(L lhs, R rhs, uint32_t *out, size_t n) {
+  binop_loop<op>(lhs, rhs, out, 0, n);
+}
+#endif
+
+template <typename L, typename R>
+void dispatch(Op op, L lhs, R rhs, uint32_t *out, size_t n, bool vectorise) {
+  switch (op) {
+#define CASE(OP)                                                               \
+  case OP:                                                                     \
+    if (vectorise)                                                             \
+      binop_vec<OP>(lhs, rhs, out, n);                                         \
+    else                                                                       \
+      binop_loop<OP>(lhs, rhs, out, 0, n);                                     \
+    break;
+    CASE(Op::Less)
+    CASE(Op::Equal)
+    CASE(Op::Greater)
+    CASE(Op::Add)
+    CASE(Op::Sub)
+#undef CASE
+  }
+}
+
+} // namespace
+
+const char *isa(void) { return ISA; }
+
+void iota(uint32_t *out, size_t n, uint32_t start) {
+  size_t i = 0;
+#ifdef HAVE_VEC
+  auto current = Vec::add(Vec::splat(start), Vec::steps());
+  auto step = Vec::splat(Vec::width);
+  for (; i + Vec::width <= n; i += Vec::width) {
+    Vec::store(out + i, current);
+    current = Vec::add(current, step);
+  }
+#endif
+  for (; i < n; ++i)
+    out[i] = start + uint32_t(i);
+}
+
+void iota_scalar(uint32_t *out, size_t n, uint32_t start) {
+  for (size_t i = 0; i < n; ++i)
+    out[i] = start + uint32_t(i);
+}
+
+uint64_t sum(const uint32_t *in, size_t n) {
+  size_t i = 0;
+  uint64_t total = 0;
+#ifdef HAVE_VEC
+  // Widened to 64-bit lanes, with the low and high halves of each load in
+  // separate accumulators to hide the latency of the adds
+  auto a = Vec::splat(0), b = Vec::splat(0);
+  for (; i + Vec::width <= n; i += Vec::width) {
+    auto v = Vec::load(in + i);
+    a = Vec::add64(a, Vec::widen_low(v));
+    b = Vec::add64(b, Vec::widen_high(v));
+  }
+  total = Vec::hsum64(Vec::add64(a, b));
+#endif
+  for (; i < n; ++i)
+    total += in[i];
+  return total;
+}
+
+uint64_t sum_scalar(const uint32_t *in, size_t n) {
+  uint64_t total = 0;
+  for (size_t i = 0; i < n; ++i) {
+    total += in[i];
+#if defined(__GNUC__)
+    // Keeps the compiler from vectorising the reference loop itself
+    asm volatile("" : "+r"(total));
+#endif
+  }
+  return total;
+}
+
+void binop(Op op, const uint32_t *lhs, const uint32_t *rhs, uint32_t *out,
+           size_t n) {
+  dispatch(op, lhs, rhs, out, n, true);
+}
+void binop_scalar(Op op, const uint32_t *lhs, const uint32_t *rhs,
+                  uint32_t *out, size_t n) {
+  dispatch(op, lhs, rhs, out, n, false);
+}
+
+void binop(Op op, const uint32_t *lhs, uint32_t rhs, uint32_t *out, size_t n) {
+  dispatch(op, lhs, rhs, out, n, true);
+}
+void binop_scalar(Op op, const uint32_t *lhs, uint32_t rhs, uint32_t *out,
+                  size_t n) {
+  dispatch(op, lhs, rhs, out, n, false);
+}
+
+void binop(Op op, uint32_t lhs, const uint32_t *rhs, uint32_t *out, size_t n) {
+  dispatch(op, lhs, rhs, out, n, true);
+}
+void binop_scalar(Op op, uint32_t lhs, const uint32_t *rhs, uint32_t *out,
+                  size_t n) {
+  dispatch(op, lhs, rhs, out, n, false);
+}
+
+} // namespace kernels
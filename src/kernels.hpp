@@ -0,0 +1,48 @@
+#pragma once
+
+/** \file
+ * \brief Numeric kernels over packed `uint32_t` arrays. These are vectorised
+ * with AVX2 when compiled for it (see the `TINY_INTERP_NATIVE` CMake option),
+ * otherwise with SSE2 on x86-64, and fall back to scalar loops elsewhere.
+ * Element-wise arithmetic wraps, in the arrays' 32-bit elements.
+ * Sums are totalled in 64 bits, which can't overflow for any array that fits
+ * in memory.
+ *
+ * The `_scalar` variants are always the plain loops, for testing and
+ * benchmarking the vectorised ones against.
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+namespace kernels {
+
+enum class Op { Less, Equal, Greater, Add, Sub };
+
+/// The instruction set the kernels were compiled for, e.g. "avx2"
+const char *isa(void);
+
+/// out[i] = start + i
+void iota(uint32_t *out, size_t n, uint32_t start);
+void iota_scalar(uint32_t *out, size_t n, uint32_t start);
+
+uint64_t sum(const uint32_t *in, size_t n);
+uint64_t sum_scalar(const uint32_t *in, size_t n);
+
+/// out[i] = lhs[i] op rhs[i], comparisons give 0 or 1
+void binop(Op op, const uint32_t *lhs, const uint32_t *rhs, uint32_t *out,
+           size_t n);
+void binop_scalar(Op op, const uint32_t *lhs, const uint32_t *rhs,
+                  uint32_t *out, size_t n);
+
+/// out[i] = lhs[i] op rhs
+void binop(Op op, const uint32_t *lhs, uint32_t rhs, uint32_t *out, size_t n);
+void binop_scalar(Op op, const uint32_t *lhs, uint32_t rhs, uint32_t *out,
+                  size_t n);
+
+/// out[i] = lhs op rhs[i]
+void binop(Op op, uint32_t lhs, const uint32_t *rhs, uint32_t *out, size_t n);
+void binop_scalar(Op op, uint32_t lhs, const uint32_t *rhs, uint32_t *out,
+                  size_t n);
+
+} // namespace kernels
@@ -1,31 +1,557 @@
+#include "batch.hpp"
+#include "codegen.hpp"
 #include "eval.hpp"
 #include "formatter.hpp"
+#include "interpreter.hpp"
+#include "metrics.hpp"
 #include "parser.hpp"
+#include "profiler.hpp"
 #include "readline.hpp"
+#include "replay.hpp"
+#include "serialise.hpp"
+#include "session.hpp"
 #include "tokeniser.hpp"
+#include "types.hpp"
 
+#include <cctype>
+#include <charconv>
+#include <csignal>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <optional>
+#include <sstream>
+#include <thread>
+
+#include <unistd.h>
+
+#define DEFAULT_MAX_DEPTH 4000
+/// Functions in the profiler's table
+#define TOP_FUNCTIONS 20
+
+struct Options {
+  bool use_cache = true;
+  /// Only type-check the script
+  bool check = false;
+  /// Compile the script to C++, rather than run it
+  bool compile = false;
+  const char *path = nullptr;
+  FmtLimits limits;
+  EvalLimits eval_limits;
+  /// With `--map`, the function to apply to each number on stdin
+  const char *map = nullptr;
+  size_t threads = std::thread::hardware_concurrency();
+  /// Where to dump the metrics periodically, if anywhere
+  const char *metrics_file = nullptr;
+  std::chrono::seconds metrics_interval = std::chrono::seconds(10);
+  /// Where to log the REPL's lines, if anywhere
+  const char *capture = nullptr;
+  /// A log to replay instead of starting the REPL
+  const char *replay = nullptr;
+  /// Replay at the pace the lines were captured
+  bool paced = false;
+  /// Parse scripts into shared nodes (see `nodes.hpp`), and report how many
+  bool share_nodes = false;
+  /// Parse scripts' function bodies when first called (see `LazyBody`)
+  bool lazy = false;
+  /// Where to write the profile's stacks on exit, if profiling
+  const char *profile = nullptr;
+  unsigned profile_rate = 1000;
+};
+
+void usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0
+            << " [--no-cache | --share-nodes] [--lazy] [--check | --compile]"
+               " [--print-depth N]"
+               " [--print-length N]"
+               " [--fuel STEPS] [--max-memory BYTES] [--max-depth CALLS]"
+               " [--map FUNC [--threads N]]"
+               " [--metrics-file PATH [--metrics-interval SECONDS]]"
+               " [--capture LOG | --replay LOG [--paced]]"
+               " [--profile PATH [--profile-rate HZ]] [FILE]"
+            << std::endl;
+}
+
+/// Thrown for an option whose value isn't a number in range
+struct BadOption {};
+
+/// Parses the value of a numeric option, which has to be a whole number
+/// that fits in `T`
+template <typename T> T number_option(const char *value) {
+  if (!std::isdigit(static_cast<unsigned char>(value[0])))
+    throw BadOption();
+  try {
+    size_t end;
+    auto n = std::stoull(value, &end);
+    if (value[end] != '\0' || n > std::numeric_limits<T>::max())
+      throw BadOption();
+    return T(n);
+  } catch (const std::invalid_argument &) {
+    throw BadOption();
+  } catch (const std::out_of_range &) {
+    throw BadOption();
+  }
+}
+
+/// Parses a script, or loads it from the program cache if it has been parsed
+/// before. The cache holds whole, unshared trees, so isn't used when sharing
+/// nodes or parsing lazily.
+std::vector<std::unique_ptr<Ast>> load_script(const std::string &source,
+                                              const Options &options) {
+  if (options.share_nodes) {
+    NodeTable nodes;
+    auto program = parse_lines(source, &nodes, options.lazy);
+    auto &stats = nodes.get_stats();
+    auto shared_bytes = stats.parsed_bytes - stats.shared_bytes;
+    std::cerr << "Nodes: " << stats.parsed << " parsed, " << nodes.size()
+              << " distinct; about " << stats.parsed_bytes / 1024
+              << "KB unshared, " << shared_bytes / 1024 << "KB shared"
+              << std::endl;
+    return program;
+  }
+  if (options.lazy)
+    return parse_lines(source, nullptr, true);
+  ProgramCache cache(ProgramCache::default_directory());
+  if (options.use_cache) {
+    if (auto program = cache.load(source))
+      return std::move(*program);
+  }
+  auto program = parse_lines(source);
+  if (options.use_cache)
+    cache.store(source, program);
+  return program;
+}
+
+/// Prints the profile's top functions, and writes its stacks to `path`
+void report_profile(Profiler &profiler, const char *path) {
+  profiler.stop();
+  std::cerr << profiler.top(TOP_FUNCTIONS) << std::flush;
+  std::ofstream file(path);
+  file << profiler.collapsed();
+  if (!file)
+    std::cerr << "Cannot write " << path << std::endl;
+}
+
+int run_file(const Options &options) {
+  std::ifstream file(options.path, std::ios::binary);
+  if (!file) {
+    std::cerr << "Cannot open " << options.path << std::endl;
+    return 1;
+  }
+  std::stringstream source;
+  source << file.rdbuf();
+  metrics::add(metrics::Counter::Inputs);
+
+  FmtBuffer out(STDOUT_FILENO);
+  EvalVisitor evaluator;
+  evaluator.set_limits(options.eval_limits);
+  TypeChecker checker;
+  FmtAst ast_formatter(out, options.limits);
+  FmtValue value_formatter(ast_formatter, out);
+  std::optional<Profiler> profiler;
+
+  try {
+    if (options.profile) {
+      profiler.emplace(evaluator);
+      profiler->start(options.profile_rate);
+    }
+    auto program = load_script(source.str(), options);
+    for (auto &node : program) {
+      evaluate_checked(checker, evaluator, *node);
+    }
+  } catch (const std::exception &e) {
+    std::cerr << options.path << ": " << e.what() << std::endl;
+    if (profiler)
+      report_profile(*profiler, options.profile);
+    return 1;
+  }
+  if (profiler)
+    report_profile(*profiler, options.profile);
+  if (evaluator.get_last()) {
+    evaluator.get_last()->accept(value_formatter);
+    out.write("\n");
+    out.flush();
+  }
+  return 0;
+}
+
+/// Type-checks a script without evaluating it, reporting the statements that
+/// are not typeable
+int check_file(const Options &options) {
+  std::ifstream file(options.path, std::ios::binary);
+  if (!file) {
+    std::cerr << "Cannot open " << options.path << std::endl;
+    return 1;
+  }
+  std::stringstream source;
+  source << file.rdbuf();
+
+  std::vector<std::unique_ptr<Ast>> program;
+  try {
+    program = load_script(source.str(), options);
+  } catch (const std::exception &e) {
+    std::cerr << options.path << ": " << e.what() << std::endl;
+    return 1;
+  }
+  TypeChecker checker;
+  int status = 0;
+  for (size_t i = 0; i < program.size(); ++i) {
+    try {
+      checker.check(*program[i]);
+      checker.commit();
+    } catch (const TypeError &e) {
+      std::cerr << options.path << ": statement " << i + 1 << ": " << e.what()
+                << std::endl;
+      checker.forget(*program[i]);
+      status = 1;
+    }
+  }
+  return status;
+}
+
+/// Writes the script compiled to C++ to stdout
+int compile_file(const Options &options) {
+  std::ifstream file(options.path, std::ios::binary);
+  if (!file) {
+    std::cerr << "Cannot open " << options.path << std::endl;
+    return 1;
+  }
+  std::stringstream source;
+  source << file.rdbuf();
+
+  try {
+    std::cout << compile(load_script(source.str(), options));
+  } catch (const std::exception &e) {
+    std::cerr << options.path << ": " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+/// Reads whitespace-separated numbers
+std::optional<std::vector<uint32_t>> read_numbers(std::istream &in) {
+  std::stringstream text;
+  text << in.rdbuf();
+  auto str = text.str();
+  std::vector<uint32_t> numbers;
+  const char *it = str.data(), *end = str.data() + str.size();
+  while (true) {
+    while (it != end && std::isspace(static_cast<unsigned char>(*it)))
+      ++it;
+    if (it == end)
+      return numbers;
+    uint32_t n;
+    auto [next, error] = std::from_chars(it, end, n);
+    if (error != std::errc())
+      return std::nullopt;
+    numbers.push_back(n);
+    it = next;
+  }
+}
+
+/// Loads the definitions in the file, then applies a function to each number
+/// on stdin in parallel, writing the results in order, one per line
+int run_map(const Options &options) {
+  std::ifstream file(options.path, std::ios::binary);
+  if (!file) {
+    std::cerr << "Cannot open " << options.path << std::endl;
+    return 1;
+  }
+  std::stringstream source;
+  source << file.rdbuf();
+
+  Interpreter interpreter;
+  interpreter.get_evaluator().set_limits(options.eval_limits);
+  try {
+    auto program = load_script(source.str(), options);
+    for (auto &node : program)
+      interpreter.get_evaluator().evaluate(*node);
+  } catch (const std::exception &e) {
+    std::cerr << options.path << ": " << e.what() << std::endl;
+    return 1;
+  }
+
+  auto inputs = read_numbers(std::cin);
+  if (!inputs) {
+    std::cerr << "Inputs have to be numbers" << std::endl;
+    return 1;
+  }
+  std::vector<uint32_t> results;
+  try {
+    ThreadPool pool(options.threads);
+    results = batch_map(interpreter, options.map, *inputs, pool);
+  } catch (const std::exception &e) {
+    std::cerr << options.map << ": " << e.what() << std::endl;
+    return 1;
+  }
+
+  FmtBuffer out(STDOUT_FILENO);
+  for (auto result : results) {
+    out.write(result);
+    out.write("\n");
+  }
+  out.flush();
+  return 0;
+}
+
+/// Replays a captured session, reporting mismatches and regressions, and
+/// fails if any line's result or error differs
+int run_replay(const Options &options) {
+  std::vector<Record> log;
+  try {
+    log = read_log(options.replay);
+  } catch (const BadLog &e) {
+    std::cerr << options.replay << ": " << e.what() << std::endl;
+    return 1;
+  }
+  auto replayed = replay(log, options.paced, options.eval_limits);
+  return report(replayed, std::cout) ? 0 : 1;
+}
+
+/// Handles REPL commands, which start with a colon. `:sample` starts
+/// `profiler` if it isn't already.
+void run_command(const std::string &line, Session &session,
+                 std::optional<Profiler> &profiler, unsigned profile_rate) {
+  std::istringstream words(line);
+  std::string command, argument;
+  words >> command >> argument;
+  if (command == ":deps" && !argument.empty()) {
+    std::cout << session.format_deps(Identifier(argument)) << std::flush;
+  } else if (command == ":type" && !argument.empty()) {
+    try {
+      auto tree = parse(line.substr(line.find(argument)));
+      if (tree.empty())
+        return;
+      // The statement isn't evaluated, so nothing it binds is committed
+      auto type = session.get_checker().check(*tree.back());
+      std::cout << TypeChecker::format(type) << std::endl;
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+    }
+  } else if (command == ":stats") {
+    std::cout << metrics::prometheus(metrics::snapshot()) << std::flush;
+  } else if (command == ":sample") {
+    if (!profiler) {
+      profiler.emplace(session.get_evaluator());
+      try {
+        profiler->start(profile_rate);
+      } catch (const ProfilerError &e) {
+        std::cerr << e.what() << std::endl;
+        profiler.reset();
+        return;
+      }
+      std::cout << "Profiling started" << std::endl;
+    } else if (argument == "stacks") {
+      std::cout << profiler->collapsed() << std::flush;
+    } else if (argument == "clear") {
+      profiler->clear();
+    } else {
+      size_t n = TOP_FUNCTIONS;
+      std::from_chars(argument.data(), argument.data() + argument.size(), n);
+      std::cout << profiler->top(n) << std::flush;
+    }
+  } else {
+    std::cerr << "Commands:" << std::endl
+              << "  :deps NAME  show the bindings NAME depends on, and those "
+                 "that depend on it"
+              << std::endl
+              << "  :type EXPR  show the type of an expression" << std::endl
+              << "  :stats      show the metrics, in the Prometheus format"
+              << std::endl
+              << "  :sample [N | stacks | clear]" << std::endl
+              << "              start profiling, or show the top N functions "
+                 "or the stacks"
+              << std::endl;
+  }
+}
+
+/// The evaluator Ctrl-C cancels, while the REPL is evaluating a line
+EvalVisitor *interruptible = nullptr;
+
+void interrupt(int) { interruptible->cancel(); }
+
+/// Cancels the evaluation on SIGINT while in scope, rather than exiting
+struct CancelOnInterrupt {
+  CancelOnInterrupt(EvalVisitor &evaluator) {
+    interruptible = &evaluator;
+    struct sigaction action = {};
+    action.sa_handler = interrupt;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &previous);
+  }
+  ~CancelOnInterrupt() { sigaction(SIGINT, &previous, nullptr); }
+
+private:
+  struct sigaction previous;
+};
+
+/// Parses the command line into `options`, giving false if it is malformed.
+/// Throws BadOption for a numeric option's bad value.
+bool parse_options(int argc, char *argv[], Options &options) {
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--no-cache") == 0) {
+      options.use_cache = false;
+    } else if (std::strcmp(argv[i], "--share-nodes") == 0) {
+      options.share_nodes = true;
+    } else if (std::strcmp(argv[i], "--lazy") == 0) {
+      options.lazy = true;
+    } else if (std::strcmp(argv[i], "--check") == 0) {
+      options.check = true;
+    } else if (std::strcmp(argv[i], "--compile") == 0) {
+      options.compile = true;
+    } else if (std::strcmp(argv[i], "--print-depth") == 0 && i + 1 < argc) {
+      options.limits.max_depth = number_option<size_t>(argv[++i]);
+    } else if (std::strcmp(argv[i], "--print-length") == 0 && i + 1 < argc) {
+      options.limits.max_length = number_option<size_t>(argv[++i]);
+    } else if (std::strcmp(argv[i], "--fuel") == 0 && i + 1 < argc) {
+      options.eval_limits.fuel = number_option<uint64_t>(argv[++i]);
+    } else if (std::strcmp(argv[i], "--max-memory") == 0 && i + 1 < argc) {
+      options.eval_limits.max_bytes = number_option<size_t>(argv[++i]);
+    } else if (std::strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) {
+      options.eval_limits.max_depth = number_option<size_t>(argv[++i]);
+    } else if (std::strcmp(argv[i], "--map") == 0 && i + 1 < argc) {
+      options.map = argv[++i];
+    } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      options.threads = number_option<size_t>(argv[++i]);
+    } else if (std::strcmp(argv[i], "--metrics-file") == 0 && i + 1 < argc) {
+      options.metrics_file = argv[++i];
+    } else if (std::strcmp(argv[i], "--metrics-interval") == 0 &&
+               i + 1 < argc) {
+      options.metrics_interval =
+          std::chrono::seconds(number_option<unsigned>(argv[++i]));
+    } else if (std::strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+      options.capture = argv[++i];
+    } else if (std::strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      options.replay = argv[++i];
+    } else if (std::strcmp(argv[i], "--paced") == 0) {
+      options.paced = true;
+    } else if (std::strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      options.profile = argv[++i];
+    } else if (std::strcmp(argv[i], "--profile-rate") == 0 && i + 1 < argc) {
+      options.profile_rate = number_option<unsigned>(argv[++i]);
+    } else if (argv[i][0] != '-' && !options.path) {
+      options.path = argv[i];
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
 
 int main(int argc, char *argv[]) {
+  Options options;
+  // Well short of overflowing a default 8MB stack, even in a debug build
+  options.eval_limits.max_depth = DEFAULT_MAX_DEPTH;
+  bool parsed;
+  try {
+    parsed = parse_options(argc, argv, options);
+  } catch (const BadOption &) {
+    parsed = false;
+  }
+  if (!parsed) {
+    usage(argv[0]);
+    return 1;
+  }
+  if ((options.map || options.check || options.compile ||
+       options.share_nodes || options.lazy) &&
+      !options.path) {
+    usage(argv[0]);
+    return 1;
+  }
+  // Lazily parsed bodies are not type-checked
+  if (options.lazy && options.check) {
+    usage(argv[0]);
+    return 1;
+  }
+  // Capturing is only for the REPL, and replaying starts no REPL
+  if ((options.capture && (options.path || options.replay)) ||
+      (options.paced && !options.replay)) {
+    usage(argv[0]);
+    return 1;
+  }
+  // Dumping with no interval would rewrite the file in a busy loop
+  if (options.metrics_interval.count() == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  // Profiling is only for evaluating in this thread
+  if (options.profile &&
+      (options.check || options.compile || options.map || options.replay)) {
+    usage(argv[0]);
+    return 1;
+  }
+  // Dumps once more on the way out, whichever mode runs
+  std::optional<metrics::Dumper> dumper;
+  if (options.metrics_file)
+    dumper.emplace(options.metrics_file, options.metrics_interval);
+  if (options.check)
+    return check_file(options);
+  if (options.compile)
+    return compile_file(options);
+  if (options.map)
+    return run_map(options);
+  if (options.replay)
+    return run_replay(options);
+  if (options.path)
+    return run_file(options);
+
+  std::optional<LogWriter> capture;
+  try {
+    if (options.capture)
+      capture.emplace(options.capture);
+  } catch (const BadLog &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
   Readline readline;
   std::optional<std::string> line;
 
-  std::string formatted;
-  EvalVisitor evaluator;
-  FmtAst ast_formatter([&](auto s) { formatted += s; });
-  FmtValue value_formatter(ast_formatter, [&](auto s) { formatted += s; });
+  FmtBuffer out(STDOUT_FILENO);
+  Session session;
+  session.get_evaluator().set_limits(options.eval_limits);
+  FmtAst ast_formatter(out, options.limits);
+  FmtValue value_formatter(ast_formatter, out);
+  auto start = std::chrono::steady_clock::now();
+  std::optional<Profiler> profiler;
+  if (options.profile) {
+    profiler.emplace(session.get_evaluator());
+    try {
+      profiler->start(options.profile_rate);
+    } catch (const ProfilerError &e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+  }
 
   while ((line = readline.read("> ")).has_value()) {
-    auto tree = parse(*line);
-    for (auto &node : tree) {
-      node->accept(evaluator);
+    if (line->starts_with(":")) {
+      run_command(*line, session, profiler, options.profile_rate);
+      continue;
+    }
+
+    metrics::add(metrics::Counter::Inputs);
+    auto at = std::chrono::steady_clock::now() - start;
+    Record record;
+    {
+      CancelOnInterrupt cancel_on_interrupt(session.get_evaluator());
+      record = run_line(session, *line, std::cerr, capture.has_value());
+    }
+    if (capture) {
+      record.line = *line;
+      record.at = at;
+      capture->write(record);
     }
-    formatted = "";
-    if (evaluator.get_last()) {
-      evaluator.get_last()->accept(value_formatter);
-      std::cout << formatted << std::endl;
+    if (record.error)
+      continue;
+    if (session.get_last()) {
+      session.get_last()->accept(value_formatter);
+      out.write("\n");
+      out.flush();
     }
   }
+  if (profiler && options.profile)
+    report_profile(*profiler, options.profile);
 }
@@ -0,0 +1,278 @@
+#include "metrics.hpp"
+#include "builtins.hpp"
+#include "eval.hpp"
+#include "interpreter.hpp"
+#include "tokeniser.hpp"
+
+#include <atomic>
+#include <bit>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+namespace metrics {
+
+namespace {
+
+/// Only ever written by the thread that owns it, so a plain load and store
+/// is enough, and cheaper than an atomic increment
+struct Cell {
+  void add(uint64_t n) {
+    value.store(value.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+  }
+  uint64_t get(void) const { return value.load(std::memory_order_relaxed); }
+
+  std::atomic<uint64_t> value = 0;
+};
+
+struct Histogram {
+  std::array<Cell, BUCKETS> buckets;
+  Cell count;
+  Cell sum_ns;
+};
+
+struct Block {
+  std::array<Cell, size_t(Counter::Count)> counters;
+  std::array<Cell, size_t(Error::Count)> errors;
+  std::array<Histogram, size_t(Timing::Count)> timings;
+};
+
+void accumulate(Snapshot &snapshot, const Block &block) {
+  for (size_t i = 0; i < block.counters.size(); ++i)
+    snapshot.counters[i] += block.counters[i].get();
+  for (size_t i = 0; i < block.errors.size(); ++i)
+    snapshot.errors[i] += block.errors[i].get();
+  for (size_t i = 0; i < block.timings.size(); ++i) {
+    auto &from = block.timings[i];
+    auto &to = snapshot.timings[i];
+    for (size_t j = 0; j < BUCKETS; ++j)
+      to.buckets[j] += from.buckets[j].get();
+    to.count += from.count.get();
+    to.sum_ns += from.sum_ns.get();
+  }
+}
+
+struct Registry {
+  std::mutex mutex;
+  std::vector<Block *> live;
+  /// Totals of the threads that have exited
+  Snapshot retired;
+};
+
+Registry &registry(void) {
+  // Never destroyed, as threads can exit during static destruction
+  static Registry *registry = new Registry();
+  return *registry;
+}
+
+/// Unregisters the thread's block when the thread exits
+struct Owner {
+  Owner(Block *block) : block(block) {
+    auto &r = registry();
+    std::lock_guard lock(r.mutex);
+    r.live.push_back(block);
+  }
+  ~Owner() {
+    auto &r = registry();
+    std::lock_guard lock(r.mutex);
+    accumulate(r.retired, *block);
+    std::erase(r.live, block);
+    delete block;
+  }
+
+  Block *block;
+};
+
+thread_local Block *local = nullptr;
+
+Block &block(void) {
+  if (local == nullptr) [[unlikely]] {
+    thread_local Owner owner(new Block());
+    local = owner.block;
+  }
+  return *local;
+}
+
+const char *ERROR_NAMES[] = {
+    "ParseError",      "EofToken",        "EvalError",
+    "NotANumber",      "NotAFunction",    "UnknownVariable",
+    "NotAnArray",      "IndexOutOfRange", "LengthMismatch",
+    "NotATuple",       "NumberOutOfRange", "DivisionByZero",
+    "WrongArity",      "OutOfFuel",       "MemoryLimitExceeded",
+    "CallDepthExceeded", "Cancelled",     "Other",
+};
+static_assert(std::size(ERROR_NAMES) == size_t(Error::Count));
+
+bool is_parse_error(Error error) {
+  return error == Error::ParseError || error == Error::EofToken;
+}
+
+} // namespace
+
+void add(Counter counter, uint64_t n) {
+  block().counters[size_t(counter)].add(n);
+}
+
+Error classify(const std::exception &error) {
+  if (dynamic_cast<const EofToken *>(&error))
+    return Error::EofToken;
+  if (dynamic_cast<const ParseError *>(&error))
+    return Error::ParseError;
+  if (dynamic_cast<const NotANumber *>(&error))
+    return Error::NotANumber;
+  if (dynamic_cast<const NotAFunction *>(&error))
+    return Error::NotAFunction;
+  if (dynamic_cast<const UnknownVariable *>(&error))
+    return Error::UnknownVariable;
+  if (dynamic_cast<const NotAnArray *>(&error))
+    return Error::NotAnArray;
+  if (dynamic_cast<const IndexOutOfRange *>(&error))
+    return Error::IndexOutOfRange;
+  if (dynamic_cast<const LengthMismatch *>(&error))
+    return Error::LengthMismatch;
+  if (dynamic_cast<const NotATuple *>(&error))
+    return Error::NotATuple;
+  if (dynamic_cast<const NumberOutOfRange *>(&error))
+    return Error::NumberOutOfRange;
+  if (dynamic_cast<const DivisionByZero *>(&error))
+    return Error::DivisionByZero;
+  if (dynamic_cast<const WrongArity *>(&error))
+    return Error::WrongArity;
+  if (dynamic_cast<const OutOfFuel *>(&error))
+    return Error::OutOfFuel;
+  if (dynamic_cast<const MemoryLimitExceeded *>(&error))
+    return Error::MemoryLimitExceeded;
+  if (dynamic_cast<const CallDepthExceeded *>(&error))
+    return Error::CallDepthExceeded;
+  if (dynamic_cast<const Cancelled *>(&error))
+    return Error::Cancelled;
+  if (dynamic_cast<const EvalError *>(&error))
+    return Error::EvalError;
+  return Error::Other;
+}
+
+void record_error(const std::exception &error) {
+  block().errors[size_t(classify(error))].add(1);
+}
+
+void observe(Timing timing, std::chrono::nanoseconds duration) {
+  auto &histogram = block().timings[size_t(timing)];
+  uint64_t ns = std::max<int64_t>(duration.count(), 0);
+  size_t bucket = std::min<size_t>(std::bit_width(ns >> 10), BUCKETS - 1);
+  histogram.buckets[bucket].add(1);
+  histogram.count.add(1);
+  histogram.sum_ns.add(ns);
+}
+
+Timer::Timer(Timing timing)
+    : timing(timing), start(std::chrono::steady_clock::now()) {}
+
+Timer::~Timer() { observe(timing, std::chrono::steady_clock::now() - start); }
+
+uint64_t Snapshot::get(Counter counter) const {
+  return counters[size_t(counter)];
+}
+
+uint64_t Snapshot::get(Error error) const { return errors[size_t(error)]; }
+
+const Snapshot::Histogram &Snapshot::get(Timing timing) const {
+  return timings[size_t(timing)];
+}
+
+Snapshot snapshot(void) {
+  auto &r = registry();
+  std::lock_guard lock(r.mutex);
+  Snapshot snapshot = r.retired;
+  for (auto block : r.live)
+    accumulate(snapshot, *block);
+  return snapshot;
+}
+
+const char *name(Error error) { return ERROR_NAMES[size_t(error)]; }
+
+std::string prometheus(const Snapshot &snapshot) {
+  std::ostringstream out;
+  auto counter = [&](const char *name, const char *help, uint64_t value) {
+    out << "# HELP tiny_interp_" << name << " " << help << "\n"
+        << "# TYPE tiny_interp_" << name << " counter\n"
+        << "tiny_interp_" << name << " " << value << "\n";
+  };
+  counter("inputs_total", "Lines read by the REPL, or scripts run",
+          snapshot.get(Counter::Inputs));
+  counter("statements_total", "Top-level statements evaluated",
+          snapshot.get(Counter::Statements));
+  counter("steps_total", "Function applications",
+          snapshot.get(Counter::Steps));
+  counter("values_total", "Values allocated", snapshot.get(Counter::Values));
+  counter("closures_total", "Closures created",
+          snapshot.get(Counter::Closures));
+  counter("allocated_bytes_total", "Bytes of values allocated",
+          snapshot.get(Counter::Bytes));
+
+  out << "# HELP tiny_interp_errors_total Errors by phase and type\n"
+      << "# TYPE tiny_interp_errors_total counter\n";
+  for (size_t i = 0; i < size_t(Error::Count); ++i) {
+    auto error = Error(i);
+    out << "tiny_interp_errors_total{phase=\""
+        << (is_parse_error(error) ? "parse" : "eval") << "\",type=\""
+        << metrics::name(error) << "\"} " << snapshot.get(error) << "\n";
+  }
+
+  auto histogram = [&](const char *name, const char *help,
+                       const Snapshot::Histogram &histogram) {
+    out << "# HELP tiny_interp_" << name << " " << help << "\n"
+        << "# TYPE tiny_interp_" << name << " histogram\n";
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i + 1 < BUCKETS; ++i) {
+      cumulative += histogram.buckets[i];
+      out << "tiny_interp_" << name << "_bucket{le=\""
+          << double(uint64_t(1) << (i + 10)) / 1e9 << "\"} " << cumulative
+          << "\n";
+    }
+    out << "tiny_interp_" << name << "_bucket{le=\"+Inf\"} "
+        << histogram.count << "\n"
+        << "tiny_interp_" << name << "_sum " << double(histogram.sum_ns) / 1e9
+        << "\n"
+        << "tiny_interp_" << name << "_count " << histogram.count << "\n";
+  };
+  histogram("parse_seconds", "Time to parse an input",
+            snapshot.get(Timing::Parse));
+  histogram("eval_seconds", "Time to evaluate a top-level statement",
+            snapshot.get(Timing::Eval));
+  return out.str();
+}
+
+Dumper::Dumper(std::string path, std::chrono::milliseconds interval)
+    : path(std::move(path)), interval(interval), stopping(false),
+      thread([this] { run(); }) {}
+
+Dumper::~Dumper() {
+  {
+    std::lock_guard lock(mutex);
+    stopping = true;
+  }
+  stopped.notify_all();
+  thread.join();
+  dump();
+}
+
+void Dumper::dump(void) const {
+  auto temporary = path + ".tmp";
+  {
+    std::ofstream file(temporary, std::ios::trunc);
+    file << prometheus(snapshot());
+    if (!file)
+      return;
+  }
+  std::rename(temporary.c_str(), path.c_str());
+}
+
+void Dumper::run(void) {
+  std::unique_lock lock(mutex);
+  while (!stopped.wait_for(lock, interval, [this] { return stopping; }))
+    dump();
+}
+
+} // namespace metrics
@@ -0,0 +1,134 @@
+#pragma once
+
+/** \file
+ * \brief Process-wide counters and latency histograms, for scraping, e.g.
+ *
+ *     metrics::Dumper dumper("/var/lib/node_exporter/tiny-interp.prom",
+ *                            std::chrono::seconds(10));
+ *
+ * writes them in the Prometheus text format every ten seconds. `parse`
+ * records parse times and errors, and `EvalVisitor::evaluate` records
+ * statements, evaluation times, errors, and the values, closures and bytes
+ * they allocated.
+ *
+ * Each thread updates its own block of counters, so recording takes no
+ * locks and no atomic read-modify-writes; reading sums the blocks. A
+ * thread's counts are kept when it exits.
+ */
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace metrics {
+
+enum class Counter : size_t {
+  /// Lines read by the REPL, or scripts run
+  Inputs,
+  /// Top-level statements evaluated, including those that threw
+  Statements,
+  Steps,
+  Values,
+  Closures,
+  /// Bytes of values allocated, as charged against the memory limit
+  Bytes,
+  Count
+};
+
+/// Errors by type. Subtypes that aren't listed count as their base type.
+enum class Error : size_t {
+  ParseError,
+  EofToken,
+  EvalError,
+  NotANumber,
+  NotAFunction,
+  UnknownVariable,
+  NotAnArray,
+  IndexOutOfRange,
+  LengthMismatch,
+  NotATuple,
+  NumberOutOfRange,
+  DivisionByZero,
+  WrongArity,
+  OutOfFuel,
+  MemoryLimitExceeded,
+  CallDepthExceeded,
+  Cancelled,
+  /// Anything else
+  Other,
+  Count
+};
+
+enum class Timing : size_t { Parse, Eval, Count };
+
+/// Bucket `i` counts durations under 2^(i + 10) ns, i.e. from about 1us up
+/// to about 17s, and the last bucket everything longer
+const size_t BUCKETS = 26;
+
+void add(Counter counter, uint64_t n = 1);
+/// The type of an error, as counted by `record_error`
+Error classify(const std::exception &error);
+void record_error(const std::exception &error);
+void observe(Timing timing, std::chrono::nanoseconds duration);
+
+/// Observes the time until it is destroyed
+struct Timer {
+  Timer(Timing timing);
+  ~Timer();
+
+private:
+  Timing timing;
+  std::chrono::steady_clock::time_point start;
+};
+
+/// Totals over all threads
+struct Snapshot {
+  struct Histogram {
+    std::array<uint64_t, BUCKETS> buckets{};
+    uint64_t count = 0;
+    uint64_t sum_ns = 0;
+  };
+
+  std::array<uint64_t, size_t(Counter::Count)> counters{};
+  std::array<uint64_t, size_t(Error::Count)> errors{};
+  std::array<Histogram, size_t(Timing::Count)> timings{};
+
+  uint64_t get(Counter counter) const;
+  uint64_t get(Error error) const;
+  const Histogram &get(Timing timing) const;
+};
+
+Snapshot snapshot(void);
+/// The name of an error, as in its label
+const char *name(Error error);
+/// In the Prometheus text exposition format
+std::string prometheus(const Snapshot &snapshot);
+
+/// Writes the metrics to a file periodically, and once more when destroyed.
+/// The file is replaced atomically, so readers never see a partial dump.
+struct Dumper {
+  Dumper(std::string path, std::chrono::milliseconds interval);
+  Dumper(const Dumper &) = delete;
+  Dumper &operator=(const Dumper &) = delete;
+  ~Dumper();
+
+  void dump(void) const;
+
+private:
+  void run(void);
+
+  std::string path;
+  std::chrono::milliseconds interval;
+  std::mutex mutex;
+  std::condition_variable stopped;
+  bool stopping;
+  std::thread thread;
+};
+
+} // namespace metrics
@@ -0,0 +1,188 @@
+#include "nodes.hpp"
+
+#include <string>
+#include <vector>
+
+namespace {
+
+enum Tag : char {
+  TagAssignment = 'a',
+  TagFn = 'f',
+  TagIfCond = 'i',
+  TagLoop = 'l',
+  TagApp = 'p',
+  TagBinop = 'b',
+  TagNumber = 'n',
+  TagIdentifier = 'd',
+  TagStatementExpr = 's',
+  TagLazyBody = 'z',
+  TagTuple = 't',
+  TagProject = 'j',
+  TagDestructure = 'u',
+};
+
+/// A node's key in the table, and roughly how many bytes it takes, not
+/// counting its children
+struct Shape : Visitor {
+  void visitAssignment(const Assignment &let) override {
+    key = TagAssignment;
+    name(let.get_name());
+    child(let.get_body());
+    bytes = sizeof(Assignment) + sizeof(Identifier) +
+            heap(*let.get_name());
+  }
+  void visitFn(const Fn &fn) override {
+    key = TagFn;
+    names(fn.get_args());
+    child(*fn.get_body());
+    bytes = sizeof(Fn) + heap(fn.get_args());
+  }
+  void visitIfCond(const IfCond &if_cond) override {
+    key = TagIfCond;
+    child(if_cond.get_condition());
+    child(if_cond.get_true_case());
+    child(if_cond.get_false_case());
+    bytes = sizeof(IfCond);
+  }
+  void visitLoop(const Loop &loop) override {
+    key = TagLoop;
+    names(loop.get_vars());
+    for (auto &init : loop.get_inits())
+      child(*init);
+    child(loop.get_condition());
+    for (auto &step : loop.get_steps())
+      child(*step);
+    bytes = sizeof(Loop) + heap(loop.get_vars()) +
+            2 * loop.get_inits().size() * sizeof(loop.get_inits()[0]);
+  }
+  void visitApp(const App &app) override {
+    key = TagApp;
+    child(app.get_lhs());
+    child(app.get_rhs());
+    bytes = sizeof(App);
+  }
+  void visitBinop(const Binop &op) override {
+    key = TagBinop;
+    key += op.get_op();
+    key += '\0';
+    child(op.get_lhs());
+    child(op.get_rhs());
+    bytes = sizeof(Binop) + heap(op.get_op());
+  }
+  void visitNumber(const Number &n) override {
+    key = TagNumber;
+    auto &value = *n;
+    if (value.is_small()) {
+      auto small = value.small();
+      key.append(reinterpret_cast<const char *>(&small), sizeof(small));
+    } else {
+      // Longer than a small one's bytes, so they can't collide
+      key += value.to_string();
+    }
+    bytes = sizeof(Number) + value.heap_bytes();
+  }
+  void visitIdentifier(const Identifier &id) override {
+    key = TagIdentifier;
+    name(id);
+    bytes = sizeof(Identifier) + heap(*id);
+  }
+  void visitStatementExpr(const StatementExpr &statements) override {
+    key = TagStatementExpr;
+    for (auto &statement : statements.get_body())
+      child(*statement);
+    bytes = sizeof(StatementExpr) +
+            statements.get_body().size() * sizeof(statements.get_body()[0]);
+  }
+
+  void visitLazyBody(const LazyBody &lazy) override {
+    key = TagLazyBody;
+    key += lazy.get_source();
+    bytes = sizeof(LazyBody);
+  }
+  void visitTuple(const Tuple &tuple) override {
+    key = TagTuple;
+    for (auto &field : tuple.get_fields())
+      child(*field);
+    bytes = sizeof(Tuple) +
+            tuple.get_fields().size() * sizeof(tuple.get_fields()[0]);
+  }
+  void visitProject(const Project &project) override {
+    key = TagProject;
+    auto index = project.get_index();
+    key.append(reinterpret_cast<const char *>(&index), sizeof(index));
+    child(project.get_tuple());
+    bytes = sizeof(Project);
+  }
+  void visitDestructure(const Destructure &destructure) override {
+    key = TagDestructure;
+    names(destructure.get_names());
+    child(destructure.get_body());
+    bytes = sizeof(Destructure) + heap(destructure.get_names());
+  }
+
+  /// Children are already shared, so are equal only if they are the same
+  void child(const Ast &ast) {
+    auto address = &ast;
+    key.append(reinterpret_cast<const char *>(&address), sizeof(address));
+  }
+  void name(const Identifier &id) {
+    key += *id;
+    key += '\0';
+  }
+  void names(const std::vector<Identifier> &ids) {
+    for (auto &id : ids)
+      name(id);
+    key += '\0';
+  }
+
+  static size_t heap(const std::string &str) {
+    // Short strings are stored inline
+    return str.capacity() > std::string().capacity() ? str.capacity() + 1 : 0;
+  }
+  static size_t heap(const std::vector<Identifier> &ids) {
+    size_t size = ids.capacity() * sizeof(Identifier);
+    for (auto &id : ids)
+      size += heap(*id);
+    return size;
+  }
+
+  std::string key;
+  size_t bytes;
+};
+
+/// What `std::shared_ptr` adds to each node it owns
+const size_t CONTROL_BLOCK_SIZE = 3 * sizeof(void *);
+
+} // namespace
+
+std::shared_ptr<Ast> NodeTable::intern(std::unique_ptr<Ast> node) {
+  Shape shape;
+  node->accept(shape);
+  ++stats.parsed;
+  stats.parsed_bytes += shape.bytes + CONTROL_BLOCK_SIZE;
+
+  auto &entry = nodes[shape.key];
+  if (auto existing = entry.lock()) {
+    ++stats.shared;
+    stats.shared_bytes += shape.bytes + CONTROL_BLOCK_SIZE;
+    return existing;
+  }
+
+  node->set_id(next_id++);
+  std::shared_ptr<Ast> shared(std::move(node));
+  entry = shared;
+  if (nodes.size() >= 2 * swept + 1024) {
+    std::erase_if(nodes, [](auto &entry) { return entry.second.expired(); });
+    swept = nodes.size();
+  }
+  return shared;
+}
+
+size_t NodeTable::size(void) const {
+  size_t live = 0;
+  for (auto &[key, node] : nodes)
+    live += !node.expired();
+  return live;
+}
+
+const NodeTable::Stats &NodeTable::get_stats(void) const { return stats; }
@@ -0,0 +1,63 @@
+#pragma once
+
+/** \file
+ * \brief Hash-consing of syntax-trees, for generated scripts which repeat
+ * the same subexpressions and functions many times, e.g.
+ *
+ *     NodeTable nodes;
+ *     auto program = parse(source, &nodes);
+ *
+ * makes each subtree which occurs more than once in `source` (or in
+ * anything else parsed with `nodes`) a single node, shared by all its
+ * parents, with an id (see `Ast::get_id`) that is the same for every
+ * occurrence. Top-level statements are not shared, as they are owned by
+ * whatever runs them.
+ *
+ * Nodes are only annotated with what is true of every occurrence, so
+ * sharing is invisible to evaluation, but a subtree proven a number in one
+ * place and a function in another is not proven anything in either.
+ */
+
+#include "ast.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+struct NodeTable {
+  struct Stats {
+    /// Nodes parsed, other than top-level statements
+    size_t parsed = 0;
+    /// Of those, the ones that were replaced by a node already in the table
+    size_t shared = 0;
+    /// Roughly what the parsed nodes would take unshared, and what the ones
+    /// replaced took
+    size_t parsed_bytes = 0;
+    size_t shared_bytes = 0;
+  };
+
+  /// The node in the table which is structurally equal to `node`, adding
+  /// `node` if there is none. The children of `node` must be from the table.
+  std::shared_ptr<Ast> intern(std::unique_ptr<Ast> node);
+  template <typename T> std::shared_ptr<T> intern(std::unique_ptr<T> node) {
+    return std::static_pointer_cast<T>(
+        intern(std::unique_ptr<Ast>(std::move(node))));
+  }
+
+  /// The number of distinct nodes still in use
+  size_t size(void) const;
+  const Stats &get_stats(void) const;
+
+private:
+  /// Keyed by the node's kind, its fields and the addresses of its
+  /// children. Nodes are dropped once nothing else uses them; their entries
+  /// are swept lazily, and until then an entry whose key is matched again,
+  /// once the addresses are reused, is a miss.
+  std::unordered_map<std::string, std::weak_ptr<Ast>> nodes;
+  /// Entries, dead or alive, when they were last swept
+  size_t swept = 0;
+  uint32_t next_id = 1;
+  Stats stats;
+};
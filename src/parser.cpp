@@ -1,4 +1,7 @@
 #include "parser.hpp"
+#include "analysis.hpp"
+#include "metrics.hpp"
+#include "nodes.hpp"
 #include "tokeniser.hpp"
 
 #include <algorithm>
@@ -25,32 +28,54 @@ struct Parser {
     std::string str;
   };
 
-  Parser(const std::string &str);
+  /// Parses `fn` bodies lazily if given the `source` that `str` is in
+  Parser(const std::string &str, NodeTable *nodes,
+         std::shared_ptr<const std::string> source = nullptr);
 
   bool is_id_cont(const std::string_view &s);
   bool is_id(const std::string_view &s);
   bool is_num(const std::string_view &s);
   void expect(std::string s);
   std::unique_ptr<Expression> term(void);
+  std::unique_ptr<Expression> projections(void);
   static bool is_binop(std::string_view tok);
   std::unique_ptr<Expression> infix(void);
   std::unique_ptr<Expression> app(void);
   Identifier id(void);
   std::vector<Identifier> vars(void);
+  std::vector<std::vector<Identifier>> params(void);
+  std::vector<Identifier> pattern(void);
+  std::vector<std::shared_ptr<Expression>> exprs(size_t count);
   std::unique_ptr<Expression> expr(void);
+  std::shared_ptr<Ast> body(void);
+  std::unique_ptr<LazyBody> lazy_body(void);
   std::unique_ptr<Ast> statement(void);
   std::vector<std::unique_ptr<Ast>> statements(void);
 
   void assert_finished(void);
 
 private:
+  /// A node becoming a child, shared if parsing with a NodeTable
+  template <typename T> std::shared_ptr<T> child(std::unique_ptr<T> node);
+
   std::set<std::string> builtins;
   std::unique_ptr<Tokeniser> tokr;
+  NodeTable *nodes;
+  std::shared_ptr<const std::string> source;
 };
 
-Parser::Parser(const std::string &str)
+Parser::Parser(const std::string &str, NodeTable *nodes,
+               std::shared_ptr<const std::string> source)
     : tokr(std::make_unique<Tokeniser>(str)),
-      builtins({"let", "fn", "if", "then", "else"}) {}
+      builtins({"let", "fn", "if", "then", "else", "loop", "while", "do"}),
+      nodes(nodes), source(std::move(source)) {}
+
+template <typename T>
+std::shared_ptr<T> Parser::child(std::unique_ptr<T> node) {
+  if (nodes)
+    return nodes->intern(std::move(node));
+  return node;
+}
 
 bool Parser::is_id_cont(const std::string_view &s) {
   return s.size() == 0 || std::all_of(s.begin(), s.end(), [](unsigned char c) {
@@ -80,20 +105,35 @@ std::unique_ptr<Expression> Parser::term(void) {
 
   if (tok == "(") {
     auto ast = expr();
-    expect(")");
-    return ast;
+    std::string_view next = tokr->next_token();
+    if (next == ")")
+      return ast;
+    if (next != ",")
+      throw BadToken(std::string(next));
+    std::vector<std::shared_ptr<Expression>> fields;
+    fields.push_back(child(std::move(ast)));
+    do {
+      if (fields.size() == MAX_TUPLE_SIZE)
+        throw BadToken(",");
+      fields.push_back(child(expr()));
+      next = tokr->next_token();
+    } while (next == ",");
+    if (next != ")")
+      throw BadToken(std::string(next));
+    return std::make_unique<Tuple>(std::move(fields));
   }
 
   if (tok == "{") {
     auto ast = statements();
     expect("}");
-    return std::make_unique<StatementExpr>(std::move(ast));
+    std::vector<std::shared_ptr<Ast>> body;
+    for (auto &statement : ast)
+      body.push_back(child(std::move(statement)));
+    return std::make_unique<StatementExpr>(std::move(body));
   }
 
-  if (is_num(tok)) {
-    auto i = std::stoi(std::string(tok));
-    return std::make_unique<Number>(i);
-  }
+  if (is_num(tok))
+    return std::make_unique<Number>(Integer::parse(tok));
 
   if (is_id(tok)) {
     return std::make_unique<Identifier>(std::string(tok));
@@ -106,12 +146,34 @@ bool Parser::is_binop(std::string_view tok) {
   return tok == "<" || tok == "==" || tok == ">" || tok == "+" || tok == "-";
 }
 
-std::unique_ptr<Expression> Parser::app(void) {
+/// A term followed by any projections, e.g. `t . 0 . 1`
+std::unique_ptr<Expression> Parser::projections(void) {
   auto ast = term();
   auto pos = tokr->get_pos();
+  try {
+    while (tokr->next_token() == ".") {
+      std::string_view tok = tokr->next_token();
+      auto index = is_num(tok) ? Integer::parse(tok) : Integer(-1);
+      if (!index.fits<uint32_t>())
+        throw BadToken(std::string(tok));
+      ast = std::make_unique<Project>(child(std::move(ast)),
+                                      uint32_t(index.small()));
+      pos = tokr->get_pos();
+    }
+  } catch (const ParseError &e) {
+  }
+  // Deliberately after the catch -- we want to set it back if the loop
+  // terminates
+  tokr->set_pos(pos);
+  return ast;
+}
+
+std::unique_ptr<Expression> Parser::app(void) {
+  auto ast = projections();
+  auto pos = tokr->get_pos();
   try {
     auto rhs = app();
-    ast = std::make_unique<App>(std::move(ast), std::move(rhs));
+    ast = std::make_unique<App>(child(std::move(ast)), child(std::move(rhs)));
   } catch (const ParseError &e) {
     tokr->set_pos(pos);
   }
@@ -126,8 +188,8 @@ std::unique_ptr<Expression> Parser::infix(void) {
     tok = tokr->next_token();
     while (is_binop(tok)) {
       auto rhs = app();
-      ast = std::make_unique<Binop>(std::string(tok), std::move(ast),
-                                    std::move(rhs));
+      ast = std::make_unique<Binop>(std::string(tok), child(std::move(ast)),
+                                    child(std::move(rhs)));
       pos = tokr->get_pos();
       tok = tokr->next_token();
     }
@@ -180,15 +242,84 @@ std::vector<Identifier> Parser::vars(void) {
   return ret;
 }
 
+/// A tuple pattern, e.g. `( a , b )`
+std::vector<Identifier> Parser::pattern(void) {
+  auto pos = tokr->get_pos();
+  if (tokr->next_token() != "(")
+    throw BadToken("(");
+  tokr->set_pos(pos);
+  auto names = vars();
+  if (names.size() < 2 || names.size() > MAX_TUPLE_SIZE)
+    throw BadToken(")");
+  return names;
+}
+
+/// A `fn`'s arguments: like vars, but each can be a tuple pattern, e.g.
+/// `( ( a , b ) , c )`
+std::vector<std::vector<Identifier>> Parser::params(void) {
+  std::vector<std::vector<Identifier>> ret;
+  auto pos = tokr->get_pos();
+  if (tokr->next_token() != "(") {
+    tokr->set_pos(pos);
+    ret.push_back({id()});
+    return ret;
+  }
+  std::string_view tok;
+  do {
+    pos = tokr->get_pos();
+    bool is_pattern = tokr->next_token() == "(";
+    tokr->set_pos(pos);
+    if (is_pattern)
+      ret.push_back(pattern());
+    else
+      ret.push_back({id()});
+    tok = tokr->next_token();
+  } while (tok == ",");
+  if (tok != ")")
+    throw BadToken(std::string(tok));
+  return ret;
+}
+
+std::vector<std::shared_ptr<Expression>> Parser::exprs(size_t count) {
+  std::vector<std::shared_ptr<Expression>> ret;
+  if (count == 1) {
+    ret.push_back(child(expr()));
+    return ret;
+  }
+  expect("(");
+  ret.push_back(child(expr()));
+  while (ret.size() < count) {
+    expect(",");
+    ret.push_back(child(expr()));
+  }
+  expect(")");
+  return ret;
+}
+
 std::unique_ptr<Expression> Parser::expr(void) {
   auto pos = tokr->get_pos();
   std::string_view tok = tokr->next_token();
 
   if (tok == "fn") {
-    auto args = vars();
-    // The body is going to be kept around for longer for e.g. closures
-    auto body = expr();
-    return std::make_unique<Fn>(std::move(args), std::move(body));
+    // Tuple patterns bind their names from an argument of their own, named
+    // so that it can't clash
+    std::vector<Identifier> args;
+    std::vector<std::shared_ptr<Ast>> destructures;
+    for (auto &param : params()) {
+      if (param.size() == 1) {
+        args.push_back(std::move(param.front()));
+        continue;
+      }
+      args.emplace_back("_" + std::to_string(args.size()));
+      destructures.push_back(child(std::make_unique<Destructure>(
+          std::move(param), child(std::make_unique<Identifier>(args.back())))));
+    }
+    auto fn_body = body();
+    if (!destructures.empty()) {
+      destructures.push_back(std::move(fn_body));
+      fn_body = child(std::make_unique<StatementExpr>(std::move(destructures)));
+    }
+    return std::make_unique<Fn>(std::move(args), std::move(fn_body));
   }
 
   if (tok == "if") {
@@ -197,26 +328,95 @@ std::unique_ptr<Expression> Parser::expr(void) {
     auto true_case = expr();
     expect("else");
     auto false_case = expr();
-    return std::make_unique<IfCond>(std::move(condition), std::move(true_case),
-                                    std::move(false_case));
+    return std::make_unique<IfCond>(child(std::move(condition)),
+                                    child(std::move(true_case)),
+                                    child(std::move(false_case)));
+  }
+
+  if (tok == "loop") {
+    auto loop_vars = vars();
+    expect("=");
+    auto inits = exprs(loop_vars.size());
+    expect("while");
+    auto condition = expr();
+    expect("do");
+    auto steps = exprs(loop_vars.size());
+    return std::make_unique<Loop>(std::move(loop_vars), std::move(inits),
+                                  child(std::move(condition)),
+                                  std::move(steps));
   }
 
   tokr->set_pos(pos);
   return infix();
 }
 
+/// A `fn` body, which is going to be kept around for longer for e.g. closures
+std::shared_ptr<Ast> Parser::body(void) {
+  if (source) {
+    auto pos = tokr->get_pos();
+    if (auto lazy = lazy_body())
+      return child(std::move(lazy));
+    tokr->set_pos(pos);
+  }
+  return child(expr());
+}
+
+/// Skips a body which is a block, matching braces rather than parsing it, or
+/// gives nullptr if it isn't one
+std::unique_ptr<LazyBody> Parser::lazy_body(void) {
+  try {
+    auto tok = tokr->next_token();
+    if (tok != "{")
+      return nullptr;
+    size_t begin = tok.data() - source->data();
+    for (size_t depth = 1; depth > 0;) {
+      tok = tokr->next_token();
+      if (tok == "{")
+        ++depth;
+      else if (tok == "}")
+        --depth;
+    }
+    size_t end = tok.data() + tok.size() - source->data();
+
+    // The body goes on in e.g. `{ f } x`, `{ x } + 1` or `{ t } . 0`
+    auto pos = tokr->get_pos();
+    try {
+      tok = tokr->next_token();
+      if (tok == "(" || tok == "{" || tok == "." || is_num(tok) ||
+          is_id(tok) || is_binop(tok))
+        return nullptr;
+    } catch (const EofToken &) {
+    }
+    tokr->set_pos(pos);
+    return std::make_unique<LazyBody>(source, begin, end);
+  } catch (const EofToken &) {
+    // Unbalanced, which parsing it will report
+    return nullptr;
+  }
+}
+
 std::unique_ptr<Ast> Parser::statement(void) {
   auto pos = tokr->get_pos();
   std::string_view tok = tokr->next_token();
 
   if (tok == "let") {
+    auto names_pos = tokr->get_pos();
+    if (tokr->next_token() == "(") {
+      tokr->set_pos(names_pos);
+      auto names = pattern();
+      expect("=");
+      auto body = expr();
+      return std::make_unique<Destructure>(std::move(names),
+                                           child(std::move(body)));
+    }
+    tokr->set_pos(names_pos);
     tok = tokr->next_token();
     if (!is_id(tok))
       throw BadToken(std::string(tok));
     auto id = std::make_unique<Identifier>(std::string(tok));
     expect("=");
     auto body = expr();
-    return std::make_unique<Assignment>(std::move(id), std::move(body));
+    return std::make_unique<Assignment>(std::move(id), child(std::move(body)));
   }
 
   tokr->set_pos(pos);
@@ -253,9 +453,49 @@ void Parser::assert_finished(void) {
   throw LeftoverString(std::string(tokr->rest()));
 }
 
-std::vector<std::unique_ptr<Ast>> parse(const std::string &str) {
-  auto parser = Parser(str);
-  auto ast = parser.statements();
-  parser.assert_finished();
+std::vector<std::unique_ptr<Ast>> parse(const std::string &str,
+                                        NodeTable *nodes, bool lazy) {
+  metrics::Timer timer(metrics::Timing::Parse);
+  try {
+    // Lazy bodies keep the source to parse later
+    auto source = lazy ? std::make_shared<const std::string>(str) : nullptr;
+    auto parser = Parser(source ? *source : str, nodes, source);
+    auto ast = parser.statements();
+    parser.assert_finished();
+    for (auto &statement : ast)
+      analyse_escapes(*statement);
+    return ast;
+  } catch (const std::exception &error) {
+    metrics::record_error(error);
+    throw;
+  }
+}
+
+std::vector<std::unique_ptr<Ast>> parse_lines(const std::string &str,
+                                              NodeTable *nodes, bool lazy) {
+  std::vector<std::unique_ptr<Ast>> ast;
+  std::string line;
+  size_t begin = 0;
+  while (begin < str.size()) {
+    auto end = str.find('\n', begin);
+    if (end == std::string::npos)
+      end = str.size();
+    line.assign(str, begin, end - begin);
+    begin = end + 1;
+    if (std::all_of(line.begin(), line.end(),
+                    [](unsigned char c) { return std::isspace(c); }))
+      continue;
+    for (auto &statement : parse(line, nodes, lazy))
+      ast.push_back(std::move(statement));
+  }
   return ast;
 }
+
+const Ast &LazyBody::get(void) const {
+  std::call_once(once, [&] {
+    // A block, so a single statement. Blocks inside it are lazy too.
+    body = std::move(parse(std::string(get_source()), nullptr, true).front());
+    parsed = true;
+  });
+  return *body;
+}
@@ -8,31 +8,56 @@
  *     statements -> statement (";" statement)*.
  *
  *     statement -> "let" id "=" expr.
+ *     statement -> "let" pattern "=" expr.
  *     statement -> expr.
  *
  *     vars -> "(" id ("," id)* ")".
  *     vars -> id
  *
- *     expr -> "fn" vars expr.
+ *     pattern -> "(" id ("," id)+ ")".
+ *     params -> "(" (id | pattern) ("," (id | pattern))* ")".
+ *     params -> id
+ *
+ *     expr -> "fn" params expr.
  *     expr -> "if" expr "then" expr "else" expr.
+ *     expr -> "loop" vars "=" exprs "while" expr "do" exprs.
+ *
+ *     exprs -> "(" expr ("," expr)* ")".   -- one for each of the vars
+ *     exprs -> expr.                       -- if there is only one
  *     expr -> infix.
  *
  *     infix -> app (binop app)*.
  *
  *     binop -> "<" | "==" | ">" | "+" | "-".
  *
- *     app -> infix app?.
+ *     app -> projection app?.
+ *
+ *     projection -> term ("." number)*.
  *
  *     term -> "(" expr ")"
+ *     term -> "(" expr ("," expr)+ ")"     -- a tuple
  *     term -> "{" statements "}"
  *     term -> number
  *     term -> id
  */
 
 #include "ast.hpp"
+#include "nodes.hpp"
 
 #include <memory>
 #include <string>
 #include <vector>
 
-std::vector<std::unique_ptr<Ast>> parse(const std::string &str);
+/// Shares repeated subtrees between each other and with anything else parsed
+/// with `nodes`, if given (see `nodes.hpp`). If `lazy`, `fn` bodies which are
+/// blocks are only parsed when first called (see `LazyBody`), so errors in
+/// them are only reported then, and they are not type-checked.
+std::vector<std::unique_ptr<Ast>> parse(const std::string &str,
+                                        NodeTable *nodes = nullptr,
+                                        bool lazy = false);
+
+/// Parses a script where each line is parsed like a line of the REPL, and the
+/// statements of all lines are concatenated. Blank lines are skipped.
+std::vector<std::unique_ptr<Ast>> parse_lines(const std::string &str,
+                                              NodeTable *nodes = nullptr,
+                                              bool lazy = false);
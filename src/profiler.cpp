@@ -0,0 +1,318 @@
+#include "profiler.hpp"
+#include "formatter.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <unordered_set>
+
+#include <pthread.h>
+#include <unistd.h>
+
+// Older glibcs don't name the field
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+namespace {
+
+/// Ids of the pseudo-functions standing for the calls beyond the evaluator's
+/// SAMPLED_CALLS, and for bodies made before the profiler was attached
+const size_t TRUNCATED = 0;
+const size_t UNKNOWN = 1;
+
+/// How unnamed functions are printed in the reports
+const FmtLimits LABEL_LIMITS = {4, 40};
+
+/// The profiler the SIGPROF handler samples for, if any
+std::atomic<Profiler *> running_profiler = nullptr;
+
+void on_sigprof(int) {
+  if (auto profiler = running_profiler.load(std::memory_order_relaxed))
+    profiler->sample();
+}
+
+/// Installs the handler once, and leaves it, as a SIGPROF still pending when
+/// a profiler stops would otherwise kill the process
+bool install_handler(void) {
+  struct sigaction action = {};
+  action.sa_handler = on_sigprof;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  return sigaction(SIGPROF, &action, nullptr) == 0;
+}
+
+/// Blocks SIGPROF on this thread while in scope
+struct BlockProfiling {
+  BlockProfiling(void) {
+    sigset_t prof;
+    sigemptyset(&prof);
+    sigaddset(&prof, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &prof, &previous);
+  }
+  ~BlockProfiling() { pthread_sigmask(SIG_SETMASK, &previous, nullptr); }
+
+private:
+  sigset_t previous;
+};
+
+std::string percent(uint64_t n, uint64_t total) {
+  char text[16];
+  std::snprintf(text, sizeof(text), "%5.1f%%",
+                total ? 100.0 * double(n) / double(total) : 0.0);
+  return text;
+}
+
+} // namespace
+
+ProfilerError::ProfilerError(std::string message)
+    : message(std::move(message)) {}
+
+const char *ProfilerError::what(void) const noexcept { return message.c_str(); }
+
+Profiler::Profiler(EvalVisitor &evaluator)
+    : evaluator(evaluator), timer(), running(false), buffer(PROFILER_BUFFER),
+      used(0), last(SIZE_MAX), dropped(0),
+      functions({{{}, nullptr, "[...]"}, {{}, nullptr, "[unknown]"}}),
+      samples(0) {
+  // Breadth first, so that closures are named after their top-level
+  // bindings rather than those in other closures' environments
+  auto environment = evaluator.get_environment();
+  std::deque<std::pair<const Value *, const std::string *>> pending;
+  std::unordered_set<const Value *> seen;
+  for (auto &[name, value] : environment)
+    pending.push_back({value.get(), &*name});
+  while (!pending.empty()) {
+    auto [value, name] = pending.front();
+    pending.pop_front();
+    if (!seen.insert(value).second)
+      continue;
+    if (auto closure = dynamic_cast<const ClosureValue *>(value)) {
+      add(closure->get_args(), closure->get_body());
+      auto &function = functions[ids[closure->get_body().get()]];
+      if (function.name.empty() && name)
+        function.name = *name;
+      for (auto &[inner, inner_value] : closure->get_environment())
+        pending.push_back({inner_value.get(), &*inner});
+    } else if (auto tuple = dynamic_cast<const TupleValue *>(value)) {
+      for (size_t i = 0; i < tuple->size(); ++i)
+        pending.push_back({tuple->get(i).get(), nullptr});
+    }
+  }
+  evaluator.set_profiler(this);
+}
+
+Profiler::~Profiler() {
+  stop();
+  evaluator.set_profiler(nullptr);
+}
+
+void Profiler::start(unsigned hz) {
+  if (hz == 0 || hz > 1000000)
+    throw ProfilerError("Sampling rate out of range");
+  static const bool installed = install_handler();
+  if (!installed)
+    throw ProfilerError("Cannot handle SIGPROF");
+  Profiler *none = nullptr;
+  if (!running_profiler.compare_exchange_strong(none, this))
+    throw ProfilerError("Another profiler is running");
+
+  struct sigevent event = {};
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = SIGPROF;
+  event.sigev_notify_thread_id = gettid();
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer) != 0) {
+    running_profiler.store(nullptr);
+    throw ProfilerError(std::string("Cannot make a timer: ") +
+                        std::strerror(errno));
+  }
+  long interval = 1000000000L / hz;
+  struct itimerspec spec = {};
+  spec.it_interval.tv_sec = interval / 1000000000L;
+  spec.it_interval.tv_nsec = interval % 1000000000L;
+  spec.it_value = spec.it_interval;
+  timer_settime(timer, 0, &spec, nullptr);
+  running = true;
+}
+
+void Profiler::stop(void) {
+  if (!running)
+    return;
+  timer_delete(timer);
+  running_profiler.store(nullptr);
+  running = false;
+}
+
+bool Profiler::is_running(void) const { return running; }
+
+void Profiler::sample(void) {
+  const Ast *bodies[SAMPLED_CALLS];
+  size_t depth = evaluator.get_calls(bodies);
+  size_t kept = std::min<size_t>(depth, SAMPLED_CALLS);
+  auto same = [&](size_t at) {
+    if (buffer[at + 1] != depth)
+      return false;
+    for (size_t i = 0; i < kept; ++i) {
+      if (buffer[at + 2 + i] != reinterpret_cast<uintptr_t>(bodies[i]))
+        return false;
+    }
+    return true;
+  };
+  if (last != SIZE_MAX && same(last)) {
+    ++buffer[last];
+    return;
+  }
+
+  size_t at = used.load(std::memory_order_relaxed);
+  if (buffer.size() - at < kept + 2) {
+    ++dropped;
+    return;
+  }
+  buffer[at] = 1;
+  buffer[at + 1] = depth;
+  for (size_t i = 0; i < kept; ++i)
+    buffer[at + 2 + i] = reinterpret_cast<uintptr_t>(bodies[i]);
+  last = at;
+  used.store(at + 2 + kept, std::memory_order_relaxed);
+}
+
+void Profiler::drain(void) {
+  if (used.load(std::memory_order_relaxed) == 0)
+    return;
+  BlockProfiling block;
+  size_t end = used.load(std::memory_order_relaxed);
+  std::vector<size_t> stack;
+  for (size_t at = 0; at < end;) {
+    auto count = buffer[at];
+    auto depth = buffer[at + 1];
+    size_t kept = std::min<size_t>(depth, SAMPLED_CALLS);
+    stack.clear();
+    if (depth > kept)
+      stack.push_back(TRUNCATED);
+    // The bodies of functions made before the profiler was attached may be
+    // gone, so are only compared, never followed
+    for (size_t i = 0; i < kept; ++i) {
+      auto it = ids.find(reinterpret_cast<const Ast *>(buffer[at + 2 + i]));
+      stack.push_back(it == ids.end() ? UNKNOWN : it->second);
+    }
+    stacks[stack] += count;
+    samples += count;
+    at += 2 + kept;
+  }
+  used.store(0, std::memory_order_relaxed);
+  last = SIZE_MAX;
+}
+
+void Profiler::add(const std::vector<Identifier> &args,
+                   const std::shared_ptr<Ast> &body) {
+  auto [it, added] = ids.try_emplace(body.get(), functions.size());
+  if (added)
+    functions.push_back({args, body, ""});
+}
+
+void Profiler::name(const Ast &body, const Identifier &name) {
+  auto it = ids.find(&body);
+  if (it != ids.end())
+    functions[it->second].name = *name;
+}
+
+uint64_t Profiler::get_samples(void) {
+  drain();
+  return samples;
+}
+
+uint64_t Profiler::get_dropped(void) {
+  BlockProfiling block;
+  return dropped;
+}
+
+std::string Profiler::label(size_t id) const {
+  auto &function = functions[id];
+  if (!function.name.empty())
+    return function.name;
+  std::string text;
+  FmtAst formatter([&](std::string_view str) { text += str; }, LABEL_LIMITS);
+  formatter.format_fn(function.args, function.body);
+  // `;` separates the functions of a collapsed stack
+  std::replace(text.begin(), text.end(), ';', ',');
+  return text;
+}
+
+std::string Profiler::top(size_t n) {
+  drain();
+  std::vector<uint64_t> self(functions.size()), total(functions.size());
+  uint64_t top_level = 0;
+  std::vector<size_t> distinct;
+  for (auto &[stack, count] : stacks) {
+    if (stack.empty()) {
+      top_level += count;
+      continue;
+    }
+    self[stack.back()] += count;
+    // Recursive functions count once per sample
+    distinct = stack;
+    std::sort(distinct.begin(), distinct.end());
+    distinct.erase(std::unique(distinct.begin(), distinct.end()),
+                   distinct.end());
+    for (auto id : distinct)
+      total[id] += count;
+  }
+
+  struct Row {
+    uint64_t self, total;
+    std::string function;
+  };
+  std::vector<Row> rows;
+  if (top_level)
+    rows.push_back({top_level, samples, "[top level]"});
+  for (size_t id = 0; id < functions.size(); ++id) {
+    if (total[id])
+      rows.push_back({self[id], total[id], label(id)});
+  }
+  std::stable_sort(rows.begin(), rows.end(), [](auto &a, auto &b) {
+    return a.self != b.self ? a.self > b.self : a.total > b.total;
+  });
+  if (rows.size() > n)
+    rows.resize(n);
+
+  std::string table = std::to_string(samples) + " samples";
+  if (auto lost = get_dropped())
+    table += ", " + std::to_string(lost) + " dropped";
+  table += "\n  self   total  function\n";
+  for (auto &row : rows) {
+    table += percent(row.self, samples) + "  " + percent(row.total, samples) +
+             "  " + row.function + "\n";
+  }
+  return table;
+}
+
+std::string Profiler::collapsed(void) {
+  drain();
+  std::vector<std::string> labels(functions.size());
+  std::string text;
+  for (auto &[stack, count] : stacks) {
+    if (stack.empty())
+      text += "[top level]";
+    for (size_t i = 0; i < stack.size(); ++i) {
+      auto &label = labels[stack[i]];
+      if (label.empty())
+        label = this->label(stack[i]);
+      if (i)
+        text += ";";
+      text += label;
+    }
+    text += " " + std::to_string(count) + "\n";
+  }
+  return text;
+}
+
+void Profiler::clear(void) {
+  drain();
+  BlockProfiling block;
+  stacks.clear();
+  samples = 0;
+  dropped = 0;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+/** \file
+ * \brief A sampling profiler for scripts, e.g.
+ *
+ *     Profiler profiler(evaluator);
+ *     profiler.start(1000);
+ *     evaluator.evaluate(*program);
+ *     std::cerr << profiler.top(10);
+ *     std::ofstream("stacks.txt") << profiler.collapsed();
+ *
+ * A timer interrupts the thread that started the profiler with SIGPROF each
+ * millisecond of its CPU time, and the handler copies the evaluator's stack
+ * of closure bodies being applied (see `EvalVisitor::get_calls`) into a
+ * preallocated buffer, without allocating or locking. After each top-level
+ * statement, the evaluator drains the buffer into counts per stack.
+ *
+ * Functions are named by the `let` that bound them, and otherwise printed
+ * (shortened) with FmtAst. The profiler keeps the bodies of the functions
+ * made while it is attached alive, so that they can still be printed after
+ * the statements that made them are gone. `collapsed` gives the stacks in
+ * the format of Brendan Gregg's `flamegraph.pl`.
+ */
+
+#include "ast.hpp"
+#include "eval.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <exception>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// The sample buffer, in words, which holds a few seconds of samples of the
+/// deepest stacks before the evaluator drains it
+#define PROFILER_BUFFER (1 << 20)
+
+struct ProfilerError : std::exception {
+  ProfilerError(std::string message);
+  const char *what(void) const noexcept override;
+
+private:
+  std::string message;
+};
+
+struct Profiler {
+  /// Attaches to `evaluator`, in place of any other profiler, naming the
+  /// closures already in its environment. The evaluator has to outlive it.
+  Profiler(EvalVisitor &evaluator);
+  Profiler(const Profiler &) = delete;
+  Profiler &operator=(const Profiler &) = delete;
+  ~Profiler();
+
+  /// Starts sampling `hz` times a second of this thread's CPU time. This has
+  /// to be the thread the evaluator runs on, and only one profiler in the
+  /// process can be running. Throws ProfilerError if the timer can't be
+  /// made.
+  void start(unsigned hz = 1000);
+  void stop(void);
+  bool is_running(void) const;
+
+  /// Records the evaluator's stack now, as the timer's signal handler does.
+  /// Only call it directly while the profiler isn't running.
+  void sample(void);
+  /// Counts the samples taken since the last drain, on the profiled thread
+  void drain(void);
+
+  /// Keeps a function's body alive, so samples of it can be printed
+  void add(const std::vector<Identifier> &args,
+           const std::shared_ptr<Ast> &body);
+  /// Names the function with `body` after the binding it was assigned to
+  void name(const Ast &body, const Identifier &name);
+
+  /// The samples counted so far, and those lost to a full buffer
+  uint64_t get_samples(void);
+  uint64_t get_dropped(void);
+  /// A table of the `n` functions with the most samples, with the percentage
+  /// of samples they were running in (self) or on the stack (total)
+  std::string top(size_t n);
+  /// Each stack sampled, outermost function first and separated by `;`,
+  /// then the number of samples, one per line
+  std::string collapsed(void);
+  /// Forgets the samples counted so far
+  void clear(void);
+
+private:
+  struct Function {
+    std::vector<Identifier> args;
+    std::shared_ptr<Ast> body;
+    std::string name;
+  };
+
+  /// How `functions[id]` is printed in the reports
+  std::string label(size_t id) const;
+
+  EvalVisitor &evaluator;
+  timer_t timer;
+  bool running;
+
+  /// Each sample is its count, the evaluator's depth, and then the bodies
+  /// the evaluator kept. A sample like the last is counted in the last.
+  std::vector<uintptr_t> buffer;
+  std::atomic<size_t> used;
+  size_t last;
+  uint64_t dropped;
+
+  /// Indexed by id, with the first two for truncated stacks and unknown
+  /// functions
+  std::vector<Function> functions;
+  std::unordered_map<const Ast *, size_t> ids;
+  /// By stack of function ids, outermost first
+  std::map<std::vector<size_t>, uint64_t> stacks;
+  uint64_t samples;
+};
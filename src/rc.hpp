@@ -0,0 +1,121 @@
+#pragma once
+
+/** \file
+ * \brief Intrusive reference counting for values. The count lives in the
+ * object (see RefCounted), so an `Rc` is one pointer and making an object is
+ * one allocation, and the count is updated with plain increments unless the
+ * object has been shared with other threads:
+ *
+ *     Rc<NumberValue> n = make_rc<NumberValue>(1);
+ *     Rc<Value> v = n;                             // Not atomic
+ *     v->share();                                  // From now on, atomic
+ *
+ * `share` has to be called on the thread that made the object, before any
+ * other thread can reach it (e.g. before starting the threads), and marks
+ * everything the object refers to as well.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+/// A base for objects held by `Rc`
+struct RefCounted {
+  RefCounted(void) : count(0), shared(false) {}
+  // Copies are new objects, with no references yet
+  RefCounted(const RefCounted &) : count(0), shared(false) {}
+  RefCounted &operator=(const RefCounted &) { return *this; }
+  virtual ~RefCounted() = default;
+
+  /// Makes the count atomic, for this object and (through `share_members`)
+  /// the objects it refers to
+  void share(void) const {
+    if (shared)
+      return;
+    shared = true;
+    share_members();
+  }
+  bool is_shared(void) const { return shared; }
+
+  void retain(void) const {
+    if (shared) [[unlikely]]
+      std::atomic_ref(count).fetch_add(1, std::memory_order_relaxed);
+    else
+      ++count;
+  }
+  /// Deletes the object with the last reference
+  void release(void) const {
+    if (shared) [[unlikely]] {
+      if (std::atomic_ref(count).fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete this;
+    } else if (--count == 0) {
+      delete this;
+    }
+  }
+
+protected:
+  /// Shares the objects this one holds references to
+  virtual void share_members(void) const {}
+
+private:
+  alignas(std::atomic_ref<uint32_t>::required_alignment) mutable uint32_t
+      count;
+  mutable bool shared;
+};
+
+/// A reference to a RefCounted `T`, with the parts of `std::shared_ptr`'s
+/// interface the evaluator uses
+template <typename T> struct Rc {
+  Rc(void) : ptr(nullptr) {}
+  Rc(std::nullptr_t) : ptr(nullptr) {}
+  /// Takes a reference to an object, which may already have others
+  explicit Rc(T *ptr) : ptr(ptr) {
+    if (ptr)
+      ptr->retain();
+  }
+  Rc(const Rc &other) : Rc(other.ptr) {}
+  Rc(Rc &&other) noexcept : ptr(std::exchange(other.ptr, nullptr)) {}
+  template <typename U> Rc(const Rc<U> &other) : Rc(other.get()) {}
+  template <typename U>
+  Rc(Rc<U> &&other) noexcept : ptr(other.release_ownership()) {}
+  ~Rc() {
+    if (ptr)
+      ptr->release();
+  }
+
+  Rc &operator=(Rc other) noexcept {
+    std::swap(ptr, other.ptr);
+    return *this;
+  }
+
+  T *get(void) const { return ptr; }
+  T &operator*(void) const { return *ptr; }
+  T *operator->(void) const { return ptr; }
+  explicit operator bool(void) const { return ptr != nullptr; }
+  void reset(void) { Rc().swap(*this); }
+  void swap(Rc &other) noexcept { std::swap(ptr, other.ptr); }
+
+  /// Gives up the reference without releasing it, for moves between types
+  T *release_ownership(void) { return std::exchange(ptr, nullptr); }
+
+  template <typename U> bool operator==(const Rc<U> &other) const {
+    return ptr == other.get();
+  }
+  bool operator==(std::nullptr_t) const { return ptr == nullptr; }
+
+private:
+  T *ptr;
+};
+
+template <typename T, typename... Args> Rc<T> make_rc(Args &&...args) {
+  return Rc<T>(new T(std::forward<Args>(args)...));
+}
+
+template <typename T, typename U> Rc<T> dynamic_pointer_cast(const Rc<U> &rc) {
+  return Rc<T>(dynamic_cast<T *>(rc.get()));
+}
+
+template <typename T, typename U> Rc<T> static_pointer_cast(const Rc<U> &rc) {
+  return Rc<T>(static_cast<T *>(rc.get()));
+}
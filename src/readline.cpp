@@ -1,24 +1,35 @@
 #include "readline.hpp"
 
+#include <cstdlib>
+
 extern "C" {
 #include <readline/history.h>
 #include <readline/readline.h>
 }
 
-Readline::Readline() : buffer(nullptr) {
-  using_history();
-  read_history(HISTORY_FILE);
-}
+Readline::Readline(int fd, std::string history)
+    : history(std::move(history)),
+      interactive(fd == STDIN_FILENO && isatty(fd)), buffer(nullptr),
+      reader(fd) {}
+
+Readline::~Readline() { std::free(buffer); }
 
 std::optional<std::string> Readline::read(const std::string &prompt) {
-  if (buffer)
-    std::free(buffer);
+  if (!interactive)
+    return reader.read();
+
+  if (!writer) {
+    using_history();
+    stifle_history(HISTORY_LINES);
+    for (auto &line : load_history(history))
+      add_history(line.c_str());
+    writer.emplace(history);
+  }
+  std::free(buffer);
   buffer = readline(prompt.c_str());
-  if (buffer) {
-    add_history(buffer);
-    write_history(HISTORY_FILE);
-    return std::string(buffer);
-  } else {
+  if (!buffer)
     return std::nullopt;
-  }
+  add_history(buffer);
+  writer->append(buffer);
+  return std::string(buffer);
 }
@@ -1,18 +1,34 @@
 #pragma once
 
 /** \file
- * \brief Wraps readline for line-editing and history capabilities.
+ * \brief Wraps readline for line-editing and history capabilities, when the
+ * input is a terminal. Other input is read a buffer at a time, without
+ * prompts or history.
  */
 
+#include "history.hpp"
+
 #include <optional>
 #include <string>
 
+#include <unistd.h>
+
 #define HISTORY_FILE ".tiny-interp-history"
 
 struct Readline {
-  Readline();
+  /// Uses readline if `fd` is stdin and a terminal. The history is loaded
+  /// when the first line is read.
+  Readline(int fd = STDIN_FILENO, std::string history = HISTORY_FILE);
+  Readline(const Readline &) = delete;
+  Readline &operator=(const Readline &) = delete;
+  ~Readline();
   std::optional<std::string> read(const std::string &prompt);
 
 private:
+  std::string history;
+  bool interactive;
   char *buffer;
+  LineReader reader;
+  /// Made with the first line read interactively
+  std::optional<HistoryWriter> writer;
 };
@@ -0,0 +1,249 @@
+#include "replay.hpp"
+#include "formatter.hpp"
+#include "parser.hpp"
+#include "serialise.hpp"
+
+#include <algorithm>
+#include <sstream>
+#include <string_view>
+#include <thread>
+
+/// A line has regressed if it takes this many times as long as captured...
+#define REGRESSION_RATIO 1.5
+/// ...and at least this much longer, so that timer noise on quick lines
+/// doesn't count
+#define REGRESSION_MIN_NS 50000
+
+namespace {
+
+const char MAGIC[4] = {'T', 'I', 'L', 'G'};
+
+void put_varint(std::string &out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(char((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out.push_back(char(value));
+}
+
+template <typename T> void put_fixed(std::string &out, T value) {
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    out.push_back(char((value >> (8 * i)) & 0xff));
+  }
+}
+
+uint64_t nanoseconds(std::chrono::nanoseconds duration) {
+  return std::max<int64_t>(duration.count(), 0);
+}
+
+struct Reader {
+  Reader(std::string_view data) : data(data), pos(0) {}
+
+  bool done(void) const { return pos == data.size(); }
+
+  uint8_t byte(void) {
+    if (pos >= data.size())
+      throw BadLog("truncated");
+    return uint8_t(data[pos++]);
+  }
+
+  uint64_t varint(void) {
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      uint8_t b = byte();
+      value |= uint64_t(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        return value;
+    }
+    throw BadLog("bad varint");
+  }
+
+  template <typename T> T fixed(void) {
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); ++i)
+      value |= T(byte()) << (8 * i);
+    return value;
+  }
+
+  std::string string(void) {
+    auto length = varint();
+    if (length > data.size() - pos)
+      throw BadLog("truncated");
+    std::string str(data.substr(pos, length));
+    pos += length;
+    return str;
+  }
+
+  std::string_view data;
+  size_t pos;
+};
+
+/// What the REPL prints for the session's last value
+uint64_t hash_result(const Session &session) {
+  auto value = session.get_last();
+  if (!value)
+    return 0;
+  std::string text;
+  auto output = [&](std::string_view str) { text += str; };
+  FmtAst ast_formatter(output);
+  FmtValue value_formatter(ast_formatter, output);
+  value->accept(value_formatter);
+  return hash_source(text);
+}
+
+std::string describe(const std::optional<metrics::Error> &error) {
+  return error ? metrics::name(*error) : "no error";
+}
+
+double milliseconds(std::chrono::nanoseconds duration) {
+  return double(duration.count()) / 1e6;
+}
+
+} // namespace
+
+BadLog::BadLog(std::string message)
+    : message("Bad session log: " + message) {}
+
+const char *BadLog::what(void) const noexcept { return message.c_str(); }
+
+LogWriter::LogWriter(const std::string &path)
+    : file(path, std::ios::binary | std::ios::trunc) {
+  std::string header(MAGIC, sizeof(MAGIC));
+  put_fixed<uint32_t>(header, REPLAY_VERSION);
+  file.write(header.data(), header.size());
+  file.flush();
+  if (!file)
+    throw BadLog("cannot write " + path);
+}
+
+void LogWriter::write(const Record &record) {
+  std::string out;
+  put_varint(out, record.line.size());
+  out += record.line;
+  put_varint(out, nanoseconds(record.at));
+  put_varint(out, nanoseconds(record.parse));
+  put_varint(out, nanoseconds(record.eval));
+  put_fixed<uint64_t>(out, record.result);
+  out.push_back(char(record.error ? size_t(*record.error) + 1 : 0));
+  file.write(out.data(), out.size());
+  file.flush();
+}
+
+std::vector<Record> read_log(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    throw BadLog("cannot open " + path);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  auto data = contents.str();
+
+  Reader reader(data);
+  for (char c : MAGIC) {
+    if (char(reader.byte()) != c)
+      throw BadLog("bad magic");
+  }
+  if (reader.fixed<uint32_t>() != REPLAY_VERSION)
+    throw BadLog("version mismatch");
+
+  std::vector<Record> log;
+  while (!reader.done()) {
+    Record record;
+    record.line = reader.string();
+    record.at = std::chrono::nanoseconds(reader.varint());
+    record.parse = std::chrono::nanoseconds(reader.varint());
+    record.eval = std::chrono::nanoseconds(reader.varint());
+    record.result = reader.fixed<uint64_t>();
+    auto error = reader.byte();
+    if (error > size_t(metrics::Error::Count))
+      throw BadLog("bad error type");
+    if (error != 0)
+      record.error = metrics::Error(error - 1);
+    log.push_back(std::move(record));
+  }
+  return log;
+}
+
+Record run_line(Session &session, const std::string &line,
+                std::ostream &errors, bool hash) {
+  Record record;
+  auto start = std::chrono::steady_clock::now();
+  auto parsed = start;
+  try {
+    auto tree = parse(line);
+    parsed = std::chrono::steady_clock::now();
+    record.parse = parsed - start;
+    for (auto &node : tree) {
+      for (auto &failure : session.run(std::move(node))) {
+        errors << "Could not recompute " << failure.name << ": "
+               << failure.message << std::endl;
+      }
+    }
+    record.eval = std::chrono::steady_clock::now() - parsed;
+  } catch (const std::exception &e) {
+    auto now = std::chrono::steady_clock::now();
+    if (parsed == start)
+      record.parse = now - start;
+    else
+      record.eval = now - parsed;
+    record.error = metrics::classify(e);
+    errors << e.what() << std::endl;
+    return record;
+  }
+  if (hash)
+    record.result = hash_result(session);
+  return record;
+}
+
+std::vector<Replayed> replay(const std::vector<Record> &log, bool paced,
+                             EvalLimits limits) {
+  Session session;
+  session.get_evaluator().set_limits(limits);
+  // Discards the errors, which are compared instead
+  std::ostringstream errors;
+  std::vector<Replayed> replayed;
+  replayed.reserve(log.size());
+
+  auto start = std::chrono::steady_clock::now();
+  for (auto &record : log) {
+    if (paced)
+      std::this_thread::sleep_until(start + record.at);
+    auto at = std::chrono::steady_clock::now() - start;
+    metrics::add(metrics::Counter::Inputs);
+    replayed.push_back({record, run_line(session, record.line, errors)});
+    replayed.back().replayed.line = record.line;
+    replayed.back().replayed.at = at;
+    errors.str("");
+  }
+  return replayed;
+}
+
+bool report(const std::vector<Replayed> &replayed, std::ostream &out) {
+  size_t mismatches = 0, regressions = 0;
+  std::chrono::nanoseconds captured_total{0}, replayed_total{0};
+  for (size_t i = 0; i < replayed.size(); ++i) {
+    auto &[before, after] = replayed[i];
+    if (before.error != after.error) {
+      out << "line " << i + 1 << ": " << describe(before.error)
+          << " when captured, " << describe(after.error) << " now: "
+          << before.line << "\n";
+      ++mismatches;
+    } else if (before.result != after.result) {
+      out << "line " << i + 1 << ": result differs: " << before.line << "\n";
+      ++mismatches;
+    }
+
+    auto was = before.parse + before.eval, is = after.parse + after.eval;
+    captured_total += was;
+    replayed_total += is;
+    if (double(is.count()) > REGRESSION_RATIO * double(was.count()) &&
+        (is - was).count() >= REGRESSION_MIN_NS) {
+      out << "line " << i + 1 << ": " << milliseconds(was) << "ms -> "
+          << milliseconds(is) << "ms: " << before.line << "\n";
+      ++regressions;
+    }
+  }
+  out << replayed.size() << " lines, " << mismatches << " mismatched, "
+      << regressions << " slower; " << milliseconds(captured_total)
+      << "ms when captured, " << milliseconds(replayed_total) << "ms now\n";
+  return mismatches == 0;
+}
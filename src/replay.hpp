@@ -0,0 +1,93 @@
+#pragma once
+
+/** \file
+ * \brief Captures REPL sessions to a log, and replays them to check that a
+ * change to the interpreter keeps their results and doesn't slow them down,
+ * e.g.
+ *
+ *     $ tiny-interp --capture session.log
+ *     $ tiny-interp --replay session.log
+ *
+ * Each line is logged with when it was read, how long it took to parse and
+ * to evaluate, a hash of its result and the type of error it threw, if any.
+ * Replaying runs the lines in a fresh session, as fast as possible or (with
+ * `--paced`) at the pace they were read, and reports lines whose results or
+ * errors differ, and lines that are much slower than when captured.
+ *
+ * The format is (integers little-endian, "varint" is LEB128)
+ *
+ *     log      -> "TILG" version:u32 record*
+ *     record   -> length:varint byte* at:varint parse:varint eval:varint
+ *                 result:u64 error:u8
+ *
+ * with times in nanoseconds, and `error` 0 for none or one more than a
+ * `metrics::Error`.
+ */
+
+#include "eval.hpp"
+#include "metrics.hpp"
+#include "session.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#define REPLAY_VERSION 3
+
+struct BadLog : std::exception {
+  BadLog(std::string message);
+  const char *what(void) const noexcept override;
+
+private:
+  std::string message;
+};
+
+struct Record {
+  std::string line;
+  /// Since the session started
+  std::chrono::nanoseconds at{0};
+  std::chrono::nanoseconds parse{0};
+  std::chrono::nanoseconds eval{0};
+  /// Hash of the printed result, or 0 if there was none
+  uint64_t result = 0;
+  std::optional<metrics::Error> error;
+};
+
+/// Appends records to a log, flushing each so a crashed session keeps them
+struct LogWriter {
+  /// Truncates the file. Throws BadLog if it cannot be opened.
+  LogWriter(const std::string &path);
+
+  void write(const Record &record);
+
+private:
+  std::ofstream file;
+};
+
+/// Throws BadLog if the file is missing, truncated or of another version
+std::vector<Record> read_log(const std::string &path);
+
+/// Parses and evaluates a REPL line, reporting errors and bindings that could
+/// not be recomputed to `errors`. The result is only hashed if `hash`, as
+/// formatting it costs time. `line` and `at` are left for the caller.
+Record run_line(Session &session, const std::string &line,
+                std::ostream &errors, bool hash = true);
+
+struct Replayed {
+  const Record &captured;
+  Record replayed;
+};
+
+/// Runs the lines in a fresh session, sleeping until each was read if
+/// `paced`. Errors are expected, so are not printed.
+std::vector<Replayed> replay(const std::vector<Record> &log, bool paced,
+                             EvalLimits limits = {});
+
+/// Writes the lines whose results or errors differ, the regressions and
+/// totals, and returns whether all the results and errors matched
+bool report(const std::vector<Replayed> &replayed, std::ostream &out);
@@ -0,0 +1,536 @@
+#pragma once
+
+/** \file
+ * \brief The runtime for scripts compiled to C++ (see `codegen.hpp`). It is
+ * header-only and depends on nothing else in the interpreter but
+ * `integer.hpp`, so a compiled script builds with just
+ *
+ *     c++ -std=c++20 -O2 -I src script.cpp -o script
+ *
+ * Values are numbers (an `Integer`, unboxed unless it is a bignum), packed
+ * arrays of 32-bit numbers, tuples,
+ * functions or nothing. Closures are structs generated for each `fn`,
+ * holding only the variables it captures, see `Closure`. The builtins are
+ * those of the standard registry, with the same errors, raised as `Error`s
+ * with the interpreter's messages.
+ *
+ * A call in tail position doesn't call: it returns a `Tail` value, and
+ * `call` loops, so tail recursion (such as `( self self ) ( n - 1 )`) runs in
+ * constant stack.
+ */
+
+#include "integer.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace tiny {
+
+struct Error : std::exception {
+  Error(const char *message) : message(message) {}
+  const char *what(void) const noexcept override { return message; }
+
+private:
+  const char *message;
+};
+
+inline const char *const NOT_A_NUMBER = "Value is not a number";
+inline const char *const NOT_A_FUNCTION = "Value is not a function";
+inline const char *const UNKNOWN_VARIABLE = "Unknown variable";
+inline const char *const NOT_AN_ARRAY = "Value is not an array";
+inline const char *const INDEX_OUT_OF_RANGE = "Index out of range";
+inline const char *const LENGTH_MISMATCH = "Arrays have different lengths";
+inline const char *const DIVISION_BY_ZERO = "Division by zero";
+inline const char *const NOT_A_TUPLE = "Value is not a tuple of that size";
+inline const char *const NUMBER_OUT_OF_RANGE = "Number out of range";
+
+struct Object {
+  virtual ~Object() = default;
+};
+
+struct Array : Object {
+  Array(std::vector<uint32_t> values) : values(std::move(values)) {}
+
+  const std::vector<uint32_t> values;
+};
+
+struct Tuple;
+struct Function;
+
+struct Value {
+  enum class Kind : uint8_t {
+    /// The value of an empty block
+    Nothing,
+    /// A variable that no `let` has bound yet
+    Unbound,
+    Number,
+    Array,
+    Tuple,
+    Function,
+    /// Returned by a function making a tail call, see `tail`
+    Tail
+  };
+
+  Value() : kind(Kind::Nothing), number(0) {}
+  Value(int64_t number) : kind(Kind::Number), number(number) {}
+  Value(Integer number) : kind(Kind::Number), number(std::move(number)) {}
+  Value(std::shared_ptr<const Array> array)
+      : kind(Kind::Array), number(0), object(std::move(array)) {}
+  Value(std::shared_ptr<const Tuple> tuple);
+  Value(std::shared_ptr<const Function> function);
+
+  static Value unbound(void) { return Value(Kind::Unbound); }
+  static Value tail(void) { return Value(Kind::Tail); }
+
+  const Array &array(void) const {
+    return static_cast<const Array &>(*object);
+  }
+  const Tuple &tuple(void) const;
+  const Function &function(void) const;
+
+  Kind kind;
+  Integer number;
+  std::shared_ptr<const Object> object;
+
+private:
+  Value(Kind kind) : kind(kind), number(0) {}
+};
+
+/// A tuple, with its fields inline in the object as in the interpreter
+struct Tuple : Object {
+  Tuple(const Value *fields, size_t size) : fields(fields), size(size) {}
+
+  const Value *const fields;
+  const size_t size;
+};
+
+template <size_t N> struct InlineTuple : Tuple {
+  InlineTuple(std::array<Value, N> values)
+      : Tuple(storage.data(), N), storage(std::move(values)) {}
+  // The base points into `storage`
+  InlineTuple(const InlineTuple &) = delete;
+
+  const std::array<Value, N> storage;
+};
+
+inline Value::Value(std::shared_ptr<const Tuple> tuple)
+    : kind(Kind::Tuple), number(0), object(std::move(tuple)) {}
+
+inline const Tuple &Value::tuple(void) const {
+  return static_cast<const Tuple &>(*object);
+}
+
+/// A call in progress: the function being applied and its argument, which
+/// the function replaces to make a tail call
+struct Call {
+  Value function;
+  Value arg;
+};
+
+struct Function : Object {
+  /// Applies the function to `call.arg`, or returns `Value::tail()` having
+  /// set `call` to the call to make instead
+  virtual Value apply(Call &call) const = 0;
+  /// As the interpreter prints it
+  virtual void format(std::string &out) const = 0;
+};
+
+inline Value::Value(std::shared_ptr<const Function> function)
+    : kind(Kind::Function), number(0), object(std::move(function)) {}
+
+inline const Function &Value::function(void) const {
+  return static_cast<const Function &>(*object);
+}
+
+inline void format(const Value &value, std::string &out) {
+  switch (value.kind) {
+  case Value::Kind::Number:
+    out += value.number.to_string();
+    break;
+  case Value::Kind::Array: {
+    out += "[ ";
+    bool first = true;
+    for (auto n : value.array().values) {
+      if (!first)
+        out += " , ";
+      first = false;
+      out += std::to_string(n);
+    }
+    out += first ? "]" : " ]";
+    break;
+  }
+  case Value::Kind::Tuple: {
+    auto &tuple = value.tuple();
+    out += "( ";
+    for (size_t i = 0; i < tuple.size; ++i) {
+      if (i > 0)
+        out += " , ";
+      format(tuple.fields[i], out);
+    }
+    out += " )";
+    break;
+  }
+  case Value::Kind::Function:
+    value.function().format(out);
+    break;
+  default:
+    break;
+  }
+}
+
+inline Value unknown(void) { throw Error(UNKNOWN_VARIABLE); }
+
+/// Reads a variable which may not have been bound
+inline const Value &read(const Value &value) {
+  if (value.kind == Value::Kind::Unbound) [[unlikely]]
+    throw Error(UNKNOWN_VARIABLE);
+  return value;
+}
+
+/// As for `if`: anything but the number 0 is true
+inline bool truthy(const Value &value) {
+  return value.kind != Value::Kind::Number || bool(value.number);
+}
+
+inline const Integer &number(const Value &value) {
+  if (value.kind != Value::Kind::Number) [[unlikely]]
+    throw Error(NOT_A_NUMBER);
+  return value.number;
+}
+
+/// Of a number which has to fit in `T`
+template <typename T> T checked(const Integer &n) {
+  if (!n.fits<T>()) [[unlikely]]
+    throw Error(NUMBER_OUT_OF_RANGE);
+  return T(n.small());
+}
+
+inline const std::vector<uint32_t> &array(const Value &value) {
+  if (value.kind != Value::Kind::Array) [[unlikely]]
+    throw Error(NOT_AN_ARRAY);
+  return value.array().values;
+}
+
+template <typename... Fields> Value tuple(Fields... fields) {
+  constexpr size_t N = sizeof...(Fields);
+  return Value(std::shared_ptr<const Tuple>(std::make_shared<
+                                            const InlineTuple<N>>(
+      std::array<Value, N>{std::move(fields)...})));
+}
+
+/// Checks a tuple has `size` fields, if that is not 0
+inline const Tuple &as_tuple(const Value &value, size_t size = 0) {
+  if (value.kind != Value::Kind::Tuple ||
+      (size != 0 && value.tuple().size != size)) [[unlikely]]
+    throw Error(NOT_A_TUPLE);
+  return value.tuple();
+}
+
+inline const Value &project(const Value &value, size_t index) {
+  auto &tuple = as_tuple(value);
+  if (index >= tuple.size) [[unlikely]]
+    throw Error(INDEX_OUT_OF_RANGE);
+  return tuple.fields[index];
+}
+
+/// Applications check the function before evaluating the argument
+inline void check_function(const Value &value) {
+  if (value.kind != Value::Kind::Function) [[unlikely]]
+    throw Error(NOT_A_FUNCTION);
+}
+
+inline Value call(Value function, Value arg) {
+  Call call{std::move(function), std::move(arg)};
+  while (true) {
+    check_function(call.function);
+    // Keeps the function alive while it runs, as a tail call replaces it
+    auto object = std::move(call.function.object);
+    auto result = static_cast<const Function &>(*object).apply(call);
+    if (result.kind != Value::Kind::Tail)
+      return result;
+  }
+}
+
+/// A call in tail position, which the enclosing `call` makes
+inline Value tail(Call &call, Value function, Value arg) {
+  call.function = std::move(function);
+  call.arg = std::move(arg);
+  return Value::tail();
+}
+
+/// The base of the struct generated for each `fn`, which has the variables it
+/// captures as members, and defines
+///
+///     Value body(Call &call) const;  -- with the last argument in call.arg
+///     static constexpr const char *TEXT[Arity];
+///
+/// where TEXT[i] is how the closure prints with i arguments applied
+template <typename Self, size_t Arity> struct Closure : Function {
+  Value apply(Call &call) const override {
+    auto &self = static_cast<const Self &>(*this);
+    if (count + 1 < Arity) {
+      auto next = std::make_shared<Self>(self);
+      next->args[next->count++] = std::move(call.arg);
+      return Value(std::shared_ptr<const Function>(std::move(next)));
+    }
+    return self.body(call);
+  }
+
+  void format(std::string &out) const override { out += Self::TEXT[count]; }
+
+  /// The arguments applied so far, but the last
+  std::array<Value, Arity - 1> args;
+  size_t count = 0;
+};
+
+/// A builtin, curried like a closure
+struct Builtin : Function {
+  typedef Value (*Body)(const Value *args);
+
+  Builtin(const char *name, size_t arity, Body body,
+          std::vector<Value> bound = {})
+      : name(name), arity(arity), body(body), bound(std::move(bound)) {}
+
+  Value apply(Call &call) const override {
+    auto args = bound;
+    args.push_back(std::move(call.arg));
+    if (args.size() == arity)
+      return body(args.data());
+    return Value(std::make_shared<const Builtin>(name, arity, body,
+                                                 std::move(args)));
+  }
+
+  void format(std::string &out) const override {
+    out += name;
+    for (auto &arg : bound) {
+      out += " ( ";
+      tiny::format(arg, out);
+      out += " )";
+    }
+  }
+
+  const char *name;
+  size_t arity;
+  Body body;
+  std::vector<Value> bound;
+};
+
+enum class Op { Less, Equal, Greater, Add, Sub };
+
+/// On `Integer`s, or on the `uint32_t`s of arrays
+template <Op op, typename T> T apply(const T &a, const T &b) {
+  if constexpr (op == Op::Less)
+    return a < b;
+  if constexpr (op == Op::Equal)
+    return a == b;
+  if constexpr (op == Op::Greater)
+    return a > b;
+  if constexpr (op == Op::Add)
+    return a + b;
+  return a - b;
+}
+
+/// Binary operators check their left operand before evaluating the right
+inline void check_operand(const Value &value) {
+  if (value.kind != Value::Kind::Number && value.kind != Value::Kind::Array)
+      [[unlikely]]
+    throw Error(NOT_A_NUMBER);
+}
+
+/// Element-wise, where at least one side is an array
+template <Op op> Value array_binop(const Value &lhs, const Value &rhs) {
+  std::vector<uint32_t> out;
+  if (lhs.kind == Value::Kind::Array && rhs.kind == Value::Kind::Array) {
+    auto &l = lhs.array().values, &r = rhs.array().values;
+    if (l.size() != r.size())
+      throw Error(LENGTH_MISMATCH);
+    out.resize(l.size());
+    for (size_t i = 0; i < out.size(); ++i)
+      out[i] = apply<op>(l[i], r[i]);
+  } else if (lhs.kind == Value::Kind::Array &&
+             rhs.kind == Value::Kind::Number) {
+    auto &l = lhs.array().values;
+    auto r = checked<uint32_t>(rhs.number);
+    out.resize(l.size());
+    for (size_t i = 0; i < out.size(); ++i)
+      out[i] = apply<op>(l[i], r);
+  } else if (lhs.kind == Value::Kind::Number &&
+             rhs.kind == Value::Kind::Array) {
+    auto l = checked<uint32_t>(lhs.number);
+    auto &r = rhs.array().values;
+    out.resize(r.size());
+    for (size_t i = 0; i < out.size(); ++i)
+      out[i] = apply<op>(l, r[i]);
+  } else {
+    throw Error(NOT_A_NUMBER);
+  }
+  return Value(std::make_shared<const Array>(std::move(out)));
+}
+
+template <Op op> Value binop(const Value &lhs, const Value &rhs) {
+  if (lhs.kind == Value::Kind::Number && rhs.kind == Value::Kind::Number)
+      [[likely]]
+    return apply<op>(lhs.number, rhs.number);
+  return array_binop<op>(lhs, rhs);
+}
+
+namespace builtins {
+
+typedef const Integer &Num;
+
+template <Integer (*f)(Num, Num)> Value numeric(const Value *args) {
+  auto &a = number(args[0]);
+  return f(a, number(args[1]));
+}
+
+/// As in the interpreter's builtins
+constexpr uint32_t MAX_SHIFT = 1 << 16;
+
+inline Integer add(Num a, Num b) { return a + b; }
+inline Integer sub(Num a, Num b) { return a - b; }
+inline Integer mul(Num a, Num b) { return a * b; }
+inline Integer div(Num a, Num b) {
+  if (!b)
+    throw Error(DIVISION_BY_ZERO);
+  return a / b;
+}
+inline Integer mod(Num a, Num b) {
+  if (!b)
+    throw Error(DIVISION_BY_ZERO);
+  return a % b;
+}
+inline Integer min(Num a, Num b) { return std::min(a, b); }
+inline Integer max(Num a, Num b) { return std::max(a, b); }
+inline Integer band(Num a, Num b) {
+  return checked<int64_t>(a) & checked<int64_t>(b);
+}
+inline Integer bor(Num a, Num b) {
+  return checked<int64_t>(a) | checked<int64_t>(b);
+}
+inline Integer bxor(Num a, Num b) {
+  return checked<int64_t>(a) ^ checked<int64_t>(b);
+}
+inline Integer shl(Num a, Num b) {
+  auto shift = checked<uint32_t>(b);
+  if (shift > MAX_SHIFT)
+    throw Error(NUMBER_OUT_OF_RANGE);
+  Integer n = a;
+  for (; shift >= 62; shift -= 62)
+    n = n * (int64_t(1) << 62);
+  return n * (int64_t(1) << shift);
+}
+inline Integer shr(Num a, Num b) {
+  auto n = checked<int64_t>(a);
+  auto shift = checked<uint32_t>(b);
+  return shift < 64 ? n >> shift : n < 0 ? -1 : 0;
+}
+
+inline Value range(const Value *args) {
+  std::vector<uint32_t> values(checked<uint32_t>(number(args[0])));
+  for (size_t i = 0; i < values.size(); ++i)
+    values[i] = uint32_t(i);
+  return Value(std::make_shared<const Array>(std::move(values)));
+}
+
+inline Value len(const Value *args) { return uint32_t(array(args[0]).size()); }
+
+inline Value get(const Value *args) {
+  auto &values = array(args[0]);
+  auto &index = number(args[1]);
+  if (!index.fits<uint32_t>() || index.small() >= int64_t(values.size()))
+    throw Error(INDEX_OUT_OF_RANGE);
+  return values[index.small()];
+}
+
+inline Value sum(const Value *args) {
+  uint64_t total = 0;
+  for (auto value : array(args[0]))
+    total += value;
+  if (total > uint64_t(INT64_MAX))
+    return Integer(INT64_MAX) + Integer(int64_t(total - uint64_t(INT64_MAX)));
+  return int64_t(total);
+}
+
+inline Value map(const Value *args) {
+  auto &values = array(args[1]);
+  std::vector<uint32_t> out;
+  out.reserve(values.size());
+  for (auto value : values)
+    out.push_back(number(call(args[0], value)).low32());
+  return Value(std::make_shared<const Array>(std::move(out)));
+}
+
+inline Value filter(const Value *args) {
+  auto &values = array(args[1]);
+  std::vector<uint32_t> out;
+  for (auto value : values) {
+    if (truthy(call(args[0], value)))
+      out.push_back(value);
+  }
+  return Value(std::make_shared<const Array>(std::move(out)));
+}
+
+inline Value fold(const Value *args) {
+  auto &values = array(args[2]);
+  auto acc = args[1];
+  for (auto value : values)
+    acc = call(call(args[0], std::move(acc)), value);
+  return acc;
+}
+
+struct Entry {
+  const char *name;
+  size_t arity;
+  Builtin::Body body;
+};
+
+inline const Entry ALL[] = {
+    {"add", 2, numeric<add>},   {"sub", 2, numeric<sub>},
+    {"mul", 2, numeric<mul>},   {"div", 2, numeric<div>},
+    {"mod", 2, numeric<mod>},   {"min", 2, numeric<min>},
+    {"max", 2, numeric<max>},   {"band", 2, numeric<band>},
+    {"bor", 2, numeric<bor>},   {"bxor", 2, numeric<bxor>},
+    {"shl", 2, numeric<shl>},   {"shr", 2, numeric<shr>},
+    {"range", 1, range},        {"len", 1, len},
+    {"get", 2, get},            {"sum", 1, sum},
+    {"map", 2, map},            {"filter", 2, filter},
+    {"fold", 3, fold},
+};
+
+} // namespace builtins
+
+/// The builtin called `name`, or an unbound value if there is none
+inline Value builtin(std::string_view name) {
+  for (auto &entry : builtins::ALL) {
+    if (name == entry.name)
+      return Value(
+          std::make_shared<const Builtin>(entry.name, entry.arity, entry.body));
+  }
+  return Value::unbound();
+}
+
+/// Runs a compiled script, printing its value, or its error to stderr
+inline int main(Value (*run)(void)) {
+  try {
+    auto value = run();
+    std::string out;
+    format(value, out);
+    if (value.kind != Value::Kind::Nothing)
+      std::puts(out.c_str());
+    return 0;
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+}
+
+} // namespace tiny
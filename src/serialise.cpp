@@ -0,0 +1,536 @@
+#include "serialise.hpp"
+#include "analysis.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+enum Tag : uint8_t {
+  TagAssignment = 1,
+  TagFn,
+  TagIfCond,
+  TagApp,
+  TagBinop,
+  TagNumber,
+  TagIdentifier,
+  TagStatementExpr,
+  TagLoop,
+  TagTuple,
+  TagProject,
+  TagDestructure,
+  /// A Number too large for a varint, as its decimal digits
+  TagBigNumber,
+};
+
+const char MAGIC[4] = {'T', 'I', 'N', 'Y'};
+/// The source's size, ahead of it in cache files
+const size_t SOURCE_SIZE_BYTES = 8;
+const size_t HEADER_SIZE = sizeof(MAGIC) + 4 + 8 + 8 + 8;
+
+void put_varint(std::string &out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(char((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out.push_back(char(value));
+}
+
+template <typename T> void put_fixed(std::string &out, T value) {
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    out.push_back(char((value >> (8 * i)) & 0xff));
+  }
+}
+
+struct Serialiser : Visitor {
+  void visitAssignment(const Assignment &let) override {
+    out.push_back(TagAssignment);
+    put_string(*let.get_name());
+    let.get_body().accept(*this);
+  }
+
+  void visitFn(const Fn &fn) override {
+    out.push_back(TagFn);
+    put_varint(out, fn.get_args().size());
+    for (auto &arg : fn.get_args())
+      put_string(*arg);
+    fn.get_body()->accept(*this);
+  }
+
+  void visitIfCond(const IfCond &if_cond) override {
+    out.push_back(TagIfCond);
+    if_cond.get_condition().accept(*this);
+    if_cond.get_true_case().accept(*this);
+    if_cond.get_false_case().accept(*this);
+  }
+
+  void visitLoop(const Loop &loop) override {
+    out.push_back(TagLoop);
+    put_varint(out, loop.get_vars().size());
+    for (auto &var : loop.get_vars())
+      put_string(*var);
+    for (auto &init : loop.get_inits())
+      init->accept(*this);
+    loop.get_condition().accept(*this);
+    for (auto &step : loop.get_steps())
+      step->accept(*this);
+  }
+
+  void visitApp(const App &app) override {
+    out.push_back(TagApp);
+    app.get_lhs().accept(*this);
+    app.get_rhs().accept(*this);
+  }
+
+  void visitBinop(const Binop &op) override {
+    out.push_back(TagBinop);
+    put_string(op.get_op());
+    op.get_lhs().accept(*this);
+    op.get_rhs().accept(*this);
+  }
+
+  void visitNumber(const Number &n) override {
+    if (!(*n).fits<uint64_t>()) {
+      out.push_back(TagBigNumber);
+      put_string((*n).to_string());
+      return;
+    }
+    out.push_back(TagNumber);
+    put_varint(out, uint64_t((*n).small()));
+  }
+
+  void visitIdentifier(const Identifier &id) override {
+    out.push_back(TagIdentifier);
+    put_string(*id);
+  }
+
+  void visitStatementExpr(const StatementExpr &statements) override {
+    out.push_back(TagStatementExpr);
+    put_varint(out, statements.get_body().size());
+    for (auto &statement : statements.get_body())
+      statement->accept(*this);
+  }
+
+  // Parsed, as the cache is for skipping parsing
+  void visitLazyBody(const LazyBody &lazy) override {
+    lazy.get().accept(*this);
+  }
+
+  void visitTuple(const Tuple &tuple) override {
+    out.push_back(TagTuple);
+    put_varint(out, tuple.get_fields().size());
+    for (auto &field : tuple.get_fields())
+      field->accept(*this);
+  }
+
+  void visitProject(const Project &project) override {
+    out.push_back(TagProject);
+    put_varint(out, project.get_index());
+    project.get_tuple().accept(*this);
+  }
+
+  void visitDestructure(const Destructure &destructure) override {
+    out.push_back(TagDestructure);
+    put_varint(out, destructure.get_names().size());
+    for (auto &name : destructure.get_names())
+      put_string(*name);
+    destructure.get_body().accept(*this);
+  }
+
+  void put_string(const std::string &str) {
+    auto [it, inserted] = string_index.try_emplace(str, strings.size());
+    if (inserted)
+      strings.push_back(&it->first);
+    put_varint(out, it->second);
+  }
+
+  std::string out;
+  std::map<std::string, uint64_t> string_index;
+  std::vector<const std::string *> strings;
+};
+
+struct Deserialiser {
+  Deserialiser(std::string_view data) : data(data), pos(0) {}
+
+  uint8_t byte(void) {
+    if (pos >= data.size())
+      throw BadSerialisation("truncated");
+    return uint8_t(data[pos++]);
+  }
+
+  uint64_t varint(void) {
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      uint8_t b = byte();
+      value |= uint64_t(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        return value;
+    }
+    throw BadSerialisation("bad varint");
+  }
+
+  template <typename T> T fixed(void) {
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); ++i)
+      value |= T(byte()) << (8 * i);
+    return value;
+  }
+
+  /// Bounds a count read from the input by the bytes left, so corrupt counts
+  /// cannot make us reserve huge vectors
+  uint64_t count(void) {
+    auto n = varint();
+    if (n > data.size() - pos)
+      throw BadSerialisation("bad count");
+    return n;
+  }
+
+  void read_strings(void) {
+    auto n = count();
+    strings.reserve(n);
+    for (uint64_t i = 0; i < n; ++i) {
+      auto length = count();
+      strings.emplace_back(data.substr(pos, length));
+      pos += length;
+    }
+  }
+
+  const std::string &string(void) {
+    auto index = varint();
+    if (index >= strings.size())
+      throw BadSerialisation("bad string index");
+    return strings[index];
+  }
+
+  std::unique_ptr<Ast> ast(void) {
+    if (peek() == TagAssignment) {
+      ++pos;
+      auto name = std::make_unique<Identifier>(string());
+      auto body = expr();
+      return std::make_unique<Assignment>(std::move(name), std::move(body));
+    }
+    if (peek() == TagDestructure) {
+      ++pos;
+      auto n = count();
+      if (n < 2 || n > MAX_TUPLE_SIZE)
+        throw BadSerialisation("bad tuple size");
+      std::vector<Identifier> names;
+      names.reserve(n);
+      for (uint64_t i = 0; i < n; ++i)
+        names.emplace_back(string());
+      auto body = expr();
+      return std::make_unique<Destructure>(std::move(names), std::move(body));
+    }
+    return expr();
+  }
+
+  std::unique_ptr<Expression> expr(void) {
+    switch (byte()) {
+    case TagFn: {
+      auto n = count();
+      std::vector<Identifier> args;
+      args.reserve(n);
+      for (uint64_t i = 0; i < n; ++i)
+        args.emplace_back(string());
+      if (args.empty())
+        throw BadSerialisation("function without arguments");
+      std::shared_ptr<Ast> body = ast();
+      return std::make_unique<Fn>(std::move(args), std::move(body));
+    }
+    case TagIfCond: {
+      auto condition = expr();
+      auto true_case = expr();
+      auto false_case = expr();
+      return std::make_unique<IfCond>(
+          std::move(condition), std::move(true_case), std::move(false_case));
+    }
+    case TagApp: {
+      auto lhs = expr();
+      auto rhs = expr();
+      return std::make_unique<App>(std::move(lhs), std::move(rhs));
+    }
+    case TagBinop: {
+      auto op = string();
+      auto lhs = expr();
+      auto rhs = expr();
+      return std::make_unique<Binop>(op, std::move(lhs), std::move(rhs));
+    }
+    case TagNumber: {
+      auto value = varint();
+      if (value > INT64_MAX)
+        throw BadSerialisation("number out of range");
+      return std::make_unique<Number>(Integer(int64_t(value)));
+    }
+    case TagBigNumber: {
+      auto &digits = string();
+      if (digits.empty() ||
+          !std::all_of(digits.begin(), digits.end(),
+                       [](char c) { return std::isdigit(uint8_t(c)); }))
+        throw BadSerialisation("bad number");
+      return std::make_unique<Number>(Integer::parse(digits));
+    }
+    case TagIdentifier:
+      return std::make_unique<Identifier>(string());
+    case TagStatementExpr: {
+      auto body = statements();
+      return std::make_unique<StatementExpr>(std::vector<std::shared_ptr<Ast>>(
+          std::make_move_iterator(body.begin()),
+          std::make_move_iterator(body.end())));
+    }
+    case TagLoop: {
+      auto n = count();
+      std::vector<Identifier> vars;
+      vars.reserve(n);
+      for (uint64_t i = 0; i < n; ++i)
+        vars.emplace_back(string());
+      if (vars.empty())
+        throw BadSerialisation("loop without variables");
+      std::vector<std::shared_ptr<Expression>> inits, steps;
+      for (uint64_t i = 0; i < n; ++i)
+        inits.push_back(expr());
+      auto condition = expr();
+      for (uint64_t i = 0; i < n; ++i)
+        steps.push_back(expr());
+      return std::make_unique<Loop>(std::move(vars), std::move(inits),
+                                    std::move(condition), std::move(steps));
+    }
+    case TagTuple: {
+      auto n = count();
+      if (n < 2 || n > MAX_TUPLE_SIZE)
+        throw BadSerialisation("bad tuple size");
+      std::vector<std::shared_ptr<Expression>> fields;
+      for (uint64_t i = 0; i < n; ++i)
+        fields.push_back(expr());
+      return std::make_unique<Tuple>(std::move(fields));
+    }
+    case TagProject: {
+      auto index = varint();
+      if (index > UINT32_MAX)
+        throw BadSerialisation("index out of range");
+      auto tuple = expr();
+      return std::make_unique<Project>(std::move(tuple), uint32_t(index));
+    }
+    default:
+      throw BadSerialisation("bad tag");
+    }
+  }
+
+  std::vector<std::unique_ptr<Ast>> statements(void) {
+    auto n = count();
+    std::vector<std::unique_ptr<Ast>> ret;
+    ret.reserve(n);
+    for (uint64_t i = 0; i < n; ++i)
+      ret.push_back(ast());
+    return ret;
+  }
+
+  uint8_t peek(void) {
+    if (pos >= data.size())
+      throw BadSerialisation("truncated");
+    return uint8_t(data[pos]);
+  }
+
+  std::string_view data;
+  size_t pos;
+  std::vector<std::string> strings;
+};
+
+} // namespace
+
+BadSerialisation::BadSerialisation(const std::string str)
+    : str("Bad serialised program: " + str) {}
+
+const char *BadSerialisation::what(void) const noexcept { return str.c_str(); }
+
+uint64_t hash_source(std::string_view source) {
+  // 64-bit FNV-1a
+  uint64_t hash = 0xcbf29ce484222325;
+  for (unsigned char c : source) {
+    hash ^= c;
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+std::string serialise(const std::vector<std::unique_ptr<Ast>> &program,
+                      uint64_t source_hash) {
+  Serialiser serialiser;
+  for (auto &statement : program)
+    statement->accept(serialiser);
+
+  std::string payload;
+  put_varint(payload, serialiser.strings.size());
+  for (auto str : serialiser.strings) {
+    put_varint(payload, str->size());
+    payload += *str;
+  }
+  put_varint(payload, program.size());
+  payload += serialiser.out;
+
+  std::string out(MAGIC, sizeof(MAGIC));
+  put_fixed<uint32_t>(out, SERIALISE_VERSION);
+  put_fixed<uint64_t>(out, source_hash);
+  put_fixed<uint64_t>(out, hash_source(payload));
+  put_fixed<uint64_t>(out, payload.size());
+  return out + payload;
+}
+
+std::vector<std::unique_ptr<Ast>> deserialise(std::string_view data,
+                                              uint64_t source_hash) {
+  if (data.size() < HEADER_SIZE ||
+      std::memcmp(data.data(), MAGIC, sizeof(MAGIC)) != 0)
+    throw BadSerialisation("bad magic");
+
+  Deserialiser header(data.substr(sizeof(MAGIC), HEADER_SIZE - sizeof(MAGIC)));
+  if (header.fixed<uint32_t>() != SERIALISE_VERSION)
+    throw BadSerialisation("version mismatch");
+  if (header.fixed<uint64_t>() != source_hash)
+    throw BadSerialisation("source hash mismatch");
+  auto payload_hash = header.fixed<uint64_t>();
+  auto payload_size = header.fixed<uint64_t>();
+
+  auto payload = data.substr(HEADER_SIZE);
+  if (payload.size() != payload_size)
+    throw BadSerialisation("payload size mismatch");
+  if (hash_source(payload) != payload_hash)
+    throw BadSerialisation("payload hash mismatch");
+
+  Deserialiser deserialiser(payload);
+  deserialiser.read_strings();
+  auto program = deserialiser.statements();
+  if (deserialiser.pos != payload.size())
+    throw BadSerialisation("trailing data");
+  // Annotations aren't serialised
+  for (auto &statement : program)
+    analyse_escapes(*statement);
+  return program;
+}
+
+// Program cache
+
+ProgramCache::ProgramCache(std::filesystem::path directory)
+    : directory(std::move(directory)) {}
+
+std::filesystem::path ProgramCache::default_directory(void) {
+  if (auto dir = std::getenv("TINY_INTERP_CACHE_DIR"))
+    return dir;
+  if (auto dir = std::getenv("XDG_CACHE_HOME"))
+    return std::filesystem::path(dir) / "tiny-interp";
+  if (auto dir = std::getenv("HOME"))
+    return std::filesystem::path(dir) / ".cache" / "tiny-interp";
+  // Not a shared directory like /tmp, where others could plant programs
+  return {};
+}
+
+namespace {
+
+/// Whether `directory` is ours and no one else can write to it, so that the
+/// programs in it are the ones we stored
+bool is_private(const std::filesystem::path &directory) {
+  struct stat st;
+  return lstat(directory.c_str(), &st) == 0 && S_ISDIR(st.st_mode) &&
+         st.st_uid == getuid() && (st.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+/// Removes a file when it goes out of scope, unless it was kept
+struct RemoveUnlessKept {
+  RemoveUnlessKept(std::filesystem::path path) : path(std::move(path)) {}
+  ~RemoveUnlessKept() {
+    if (!kept) {
+      std::error_code error;
+      std::filesystem::remove(path, error);
+    }
+  }
+
+  bool kept = false;
+
+private:
+  std::filesystem::path path;
+};
+
+} // namespace
+
+std::filesystem::path ProgramCache::path_for(const std::string &source) const {
+  char name[32];
+  std::snprintf(name, sizeof(name), "%016llx.tic",
+                (unsigned long long)hash_source(source));
+  return directory / name;
+}
+
+std::optional<std::vector<std::unique_ptr<Ast>>>
+ProgramCache::load(const std::string &source) const {
+  if (directory.empty() || !is_private(directory))
+    return std::nullopt;
+  // A directory opens fine, but has no sensible size
+  auto path = path_for(source);
+  std::error_code error;
+  if (!std::filesystem::is_regular_file(path, error))
+    return std::nullopt;
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file)
+    return std::nullopt;
+  std::string data(file.tellg(), '\0');
+  file.seekg(0);
+  if (!file.read(data.data(), data.size()))
+    return std::nullopt;
+
+  // The hash only picks the file; the source has to match exactly
+  if (data.size() < SOURCE_SIZE_BYTES)
+    return std::nullopt;
+  uint64_t source_size = 0;
+  for (size_t i = 0; i < SOURCE_SIZE_BYTES; ++i)
+    source_size |= uint64_t(uint8_t(data[i])) << (8 * i);
+  if (source_size != source.size() ||
+      data.size() - SOURCE_SIZE_BYTES < source_size ||
+      data.compare(SOURCE_SIZE_BYTES, source_size, source) != 0)
+    return std::nullopt;
+
+  try {
+    return deserialise(
+        std::string_view(data).substr(SOURCE_SIZE_BYTES + source_size),
+        hash_source(source));
+  } catch (const BadSerialisation &e) {
+    return std::nullopt;
+  }
+}
+
+void ProgramCache::store(
+    const std::string &source,
+    const std::vector<std::unique_ptr<Ast>> &program) const {
+  if (directory.empty())
+    return;
+  std::error_code error;
+  std::filesystem::create_directories(directory.parent_path(), error);
+  if (mkdir(directory.c_str(), 0700) != 0 && errno != EEXIST)
+    return;
+  if (!is_private(directory))
+    return;
+
+  // Write then rename, so a concurrent reader never sees a partial file
+  auto path = path_for(source);
+  auto temporary = path;
+  temporary += ".tmp" + std::to_string(getpid());
+  // Whether writing fails, renaming fails or serialising throws
+  RemoveUnlessKept remove(temporary);
+  std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+  std::string data;
+  put_fixed<uint64_t>(data, source.size());
+  data += source;
+  data += serialise(program, hash_source(source));
+  file.write(data.data(), data.size());
+  file.close();
+  if (!file)
+    return;
+  std::filesystem::rename(temporary, path, error);
+  remove.kept = !error;
+}
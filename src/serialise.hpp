@@ -0,0 +1,77 @@
+#pragma once
+
+/** \file
+ * \brief A compact binary form of parsed programs, and an on-disk cache of
+ * them keyed by a hash of the source text, so unchanged scripts can skip
+ * tokenising and parsing.
+ *
+ * The format is (all integers little-endian, "varint" is LEB128)
+ *
+ *     header   -> "TINY" version:u32 source_hash:u64 payload_hash:u64
+ *                 payload_size:u64
+ *     payload  -> strings statements
+ *     strings  -> count:varint (length:varint byte*)*
+ *     statements -> count:varint node*
+ *     node     -> tag:u8 fields
+ *
+ * where identifiers and operators are indices into the string table. The
+ * whole file is read with a single read and everything is validated (magic,
+ * version, hashes, bounds and tags) before it is trusted.
+ *
+ * The cache names files by the hash of the source, and stores the source
+ * itself ahead of the program,
+ *
+ *     cache file -> source_size:u64 source header payload
+ *
+ * so that a file is only used for exactly the source it was made from, not
+ * another with the same (easily forged) hash. It only uses a directory which
+ * is the user's own and which no one else can write to.
+ */
+
+#include "ast.hpp"
+
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define SERIALISE_VERSION 4
+
+struct BadSerialisation : std::exception {
+  BadSerialisation(const std::string str);
+  const char *what(void) const noexcept override;
+
+private:
+  std::string str;
+};
+
+uint64_t hash_source(std::string_view source);
+
+std::string serialise(const std::vector<std::unique_ptr<Ast>> &program,
+                      uint64_t source_hash);
+std::vector<std::unique_ptr<Ast>> deserialise(std::string_view data,
+                                              uint64_t source_hash);
+
+struct ProgramCache {
+  ProgramCache(std::filesystem::path directory);
+
+  /// `$TINY_INTERP_CACHE_DIR`, `$XDG_CACHE_HOME/tiny-interp` or
+  /// `$HOME/.cache/tiny-interp`, in that order, or empty (disabling the
+  /// cache) if none is set
+  static std::filesystem::path default_directory(void);
+
+  std::filesystem::path path_for(const std::string &source) const;
+  /// Returns nullopt on a miss, when the cached file is stale or corrupt,
+  /// or when the directory could have been written by someone else
+  std::optional<std::vector<std::unique_ptr<Ast>>>
+  load(const std::string &source) const;
+  void store(const std::string &source,
+             const std::vector<std::unique_ptr<Ast>> &program) const;
+
+private:
+  std::filesystem::path directory;
+};
@@ -0,0 +1,236 @@
+#include "session.hpp"
+#include "analysis.hpp"
+
+#include <algorithm>
+#include <functional>
+
+namespace {
+
+/// Whether a recomputed binding can be treated as unchanged. Closures and
+/// builtins are only the same if they are the same object, and tuples if
+/// their fields are the same.
+bool same_value(const Rc<Value> &a, const Rc<Value> &b) {
+  // Compared with a stack of their own, as lists nest deeply in tuples
+  std::vector<std::pair<const Value *, const Value *>> pending{
+      {a.get(), b.get()}};
+  while (!pending.empty()) {
+    auto [lhs, rhs] = pending.back();
+    pending.pop_back();
+    if (lhs == rhs)
+      continue;
+    if (!lhs || !rhs)
+      return false;
+    auto lhs_number = dynamic_cast<const NumberValue *>(lhs);
+    auto rhs_number = dynamic_cast<const NumberValue *>(rhs);
+    if (lhs_number && rhs_number) {
+      if (lhs_number->get_value() != rhs_number->get_value())
+        return false;
+      continue;
+    }
+    auto lhs_array = dynamic_cast<const ArrayValue *>(lhs);
+    auto rhs_array = dynamic_cast<const ArrayValue *>(rhs);
+    if (lhs_array && rhs_array) {
+      if (lhs_array->get_values() != rhs_array->get_values())
+        return false;
+      continue;
+    }
+    auto lhs_tuple = dynamic_cast<const TupleValue *>(lhs);
+    auto rhs_tuple = dynamic_cast<const TupleValue *>(rhs);
+    if (!lhs_tuple || !rhs_tuple || lhs_tuple->size() != rhs_tuple->size())
+      return false;
+    for (size_t i = 0; i < lhs_tuple->size(); ++i)
+      pending.push_back({lhs_tuple->get(i).get(), rhs_tuple->get(i).get()});
+  }
+  return true;
+}
+
+/// The globals a top-level statement binds, if it is a `let`
+std::vector<Identifier> bound_names(const Ast &statement) {
+  if (auto let = dynamic_cast<const Assignment *>(&statement))
+    return {let->get_name()};
+  if (auto destructure = dynamic_cast<const Destructure *>(&statement))
+    return destructure->get_names();
+  return {};
+}
+
+const Ast &bound_body(const Ast &let) {
+  if (auto assignment = dynamic_cast<const Assignment *>(&let))
+    return assignment->get_body();
+  return static_cast<const Destructure &>(let).get_body();
+}
+
+} // namespace
+
+Session::Session() : last(nullptr), next_order(0) {}
+
+std::vector<Session::Failure> Session::run(std::unique_ptr<Ast> statement) {
+  auto names = bound_names(*statement);
+  if (names.empty()) {
+    evaluate_checked(checker, evaluator, *statement);
+    last = evaluator.get_last();
+    return {};
+  }
+
+  std::shared_ptr<const Ast> definition(std::move(statement));
+  std::vector<Rc<Value>> previous;
+  for (auto &name : names)
+    previous.push_back(evaluator.lookup(name));
+  define(definition, names);
+  last = evaluator.get_last();
+
+  std::set<Identifier> changed;
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (!same_value(previous[i], evaluator.lookup(names[i])))
+      changed.insert(names[i]);
+  }
+
+  std::vector<Failure> failures;
+  // The definitions recomputed, once each however many names they bind
+  std::set<const Ast *> recomputed;
+  for (auto &dependent :
+       dependents(std::set<Identifier>(names.begin(), names.end()))) {
+    auto &binding = bindings.at(dependent);
+    if (recomputed.contains(binding.definition.get()) ||
+        std::none_of(binding.dependencies.begin(), binding.dependencies.end(),
+                     [&](auto &dep) { return changed.contains(dep); }))
+      continue;
+    recomputed.insert(binding.definition.get());
+
+    // The names this definition still binds, and those since bound by
+    // other statements, which it mustn't overwrite
+    auto outputs = bound_names(*binding.definition);
+    std::vector<Rc<Value>> before;
+    for (auto &output : outputs)
+      before.push_back(evaluator.lookup(output));
+    auto owned = [&](const Identifier &output) {
+      return bindings.at(output).definition == binding.definition;
+    };
+    auto restore_others = [&] {
+      for (size_t i = 0; i < outputs.size(); ++i) {
+        if (owned(outputs[i]))
+          continue;
+        if (before[i])
+          evaluator.bind(outputs[i], before[i]);
+        else
+          evaluator.unset(outputs[i]);
+      }
+    };
+
+    // Unchecked: the definition's annotations are from when it was first
+    // checked, and closures it made then still rely on them
+    checker.forget(*binding.definition);
+    try {
+      evaluator.evaluate(*binding.definition);
+    } catch (const EvalError &e) {
+      restore_others();
+      for (auto &output : outputs) {
+        if (!owned(output))
+          continue;
+        evaluator.unset(output);
+        failures.push_back({*output, e.what()});
+        changed.insert(output);
+      }
+      continue;
+    }
+    restore_others();
+    for (size_t i = 0; i < outputs.size(); ++i) {
+      if (owned(outputs[i]) &&
+          !same_value(before[i], evaluator.lookup(outputs[i])))
+        changed.insert(outputs[i]);
+    }
+  }
+  return failures;
+}
+
+void Session::define(std::shared_ptr<const Ast> let,
+                     const std::vector<Identifier> &names) {
+  evaluate_checked(checker, evaluator, *let);
+
+  auto dependencies = free_variables(bound_body(*let));
+  // `let x = x + 1` reads the previous `x`, it does not depend on itself
+  for (auto &name : names)
+    dependencies.erase(name);
+
+  for (auto &name : names) {
+    auto [it, inserted] =
+        bindings.try_emplace(name, Binding{let, {}, next_order});
+    if (inserted)
+      ++next_order;
+    it->second.definition = let;
+    it->second.dependencies = dependencies;
+  }
+}
+
+Rc<Value> Session::get_last(void) const { return last; }
+
+EvalVisitor &Session::get_evaluator(void) { return evaluator; }
+
+TypeChecker &Session::get_checker(void) { return checker; }
+
+const std::map<Identifier, Session::Binding> &
+Session::get_bindings(void) const {
+  return bindings;
+}
+
+std::vector<Identifier> Session::dependents(const Identifier &name) const {
+  return dependents(std::set<Identifier>{name});
+}
+
+std::vector<Identifier>
+Session::dependents(const std::set<Identifier> &names) const {
+  std::set<Identifier> affected;
+  std::vector<Identifier> work(names.begin(), names.end());
+  while (!work.empty()) {
+    auto current = work.back();
+    work.pop_back();
+    for (auto &[other, binding] : bindings) {
+      if (binding.dependencies.contains(current) &&
+          affected.insert(other).second)
+        work.push_back(other);
+    }
+  }
+  // Only reachable through a cycle, and `names` have just been evaluated
+  for (auto &name : names)
+    affected.erase(name);
+
+  // Depth-first post-order, so dependencies come before their dependents.
+  // Cycles are broken by definition order.
+  std::vector<const std::pair<const Identifier, Binding> *> roots;
+  for (auto &entry : bindings) {
+    if (affected.contains(entry.first))
+      roots.push_back(&entry);
+  }
+  std::sort(roots.begin(), roots.end(), [](auto a, auto b) {
+    return a->second.order < b->second.order;
+  });
+
+  std::set<Identifier> visited;
+  std::vector<Identifier> ordered;
+  std::function<void(const Identifier &)> visit = [&](const Identifier &id) {
+    if (!affected.contains(id) || !visited.insert(id).second)
+      return;
+    for (auto &dependency : bindings.at(id).dependencies)
+      visit(dependency);
+    ordered.push_back(id);
+  };
+  for (auto root : roots)
+    visit(root->first);
+  return ordered;
+}
+
+std::string Session::format_deps(const Identifier &name) const {
+  auto format_binding = [&](const Identifier &id) {
+    std::string line = *id + ":";
+    auto it = bindings.find(id);
+    if (it == bindings.end())
+      return line + " (undefined)\n";
+    for (auto &dependency : it->second.dependencies)
+      line += " " + *dependency;
+    return line + "\n";
+  };
+
+  std::string out = format_binding(name);
+  for (auto &dependent : dependents(name))
+    out += format_binding(dependent);
+  return out;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+/** \file
+ * \brief A REPL session: evaluates top-level statements and keeps track of
+ * which globals each top-level `let` depends on, so that redefining a binding
+ * recomputes the bindings derived from it, e.g.
+ *
+ *     > let a = 1
+ *     > let b = a + 1
+ *     > let a = 10
+ *     > b
+ *     11
+ *
+ * Only the bindings transitively depending on a redefined one are recomputed,
+ * in dependency order, and a binding is skipped if none of its inputs changed
+ * value. Each name a destructuring `let ( a , b ) = e` binds is a binding with
+ * the whole statement as its definition.
+ */
+
+#include "ast.hpp"
+#include "eval.hpp"
+#include "types.hpp"
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+struct Session {
+  struct Binding {
+    /// An Assignment, or a Destructure binding other names too
+    std::shared_ptr<const Ast> definition;
+    std::set<Identifier> dependencies;
+    /// Orders bindings by when they were first defined, to break ties
+    uint64_t order;
+  };
+
+  struct Failure {
+    std::string name;
+    std::string message;
+  };
+
+  Session();
+
+  /// Evaluates one top-level statement, and returns the dependent bindings
+  /// that could not be recomputed (these are removed from the environment
+  /// until their inputs are fixed)
+  std::vector<Failure> run(std::unique_ptr<Ast> statement);
+
+  Rc<Value> get_last(void) const;
+  EvalVisitor &get_evaluator(void);
+  /// Has the types of the globals, as statements are type-checked before
+  /// they are evaluated
+  TypeChecker &get_checker(void);
+  const std::map<Identifier, Binding> &get_bindings(void) const;
+
+  /// The bindings that transitively depend on `name`, in the order they
+  /// would be recomputed
+  std::vector<Identifier> dependents(const Identifier &name) const;
+  /// Prints `name` with its dependencies, followed by its dependents with
+  /// theirs, one per line, as `name: dependency ...`
+  std::string format_deps(const Identifier &name) const;
+
+private:
+  /// Evaluates a `let` binding `names`, and takes it as their definition
+  void define(std::shared_ptr<const Ast> let,
+              const std::vector<Identifier> &names);
+  /// The bindings that transitively depend on any of `names`
+  std::vector<Identifier> dependents(const std::set<Identifier> &names) const;
+
+  EvalVisitor evaluator;
+  TypeChecker checker;
+  std::map<Identifier, Binding> bindings;
+  Rc<Value> last;
+  uint64_t next_order;
+};
@@ -0,0 +1,558 @@
+#pragma once
+
+/** \file
+ * \brief A tokeniser, parser and evaluator which can run at compile time, for
+ * expressions embedded in C++:
+ *
+ *     constexpr const char *SUM_N =
+ *         "let Y = fn f { ( fn x { f ( fn a { ( x x ) a } ) } ) "
+ *         "( fn x { f ( fn a { ( x x ) a } ) } ) }\n"
+ *         "let sum_n = Y ( fn sum_n { fn n { "
+ *         "if n == 0 then 0 else n + sum_n ( n - 1 ) } } )\n"
+ *         "sum_n 10";
+ *     static_assert(tiny::eval(SUM_N) == 55);
+ *
+ *     using namespace tiny::literals;
+ *     int64_t x = "( fn x { x + 1 } ) 41"_tiny; // Always at compile time
+ *
+ * `tiny::eval` works at runtime too, and gives the same results as
+ * EvalVisitor, except that numbers are only 64-bit: where EvalVisitor would
+ * move to a bignum, this throws NumberOutOfRange. Scripts are parsed line by
+ * line as with `parse_lines`.
+ *
+ * Everything allocated during constant evaluation must be freed again, so the
+ * AST here is an arena of nodes referring to each other by index, and
+ * closures and environments live in arenas of their own for the duration of
+ * one `eval`. Values are numbers and closures only: there are no builtins or
+ * arrays, and the result must be a number. Errors throw the same exceptions
+ * as `parse` and EvalVisitor; at compile time that makes the expression
+ * fail to be a constant.
+ *
+ * Evaluation uses an explicit stack (like CekMachine), so it isn't limited by
+ * the compiler's constexpr recursion depth.
+ */
+
+#include "eval.hpp"
+#include "tokeniser.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace tiny {
+
+namespace detail {
+
+constexpr bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' ||
+         c == '\r';
+}
+constexpr bool is_digit(char c) { return c >= '0' && c <= '9'; }
+constexpr bool is_alpha(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+/// Splits on whitespace, like Tokeniser. Reading past the last token fails.
+struct Tokeniser {
+  struct Pos {
+    size_t offset;
+    bool eof;
+  };
+
+  constexpr Tokeniser(std::string_view str) : str(str), pos{0, false} {}
+
+  constexpr bool next_token(std::string_view &token) {
+    if (pos.eof)
+      return false;
+    auto cursor = pos.offset;
+    while (cursor < str.size() && is_space(str[cursor]))
+      ++cursor;
+    auto begin = cursor;
+    while (cursor < str.size() && !is_space(str[cursor]))
+      ++cursor;
+    pos = {cursor, cursor == str.size()};
+    token = str.substr(begin, cursor - begin);
+    return true;
+  }
+
+  constexpr bool is_finished(void) const {
+    return pos.eof || pos.offset == str.size();
+  }
+
+  std::string_view str;
+  Pos pos;
+};
+
+enum class Kind : uint8_t {
+  Assignment,
+  Fn,
+  IfCond,
+  App,
+  Binop,
+  Number,
+  Identifier,
+  StatementExpr,
+};
+
+enum class Op : uint8_t { Less, Equal, Greater, Add, Sub };
+
+constexpr uint32_t NONE = UINT32_MAX;
+
+/// One node of the arena AST. Functions of several arguments are curried
+/// into nested one-argument functions, which evaluate the same way.
+struct Node {
+  Kind kind;
+  Op op;
+  /// Number value
+  int64_t number;
+  /// Identifier, let-bound name or function argument
+  std::string_view name;
+  /// Children: let body; fn body; condition, then, else; lhs, rhs. A
+  /// StatementExpr's statements are `lists[a]` to `lists[a + b]`.
+  uint32_t a, b, c;
+};
+
+struct Program {
+  std::vector<Node> nodes;
+  std::vector<uint32_t> lists;
+  /// Top-level statements
+  std::vector<uint32_t> statements;
+};
+
+/// Mirrors Parser. Where that backtracks by catching a ParseError, the
+/// functions here return false instead, since a constant expression can't
+/// throw.
+struct Parser {
+  constexpr Parser(std::string_view str, Program &program)
+      : tokr(str), program(program) {}
+
+  constexpr uint32_t add(Node node) {
+    program.nodes.push_back(node);
+    return uint32_t(program.nodes.size() - 1);
+  }
+
+  static constexpr bool is_id(std::string_view s) {
+    if (s.empty() || !(is_alpha(s[0]) || s == "_"))
+      return false;
+    for (auto c : s.substr(1)) {
+      if (!is_alpha(c) && !is_digit(c) && c != '_')
+        return false;
+    }
+    // The same keywords as Parser, including those of loops, which aren't
+    // supported here but mustn't be taken for variables
+    return s != "let" && s != "fn" && s != "if" && s != "then" &&
+           s != "else" && s != "loop" && s != "while" && s != "do";
+  }
+
+  static constexpr bool is_num(std::string_view s) {
+    if (s.empty())
+      return false;
+    for (auto c : s) {
+      if (!is_digit(c))
+        return false;
+    }
+    return true;
+  }
+
+  static constexpr bool is_binop(std::string_view tok, Op &op) {
+    if (tok == "<")
+      op = Op::Less;
+    else if (tok == "==")
+      op = Op::Equal;
+    else if (tok == ">")
+      op = Op::Greater;
+    else if (tok == "+")
+      op = Op::Add;
+    else if (tok == "-")
+      op = Op::Sub;
+    else
+      return false;
+    return true;
+  }
+
+  constexpr bool expect(std::string_view s) {
+    std::string_view tok;
+    return tokr.next_token(tok) && tok == s;
+  }
+
+  constexpr bool term(uint32_t &out) {
+    std::string_view tok;
+    if (!tokr.next_token(tok))
+      return false;
+
+    if (tok == "(")
+      return expr(out) && expect(")");
+
+    if (tok == "{") {
+      std::vector<uint32_t> body;
+      statements(body);
+      if (!expect("}"))
+        return false;
+      auto first = uint32_t(program.lists.size());
+      program.lists.insert(program.lists.end(), body.begin(), body.end());
+      out = add({Kind::StatementExpr, {}, 0, {}, first, uint32_t(body.size()),
+                 0});
+      return true;
+    }
+
+    if (is_num(tok)) {
+      // Not a parse error to backtrack from, as that would be a bignum
+      int64_t n = 0;
+      for (auto c : tok) {
+        if (__builtin_mul_overflow(n, 10, &n) ||
+            __builtin_add_overflow(n, c - '0', &n))
+          throw NumberOutOfRange();
+      }
+      out = add({Kind::Number, {}, n, {}, 0, 0, 0});
+      return true;
+    }
+
+    if (is_id(tok)) {
+      out = add({Kind::Identifier, {}, 0, tok, 0, 0, 0});
+      return true;
+    }
+
+    return false;
+  }
+
+  constexpr bool app(uint32_t &out) {
+    if (!term(out))
+      return false;
+    auto pos = tokr.pos;
+    uint32_t rhs;
+    if (app(rhs))
+      out = add({Kind::App, {}, 0, {}, out, rhs, 0});
+    else
+      tokr.pos = pos;
+    return true;
+  }
+
+  constexpr bool infix(uint32_t &out) {
+    if (!app(out))
+      return false;
+    auto pos = tokr.pos;
+    std::string_view tok;
+    Op op;
+    uint32_t rhs;
+    while (tokr.next_token(tok) && is_binop(tok, op) && app(rhs)) {
+      out = add({Kind::Binop, op, 0, {}, out, rhs, 0});
+      pos = tokr.pos;
+    }
+    tokr.pos = pos;
+    return true;
+  }
+
+  constexpr bool id(std::string_view &out) {
+    return tokr.next_token(out) && is_id(out);
+  }
+
+  constexpr bool vars(std::vector<std::string_view> &out) {
+    auto pos = tokr.pos;
+    std::string_view tok;
+    bool parenthesised = tokr.next_token(tok) && tok == "(";
+    if (!parenthesised)
+      tokr.pos = pos;
+
+    if (!id(tok))
+      return false;
+    out.push_back(tok);
+    pos = tokr.pos;
+    while (tokr.next_token(tok) && tok == "," && id(tok)) {
+      out.push_back(tok);
+      pos = tokr.pos;
+    }
+    tokr.pos = pos;
+
+    return !parenthesised || expect(")");
+  }
+
+  constexpr bool expr(uint32_t &out) {
+    auto pos = tokr.pos;
+    std::string_view tok;
+    if (!tokr.next_token(tok))
+      return false;
+
+    if (tok == "fn") {
+      std::vector<std::string_view> args;
+      if (!vars(args) || !expr(out))
+        return false;
+      for (auto arg = args.rbegin(); arg != args.rend(); ++arg)
+        out = add({Kind::Fn, {}, 0, *arg, out, 0, 0});
+      return true;
+    }
+
+    if (tok == "if") {
+      uint32_t condition, true_case, false_case;
+      if (!expr(condition) || !expect("then") || !expr(true_case) ||
+          !expect("else") || !expr(false_case))
+        return false;
+      out = add({Kind::IfCond, {}, 0, {}, condition, true_case, false_case});
+      return true;
+    }
+
+    // Loops aren't supported, so are a parse error
+    if (tok == "loop")
+      return false;
+
+    tokr.pos = pos;
+    return infix(out);
+  }
+
+  constexpr bool statement(uint32_t &out) {
+    auto pos = tokr.pos;
+    std::string_view tok;
+    if (!tokr.next_token(tok))
+      return false;
+
+    if (tok == "let") {
+      std::string_view name;
+      if (!tokr.next_token(name) || !is_id(name) || !expect("=") ||
+          !expr(out))
+        return false;
+      out = add({Kind::Assignment, {}, 0, name, out, 0, 0});
+      return true;
+    }
+
+    tokr.pos = pos;
+    return expr(out);
+  }
+
+  constexpr void statements(std::vector<uint32_t> &out) {
+    auto pos = tokr.pos;
+    std::string_view tok;
+    uint32_t node;
+    if (statement(node)) {
+      out.push_back(node);
+      pos = tokr.pos;
+      while (tokr.next_token(tok) && tok == ";" && statement(node)) {
+        out.push_back(node);
+        pos = tokr.pos;
+      }
+    }
+    tokr.pos = pos;
+  }
+
+  Tokeniser tokr;
+  Program &program;
+};
+
+/// Parses each non-blank line as a line of the REPL, like `parse_lines`
+constexpr Program parse_lines(std::string_view str) {
+  Program program;
+  while (!str.empty()) {
+    auto end = std::min(str.find('\n'), str.size());
+    auto line = str.substr(0, end);
+    str.remove_prefix(std::min(end + 1, str.size()));
+
+    bool blank = true;
+    for (auto c : line)
+      blank = blank && is_space(c);
+    if (blank)
+      continue;
+
+    Parser parser(line, program);
+    parser.statements(program.statements);
+    if (!parser.tokr.is_finished())
+      throw ParseError();
+  }
+  return program;
+}
+
+struct Value {
+  enum { Nothing, Number, Closure } kind = Nothing;
+  int64_t number = 0;
+  /// A closure's Fn node and environment
+  uint32_t fn = 0, env = 0;
+};
+
+/// Environments are linked lists of bindings, shared by the closures
+/// capturing them
+struct Binding {
+  std::string_view name;
+  Value value;
+  uint32_t next;
+};
+
+/// Evaluates with an explicit stack, like CekMachine
+struct Machine {
+  enum class Frame : uint8_t {
+    AppRhs,
+    Apply,
+    BinopRhs,
+    Binop,
+    IfBranch,
+    Statement,
+    Assign,
+    /// Restore the environment after a call
+    Return,
+  };
+
+  /// A `let` binds until the end of the enclosing call (or script), so the
+  /// environment only needs restoring when a call returns
+  struct Entry {
+    Frame frame;
+    uint32_t node, index, env;
+    Value value;
+  };
+
+  constexpr Machine(const Program &program)
+      : program(program), env(NONE), control(NONE), value{Value::Nothing} {}
+
+  constexpr Value run(uint32_t root) {
+    control = root;
+    while (true) {
+      if (control != NONE) {
+        step(program.nodes[control]);
+      } else if (!stack.empty()) {
+        auto entry = stack.back();
+        stack.pop_back();
+        resume(entry);
+      } else {
+        return value;
+      }
+    }
+  }
+
+  constexpr void leaf(Value result) {
+    value = result;
+    control = NONE;
+  }
+
+  constexpr void step(const Node &node) {
+    switch (node.kind) {
+    case Kind::Assignment:
+    case Kind::IfCond:
+    case Kind::App:
+    case Kind::Binop: {
+      auto frame = node.kind == Kind::Assignment ? Frame::Assign
+                   : node.kind == Kind::IfCond   ? Frame::IfBranch
+                   : node.kind == Kind::App      ? Frame::AppRhs
+                                                 : Frame::BinopRhs;
+      stack.push_back({frame, control, 0, 0, {}});
+      control = node.a;
+      break;
+    }
+    case Kind::Fn:
+      leaf({Value::Closure, 0, control, env});
+      break;
+    case Kind::Number:
+      leaf({Value::Number, node.number, 0, 0});
+      break;
+    case Kind::Identifier:
+      for (auto i = env; i != NONE; i = bindings[i].next) {
+        if (bindings[i].name == node.name)
+          return leaf(bindings[i].value);
+      }
+      throw UnknownVariable();
+    case Kind::StatementExpr:
+      if (node.b == 0)
+        return leaf({Value::Nothing});
+      if (node.b > 1)
+        stack.push_back({Frame::Statement, control, 1, 0, {}});
+      control = program.lists[node.a];
+      break;
+    }
+  }
+
+  constexpr void resume(const Entry &entry) {
+    auto &node = program.nodes[entry.node];
+    switch (entry.frame) {
+    case Frame::AppRhs:
+      if (value.kind != Value::Closure)
+        throw NotAFunction();
+      stack.push_back({Frame::Apply, entry.node, 0, 0, value});
+      control = node.b;
+      break;
+    case Frame::Apply: {
+      auto &fn = program.nodes[entry.value.fn];
+      stack.push_back({Frame::Return, 0, 0, env, {}});
+      bindings.push_back({fn.name, value, entry.value.env});
+      env = uint32_t(bindings.size() - 1);
+      control = fn.a;
+      break;
+    }
+    case Frame::Return:
+      env = entry.env;
+      break;
+    case Frame::BinopRhs:
+      if (value.kind != Value::Number)
+        throw NotANumber();
+      stack.push_back({Frame::Binop, entry.node, 0, 0, value});
+      control = node.b;
+      break;
+    case Frame::Binop:
+      if (value.kind != Value::Number)
+        throw NotANumber();
+      value.number = binop(node.op, entry.value.number, value.number);
+      break;
+    case Frame::IfBranch:
+      control = value.kind != Value::Number || value.number ? node.b : node.c;
+      break;
+    case Frame::Statement:
+      control = program.lists[node.a + entry.index];
+      if (entry.index + 1 < node.b)
+        stack.push_back(
+            {Frame::Statement, entry.node, entry.index + 1, 0, {}});
+      break;
+    case Frame::Assign:
+      // Later statements see the binding, as with EvalVisitor
+      bindings.push_back({node.name, value, env});
+      env = uint32_t(bindings.size() - 1);
+      break;
+    }
+  }
+
+  static constexpr int64_t binop(Op op, int64_t lhs, int64_t rhs) {
+    int64_t result = 0;
+    switch (op) {
+    case Op::Less:
+      return lhs < rhs;
+    case Op::Equal:
+      return lhs == rhs;
+    case Op::Greater:
+      return lhs > rhs;
+    case Op::Add:
+      if (__builtin_add_overflow(lhs, rhs, &result))
+        throw NumberOutOfRange();
+      return result;
+    case Op::Sub:
+      if (__builtin_sub_overflow(lhs, rhs, &result))
+        throw NumberOutOfRange();
+      return result;
+    }
+    return result;
+  }
+
+  const Program &program;
+  std::vector<Binding> bindings;
+  std::vector<Entry> stack;
+  uint32_t env, control;
+  Value value;
+};
+
+} // namespace detail
+
+/// Evaluates a script, giving the number the last statement evaluates to
+constexpr int64_t eval(std::string_view script) {
+  auto program = detail::parse_lines(script);
+  detail::Machine machine(program);
+  detail::Value value{detail::Value::Nothing};
+  for (auto statement : program.statements)
+    value = machine.run(statement);
+  if (value.kind != detail::Value::Number)
+    throw NotANumber();
+  return value.number;
+}
+
+namespace literals {
+
+/// Evaluates a one-line script at compile time
+consteval int64_t operator""_tiny(const char *str, size_t size) {
+  return eval(std::string_view(str, size));
+}
+
+} // namespace literals
+
+} // namespace tiny
@@ -0,0 +1,367 @@
+#include "task.hpp"
+#include "builtins.hpp"
+
+#include <array>
+#include <cassert>
+#include <optional>
+#include <utility>
+
+struct Task::State {
+  State(std::map<Identifier, Rc<Value>> globals, size_t slice,
+        const BuiltinRegistry &registry);
+
+  /// The root coroutine, so that errors evaluating even a leaf end up in
+  /// the task
+  Eval run(const Ast &ast);
+  /// Starts evaluating a node, without a coroutine if it is a leaf
+  Eval eval(const Ast &ast);
+  Eval assignment(const Assignment &let);
+  Eval if_cond(const IfCond &if_cond);
+  Eval loop(const Loop &loop);
+  Eval app(const App &app);
+  Eval binop(const Binop &op);
+  Eval statements(const StatementExpr &statements);
+  Eval tuple(const Tuple &tuple);
+  Eval project(const Project &project);
+  Eval destructure(const Destructure &destructure);
+  Eval apply(Rc<Value> function, Rc<Value> arg);
+
+  /// Suspends the awaiting coroutine, returning from `Task::resume`
+  struct Pause {
+    bool await_ready(void) const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> paused) noexcept {
+      state.leaf = paused;
+      state.paused = true;
+    }
+    void await_resume(void) noexcept {}
+
+    State &state;
+  };
+
+  std::map<Identifier, Rc<Value>> environment;
+  /// For builtins and the limits, with an empty environment
+  EvalVisitor evaluator;
+  size_t slice;
+  /// Steps left until the next pause
+  size_t until_pause;
+  size_t depth;
+  /// The coroutine to run next, set by each one as it suspends, or null once
+  /// the root has finished
+  std::coroutine_handle<> leaf;
+  /// Whether the slice is used up
+  bool paused;
+};
+
+namespace {
+
+/// Dispatches a node to the coroutine evaluating it
+struct Start : Visitor {
+  Start(Task::State &state) : state(state) {}
+
+  void visitAssignment(const Assignment &let) {
+    eval.emplace(state.assignment(let));
+  }
+  void visitFn(const Fn &fn) {
+    eval.emplace(state.evaluator.make_closure(fn, state.environment));
+  }
+  void visitIfCond(const IfCond &if_cond) {
+    eval.emplace(state.if_cond(if_cond));
+  }
+  void visitLoop(const Loop &loop) { eval.emplace(state.loop(loop)); }
+  void visitApp(const App &app) { eval.emplace(state.app(app)); }
+  void visitBinop(const Binop &op) { eval.emplace(state.binop(op)); }
+  void visitNumber(const Number &number) {
+    eval.emplace(state.evaluator.make_number(*number));
+  }
+  void visitIdentifier(const Identifier &id) {
+    auto it = state.environment.find(id);
+    if (it != state.environment.end()) {
+      eval.emplace(it->second);
+    } else if (auto builtin = state.evaluator.lookup(id)) {
+      eval.emplace(std::move(builtin));
+    } else {
+      throw UnknownVariable();
+    }
+  }
+  void visitStatementExpr(const StatementExpr &statements) {
+    eval.emplace(state.statements(statements));
+  }
+  void visitLazyBody(const LazyBody &lazy) { lazy.get().accept(*this); }
+  void visitTuple(const Tuple &tuple) { eval.emplace(state.tuple(tuple)); }
+  void visitProject(const Project &project) {
+    eval.emplace(state.project(project));
+  }
+  void visitDestructure(const Destructure &destructure) {
+    eval.emplace(state.destructure(destructure));
+  }
+
+  Task::State &state;
+  std::optional<Task::Eval> eval;
+};
+
+} // namespace
+
+Task::State::State(std::map<Identifier, Rc<Value>> globals,
+                   size_t slice, const BuiltinRegistry &registry)
+    : environment(std::move(globals)), evaluator(registry), slice(slice),
+      until_pause(slice), depth(0), paused(false) {
+  assert(slice > 0);
+}
+
+Task::Eval Task::State::run(const Ast &ast) { co_return co_await eval(ast); }
+
+Task::Eval Task::State::eval(const Ast &ast) {
+  Start start(*this);
+  ast.accept(start);
+  return std::move(*start.eval);
+}
+
+Task::Eval Task::State::assignment(const Assignment &let) {
+  auto value = co_await eval(let.get_body());
+  environment[*let.get_name()] = value;
+  co_return value;
+}
+
+Task::Eval Task::State::tuple(const Tuple &tuple) {
+  std::array<Rc<Value>, MAX_TUPLE_SIZE> fields;
+  auto &exprs = tuple.get_fields();
+  for (size_t i = 0; i < exprs.size(); ++i)
+    fields[i] = co_await eval(*exprs[i]);
+  co_return evaluator.make_tuple(fields.data(), exprs.size());
+}
+
+Task::Eval Task::State::project(const Project &project) {
+  auto tuple = co_await eval(project.get_tuple());
+  co_return as_tuple(tuple).get(project.get_index());
+}
+
+Task::Eval Task::State::destructure(const Destructure &destructure) {
+  auto value = co_await eval(destructure.get_body());
+  auto &names = destructure.get_names();
+  auto &tuple = as_tuple(value, names.size());
+  for (size_t i = 0; i < names.size(); ++i)
+    environment[names[i]] = tuple.get(i);
+  co_return value;
+}
+
+Task::Eval Task::State::if_cond(const IfCond &if_cond) {
+  auto cond = dynamic_pointer_cast<NumberValue>(
+      co_await eval(if_cond.get_condition()));
+  if (cond == nullptr || cond->get_value())
+    co_return co_await eval(if_cond.get_true_case());
+  co_return co_await eval(if_cond.get_false_case());
+}
+
+Task::Eval Task::State::loop(const Loop &loop) {
+  auto &vars = loop.get_vars();
+  std::vector<Rc<Value>> values;
+  for (auto &init : loop.get_inits())
+    values.push_back(co_await eval(*init));
+
+  // The loop runs in a copy of the environment, as in EvalVisitor
+  auto outer_environment = environment;
+  Rc<Value> result;
+  try {
+    while (true) {
+      for (size_t i = 0; i < vars.size(); ++i)
+        environment[vars[i]] = std::move(values[i]);
+      // Each iteration counts as a step, so long loops yield too
+      evaluator.step();
+      if (--until_pause == 0)
+        co_await Pause{*this};
+      auto cond = dynamic_pointer_cast<NumberValue>(
+          co_await eval(loop.get_condition()));
+      if (cond != nullptr && !cond->get_value())
+        break;
+      for (size_t i = 0; i < vars.size(); ++i)
+        values[i] = co_await eval(*loop.get_steps()[i]);
+    }
+    result = environment[vars.back()];
+  } catch (...) {
+    environment = std::move(outer_environment);
+    throw;
+  }
+  environment = std::move(outer_environment);
+  co_return result;
+}
+
+Task::Eval Task::State::app(const App &app) {
+  auto lhs = co_await eval(app.get_lhs());
+  if (!dynamic_pointer_cast<ClosureValue>(lhs) &&
+      !dynamic_pointer_cast<BuiltinValue>(lhs))
+    throw NotAFunction();
+  auto rhs = co_await eval(app.get_rhs());
+  co_return co_await apply(std::move(lhs), std::move(rhs));
+}
+
+Task::Eval Task::State::binop(const Binop &op) {
+  auto lhs = co_await eval(op.get_lhs());
+  if (!dynamic_pointer_cast<NumberValue>(lhs) &&
+      !dynamic_pointer_cast<ArrayValue>(lhs))
+    throw NotANumber();
+  auto rhs = co_await eval(op.get_rhs());
+  co_return evaluator.binop(op.get_op(), lhs, rhs);
+}
+
+Task::Eval Task::State::statements(const StatementExpr &statements) {
+  Rc<Value> last;
+  for (auto &statement : statements.get_body())
+    last = co_await eval(*statement);
+  co_return last;
+}
+
+Task::Eval Task::State::apply(Rc<Value> function, Rc<Value> arg) {
+  evaluator.step();
+  if (--until_pause == 0)
+    co_await Pause{*this};
+
+  if (auto builtin = dynamic_pointer_cast<BuiltinValue>(function))
+    co_return builtin->apply(std::move(arg), evaluator);
+  auto closure = dynamic_pointer_cast<ClosureValue>(function);
+  if (closure == nullptr)
+    throw NotAFunction();
+  // Partial application doesn't evaluate the body
+  if (closure->get_args().size() > 1)
+    co_return closure->apply(std::move(arg), evaluator);
+
+  if (depth >= evaluator.get_limits().max_depth)
+    throw CallDepthExceeded();
+  auto outer_environment = closure->get_environment();
+  outer_environment[closure->get_args().front()] = std::move(arg);
+  std::swap(environment, outer_environment);
+  ++depth;
+  Rc<Value> result;
+  try {
+    result = co_await eval(*closure->get_body());
+  } catch (...) {
+    --depth;
+    environment = std::move(outer_environment);
+    throw;
+  }
+  --depth;
+  environment = std::move(outer_environment);
+  co_return result;
+}
+
+Task::Eval::Eval(Handle handle) : handle(handle) {}
+
+Task::Eval::Eval(Rc<Value> ready) : handle(nullptr), ready(std::move(ready)) {}
+
+Task::Eval::Eval(Eval &&other)
+    : handle(std::exchange(other.handle, nullptr)),
+      ready(std::move(other.ready)) {}
+
+Task::Eval &Task::Eval::operator=(Eval &&other) {
+  if (handle)
+    handle.destroy();
+  handle = std::exchange(other.handle, nullptr);
+  ready = std::move(other.ready);
+  return *this;
+}
+
+Task::Eval::~Eval() {
+  if (handle)
+    handle.destroy();
+}
+
+bool Task::Eval::await_ready(void) const noexcept { return !handle; }
+
+void Task::Eval::await_suspend(Handle awaiting) {
+  auto &promise = handle.promise();
+  promise.continuation = awaiting;
+  promise.state = awaiting.promise().state;
+  promise.state->leaf = handle;
+}
+
+Rc<Value> Task::Eval::await_resume(void) {
+  if (!handle)
+    return std::move(ready);
+  auto &promise = handle.promise();
+  if (promise.error)
+    std::rethrow_exception(promise.error);
+  return std::move(promise.value);
+}
+
+Task::Eval Task::Eval::promise_type::get_return_object(void) {
+  return Eval(Handle::from_promise(*this));
+}
+
+std::suspend_always Task::Eval::promise_type::initial_suspend(void) noexcept {
+  return {};
+}
+
+bool Task::Eval::promise_type::FinalAwaiter::await_ready(void) const noexcept {
+  return false;
+}
+
+void Task::Eval::promise_type::FinalAwaiter::await_suspend(
+    Handle finished) noexcept {
+  auto &promise = finished.promise();
+  promise.state->leaf = promise.continuation;
+}
+
+void Task::Eval::promise_type::FinalAwaiter::await_resume(void) noexcept {}
+
+Task::Eval::promise_type::FinalAwaiter
+Task::Eval::promise_type::final_suspend(void) noexcept {
+  return {};
+}
+
+void Task::Eval::promise_type::return_value(Rc<Value> result) {
+  value = std::move(result);
+}
+
+void Task::Eval::promise_type::unhandled_exception(void) {
+  error = std::current_exception();
+}
+
+Task::Task(const Ast &ast,
+           std::map<Identifier, Rc<Value>> globals, size_t slice)
+    : Task(ast, std::move(globals), slice, BuiltinRegistry::standard()) {}
+
+Task::Task(const Ast &ast,
+           std::map<Identifier, Rc<Value>> globals, size_t slice,
+           const BuiltinRegistry &registry)
+    : state(std::make_unique<State>(std::move(globals), slice, registry)),
+      root(state->run(ast)) {
+  root.handle.promise().state = state.get();
+  state->leaf = root.handle;
+}
+
+Task::Task(Task &&other) = default;
+
+// The coroutines go before the state they refer to
+Task &Task::operator=(Task &&other) {
+  root = std::move(other.root);
+  state = std::move(other.state);
+  return *this;
+}
+
+Task::~Task() = default;
+
+bool Task::resume(void) {
+  assert(!done());
+  state->until_pause = state->slice;
+  state->paused = false;
+  // Each coroutine suspends back here, so the C++ stack stays as deep as one
+  // coroutine however deeply the calls nest
+  while (state->leaf && !state->paused)
+    state->leaf.resume();
+  return done();
+}
+
+bool Task::done(void) const { return root.handle.done(); }
+
+Rc<Value> Task::get_result(void) const {
+  assert(done());
+  auto &promise = root.handle.promise();
+  if (promise.error)
+    std::rethrow_exception(promise.error);
+  return promise.value;
+}
+
+const std::map<Identifier, Rc<Value>> & Task::get_environment(void) const {
+  return state->environment;
+}
+
+EvalVisitor &Task::get_evaluator(void) { return state->evaluator; }
@@ -0,0 +1,109 @@
+#pragma once
+
+/** \file
+ * \brief Evaluation as C++20 coroutines, which can be suspended part-way so
+ * that one thread can interleave many evaluations, e.g. round-robin:
+ *
+ *     std::deque<Task> tasks;
+ *     ...
+ *     while (!tasks.empty()) {
+ *       auto task = std::move(tasks.front());
+ *       tasks.pop_front();
+ *       if (!task.resume())
+ *         tasks.push_back(std::move(task));
+ *     }
+ *
+ * A task yields after every `slice` function applications. Each node is
+ * evaluated by its own coroutine. Rather than resuming each other, which
+ * only takes no C++ stack if the optimiser makes it a tail call, they
+ * suspend back to a loop in `resume` naming the coroutine to run next, so
+ * nested calls take heap frames rather than C++ stack at any optimisation
+ * level.
+ *
+ * Builtins are run to completion by an EvalVisitor, including the functions
+ * passed to `map`, `filter` and `fold`. That EvalVisitor also holds the
+ * limits, which apply to the task as a whole rather than to each slice.
+ */
+
+#include "ast.hpp"
+#include "eval.hpp"
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <map>
+#include <memory>
+
+struct Task {
+  /// Evaluates `ast` in an environment of `globals`, suspending every
+  /// `slice` steps. The AST must outlive the task.
+  Task(const Ast &ast, std::map<Identifier, Rc<Value>> globals, size_t slice);
+  Task(const Ast &ast, std::map<Identifier, Rc<Value>> globals,
+       size_t slice, const BuiltinRegistry &registry);
+  Task(Task &&other);
+  Task &operator=(Task &&other);
+  ~Task();
+
+  /// Runs until the evaluation finishes or uses up its slice. Returns
+  /// whether it has finished, in which case it must not be resumed again.
+  bool resume(void);
+  bool done(void) const;
+  /// The value of a finished task, or rethrows the error it finished with
+  Rc<Value> get_result(void) const;
+  /// The globals, including any defined by the task
+  const std::map<Identifier, Rc<Value>> & get_environment(void) const;
+  /// For setting limits or cancelling the task
+  EvalVisitor &get_evaluator(void);
+
+  /// A coroutine evaluating one node to a value. It starts suspended, and
+  /// runs when awaited.
+  struct Eval {
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    Eval(Handle handle);
+    /// An already evaluated node, which needs no coroutine
+    Eval(Rc<Value> ready);
+    Eval(Eval &&other);
+    Eval &operator=(Eval &&other);
+    ~Eval();
+
+    bool await_ready(void) const noexcept;
+    void await_suspend(Handle awaiting);
+    Rc<Value> await_resume(void);
+
+  private:
+    friend Task;
+    Handle handle;
+    Rc<Value> ready;
+  };
+
+  /// The state of one evaluation, shared by all of its coroutines
+  struct State;
+
+private:
+  std::unique_ptr<State> state;
+  Eval root;
+};
+
+struct Task::Eval::promise_type {
+  std::coroutine_handle<> continuation;
+  /// Where to say which coroutine runs next, passed down from the awaiting
+  /// coroutine
+  State *state = nullptr;
+  Rc<Value> value;
+  std::exception_ptr error;
+
+  Eval get_return_object(void);
+  std::suspend_always initial_suspend(void) noexcept;
+  /// Has `Task::resume` carry on with the awaiting coroutine, or finish at
+  /// the root
+  struct FinalAwaiter {
+    bool await_ready(void) const noexcept;
+    void await_suspend(Handle finished) noexcept;
+    void await_resume(void) noexcept;
+  };
+  FinalAwaiter final_suspend(void) noexcept;
+  void return_value(Rc<Value> result);
+  void unhandled_exception(void);
+};
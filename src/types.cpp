@@ -0,0 +1,571 @@
+#include "types.hpp"
+#include "analysis.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace {
+
+typedef std::shared_ptr<Type> TypePtr;
+
+TypePtr make_type(Type::Kind kind, TypePtr from = nullptr,
+                  TypePtr to = nullptr) {
+  return std::make_shared<Type>(
+      Type{kind, std::move(from), std::move(to), nullptr, 0, {}});
+}
+
+TypePtr make_variable(unsigned level) {
+  return std::make_shared<Type>(
+      Type{Type::Kind::Variable, nullptr, nullptr, nullptr, level, {}});
+}
+
+TypePtr make_function(TypePtr from, TypePtr to) {
+  return make_type(Type::Kind::Function, std::move(from), std::move(to));
+}
+
+TypePtr make_tuple_type(std::vector<TypePtr> fields) {
+  auto type = make_type(Type::Kind::Tuple);
+  type->fields = std::move(fields);
+  return type;
+}
+
+/// Follows unified variables to what they stand for
+TypePtr resolve(TypePtr type) {
+  while (type->kind == Type::Kind::Variable && type->instance) {
+    // Path compression
+    if (type->instance->kind == Type::Kind::Variable &&
+        type->instance->instance)
+      type->instance = type->instance->instance;
+    type = type->instance;
+  }
+  return type;
+}
+
+/// Names variables in order of appearance, consistently across the types in
+/// one message
+struct Formatter {
+  std::string format(const TypePtr &unresolved, bool in_function = false) {
+    auto type = resolve(unresolved);
+    switch (type->kind) {
+    case Type::Kind::Number:
+      return "num";
+    case Type::Kind::Array:
+      return "array";
+    case Type::Kind::Nothing:
+      return "nothing";
+    case Type::Kind::Variable: {
+      auto [it, inserted] = names.try_emplace(type.get(), "");
+      if (inserted) {
+        size_t n = names.size() - 1;
+        it->second = std::string(1, char('a' + n % 26));
+        if (n >= 26)
+          it->second += std::to_string(n / 26);
+      }
+      return it->second;
+    }
+    case Type::Kind::Function: {
+      // In order, so the variables are named in order
+      auto from = format(type->from, true);
+      auto str = from + " -> " + format(type->to);
+      return in_function ? "( " + str + " )" : str;
+    }
+    case Type::Kind::Tuple: {
+      std::string str = "( ";
+      for (size_t i = 0; i < type->fields.size(); ++i)
+        str += (i > 0 ? " , " : "") + format(type->fields[i]);
+      return str + " )";
+    }
+    }
+    return "";
+  }
+
+  std::map<const Type *, std::string> names;
+};
+
+TypeError mismatch(const TypePtr &expected, const TypePtr &found) {
+  Formatter formatter;
+  auto lhs = formatter.format(expected);
+  return TypeError("Expected " + lhs + " but found " +
+                   formatter.format(found));
+}
+
+/// Whether `variable` occurs in `type`. Also brings the variables of `type`
+/// out to its level, as they can no longer be generalised any deeper.
+bool occurs(const TypePtr &variable, const TypePtr &unresolved) {
+  auto type = resolve(unresolved);
+  if (type == variable)
+    return true;
+  if (type->kind == Type::Kind::Variable)
+    type->level = std::min(type->level, variable->level);
+  else if (type->kind == Type::Kind::Function)
+    return occurs(variable, type->from) || occurs(variable, type->to);
+  else if (type->kind == Type::Kind::Tuple)
+    return std::any_of(
+        type->fields.begin(), type->fields.end(),
+        [&](const TypePtr &field) { return occurs(variable, field); });
+  return false;
+}
+
+/// Binds a variable to a type
+void bind_variable(const TypePtr &variable, const TypePtr &type) {
+  if (occurs(variable, type)) {
+    Formatter formatter;
+    auto lhs = formatter.format(variable);
+    throw TypeError("Cannot construct the infinite type " + lhs + " = " +
+                    formatter.format(type));
+  }
+  variable->instance = type;
+}
+
+void unify(const TypePtr &expected, const TypePtr &found) {
+  auto lhs = resolve(expected), rhs = resolve(found);
+  if (lhs == rhs)
+    return;
+  if (lhs->kind == Type::Kind::Variable) {
+    bind_variable(lhs, rhs);
+    return;
+  }
+  if (rhs->kind == Type::Kind::Variable) {
+    bind_variable(rhs, lhs);
+    return;
+  }
+  if (lhs->kind != rhs->kind ||
+      lhs->fields.size() != rhs->fields.size())
+    throw mismatch(expected, found);
+  if (lhs->kind == Type::Kind::Function) {
+    unify(lhs->from, rhs->from);
+    unify(lhs->to, rhs->to);
+  }
+  for (size_t i = 0; i < lhs->fields.size(); ++i)
+    unify(lhs->fields[i], rhs->fields[i]);
+}
+
+/// Makes the variables created deeper than `level` generic
+void generalise(const TypePtr &unresolved, unsigned level) {
+  auto type = resolve(unresolved);
+  if (type->kind == Type::Kind::Variable) {
+    if (type->level > level)
+      type->level = Type::GENERIC;
+  } else if (type->kind == Type::Kind::Function) {
+    generalise(type->from, level);
+    generalise(type->to, level);
+  }
+  for (auto &field : type->fields)
+    generalise(field, level);
+}
+
+/// Copies a type with fresh variables for its generic ones
+TypePtr instantiate(const TypePtr &unresolved, unsigned level,
+                    std::map<const Type *, TypePtr> &fresh) {
+  auto type = resolve(unresolved);
+  if (type->kind == Type::Kind::Variable) {
+    if (type->level != Type::GENERIC)
+      return type;
+    auto &copy = fresh[type.get()];
+    if (!copy)
+      copy = make_variable(level);
+    return copy;
+  }
+  if (type->kind == Type::Kind::Function)
+    return make_function(instantiate(type->from, level, fresh),
+                         instantiate(type->to, level, fresh));
+  if (type->kind == Type::Kind::Tuple) {
+    std::vector<TypePtr> fields;
+    for (auto &field : type->fields)
+      fields.push_back(instantiate(field, level, fresh));
+    return make_tuple_type(std::move(fields));
+  }
+  return type;
+}
+
+TypePtr instantiate(const TypePtr &type, unsigned level) {
+  std::map<const Type *, TypePtr> fresh;
+  return instantiate(type, level, fresh);
+}
+
+/// Parses signatures by recursive descent
+struct SignatureParser {
+  SignatureParser(const std::string &signature) : signature(signature) {
+    for (size_t i = 0; i < signature.size();) {
+      char c = signature[i];
+      if (std::isspace(static_cast<unsigned char>(c))) {
+        ++i;
+      } else if (c == '(' || c == ')' || c == ',') {
+        tokens.push_back(std::string(1, c));
+        ++i;
+      } else if (signature.compare(i, 2, "->") == 0) {
+        tokens.push_back("->");
+        i += 2;
+      } else if (std::islower(static_cast<unsigned char>(c))) {
+        size_t start = i;
+        while (i < signature.size() &&
+               std::isalnum(static_cast<unsigned char>(signature[i])))
+          ++i;
+        tokens.push_back(signature.substr(start, i - start));
+      } else {
+        throw error();
+      }
+    }
+  }
+
+  TypePtr parse(void) {
+    auto type = parse_type();
+    if (next != tokens.size())
+      throw error();
+    return type;
+  }
+
+  TypePtr parse_type(void) {
+    auto from = parse_atom();
+    if (next < tokens.size() && tokens[next] == "->") {
+      ++next;
+      return make_function(from, parse_type());
+    }
+    return from;
+  }
+
+  TypePtr parse_atom(void) {
+    if (next == tokens.size())
+      throw error();
+    auto &token = tokens[next++];
+    if (token == "(") {
+      std::vector<TypePtr> fields = {parse_type()};
+      while (next < tokens.size() && tokens[next] == ",") {
+        ++next;
+        fields.push_back(parse_type());
+      }
+      if (next == tokens.size() || tokens[next++] != ")" ||
+          fields.size() > MAX_TUPLE_SIZE)
+        throw error();
+      return fields.size() == 1 ? fields.front()
+                                : make_tuple_type(std::move(fields));
+    }
+    if (token == "num")
+      return make_type(Type::Kind::Number);
+    if (token == "array")
+      return make_type(Type::Kind::Array);
+    if (token == "nothing")
+      return make_type(Type::Kind::Nothing);
+    if (token == ")" || token == "->" || token == ",")
+      throw error();
+    auto &variable = variables[token];
+    if (!variable)
+      variable = make_variable(Type::GENERIC);
+    return variable;
+  }
+
+  TypeError error(void) const {
+    return TypeError("Bad type signature: " + signature);
+  }
+
+  const std::string &signature;
+  std::vector<std::string> tokens;
+  size_t next = 0;
+  std::map<std::string, TypePtr> variables;
+};
+
+} // namespace
+
+TypeError::TypeError(std::string message) : message(std::move(message)) {}
+
+const char *TypeError::what(void) const noexcept { return message.c_str(); }
+
+/// Algorithm W, over an environment which `let`s update in evaluation order
+/// as they do when evaluating
+struct TypeChecker::Infer : Visitor {
+  Infer(const TypeChecker &checker, Environment &environment)
+      : checker(checker), environment(&environment), level(0) {}
+
+  void visitAssignment(const Assignment &let) override {
+    ++level;
+    let.get_body().accept(*this);
+    --level;
+    generalise(type, level);
+    (*environment)[let.get_name()] = type;
+    type = instantiate(type, level);
+  }
+
+  void visitFn(const Fn &fn) override {
+    // The closure captures the environment as it is now, and its `let`s
+    // only change its own copy
+    Environment inner = *environment;
+    std::vector<TypePtr> args;
+    for (auto &arg : fn.get_args()) {
+      args.push_back(make_variable(level));
+      inner[arg] = args.back();
+    }
+    auto outer = std::exchange(environment, &inner);
+    fn.get_body()->accept(*this);
+    environment = outer;
+    for (auto it = args.rbegin(); it != args.rend(); ++it)
+      type = make_function(*it, type);
+    record(fn);
+  }
+
+  void visitIfCond(const IfCond &if_cond) override {
+    // Anything can be a condition
+    if_cond.get_condition().accept(*this);
+
+    Environment true_environment = *environment;
+    Environment false_environment = *environment;
+    auto outer = std::exchange(environment, &true_environment);
+    if_cond.get_true_case().accept(*this);
+    auto true_type = type;
+    environment = &false_environment;
+    if_cond.get_false_case().accept(*this);
+    environment = outer;
+    unify(true_type, type);
+
+    // A binding made in only one branch, or differently in each, could be
+    // either afterwards
+    Environment merged;
+    for (auto &[id, binding] : true_environment) {
+      auto it = false_environment.find(id);
+      bool same = it != false_environment.end() && it->second == binding;
+      merged.emplace(id, same ? binding : nullptr);
+    }
+    for (auto &[id, binding] : false_environment)
+      merged.emplace(id, nullptr);
+    *environment = std::move(merged);
+    record(if_cond);
+  }
+
+  void visitLoop(const Loop &loop) override {
+    std::vector<TypePtr> vars;
+    for (auto &init : loop.get_inits()) {
+      init->accept(*this);
+      vars.push_back(type);
+    }
+    // The loop's variables and `let`s are its own
+    Environment inner = *environment;
+    for (size_t i = 0; i < vars.size(); ++i)
+      inner[loop.get_vars()[i]] = vars[i];
+    auto outer = std::exchange(environment, &inner);
+    // Anything can be a condition
+    loop.get_condition().accept(*this);
+    for (size_t i = 0; i < vars.size(); ++i) {
+      loop.get_steps()[i]->accept(*this);
+      unify(vars[i], type);
+    }
+    environment = outer;
+    type = vars.back();
+    record(loop);
+  }
+
+  void visitApp(const App &app) override {
+    app.get_lhs().accept(*this);
+    auto function = type;
+    app.get_rhs().accept(*this);
+    auto argument = type;
+    auto kind = resolve(function)->kind;
+    if (kind != Type::Kind::Variable && kind != Type::Kind::Function)
+      throw TypeError("Expected a function but found " + format(function));
+    type = make_variable(level);
+    unify(function, make_function(argument, type));
+    record(app);
+  }
+
+  void visitBinop(const Binop &op) override {
+    op.get_lhs().accept(*this);
+    auto lhs = type;
+    op.get_rhs().accept(*this);
+    auto rhs = type;
+
+    auto is_array = [](const TypePtr &t) {
+      return resolve(t)->kind == Type::Kind::Array;
+    };
+    if (is_array(lhs) || is_array(rhs)) {
+      // Element-wise, with either side an array or a number
+      for (auto &operand : {lhs, rhs}) {
+        if (!is_array(operand))
+          unify(make_type(Type::Kind::Number), operand);
+      }
+      type = make_type(Type::Kind::Array);
+    } else {
+      unify(make_type(Type::Kind::Number), lhs);
+      unify(make_type(Type::Kind::Number), rhs);
+      type = make_type(Type::Kind::Number);
+    }
+    record(op);
+  }
+
+  void visitNumber(const Number &number) override {
+    type = make_type(Type::Kind::Number);
+    record(number);
+  }
+
+  void visitIdentifier(const Identifier &id) override {
+    auto it = environment->find(id);
+    if (it != environment->end()) {
+      if (!it->second)
+        throw TypeError(*id + " has no known type");
+      type = instantiate(it->second, level);
+    } else if (auto signature = checker.signature(id)) {
+      type = instantiate(signature, level);
+    } else if (checker.registry->environment().contains(id)) {
+      throw TypeError(*id + " has no type signature");
+    } else {
+      throw TypeError("Unknown variable " + *id);
+    }
+    record(id);
+  }
+
+  void visitStatementExpr(const StatementExpr &statements) override {
+    type = make_type(Type::Kind::Nothing);
+    for (auto &statement : statements.get_body())
+      statement->accept(*this);
+    record(statements);
+  }
+
+  void visitTuple(const Tuple &tuple) override {
+    std::vector<TypePtr> fields;
+    for (auto &field : tuple.get_fields()) {
+      field->accept(*this);
+      fields.push_back(type);
+    }
+    type = make_tuple_type(std::move(fields));
+    record(tuple);
+  }
+
+  void visitProject(const Project &project) override {
+    project.get_tuple().accept(*this);
+    auto tuple = resolve(type);
+    if (tuple->kind == Type::Kind::Variable)
+      throw TypeError("Cannot project out of a tuple of unknown size");
+    if (tuple->kind != Type::Kind::Tuple)
+      throw TypeError("Expected a tuple but found " + format(tuple));
+    if (project.get_index() >= tuple->fields.size())
+      throw TypeError("No field " + std::to_string(project.get_index()) +
+                      " in " + format(tuple));
+    type = tuple->fields[project.get_index()];
+    record(project);
+  }
+
+  void visitDestructure(const Destructure &destructure) override {
+    auto &names = destructure.get_names();
+    ++level;
+    destructure.get_body().accept(*this);
+    std::vector<TypePtr> fields;
+    for (size_t i = 0; i < names.size(); ++i)
+      fields.push_back(make_variable(level));
+    --level;
+    auto tuple = make_tuple_type(fields);
+    unify(tuple, type);
+    for (size_t i = 0; i < names.size(); ++i) {
+      generalise(fields[i], level);
+      (*environment)[names[i]] = fields[i];
+    }
+    type = instantiate(tuple, level);
+  }
+
+  void visitLazyBody(const LazyBody &) override {
+    // Checking the statement would parse it
+    throw TypeError("Function bodies parsed lazily are not checked");
+  }
+
+  void record(const Expression &expression) {
+    types.emplace_back(&expression, type);
+  }
+
+  /// Annotates every expression of the statement
+  void annotate(void) const {
+    for (auto &[expression, unresolved] : types) {
+      auto kind = resolve(unresolved)->kind;
+      expression->set_proven(kind == Type::Kind::Number ? Proven::Number
+                             : kind == Type::Kind::Function
+                                 ? Proven::Function
+                                 : Proven::Unknown);
+    }
+  }
+
+  const TypeChecker &checker;
+  Environment *environment;
+  /// How deeply nested in the bodies of `let`s
+  unsigned level;
+  /// Of the node last visited
+  TypePtr type;
+  std::vector<std::pair<const Expression *, TypePtr>> types;
+};
+
+TypeChecker::TypeChecker() : TypeChecker(BuiltinRegistry::standard()) {}
+
+TypeChecker::TypeChecker(const BuiltinRegistry &registry)
+    : registry(&registry) {}
+
+std::shared_ptr<Type> TypeChecker::check(const Ast &ast) {
+  pending.reset();
+  Environment environment = globals;
+  Infer infer(*this, environment);
+  ast.accept(infer);
+  infer.annotate();
+  pending = std::move(environment);
+  return infer.type;
+}
+
+void TypeChecker::commit(void) {
+  if (pending)
+    globals = std::move(*pending);
+  pending.reset();
+}
+
+void TypeChecker::forget(const Ast &ast) {
+  pending.reset();
+  for (auto &name : assigned_variables(ast))
+    globals.insert_or_assign(name, nullptr);
+}
+
+std::shared_ptr<Type> TypeChecker::lookup(const Identifier &id) const {
+  auto it = globals.find(id);
+  if (it != globals.end())
+    return it->second;
+  return signature(id);
+}
+
+std::shared_ptr<Type> TypeChecker::signature(const Identifier &id) const {
+  auto it = signatures.find(id);
+  if (it != signatures.end())
+    return it->second;
+  auto text = registry->signature(id);
+  if (!text)
+    return nullptr;
+  auto type = parse(*text);
+  signatures.emplace(id, type);
+  return type;
+}
+
+std::string TypeChecker::format(const std::shared_ptr<Type> &type) {
+  Formatter formatter;
+  return formatter.format(type);
+}
+
+std::shared_ptr<Type> TypeChecker::parse(const std::string &signature) {
+  SignatureParser parser(signature);
+  return parser.parse();
+}
+
+void evaluate_checked(TypeChecker &checker, EvalVisitor &evaluator,
+                      const Ast &ast) {
+  bool typed = true;
+  try {
+    checker.check(ast);
+  } catch (const TypeError &) {
+    typed = false;
+  }
+
+  try {
+    if (typed)
+      evaluator.evaluate_typed(ast);
+    else
+      evaluator.evaluate(ast);
+  } catch (...) {
+    checker.forget(ast);
+    throw;
+  }
+  if (typed)
+    checker.commit();
+  else
+    checker.forget(ast);
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+/** \file
+ * \brief Hindley-Milner type inference, so that evaluation can skip run-time
+ * checks on values proven to be numbers or functions. Types are
+ *
+ *     num              -- numbers
+ *     array            -- packed arrays of numbers
+ *     nothing          -- the value of an empty block
+ *     ( a , b , ... )  -- tuples
+ *     a -> b           -- functions, curried
+ *     a  b  c ...      -- type variables, of polymorphic functions
+ *
+ * e.g. `fn ( f , x ) f ( f x )` has type `( a -> a ) -> a -> a`. Functions
+ * bound by `let` are polymorphic. An operand of a binary operator is `num`
+ * or, element-wise, `array`; one that could be either is taken to be `num`.
+ * A `let` whose binding differs between the branches of an `if` leaves the
+ * name without a type. Projecting a field out of a tuple needs its size to be
+ * known, e.g. `fn p p . 0` is not typeable but `fn ( ( a , b ) ) a` is.
+ *
+ * A TypeChecker keeps the types of the globals in step with an evaluator:
+ *
+ *     TypeChecker checker;
+ *     EvalVisitor evaluator;
+ *     for (auto &node : parse(line))
+ *       evaluate_checked(checker, evaluator, *node);
+ *
+ * Checking a statement annotates its expressions (see `Expression::
+ * get_proven`), and `EvalVisitor::evaluate_typed` trusts them. Statements
+ * which are not typeable, such as ones using the self-application in `Y`,
+ * are evaluated with all the usual checks, and the globals they bind have no
+ * type afterwards.
+ */
+
+#include "ast.hpp"
+#include "builtins.hpp"
+#include "eval.hpp"
+
+#include <climits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+struct TypeError : std::exception {
+  TypeError(std::string message);
+  const char *what(void) const noexcept override;
+
+private:
+  std::string message;
+};
+
+struct Type {
+  enum class Kind { Variable, Number, Array, Nothing, Function, Tuple };
+
+  /// Variables of a polymorphic type, which are copied for each use
+  static const unsigned GENERIC = UINT_MAX;
+
+  Kind kind;
+  // Functions
+  std::shared_ptr<Type> from;
+  std::shared_ptr<Type> to;
+  // Variables: what it was unified with, if anything, and how deeply nested
+  // in `let`s it was created (or GENERIC)
+  std::shared_ptr<Type> instance;
+  unsigned level;
+  // Tuples
+  std::vector<std::shared_ptr<Type>> fields;
+};
+
+struct TypeChecker {
+  typedef std::map<Identifier, std::shared_ptr<Type>> Environment;
+
+  /// Builtins are typed by their signatures in the registry, which has to
+  /// outlive the checker
+  TypeChecker();
+  TypeChecker(const BuiltinRegistry &registry);
+
+  /// Infers the type of a top-level statement, given the globals so far, and
+  /// annotates its expressions. Throws TypeError.
+  std::shared_ptr<Type> check(const Ast &ast);
+  /// Takes the globals bound by the statement last checked as bound, once it
+  /// has been evaluated without error
+  void commit(void);
+  /// Forgets the types of the globals a statement binds, when it was
+  /// evaluated unchecked or threw part-way
+  void forget(const Ast &ast);
+  /// The type of a global, or nullptr if it has none
+  std::shared_ptr<Type> lookup(const Identifier &id) const;
+
+  /// E.g. `( num -> a ) -> array`
+  static std::string format(const std::shared_ptr<Type> &type);
+  /// Parses the format above. Its variables are generic.
+  static std::shared_ptr<Type> parse(const std::string &signature);
+
+private:
+  struct Infer;
+
+  /// The type of a builtin, from its signature, or nullptr
+  std::shared_ptr<Type> signature(const Identifier &id) const;
+
+  const BuiltinRegistry *registry;
+  /// Globals bound to nullptr have no known type
+  Environment globals;
+  /// The globals after the statement last checked
+  std::optional<Environment> pending;
+  /// Parsed signatures of builtins
+  mutable std::map<Identifier, std::shared_ptr<Type>> signatures;
+};
+
+/// Evaluates a top-level statement typed if it type-checks, and untyped
+/// otherwise, keeping the checker's globals in step with the evaluator's
+void evaluate_checked(TypeChecker &checker, EvalVisitor &evaluator,
+                      const Ast &ast);
@@ -0,0 +1,646 @@
+#include "batch.hpp"
+#include "cek.hpp"
+#include "eval.hpp"
+#include "formatter.hpp"
+#include "history.hpp"
+#include "interpreter.hpp"
+#include "kernels.hpp"
+#include "metrics.hpp"
+#include "nodes.hpp"
+#include "parser.hpp"
+#include "profiler.hpp"
+#include "serialise.hpp"
+#include "task.hpp"
+#include "types.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+extern "C" {
+#include <readline/history.h>
+#include <readline/readline.h>
+}
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+/// A script of `lines` definitions, each with a non-trivial function body
+std::string large_script(size_t lines) {
+  std::string script;
+  for (size_t i = 0; i < lines; ++i) {
+    auto n = std::to_string(i);
+    script += "let f" + n + " = fn ( x , y ) { let z = x + " + n +
+              " ; if z < y then ( fn a { a - z } ) y else { z + y - 1 } }\n";
+  }
+  return script;
+}
+
+TEST_CASE("Program cache", "[!benchmark][serialise]") {
+  auto script = large_script(5000);
+  auto hash = hash_source(script);
+  auto data = serialise(parse_lines(script), hash);
+
+  BENCHMARK("cold: tokenise and parse 5000 lines") {
+    return parse_lines(script);
+  };
+
+  BENCHMARK("warm: deserialise 5000 lines") { return deserialise(data, hash); };
+}
+
+TEST_CASE("Shared nodes", "[!benchmark][nodes]") {
+  // Generated code, where every line has the same helpers
+  std::string script;
+  for (size_t i = 0; i < 5000; ++i) {
+    script += "let f" + std::to_string(i % 100) +
+              " = fn ( x , y ) { let z = x + 1 ; if z < y then ( fn a "
+              "{ a - z } ) y else { z + y - 1 } }\n";
+  }
+  NodeTable nodes;
+  auto program = parse_lines(script, &nodes);
+  auto &stats = nodes.get_stats();
+  std::cout << "5000 lines: " << stats.parsed << " nodes, " << nodes.size()
+            << " distinct; " << stats.parsed_bytes / 1024 << "KB unshared, "
+            << (stats.parsed_bytes - stats.shared_bytes) / 1024
+            << "KB shared" << std::endl;
+
+  BENCHMARK("parse 5000 lines") { return parse_lines(script); };
+  BENCHMARK("parse 5000 lines, sharing nodes") {
+    NodeTable nodes;
+    return parse_lines(script, &nodes);
+  };
+}
+
+/// Bytes in use on the heap, where glibc can tell
+size_t heap_in_use(void) {
+#ifdef __GLIBC__
+  return mallinfo2().uordblks;
+#else
+  return 0;
+#endif
+}
+
+TEST_CASE("Lazy parsing", "[!benchmark][lazy]") {
+  // A prelude of 5000 functions, of which a run only calls a few. Defining
+  // them all copies the environment into each closure, which takes as long
+  // either way, so this times the parsing and the calls.
+  auto prelude = large_script(5000);
+  auto run = [&](bool lazy) {
+    auto program = parse_lines(prelude, nullptr, lazy);
+    EvalVisitor evaluator;
+    for (size_t i : {0, 42, 4999})
+      evaluator.evaluate(*program[i]);
+    evaluator.evaluate(
+        *parse("( ( f0 1 ) 2 ) + ( ( f42 3 ) 4 ) + ( ( f4999 5 ) 6 )")[0]);
+    return program;
+  };
+
+  for (bool lazy : {false, true}) {
+    auto before = heap_in_use();
+    auto program = run(lazy);
+    std::cout << (lazy ? "lazy" : "eager") << ": "
+              << (heap_in_use() - before) / 1024 << "KB of syntax-tree"
+              << std::endl;
+  }
+
+  BENCHMARK("5000 functions, eager") { return run(false); };
+  BENCHMARK("5000 functions, lazy") { return run(true); };
+}
+
+TEST_CASE("Formatting", "[!benchmark][format]") {
+  // One closure with a large body
+  std::string body = "0";
+  for (size_t i = 0; i < 2000; ++i)
+    body = "if x < " + std::to_string(i) + " then x + " + std::to_string(i) +
+           " else ( f x ) " + std::to_string(i) + " - { " + body + " }";
+  auto program = parse("fn ( f , x ) " + body);
+
+  BENCHMARK("callback into std::string") {
+    std::string formatted;
+    FmtAst ast_formatter([&](auto s) { formatted += s; });
+    program[0]->accept(ast_formatter);
+    return formatted.size();
+  };
+
+  FmtBuffer buffer;
+  FmtAst ast_formatter(buffer);
+  BENCHMARK("FmtBuffer") {
+    buffer.clear();
+    program[0]->accept(ast_formatter);
+    return buffer.view().size();
+  };
+}
+
+/// Evaluates each line in turn, returning the last value
+Rc<Value> evaluate(EvalVisitor &evaluator,
+                   std::initializer_list<std::string> lines) {
+  for (auto &line : lines) {
+    for (auto &node : parse(line))
+      node->accept(evaluator);
+  }
+  return evaluator.get_last();
+}
+
+const std::string Y = "let Y = fn f {"
+                      "  ( fn x { f ( fn a { ( x x ) a } ) } )"
+                      "  ( fn x { f ( fn a { ( x x ) a } ) } )"
+                      " }";
+const std::string SUM_N = "let sum_n = Y ( fn sum_n { fn n {"
+                          "  if n == 0 then 0 else n + sum_n ( n - 1 ) "
+                          " } } )";
+
+TEST_CASE("Arrays", "[!benchmark][array]") {
+  EvalVisitor evaluator;
+  evaluate(evaluator, {Y, SUM_N, "let xs = range 10000000"});
+  auto &xs = dynamic_pointer_cast<ArrayValue>(
+                 evaluator.lookup(Identifier("xs")))
+                 ->get_values();
+
+  BENCHMARK("recursive sum_n 1000") {
+    return evaluate(evaluator, {"sum_n 1000"});
+  };
+
+  BENCHMARK("sum ( range 1000 )") {
+    return evaluate(evaluator, {"sum ( range 1000 )"});
+  };
+
+  BENCHMARK("sum ( range 10000000 )") {
+    return evaluate(evaluator, {"sum ( range 10000000 )"});
+  };
+
+  BENCHMARK(std::string("sum over 10M, ") + kernels::isa() + " kernel") {
+    return kernels::sum(xs.data(), xs.size());
+  };
+
+  BENCHMARK("sum over 10M, scalar kernel") {
+    return kernels::sum_scalar(xs.data(), xs.size());
+  };
+
+  BENCHMARK("xs + xs over 10M") { return evaluate(evaluator, {"xs + xs"}); };
+}
+
+TEST_CASE("Builtins", "[!benchmark][builtins]") {
+  EvalVisitor evaluator;
+  evaluate(evaluator, {"let xs = range 10000",
+                       "let min_l = fn ( a , b ) if a < b then a else b",
+                       "let add_l = fn ( a , b ) a + b"});
+
+  auto lambda_min = parse("( min_l 6 ) 7");
+  BENCHMARK("lambda min") {
+    lambda_min[0]->accept(evaluator);
+    return evaluator.get_last();
+  };
+  auto builtin_min = parse("( min 6 ) 7");
+  BENCHMARK("builtin min") {
+    builtin_min[0]->accept(evaluator);
+    return evaluator.get_last();
+  };
+
+  BENCHMARK("fold with lambda add over 10000") {
+    return evaluate(evaluator, {"( ( fold add_l ) 0 ) xs"});
+  };
+  BENCHMARK("fold with builtin add over 10000") {
+    return evaluate(evaluator, {"( ( fold add ) 0 ) xs"});
+  };
+}
+
+TEST_CASE("Evaluation limits", "[!benchmark][limits]") {
+  EvalVisitor evaluator;
+  evaluate(evaluator, {Y, SUM_N});
+  auto program = parse("sum_n 1000");
+
+  BENCHMARK("sum_n 1000, no limits") {
+    evaluator.evaluate(*program[0]);
+    return evaluator.get_last();
+  };
+
+  EvalVisitor limited;
+  limited.set_limits(
+      {.fuel = 1000000, .max_bytes = 1 << 30, .max_depth = 4000});
+  evaluate(limited, {Y, SUM_N});
+  BENCHMARK("sum_n 1000, with limits") {
+    limited.evaluate(*program[0]);
+    return limited.get_last();
+  };
+}
+
+/// Runs long and short evaluations round-robin on one thread, all arriving
+/// at once, and prints percentiles of how long the short ones took to finish
+void schedule(const std::map<Identifier, Rc<Value>> &globals, size_t slice) {
+  auto long_program = parse("sum_n 2000");
+  auto short_program = parse("sum_n 10");
+  std::deque<std::pair<Task, bool>> queue;
+  for (size_t i = 0; i < 1000; ++i) {
+    bool is_short = i % 10 != 0;
+    queue.emplace_back(
+        Task(*(is_short ? short_program : long_program)[0], globals, slice),
+        is_short);
+  }
+
+  typedef std::chrono::steady_clock Clock;
+  std::vector<double> latencies;
+  auto start = Clock::now();
+  while (!queue.empty()) {
+    auto [task, is_short] = std::move(queue.front());
+    queue.pop_front();
+    if (!task.resume()) {
+      queue.emplace_back(std::move(task), is_short);
+    } else if (is_short) {
+      latencies.push_back(
+          std::chrono::duration<double, std::milli>(Clock::now() - start)
+              .count());
+    }
+  }
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) {
+    return latencies[size_t(p * (latencies.size() - 1))];
+  };
+  auto slice_name = slice == SIZE_MAX ? "unlimited" : std::to_string(slice);
+  std::cout << "slice " << slice_name << ": short evaluations p50 "
+            << percentile(0.5) << " ms, p99 " << percentile(0.99)
+            << " ms, max " << latencies.back() << " ms; all done in "
+            << std::chrono::duration<double, std::milli>(Clock::now() - start)
+                   .count()
+            << " ms" << std::endl;
+}
+
+TEST_CASE("Task scheduling", "[!benchmark][task]") {
+  EvalVisitor evaluator;
+  evaluate(evaluator, {Y, SUM_N});
+  auto globals = evaluator.get_environment();
+  auto program = parse("sum_n 1000");
+
+  BENCHMARK("sum_n 1000, EvalVisitor") {
+    evaluator.evaluate(*program[0]);
+    return evaluator.get_last();
+  };
+  BENCHMARK("sum_n 1000, one task") {
+    Task task(*program[0], globals, SIZE_MAX);
+    task.resume();
+    return task.get_result();
+  };
+  BENCHMARK("sum_n 1000, task in slices of 100") {
+    Task task(*program[0], globals, 100);
+    while (!task.resume()) {
+    }
+    return task.get_result();
+  };
+
+  // 100 long and 900 short evaluations
+  for (auto slice : {SIZE_MAX, size_t(1000), size_t(100)})
+    schedule(globals, slice);
+}
+
+TEST_CASE("CEK machine", "[!benchmark][cek]") {
+  EvalVisitor evaluator;
+  evaluate(evaluator, {Y, SUM_N});
+  CekMachine machine;
+  machine.set_environment(evaluator.get_environment());
+  auto program = parse("sum_n 1000");
+
+  BENCHMARK("sum_n 1000, EvalVisitor") {
+    evaluator.evaluate(*program[0]);
+    return evaluator.get_last();
+  };
+  BENCHMARK("sum_n 1000, CekMachine") {
+    machine.evaluate(*program[0]);
+    return machine.get_last();
+  };
+}
+
+TEST_CASE("Prepared functions", "[!benchmark][interpreter]") {
+  const char *DIST = "let dist = fn ( a , b ) if a < b then b - a else a - b";
+  Interpreter interpreter;
+  interpreter.load(DIST);
+  auto dist = interpreter.prepare("dist");
+  uint32_t a = 3, b = 10;
+
+  BENCHMARK("dist, building and evaluating source") {
+    auto source = "( ( dist ) " + std::to_string(a) + " ) " +
+                  std::to_string(b);
+    return interpreter.load(source);
+  };
+  BENCHMARK("dist, EvalVisitor::apply") {
+    auto &evaluator = interpreter.get_evaluator();
+    auto function = interpreter.get("dist");
+    auto partial = evaluator.apply(function, evaluator.make<NumberValue>(a));
+    return evaluator.apply(partial, evaluator.make<NumberValue>(b));
+  };
+  BENCHMARK("dist, PreparedFunction") { return dist(a, b); };
+
+  // Per-call overhead over a loop of calls, without the harness
+  const size_t CALLS = 1000000;
+  auto start = std::chrono::steady_clock::now();
+  uint32_t total = 0;
+  for (size_t i = 0; i < CALLS; ++i)
+    total += dist(uint32_t(i), b);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "PreparedFunction: "
+            << std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+                       .count() /
+                   CALLS
+            << " ns per call (total " << total << ")" << std::endl;
+}
+
+TEST_CASE("Batch evaluation", "[!benchmark][batch]") {
+  Interpreter interpreter;
+  interpreter.load("let f = fn x { let y = ( ( mul x ) 40503 ) ; "
+                   "if ( ( mod y ) 3 ) == 0 then y - x else y + x }");
+  std::vector<uint32_t> inputs(1000000);
+  for (size_t i = 0; i < inputs.size(); ++i)
+    inputs[i] = uint32_t(i);
+
+  // The scaling curve, from one thread to one per core, and past that to
+  // show the cost of oversubscription on small machines
+  size_t cores = std::max(std::thread::hardware_concurrency(), 1u);
+  std::vector<size_t> counts;
+  for (size_t threads = 1; threads < std::max<size_t>(cores, 4); threads *= 2)
+    counts.push_back(threads);
+  counts.push_back(std::max<size_t>(cores, 4));
+  std::cout << cores << " cores" << std::endl;
+
+  // What it replaces: a line of source per input, on a tenth of the inputs
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < inputs.size() / 10; ++i)
+    interpreter.load("f " + std::to_string(inputs[i]));
+  std::chrono::duration<double, std::milli> sequential =
+      std::chrono::steady_clock::now() - start;
+  std::cout << "One line per input: " << sequential.count() * 10 << " ms"
+            << std::endl;
+
+  double one_thread = 0;
+  for (auto threads : counts) {
+    ThreadPool pool(threads);
+    auto start = std::chrono::steady_clock::now();
+    auto results = batch_map(interpreter, "f", inputs, pool);
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if (threads == 1)
+      one_thread = elapsed.count();
+    std::cout << threads << " threads: " << elapsed.count() << " ms, "
+              << one_thread / elapsed.count() << "x" << std::endl;
+  }
+}
+
+TEST_CASE("Type-checked evaluation", "[!benchmark][types]") {
+  const std::string STEP = "let step = fn ( acc , x ) "
+                           "if x < 50000 then acc + x - 1 else acc - x + 2";
+  const std::string FOLD = "( ( fold step ) 0 ) ( range 100000 )";
+  const std::string MAP = "( map ( fn x { let y = x + x ; "
+                          "if y > 1000 then y - 1000 else y + 1 } ) ) "
+                          "( range 100000 )";
+
+  EvalVisitor untyped;
+  evaluate(untyped, {STEP});
+  EvalVisitor typed;
+  TypeChecker checker;
+  for (auto &node : parse(STEP))
+    evaluate_checked(checker, typed, *node);
+
+  for (auto [name, line] : {std::pair{"fold", FOLD}, std::pair{"map", MAP}}) {
+    auto program = parse(line);
+    BENCHMARK(std::string(name) + " over 100000, unchecked") {
+      untyped.evaluate(*program[0]);
+      return untyped.get_last();
+    };
+    // Including the check
+    BENCHMARK(std::string(name) + " over 100000, checked") {
+      evaluate_checked(checker, typed, *program[0]);
+      return typed.get_last();
+    };
+  }
+}
+
+TEST_CASE("Metrics overhead", "[!benchmark][metrics]") {
+  EvalVisitor evaluator;
+  evaluate(evaluator, {"let f = fn x x + 1"});
+  auto program = parse("f 41");
+
+  // The statements an embedder would evaluate, so the fixed cost counts most
+  BENCHMARK("Small statement, uninstrumented") {
+    program[0]->accept(evaluator);
+    return evaluator.get_last();
+  };
+  BENCHMARK("Small statement, with metrics") {
+    evaluator.evaluate(*program[0]);
+    return evaluator.get_last();
+  };
+  BENCHMARK("Counter") { metrics::add(metrics::Counter::Steps); };
+  BENCHMARK("Snapshot") { return metrics::snapshot(); };
+}
+
+TEST_CASE("Immediately applied functions", "[!benchmark][escape]") {
+  EvalVisitor evaluator;
+  // Escape analysis runs the inner `fn` in place rather than allocating a
+  // closure, and a copy of the environment, per element
+  auto program = parse("( ( fold ( fn ( acc , x ) ( fn y { acc + y } ) x ) ) "
+                       "0 ) ( range 10000 )");
+  BENCHMARK("fold over 10000") {
+    evaluator.evaluate(*program[0]);
+    return evaluator.get_last();
+  };
+}
+
+TEST_CASE("Loops", "[!benchmark][loop]") {
+  EvalVisitor evaluator;
+  evaluate(evaluator, {Y, SUM_N});
+  CekMachine machine;
+  machine.set_environment(evaluator.get_environment());
+  auto recursive = parse("sum_n 1000");
+  auto loop = parse("loop ( n , acc ) = ( 1000 , 0 ) while n do "
+                    "( n - 1 , acc + n )");
+
+  BENCHMARK("sum_n 1000, recursive through Y") {
+    evaluator.evaluate(*recursive[0]);
+    return evaluator.get_last();
+  };
+  BENCHMARK("sum_n 1000, loop") {
+    evaluator.evaluate(*loop[0]);
+    return evaluator.get_last();
+  };
+  BENCHMARK("sum_n 1000, recursive through Y, CekMachine") {
+    machine.evaluate(*recursive[0]);
+    return machine.get_last();
+  };
+  BENCHMARK("sum_n 1000, loop, CekMachine") {
+    machine.evaluate(*loop[0]);
+    return machine.get_last();
+  };
+}
+
+TEST_CASE("Tuples", "[!benchmark][tuple]") {
+  // Builds a list of 1000 numbers, 0 ending it, and sums it. The Church
+  // pairs are closures, which each copy the environment and are applied to
+  // get at their fields.
+  EvalVisitor evaluator;
+  evaluate(evaluator,
+           {"let pair = fn ( a , b ) fn s ( s a ) b",
+            "let first = fn p p ( fn ( a , b ) a )",
+            "let second = fn p p ( fn ( a , b ) b )"});
+  auto tuples = parse_lines(
+      "let xs = loop ( i , xs ) = ( 1000 , 0 ) while i do "
+      "( i - 1 , ( i , xs ) )\n"
+      "loop ( n , xs , acc ) = ( 1000 , xs , 0 ) while n do "
+      "( n - 1 , xs . 1 , acc + xs . 0 )");
+  auto church = parse_lines(
+      "let xs = loop ( i , xs ) = ( 1000 , 0 ) while i do "
+      "( i - 1 , ( pair i ) xs )\n"
+      "loop ( n , xs , acc ) = ( 1000 , xs , 0 ) while n do "
+      "( n - 1 , second xs , acc + first xs )");
+
+  BENCHMARK("list of 1000, tuples") {
+    for (auto &node : tuples)
+      evaluator.evaluate(*node);
+    return evaluator.get_last();
+  };
+  BENCHMARK("list of 1000, Church pairs") {
+    for (auto &node : church)
+      evaluator.evaluate(*node);
+    return evaluator.get_last();
+  };
+}
+
+TEST_CASE("Integers", "[!benchmark][integer]") {
+  // Small numbers stay unboxed, with one overflow check per operation
+  EvalVisitor evaluator;
+  evaluate(evaluator, {Y, SUM_N,
+                       "let fact = fn ( self , n ) if n == 0 then 1 "
+                       "else ( mul n ) ( ( self self ) ( n - 1 ) )"});
+  auto sum_n = parse("sum_n 1000");
+  auto count = parse("loop ( i , acc ) = ( 100000 , 0 ) while i do "
+                     "( i - 1 , acc + i )");
+  BENCHMARK("sum_n 1000") {
+    sum_n[0]->accept(evaluator);
+    return evaluator.get_last();
+  };
+  BENCHMARK("loop of 100000") {
+    count[0]->accept(evaluator);
+    return evaluator.get_last();
+  };
+
+  // 1000! has 2568 digits, about 266 base 2^32 digits
+  auto fact = parse("( fact fact ) 1000");
+  BENCHMARK("1000!") {
+    fact[0]->accept(evaluator);
+    return evaluator.get_last();
+  };
+  auto big = Integer::parse(std::string(1000, '7'));
+  BENCHMARK("multiply 1000-digit numbers") { return big * big; };
+}
+
+TEST_CASE("Profiling", "[!benchmark][profile]") {
+  // sum_n makes a closure per call, and each is registered with an attached
+  // profiler, so this is about its worst case
+  EvalVisitor evaluator;
+  evaluate(evaluator, {Y, SUM_N});
+  auto sum_n = parse("sum_n 1000");
+  BENCHMARK("sum_n 1000, not profiled") {
+    evaluator.evaluate(*sum_n[0]);
+    return evaluator.get_last();
+  };
+
+  Profiler profiler(evaluator);
+  BENCHMARK("sum_n 1000, profiler attached") {
+    evaluator.evaluate(*sum_n[0]);
+    return evaluator.get_last();
+  };
+  profiler.start(1000);
+  BENCHMARK("sum_n 1000, sampled at 1kHz") {
+    evaluator.evaluate(*sum_n[0]);
+    return evaluator.get_last();
+  };
+  profiler.stop();
+  std::cout << profiler.top(3) << std::flush;
+}
+
+TEST_CASE("History", "[!benchmark][history]") {
+  // A history of 100k lines, as a long-lived REPL builds up
+  auto pattern =
+      (std::filesystem::temp_directory_path() / "tiny-interp-history-XXXXXX")
+          .string();
+  REQUIRE(mkdtemp(pattern.data()) != nullptr);
+  std::filesystem::path dir = pattern;
+  auto path = (dir / "history").string();
+  {
+    std::ofstream file(path);
+    for (size_t i = 0; i < 100000; ++i)
+      file << "let x" << i << " = fn y y + " << i << "\n";
+  }
+  std::string line = "let x = fn y y + 1";
+
+  BENCHMARK("read_history, 100k lines") {
+    clear_history();
+    return read_history(path.c_str());
+  };
+  BENCHMARK("load_history, 100k lines") { return load_history(path); };
+
+  // Each line rewrites the whole file
+  clear_history();
+  read_history(path.c_str());
+  stifle_history(100000);
+  BENCHMARK("per line: add_history and write_history") {
+    add_history(line.c_str());
+    return write_history(path.c_str());
+  };
+
+  clear_history();
+  stifle_history(HISTORY_LINES);
+  for (auto &loaded : load_history(path))
+    add_history(loaded.c_str());
+  HistoryWriter writer(path);
+  BENCHMARK("per line: add_history and HistoryWriter::append") {
+    add_history(line.c_str());
+    writer.append(line);
+  };
+  writer.flush();
+  clear_history();
+  unstifle_history();
+
+  // Input that isn't a terminal, e.g. a script piped to the REPL
+  auto input = (dir / "input").string();
+  {
+    std::ofstream file(input);
+    for (size_t i = 0; i < 10000; ++i)
+      file << line << "\n";
+  }
+  BENCHMARK("readline, 10k piped lines") {
+    auto in = std::fopen(input.c_str(), "r");
+    auto out = std::fopen("/dev/null", "w");
+    rl_instream = in;
+    rl_outstream = out;
+    size_t lines = 0;
+    while (auto read = readline("> ")) {
+      std::free(read);
+      ++lines;
+    }
+    std::fclose(in);
+    std::fclose(out);
+    return lines;
+  };
+  BENCHMARK("LineReader, 10k piped lines") {
+    int fd = open(input.c_str(), O_RDONLY);
+    LineReader reader(fd);
+    size_t lines = 0;
+    while (reader.read())
+      ++lines;
+    close(fd);
+    return lines;
+  };
+  rl_instream = stdin;
+  rl_outstream = stdout;
+  std::filesystem::remove_all(dir);
+}
@@ -1,12 +1,46 @@
+#include "analysis.hpp"
+#include "batch.hpp"
+#include "builtins.hpp"
+#include "cek.hpp"
+#include "codegen.hpp"
 #include "formatter.hpp"
+#include "history.hpp"
+#include "interpreter.hpp"
+#include "kernels.hpp"
+#include "metrics.hpp"
+#include "nodes.hpp"
 #include "parser.hpp"
+#include "profiler.hpp"
+#include "replay.hpp"
+#include "serialise.hpp"
+#include "session.hpp"
+#include "static_eval.hpp"
+#include "task.hpp"
 #include "tokeniser.hpp"
+#include "types.hpp"
 
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <thread>
 
+#include <unistd.h>
+
+#include <catch2/catch_template_test_macros.hpp>
 #include <catch2/catch_test_macros.hpp>
 
+/// A new, empty directory named after `name` under the temporary directory,
+/// so that runs of the tests at the same time don't remove each other's
+std::filesystem::path make_temp_directory(const std::string &name) {
+  auto pattern =
+      (std::filesystem::temp_directory_path() / (name + "-XXXXXX")).string();
+  REQUIRE(mkdtemp(pattern.data()) != nullptr);
+  return pattern;
+}
+
 TEST_CASE("Test parsing", "[parse]") {
   std::string formatted;
   FmtAst ast_formatter([&](auto s) { formatted += s; });
@@ -83,6 +117,34 @@ TEST_CASE("Test parsing", "[parse]") {
     REQUIRE("fn ( x , y ) x ; " == formatted);
   }
 
+  SECTION("Loops") {
+    formatted = "";
+    for (auto &node : parse("loop i = 0 while i < 3 do i + 1")) {
+      node->accept(ast_formatter);
+      formatted += " ; ";
+    }
+    REQUIRE("loop i = ( 0 ) while ( ( i ) < ( 3 ) ) do ( ( i ) + ( 1 ) ) ; " ==
+            formatted);
+
+    formatted = "";
+    for (auto &node :
+         parse("loop ( i , acc ) = ( 0 , 1 ) while i do ( i - 1 , acc )")) {
+      node->accept(ast_formatter);
+      formatted += " ; ";
+    }
+    REQUIRE("loop ( i , acc ) = ( ( 0 ) , ( 1 ) ) while ( i ) do ( ( ( i ) - "
+            "( 1 ) ) , ( acc ) ) ; " == formatted);
+
+    // One expression for each variable
+    REQUIRE_THROWS_AS(parse("loop ( i , j ) = 0 while i do ( i , j )"),
+                      ParseError);
+    REQUIRE_THROWS_AS(
+        parse("loop ( i , j ) = ( 0 , 0 ) while i do ( i , j , i )"),
+        ParseError);
+    // A single variable can be a tuple
+    REQUIRE_NOTHROW(parse("loop i = 0 while i do ( i , i )"));
+  }
+
   SECTION("Application") {
     formatted = "";
     for (auto &node : parse("fn x 1 2")) {
@@ -125,9 +187,9 @@ TEST_CASE("Test parsing", "[parse]") {
   }
 }
 
-TEST_CASE("Test evaluating", "[eval]") {
+TEMPLATE_TEST_CASE("Test evaluating", "[eval]", EvalVisitor, CekMachine) {
   std::string formatted;
-  EvalVisitor evaluator;
+  TestType evaluator;
   FmtAst ast_formatter([&](auto s) { formatted += s; });
   FmtValue value_formatter(ast_formatter, [&](auto s) { formatted += s; });
 
@@ -202,3 +264,2061 @@ TEST_CASE("Test evaluating", "[eval]") {
     REQUIRE("55" == formatted);
   }
 }
+
+TEST_CASE("Test serialisation", "[serialise]") {
+  std::string formatted;
+  FmtAst ast_formatter([&](auto s) { formatted += s; });
+  auto format = [&](const std::vector<std::unique_ptr<Ast>> &program) {
+    formatted = "";
+    for (auto &node : program) {
+      node->accept(ast_formatter);
+      formatted += " ; ";
+    }
+    return formatted;
+  };
+  std::string source = "let Y = fn f { ( fn x { f ( fn a { ( x x ) a } ) } )"
+                       " ( fn x { f ( fn a { ( x x ) a } ) } ) }\n"
+                       "let g = fn ( x , y ) { let z = x + y ; z - 1 }\n"
+                       "\n"
+                       "if g 1 2 < 3 then 65536 else 0\n"
+                       "loop ( i , n ) = ( 0 , 1 ) while i < 3 do "
+                       "( i + 1 , n + n )";
+  auto program = parse_lines(source);
+  auto data = serialise(program, hash_source(source));
+
+  SECTION("Round trip") {
+    auto expected = format(program);
+    REQUIRE(expected == format(deserialise(data, hash_source(source))));
+  }
+
+  SECTION("Validation") {
+    REQUIRE_THROWS_AS(deserialise(data, hash_source(source) + 1),
+                      BadSerialisation);
+    REQUIRE_THROWS_AS(deserialise(data.substr(0, data.size() - 1),
+                                  hash_source(source)),
+                      BadSerialisation);
+    auto corrupt = data;
+    corrupt.back() ^= 1;
+    REQUIRE_THROWS_AS(deserialise(corrupt, hash_source(source)),
+                      BadSerialisation);
+    corrupt = data;
+    corrupt[4] += 1;
+    REQUIRE_THROWS_AS(deserialise(corrupt, hash_source(source)),
+                      BadSerialisation);
+  }
+
+  SECTION("Cache") {
+    auto parent = make_temp_directory("tiny-interp-test");
+    auto dir = parent / "cache";
+    ProgramCache cache(dir);
+    REQUIRE_FALSE(cache.load(source).has_value());
+    cache.store(source, program);
+    auto loaded = cache.load(source);
+    REQUIRE(loaded.has_value());
+    REQUIRE(format(program) == format(*loaded));
+    REQUIRE_FALSE(cache.load(source + " ").has_value());
+
+    // Kept from other users
+    auto perms = std::filesystem::status(dir).permissions();
+    REQUIRE(perms == std::filesystem::perms::owner_all);
+
+    // A file under the source's name, as if its hash collided, holds another
+    // source and program
+    auto other = std::string("let other = 1");
+    cache.store(other, parse(other));
+    std::filesystem::rename(cache.path_for(other), cache.path_for(source));
+    REQUIRE_FALSE(cache.load(source).has_value());
+
+    // A failed store leaves no temporary file behind, here as the file's
+    // name is taken by a directory that can't be replaced
+    std::filesystem::remove(cache.path_for(other));
+    std::filesystem::create_directories(cache.path_for(other) / "taken");
+    cache.store(other, parse(other));
+    REQUIRE_FALSE(cache.load(other).has_value());
+    size_t entries = 0;
+    for (auto &entry : std::filesystem::directory_iterator(dir))
+      entries += entry.path() != cache.path_for(other);
+    REQUIRE(entries == 1);
+
+    // Not trusted once others could write to it
+    cache.store(source, program);
+    REQUIRE(cache.load(source).has_value());
+    std::filesystem::permissions(dir, std::filesystem::perms::others_write,
+                                 std::filesystem::perm_options::add);
+    REQUIRE_FALSE(cache.load(source).has_value());
+    std::filesystem::remove_all(parent);
+  }
+}
+
+TEST_CASE("Test session", "[session]") {
+  std::string formatted;
+  FmtAst ast_formatter([&](auto s) { formatted += s; });
+  FmtValue value_formatter(ast_formatter, [&](auto s) { formatted += s; });
+  Session session;
+  auto run = [&](const std::string &line) {
+    std::vector<Session::Failure> failures;
+    for (auto &node : parse(line)) {
+      for (auto &failure : session.run(std::move(node)))
+        failures.push_back(failure);
+    }
+    formatted = "";
+    session.get_last()->accept(value_formatter);
+    return failures;
+  };
+
+  SECTION("Free variables") {
+    auto program = parse("fn x { let y = x + z ; y + w ( fn w w ) }");
+    auto free = free_variables(*program[0]);
+    REQUIRE(free == std::set<Identifier>{Identifier("w"), Identifier("z")});
+  }
+
+  SECTION("Redefinition recomputes dependents") {
+    run("let a = 1");
+    run("let b = a + 1");
+    run("let c = fn x { x + b }");
+    run("let d = 5");
+    REQUIRE(session.dependents(Identifier("a")) ==
+            std::vector<Identifier>{Identifier("b"), Identifier("c")});
+    auto d = session.get_evaluator().lookup(Identifier("d"));
+
+    run("let a = 10");
+    run("c 100");
+    REQUIRE("111" == formatted);
+    REQUIRE(d == session.get_evaluator().lookup(Identifier("d")));
+    REQUIRE("a:\nb: a\nc: b\n" == session.format_deps(Identifier("a")));
+  }
+
+  SECTION("Unchanged inputs are skipped") {
+    run("let a = 1");
+    run("let b = if a < 5 then 0 else 1");
+    run("let c = fn x { x + b }");
+    auto c = session.get_evaluator().lookup(Identifier("c"));
+    run("let a = 2");
+    REQUIRE(c == session.get_evaluator().lookup(Identifier("c")));
+    run("let a = 7");
+    REQUIRE(c != session.get_evaluator().lookup(Identifier("c")));
+    run("c 1");
+    REQUIRE("2" == formatted);
+  }
+
+  SECTION("Failed recomputation") {
+    run("let a = 1");
+    run("let b = a + 1");
+    auto failures = run("let a = fn x x");
+    REQUIRE(failures.size() == 1);
+    REQUIRE(failures[0].name == "b");
+    REQUIRE(session.get_evaluator().lookup(Identifier("b")) == nullptr);
+    run("let a = 2");
+    run("b");
+    REQUIRE("3" == formatted);
+  }
+
+  SECTION("Destructuring lets") {
+    run("let ( a , b ) = ( 1 , 2 )");
+    run("let c = a + 1");
+    run("let ( a , b ) = ( 5 , 6 )");
+    run("c");
+    REQUIRE("6" == formatted);
+
+    // Depending on a global, and on each name
+    run("let x = 1");
+    run("let ( p , q ) = ( x , x + 1 )");
+    run("let r = q + 10");
+    run("let x = 5");
+    run("( p , r )");
+    REQUIRE("( 5 , 16 )" == formatted);
+    REQUIRE("x:\np: x\nq: x\nr: q\n" ==
+            session.format_deps(Identifier("x")));
+
+    // A name since bound by another `let` keeps that binding
+    run("let p = 100");
+    run("let x = 7");
+    run("( p , q )");
+    REQUIRE("( 100 , 8 )" == formatted);
+
+    // Tuples equal field by field count as unchanged
+    run("let t = ( x < 10 , 1 )");
+    run("let s = fn y t");
+    auto s = session.get_evaluator().lookup(Identifier("s"));
+    run("let x = 8");
+    REQUIRE(s == session.get_evaluator().lookup(Identifier("s")));
+    run("let x = 20");
+    REQUIRE(s != session.get_evaluator().lookup(Identifier("s")));
+  }
+}
+
+TEST_CASE("Test type inference", "[types]") {
+  TypeChecker checker;
+  auto type_of = [&](const std::string &line) {
+    auto program = parse(line);
+    std::string type;
+    for (auto &node : program) {
+      type = TypeChecker::format(checker.check(*node));
+      checker.commit();
+    }
+    return type;
+  };
+
+  SECTION("Types") {
+    REQUIRE("num" == type_of("1 + 2"));
+    REQUIRE("array" == type_of("( range 3 ) + 1"));
+    REQUIRE("array" == type_of("1 < ( range 3 )"));
+    REQUIRE("nothing" == type_of("{ }"));
+    REQUIRE("num -> num" == type_of("fn x x + 1"));
+    REQUIRE("a -> a" == type_of("fn x x"));
+    REQUIRE("( a -> a ) -> a -> a" == type_of("fn ( f , x ) f ( f x )"));
+    REQUIRE("a -> b -> a" == type_of("fn ( x , y ) x"));
+    REQUIRE("num -> num" == type_of("if 1 then fn x x else fn y y + 1"));
+    REQUIRE("( num -> num ) -> array -> array" == type_of("map"));
+    REQUIRE("array -> num" ==
+            type_of("( fold ( fn ( acc , x ) acc + x ) ) 0"));
+    // Conditions can be anything
+    REQUIRE("num" == type_of("if fn x x then 1 else 2"));
+    REQUIRE("num" == type_of("loop ( i , acc ) = ( 0 , 0 ) while i < 10 do "
+                             "( i + 1 , acc + i )"));
+    REQUIRE("num -> num" ==
+            type_of("loop ( i , f ) = ( 0 , fn x x ) while i < 3 do "
+                    "( i + 1 , fn x f ( x + 1 ) )"));
+    // Steps have the types of the initial values
+    REQUIRE_THROWS_AS(
+        type_of("loop ( i , f ) = ( 0 , fn x x ) while i do ( i , 1 )"),
+        TypeError);
+  }
+
+  SECTION("Let-polymorphism") {
+    type_of("let id = fn x x");
+    REQUIRE("a -> a" == type_of("id"));
+    REQUIRE("num" == type_of("( id id ) 3"));
+    REQUIRE("num" == type_of("{ let twice = fn ( f , x ) f ( f x ) ; "
+                             "( ( twice twice ) ( fn x x + 1 ) ) 0 }"));
+    // Arguments are not polymorphic
+    REQUIRE_THROWS_AS(type_of("fn f ( f f ) 3"), TypeError);
+  }
+
+  SECTION("Lets in blocks bind in the enclosing environment") {
+    type_of("{ let a = 1 ; let b = range 3 }");
+    REQUIRE("num" == type_of("a"));
+    REQUIRE("array" == type_of("b"));
+    // Not outside a function body
+    type_of("fn x { let c = x ; c }");
+    REQUIRE_THROWS_AS(type_of("c"), TypeError);
+    // A binding that depends on the branch taken has no type
+    type_of("if a then { let d = 1 } else 2");
+    REQUIRE_THROWS_AS(type_of("d"), TypeError);
+    type_of("if a then { let a = 2 } else { let a = 3 }");
+    REQUIRE_THROWS_AS(type_of("a"), TypeError);
+  }
+
+  SECTION("Errors") {
+    auto message = [&](const std::string &line) -> std::string {
+      try {
+        type_of(line);
+      } catch (const TypeError &e) {
+        return e.what();
+      }
+      return "";
+    };
+    REQUIRE("Expected num but found a -> a" == message("1 + ( fn x x )"));
+    REQUIRE("Expected a function but found num" == message("1 2"));
+    REQUIRE("Cannot construct the infinite type a = a -> b" ==
+            message("fn x x x"));
+    REQUIRE("Unknown variable x" == message("x"));
+    REQUIRE("Expected num but found nothing" == message("{ } + 1"));
+    REQUIRE("Expected array but found num" == message("len 1"));
+    REQUIRE_THROWS_AS(type_of("let Y = fn f ( fn x f ( x x ) ) "
+                              "( fn x f ( x x ) )"),
+                      TypeError);
+  }
+
+  SECTION("Signatures") {
+    REQUIRE("( num -> a ) -> array" ==
+            TypeChecker::format(TypeChecker::parse("( num -> a ) -> array")));
+    REQUIRE("a -> b -> a" ==
+            TypeChecker::format(TypeChecker::parse("x -> y -> x")));
+    REQUIRE_THROWS_AS(TypeChecker::parse("num ->"), TypeError);
+    REQUIRE_THROWS_AS(TypeChecker::parse("( num"), TypeError);
+
+    BuiltinRegistry registry = BuiltinRegistry::standard();
+    registry.add_numeric<3>("clamp", [](uint32_t x, uint32_t lo, uint32_t hi) {
+      return std::clamp(x, lo, hi);
+    });
+    registry.add("first", 1, [](auto &args, auto &) { return args[0]; });
+    TypeChecker custom(registry);
+    REQUIRE("num -> num -> num -> num" ==
+            TypeChecker::format(custom.check(*parse("clamp")[0])));
+    REQUIRE_THROWS_AS(custom.check(*parse("first 1")[0]), TypeError);
+  }
+
+  SECTION("Annotations") {
+    auto program = parse("fn ( f , x ) if x then f ( x + 1 ) else f 0");
+    checker.check(*program[0]);
+    auto &fn = dynamic_cast<const Fn &>(*program[0]);
+    auto &if_cond = dynamic_cast<const IfCond &>(*fn.get_body());
+    REQUIRE(fn.get_proven() == Proven::Function);
+    REQUIRE(if_cond.get_condition().get_proven() == Proven::Number);
+    auto &app = dynamic_cast<const App &>(if_cond.get_true_case());
+    REQUIRE(app.get_lhs().get_proven() == Proven::Function);
+    // The result of `f` could be anything
+    REQUIRE(app.get_proven() == Proven::Unknown);
+  }
+
+  SECTION("Checked evaluation gives the same values") {
+    std::string formatted;
+    FmtAst ast_formatter([&](auto s) { formatted += s; });
+    FmtValue value_formatter(ast_formatter, [&](auto s) { formatted += s; });
+    EvalVisitor typed, untyped;
+    auto run = [&](const std::string &line) {
+      std::string results;
+      for (auto &node : parse(line)) {
+        evaluate_checked(checker, typed, *node);
+        formatted = "";
+        typed.get_last()->accept(value_formatter);
+        auto expected = formatted;
+        untyped.evaluate(*node);
+        formatted = "";
+        untyped.get_last()->accept(value_formatter);
+        REQUIRE(expected == formatted);
+        results = formatted;
+      }
+      return results;
+    };
+
+    run("let f = fn ( x , y ) { let z = x + 1 ; if z < y then y - z "
+        "else z - y }");
+    REQUIRE("3" == run("( f 4 ) 8"));
+    REQUIRE("3" == run("( f 8 ) 6"));
+    REQUIRE("5050" == run("( ( fold ( fn ( a , x ) a + x ) ) 0 ) "
+                          "( ( range 100 ) + 1 )"));
+    REQUIRE("[ 0 , 2 , 4 ]" == run("( map ( fn x x + x ) ) ( range 3 )"));
+    // Not typeable, so f's body runs unchecked with an array for x
+    REQUIRE("[ 2 , 1 , 0 ]" == run("( f ( range 3 ) ) 3"));
+    REQUIRE_THROWS_AS(checker.check(*parse("( f ( range 3 ) ) 3")[0]),
+                      TypeError);
+    // Statements which are not typeable leave their bindings without types
+    run("let Y = fn f ( fn x f ( x x ) ) ( fn x f ( x x ) )");
+    REQUIRE(checker.lookup(Identifier("Y")) == nullptr);
+    // As do ones that fail part-way
+    run("let g = fn x x");
+    REQUIRE(checker.lookup(Identifier("g")) != nullptr);
+    REQUIRE_THROWS_AS(evaluate_checked(checker, typed,
+                                       *parse("{ let g = 1 ; len 1 }")[0]),
+                      EvalError);
+    REQUIRE(checker.lookup(Identifier("g")) == nullptr);
+  }
+
+  SECTION("Sessions recompute definitions unchecked") {
+    std::string formatted;
+    FmtAst ast_formatter([&](auto s) { formatted += s; });
+    FmtValue value_formatter(ast_formatter, [&](auto s) { formatted += s; });
+    Session session;
+    for (auto line : {"let a = 1", "let f = fn x x + a", "let a = range 3",
+                      "f 1"}) {
+      for (auto &node : parse(line))
+        session.run(std::move(node));
+    }
+    session.get_last()->accept(value_formatter);
+    REQUIRE("[ 1 , 2 , 3 ]" == formatted);
+    REQUIRE(session.get_checker().lookup(Identifier("f")) == nullptr);
+    REQUIRE("array" == TypeChecker::format(
+                           session.get_checker().lookup(Identifier("a"))));
+  }
+}
+
+TEST_CASE("Test formatting", "[format]") {
+  auto program = parse("let f = fn ( x , y ) { let z = x + 400000 ; "
+                       "if z < y then ( fn a { a - z } ) y else z }");
+  std::string expected;
+  FmtAst callback_formatter([&](auto s) { expected += s; });
+  program[0]->accept(callback_formatter);
+
+  SECTION("Buffer matches callbacks") {
+    FmtBuffer buffer;
+    FmtAst ast_formatter(buffer);
+    program[0]->accept(ast_formatter);
+    REQUIRE(expected == buffer.view());
+
+    buffer.clear();
+    FmtValue value_formatter(ast_formatter, buffer);
+    NumberValue(4294967295).accept(value_formatter);
+    REQUIRE("4294967295" == buffer.view());
+  }
+
+  SECTION("Length limit") {
+    FmtBuffer buffer;
+    FmtAst ast_formatter(buffer, {.max_length = 20});
+    program[0]->accept(ast_formatter);
+    REQUIRE(expected.substr(0, 20) + "..." == buffer.view());
+
+    // The limit applies to each tree separately
+    buffer.clear();
+    program[0]->accept(ast_formatter);
+    REQUIRE(expected.substr(0, 20) + "..." == buffer.view());
+  }
+
+  SECTION("Depth limit") {
+    FmtBuffer buffer;
+    FmtAst ast_formatter(buffer, {.max_depth = 3});
+    parse("1 + ( 2 + ( 3 + 4 ) )")[0]->accept(ast_formatter);
+    REQUIRE("( 1 ) + ( ( 2 ) + ( ( ... ) + ( ... ) ) )" == buffer.view());
+  }
+
+  SECTION("Output ending at the length limit") {
+    FmtBuffer buffer;
+    FmtAst ast_formatter(buffer, {.max_length = 5});
+    parse("fn ( a , b ) a")[0]->accept(ast_formatter);
+    REQUIRE("fn ( ..." == buffer.view());
+
+    // Or all of it, if nothing follows
+    buffer.clear();
+    parse("12345")[0]->accept(ast_formatter);
+    REQUIRE("12345" == buffer.view());
+  }
+
+  SECTION("Limits on values") {
+    EvalVisitor evaluator;
+    auto value = [&](const std::string &line) {
+      for (auto &node : parse(line))
+        node->accept(evaluator);
+      return evaluator.get_last();
+    };
+    FmtBuffer buffer;
+    FmtAst ast_formatter(buffer, {.max_depth = 2, .max_length = 21});
+    FmtValue value_formatter(ast_formatter, buffer);
+    value("range 100")->accept(value_formatter);
+    REQUIRE("[ 0 , 1 , 2 , 3 , 4 ,..." == buffer.view());
+
+    buffer.clear();
+    value("( 1 , ( 2 , 3 ) )")->accept(value_formatter);
+    REQUIRE("( 1 , ( ... , ... ) )" == buffer.view());
+
+    // Each value separately
+    buffer.clear();
+    value("( 1 , 2 )")->accept(value_formatter);
+    REQUIRE("( 1 , 2 )" == buffer.view());
+  }
+}
+
+TEST_CASE("Test arrays", "[array]") {
+  std::string formatted;
+  EvalVisitor evaluator;
+  FmtAst ast_formatter([&](auto s) { formatted += s; });
+  FmtValue value_formatter(ast_formatter, [&](auto s) { formatted += s; });
+  auto run = [&](const std::string &line) {
+    for (auto &node : parse(line)) {
+      node->accept(evaluator);
+    }
+    formatted = "";
+    evaluator.get_last()->accept(value_formatter);
+    return formatted;
+  };
+
+  SECTION("Builtins") {
+    REQUIRE("[ ]" == run("range 0"));
+    REQUIRE("[ 0 , 1 , 2 , 3 , 4 ]" == run("let xs = range 5"));
+    REQUIRE("5" == run("len xs"));
+    REQUIRE("3" == run("( get xs ) 3"));
+    REQUIRE("10" == run("sum xs"));
+    REQUIRE("[ 0 , 2 , 4 , 6 , 8 ]" == run("( map ( fn x x + x ) ) xs"));
+    REQUIRE("[ 3 , 4 ]" == run("( filter ( fn x x > 2 ) ) xs"));
+    REQUIRE("20" == run("( ( fold ( fn ( acc , x ) acc + x + 1 ) ) 5 ) xs"));
+    REQUIRE("get ( [ 0 , 1 , 2 , 3 , 4 ] )" == run("get xs"));
+    REQUIRE_THROWS_AS(run("( get xs ) 5"), IndexOutOfRange);
+    REQUIRE_THROWS_AS(run("len 5"), NotAnArray);
+    REQUIRE_THROWS_AS(run("( map ( fn x xs ) ) xs"), NotANumber);
+  }
+
+  SECTION("Element-wise operators") {
+    run("let xs = range 5");
+    REQUIRE("[ 0 , 2 , 4 , 6 , 8 ]" == run("xs + xs"));
+    REQUIRE("[ 1 , 2 , 3 , 4 , 5 ]" == run("xs + 1"));
+    REQUIRE("[ 10 , 9 , 8 , 7 , 6 ]" == run("10 - xs"));
+    REQUIRE("[ 1 , 1 , 0 , 0 , 0 ]" == run("xs < 2"));
+    REQUIRE("[ 0 , 0 , 1 , 0 , 0 ]" == run("xs == 2"));
+    REQUIRE("[ 0 , 0 , 0 , 1 , 1 ]" == run("2 < xs"));
+    REQUIRE("2" == run("sum ( xs > 2 )"));
+    // Totalled without wrapping, like fold
+    REQUIRE("4999950000" == run("sum ( range 100000 )"));
+    REQUIRE(run("sum ( range 100000 )") ==
+            run("( ( fold add ) 0 ) ( range 100000 )"));
+    REQUIRE_THROWS_AS(run("xs + range 4"), LengthMismatch);
+    REQUIRE_THROWS_AS(run("xs + ( fn x x )"), NotANumber);
+  }
+
+  SECTION("Kernels match the scalar fallback") {
+    for (size_t n : {0, 1, 7, 8, 15, 16, 17, 100, 1001}) {
+      std::vector<uint32_t> lhs(n), rhs(n), out(n), expected(n);
+      for (size_t i = 0; i < n; ++i) {
+        lhs[i] = uint32_t(i * 2654435761u);
+        rhs[i] = i % 3 == 0 ? lhs[i] : uint32_t(i * 40503u + 0x80000000u);
+      }
+      REQUIRE(kernels::sum(lhs.data(), n) ==
+              kernels::sum_scalar(lhs.data(), n));
+      std::vector<uint32_t> max(n, UINT32_MAX);
+      REQUIRE(kernels::sum(max.data(), n) == n * uint64_t(UINT32_MAX));
+      kernels::iota(out.data(), n, 0xfffffff0);
+      kernels::iota_scalar(expected.data(), n, 0xfffffff0);
+      REQUIRE(out == expected);
+      for (auto op : {kernels::Op::Less, kernels::Op::Equal,
+                      kernels::Op::Greater, kernels::Op::Add,
+                      kernels::Op::Sub}) {
+        kernels::binop(op, lhs.data(), rhs.data(), out.data(), n);
+        kernels::binop_scalar(op, lhs.data(), rhs.data(), expected.data(), n);
+        REQUIRE(out == expected);
+        kernels::binop(op, lhs.data(), 0x80000001u, out.data(), n);
+        kernels::binop_scalar(op, lhs.data(), 0x80000001u, expected.data(), n);
+        REQUIRE(out == expected);
+        kernels::binop(op, 7u, rhs.data(), out.data(), n);
+        kernels::binop_scalar(op, 7u, rhs.data(), expected.data(), n);
+        REQUIRE(out == expected);
+      }
+    }
+  }
+}
+
+TEST_CASE("Test builtins", "[builtins]") {
+  std::string formatted;
+  EvalVisitor evaluator;
+  FmtAst ast_formatter([&](auto s) { formatted += s; });
+  FmtValue value_formatter(ast_formatter, [&](auto s) { formatted += s; });
+  auto run = [&](const std::string &line) {
+    for (auto &node : parse(line)) {
+      node->accept(evaluator);
+    }
+    formatted = "";
+    evaluator.get_last()->accept(value_formatter);
+    return formatted;
+  };
+
+  SECTION("Standard builtins") {
+    REQUIRE("42" == run("( mul 6 ) 7"));
+    REQUIRE("3" == run("( div 22 ) 7"));
+    REQUIRE("1" == run("( mod 22 ) 7"));
+    REQUIRE("-1" == run("( sub 0 ) 1"));
+    REQUIRE("6" == run("( min 6 ) 7"));
+    REQUIRE("7" == run("( max 6 ) 7"));
+    REQUIRE("2" == run("( band 6 ) 3"));
+    REQUIRE("7" == run("( bor 6 ) 3"));
+    REQUIRE("5" == run("( bxor 6 ) 3"));
+    REQUIRE("24" == run("( shl 6 ) 2"));
+    REQUIRE("0" == run("( shr 6 ) 32"));
+    REQUIRE_THROWS_AS(run("( div 1 ) 0"), DivisionByZero);
+    REQUIRE_THROWS_AS(run("( add 1 ) ( fn x x )"), NotANumber);
+  }
+
+  SECTION("First-class and partially applied") {
+    REQUIRE("add ( 1 )" == run("let inc = add 1"));
+    REQUIRE("5" == run("inc 4"));
+    REQUIRE("10" == run("( ( fold add ) 0 ) ( range 5 )"));
+    REQUIRE("5" == run("( fn f ( f 4 ) 5 ) max"));
+  }
+
+  SECTION("Host functions") {
+    BuiltinRegistry registry = BuiltinRegistry::standard();
+    registry.add_numeric<3>("clamp", [](uint32_t x, uint32_t lo, uint32_t hi) {
+      return std::clamp(x, lo, hi);
+    });
+    registry.add("twice", 2, [](auto &args, EvalVisitor &eval) {
+      return eval.apply(args[0], eval.apply(args[0], args[1]));
+    });
+    EvalVisitor host_evaluator(registry);
+    for (auto &node : parse("( twice ( mul 2 ) ) ( ( clamp 12 ) 1 ) 10")) {
+      node->accept(host_evaluator);
+    }
+    formatted = "";
+    host_evaluator.get_last()->accept(value_formatter);
+    REQUIRE("40" == formatted);
+
+    registry.install(evaluator);
+    REQUIRE("10" == run("( ( clamp 12 ) 1 ) 10"));
+    REQUIRE("8" == run("( twice ( mul 2 ) ) 2"));
+  }
+}
+
+TEMPLATE_TEST_CASE("Test loops", "[loop]", EvalVisitor, CekMachine) {
+  TestType evaluator;
+  auto run = [&](const std::string &line) {
+    for (auto &node : parse(line))
+      evaluator.evaluate(*node);
+    return dynamic_pointer_cast<NumberValue>(evaluator.get_last());
+  };
+
+  SECTION("Iteration") {
+    REQUIRE(run("loop ( i , acc ) = ( 0 , 0 ) while i < 10 do "
+                "( i + 1 , acc + i )")
+                ->get_value() == 45);
+    REQUIRE(run("loop i = 0 while i < 100000 do i + 1")->get_value() ==
+            100000);
+    // The condition is tested before the first iteration
+    REQUIRE(run("loop i = 7 while 0 do i + 1")->get_value() == 7);
+    // Steps see the values from before the iteration
+    REQUIRE(run("loop ( n , a , b ) = ( 10 , 0 , 1 ) while n do "
+                "( n - 1 , b , a + b )")
+                ->get_value() == 89);
+  }
+
+  SECTION("Variables and lets are local to the loop") {
+    run("let i = 5");
+    REQUIRE(run("loop ( i , j ) = ( 0 , i ) while i < 3 do "
+                "( { let k = i + 1 ; k } , j + i )")
+                ->get_value() == 8);
+    REQUIRE(run("i")->get_value() == 5);
+    REQUIRE_THROWS_AS(run("k"), UnknownVariable);
+    REQUIRE_THROWS_AS(run("j"), UnknownVariable);
+    // Closures capture the variables as they were
+    run("let f = loop ( i , f ) = ( 0 , fn x x ) while i < 3 do "
+        "( i + 1 , fn x i + x )");
+    REQUIRE(run("f 10")->get_value() == 12);
+  }
+
+  SECTION("Nested loops and recursion") {
+    run("let triangle = fn n loop ( i , acc ) = ( 0 , 0 ) while n + 1 > i "
+        "do ( i + 1 , acc + i )");
+    REQUIRE(run("loop ( n , acc ) = ( 0 , 0 ) while n < 5 do "
+                "( n + 1 , acc + triangle n )")
+                ->get_value() == 20);
+  }
+
+  SECTION("Errors and limits") {
+    run("let i = 5");
+    REQUIRE_THROWS_AS(run("loop i = 0 while i < 3 do i + ( fn x x )"),
+                      NotANumber);
+    REQUIRE(run("i")->get_value() == 5);
+    // Each iteration is a step
+    EvalLimits limits{.fuel = 100};
+    if constexpr (std::is_same_v<TestType, CekMachine>)
+      evaluator.get_evaluator().set_limits(limits);
+    else
+      evaluator.set_limits(limits);
+    REQUIRE(run("loop i = 0 while i < 99 do i + 1")->get_value() == 99);
+    REQUIRE_THROWS_AS(run("loop i = 0 while i < 100 do i + 1"), OutOfFuel);
+    REQUIRE(run("i")->get_value() == 5);
+  }
+}
+
+TEST_CASE("Test evaluation limits", "[limits]") {
+  EvalVisitor evaluator;
+  auto run = [&](const std::string &line) {
+    for (auto &node : parse(line)) {
+      evaluator.evaluate(*node);
+    }
+    return dynamic_pointer_cast<NumberValue>(evaluator.get_last());
+  };
+  run("let Y = fn f { ( fn x { f ( fn a { ( x x ) a } ) } ) "
+      "( fn x { f ( fn a { ( x x ) a } ) } ) }");
+  run("let sum_n = Y ( fn sum_n { fn n { "
+      "if n == 0 then 0 else n + sum_n ( n - 1 ) } } )");
+  run("let add_l = fn ( a , b ) a + b");
+
+  SECTION("Fuel") {
+    evaluator.set_limits({.fuel = 1000});
+    REQUIRE(run("sum_n 10")->get_value() == 55);
+    REQUIRE_THROWS_AS(run("sum_n 1000"), OutOfFuel);
+    // Counted per element by the array builtins
+    REQUIRE_THROWS_AS(run("( map ( add 1 ) ) ( range 2000 )"), OutOfFuel);
+    // Each evaluation gets the full amount again
+    REQUIRE(run("sum_n 10")->get_value() == 55);
+  }
+
+  SECTION("Memory") {
+    evaluator.set_limits({.max_bytes = 1 << 20});
+    REQUIRE(run("sum ( range 1000 )")->get_value() == 499500);
+    REQUIRE_THROWS_AS(run("range 1000000"), MemoryLimitExceeded);
+    REQUIRE_THROWS_AS(run("( range 200000 ) + ( range 200000 )"),
+                      MemoryLimitExceeded);
+  }
+
+  SECTION("Call depth") {
+    evaluator.set_limits({.max_depth = 1000});
+    REQUIRE(run("sum_n 100")->get_value() == 5050);
+    REQUIRE_THROWS_AS(run("sum_n 100000"), CallDepthExceeded);
+    // The environment is restored, so later lines still see the globals
+    REQUIRE(run("sum_n 100")->get_value() == 5050);
+  }
+
+  SECTION("Cancellation from another thread") {
+    std::thread canceller([&] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      evaluator.cancel();
+    });
+    // Takes seconds, without recursing deeply
+    REQUIRE_THROWS_AS(run("( ( fold add_l ) 0 ) ( range 10000000 )"),
+                      Cancelled);
+    canceller.join();
+    // Only the running evaluation is cancelled
+    REQUIRE(run("sum_n 10")->get_value() == 55);
+  }
+}
+
+TEST_CASE("Test escape analysis", "[escape]") {
+  auto frame = [](const std::string &line) {
+    auto program = parse(line);
+    return dynamic_cast<const App &>(*program[0]).get_frame() != nullptr;
+  };
+  EvalVisitor evaluator;
+  auto run = [&](const std::string &line) {
+    for (auto &node : parse(line))
+      evaluator.evaluate(*node);
+    return dynamic_pointer_cast<NumberValue>(evaluator.get_last());
+  };
+
+  SECTION("Applications of fn literals to all their arguments") {
+    REQUIRE(frame("( fn x { x + 1 } ) 1"));
+    REQUIRE(frame("( ( fn ( a , b ) a + b ) 1 ) 2"));
+    REQUIRE(frame("( fn x { let y = x ; y } ) 1"));
+    // Partially applied, so the closure escapes
+    REQUIRE_FALSE(frame("( fn ( a , b ) a + b ) 1"));
+    REQUIRE_FALSE(frame("f 1"));
+    // The closure would not see `y`
+    REQUIRE_FALSE(frame("( fn x x ) { let y = 1 ; y }"));
+  }
+
+  SECTION("Same results as closures") {
+    run("let x = 5");
+    run("let y = 10");
+    REQUIRE(run("( fn x x + 1 ) 1")->get_value() == 2);
+    REQUIRE(run("x")->get_value() == 5);
+    // Reads the global before its own `let` shadows it
+    REQUIRE(run("( fn z { let y = y + z ; y } ) 1")->get_value() == 11);
+    REQUIRE(run("y")->get_value() == 10);
+    REQUIRE_THROWS_AS(run("( fn a { let b = a ; b } ) 1 ; b"),
+                      UnknownVariable);
+    // Arguments are evaluated before any are bound
+    REQUIRE(run("( ( fn ( x , y ) x + y ) y ) x")->get_value() == 15);
+    // Closures created in the body capture its bindings
+    run("let add_x = ( fn x fn z x + z ) 1");
+    REQUIRE(run("add_x 2")->get_value() == 3);
+    REQUIRE(run("x")->get_value() == 5);
+  }
+
+  SECTION("Bindings are restored after errors") {
+    REQUIRE_THROWS_AS(run("let x = 5 ; ( fn x x + ( fn y y ) ) 1"),
+                      NotANumber);
+    REQUIRE(run("x")->get_value() == 5);
+    REQUIRE_THROWS_AS(run("( fn x x ) unknown"), UnknownVariable);
+    REQUIRE(run("x")->get_value() == 5);
+  }
+
+  SECTION("Limits count the application") {
+    evaluator.set_limits({.fuel = 2});
+    REQUIRE(run("( ( fn ( a , b ) a + b ) 1 ) 2")->get_value() == 3);
+    REQUIRE_THROWS_AS(run("( fn a ( ( fn ( b , c ) a ) 1 ) 2 ) 1"), OutOfFuel);
+    evaluator.set_limits({.max_depth = 1});
+    REQUIRE_THROWS_AS(run("( fn a ( fn b b ) a ) 1"), CallDepthExceeded);
+  }
+
+  SECTION("Allocates no closure") {
+    auto before = metrics::snapshot().get(metrics::Counter::Closures);
+    REQUIRE(run("( fn x { x + 1 } ) 1")->get_value() == 2);
+    REQUIRE(metrics::snapshot().get(metrics::Counter::Closures) == before);
+  }
+}
+
+TEST_CASE("Test tasks", "[task]") {
+  EvalVisitor evaluator;
+  for (auto &node : parse_lines(
+           "let Y = fn f { ( fn x { f ( fn a { ( x x ) a } ) } ) "
+           "( fn x { f ( fn a { ( x x ) a } ) } ) }\n"
+           "let sum_n = Y ( fn sum_n { fn n { "
+           "if n == 0 then 0 else n + sum_n ( n - 1 ) } } )\n"))
+    node->accept(evaluator);
+  auto globals = evaluator.get_environment();
+
+  auto number = [](const Rc<Value> &value) {
+    return dynamic_pointer_cast<NumberValue>(value)->get_value();
+  };
+  auto run = [&](const std::string &line, size_t slice = 1) {
+    auto program = parse(line);
+    Task task(*program[0], globals, slice);
+    while (!task.resume()) {
+    }
+    return task.get_result();
+  };
+
+  SECTION("Same results as EvalVisitor") {
+    for (auto line : {"sum_n 100", "( ( fn ( a , b ) a - b ) 7 ) 3",
+                      "{ let x = 2 ; if x < 3 then x + 1 else 0 }",
+                      "( ( fold add ) 0 ) ( ( map ( add 1 ) ) ( range 10 ) )",
+                      "( range 5 ) + 1", "max 4",
+                      "loop ( i , acc ) = ( 0 , 0 ) while i < 10 do "
+                      "( i + 1 , acc + sum_n i )"}) {
+      auto program = parse(line);
+      program[0]->accept(evaluator);
+      auto expected = evaluator.get_last();
+      auto result = run(line);
+      if (auto n = dynamic_pointer_cast<NumberValue>(expected))
+        REQUIRE(number(result) == n->get_value());
+      else if (auto a = dynamic_pointer_cast<ArrayValue>(expected))
+        REQUIRE(dynamic_pointer_cast<ArrayValue>(result)->get_values() ==
+                a->get_values());
+      else
+        REQUIRE(dynamic_pointer_cast<BuiltinValue>(result));
+    }
+  }
+
+  SECTION("Yields after each slice") {
+    auto program = parse("sum_n 100");
+    Task task(*program[0], globals, 10);
+    size_t slices = 1;
+    while (!task.resume())
+      ++slices;
+    REQUIRE(number(task.get_result()) == 5050);
+    REQUIRE(slices > 10);
+
+    Task whole(*program[0], globals, SIZE_MAX);
+    REQUIRE(whole.resume());
+  }
+
+  SECTION("Interleaving") {
+    auto long_program = parse("sum_n 1000");
+    auto short_program = parse("sum_n 10");
+    Task long_task(*long_program[0], globals, 50);
+    Task short_task(*short_program[0], globals, 50);
+    bool short_done = false, long_done = false;
+    while (!short_done) {
+      long_done = long_task.resume();
+      short_done = short_task.resume();
+    }
+    REQUIRE_FALSE(long_done);
+    REQUIRE(number(short_task.get_result()) == 55);
+    while (!long_task.resume()) {
+    }
+    REQUIRE(number(long_task.get_result()) == 500500);
+  }
+
+  SECTION("Definitions and errors") {
+    auto program = parse("let z = sum_n 3");
+    Task task(*program[0], globals, 1);
+    while (!task.resume()) {
+    }
+    REQUIRE(number(task.get_environment().at(Identifier("z"))) == 6);
+
+    REQUIRE_THROWS_AS(run("sum_n x"), UnknownVariable);
+    REQUIRE_THROWS_AS(run("1 + ( fn x x )"), NotANumber);
+    REQUIRE_THROWS_AS(run("( 1 ) 2"), NotAFunction);
+  }
+
+  SECTION("Limits") {
+    auto program = parse("sum_n 1000");
+    Task task(*program[0], globals, 100);
+    task.get_evaluator().set_limits({.fuel = 500});
+    REQUIRE_THROWS_AS(
+        [&] {
+          while (!task.resume()) {
+          }
+          return task.get_result();
+        }(),
+        OutOfFuel);
+  }
+
+  SECTION("Deep recursion takes no C++ stack") {
+    REQUIRE(number(run("sum_n 100000", 1000)) == 5000050000);
+  }
+}
+
+TEST_CASE("Test CEK machine", "[cek]") {
+  CekMachine machine;
+  auto run = [&](const std::string &line) {
+    for (auto &node : parse(line)) {
+      machine.evaluate(*node);
+    }
+    return dynamic_pointer_cast<NumberValue>(machine.get_last());
+  };
+  // Recursion by passing the function to itself
+  run("let sum = fn ( self , n ) "
+      "if n == 0 then 0 else n + ( self self ) ( n - 1 )");
+  run("let count_down = fn ( self , n ) "
+      "if n == 0 then 0 else ( self self ) ( n - 1 )");
+
+  SECTION("Builtins and arrays") {
+    REQUIRE(run("( ( fold add ) 0 ) ( ( map ( fn x x + 1 ) ) ( range 10 ) )")
+                ->get_value() == 55);
+    run("let xs = ( range 4 ) + 1");
+    REQUIRE(dynamic_pointer_cast<ArrayValue>(machine.get_last())
+                ->get_values() == std::vector<uint32_t>{1, 2, 3, 4});
+    REQUIRE_THROWS_AS(run("xs + ( range 3 )"), LengthMismatch);
+  }
+
+  SECTION("Calls in tail position take no frames") {
+    machine.get_evaluator().set_limits({.max_depth = 100});
+    REQUIRE(run("( count_down count_down ) 100000")->get_value() == 0);
+    REQUIRE_THROWS_AS(run("( sum sum ) 100000"), CallDepthExceeded);
+    // The machine can carry on after an error
+    REQUIRE(run("( sum sum ) 10")->get_value() == 55);
+  }
+
+  SECTION("Recursion a million deep") {
+    REQUIRE(run("( sum sum ) 1000000")->get_value() == 500000500000);
+  }
+}
+
+// Takes seconds and over a gigabyte, so only runs when asked for by tag
+TEST_CASE("Test CEK machine recursion 10 million deep", "[.][slow][cek]") {
+  CekMachine machine;
+  for (auto line : {"let sum = fn ( self , n ) "
+                    "if n == 0 then 0 else n + ( self self ) ( n - 1 )",
+                    "( sum sum ) 10000000"}) {
+    for (auto &node : parse(line))
+      machine.evaluate(*node);
+  }
+  REQUIRE(dynamic_pointer_cast<NumberValue>(machine.get_last())
+              ->get_value() == 50000005000000);
+}
+
+TEST_CASE("Test interpreter", "[interpreter]") {
+  Interpreter interpreter;
+  interpreter.load("let dist = fn ( a , b ) if a < b then b - a else a - b\n"
+                   "let offset = 100\n"
+                   "let shifted = fn x { let y = x + offset ; y }\n"
+                   "let curried = fn a fn b a - b\n"
+                   "let arrays = fn n range n\n"
+                   "let seven = 7");
+
+  SECTION("Prepared functions") {
+    auto dist = interpreter.prepare("dist");
+    REQUIRE(dist.get_arity() == 2);
+    REQUIRE(dist(3, 10) == 7);
+    REQUIRE(dist(10, 3) == 7);
+    const uint32_t args[] = {5, 5};
+    REQUIRE(dist.call(args) == 0);
+
+    auto shifted = interpreter.prepare("shifted");
+    REQUIRE(shifted(1) == 101);
+    REQUIRE(shifted(2) == 102);
+    // The `let` in the body doesn't leak into the interpreter's environment
+    REQUIRE(interpreter.get("y") == nullptr);
+    REQUIRE(interpreter.get("x") == nullptr);
+  }
+
+  SECTION("Builtins") {
+    REQUIRE(interpreter.prepare("max")(3, 9) == 9);
+    REQUIRE(interpreter.prepare("sub").get_arity() == 2);
+    interpreter.load("let sub_from_10 = sub 10");
+    auto partial = interpreter.prepare("sub_from_10");
+    REQUIRE(partial.get_arity() == 1);
+    REQUIRE(partial(4) == 6);
+  }
+
+  SECTION("Same results as evaluating source") {
+    auto dist = interpreter.prepare("dist");
+    for (uint32_t a : {0u, 1u, 17u, 2000000000u})
+      for (uint32_t b : {0u, 2u, 17u, 123456u}) {
+        auto source = "( ( dist ) " + std::to_string(a) + " ) " +
+                      std::to_string(b);
+        auto result = dynamic_pointer_cast<NumberValue>(
+            interpreter.load(source));
+        REQUIRE(dist(a, b) == result->get_value());
+      }
+  }
+
+  SECTION("Errors") {
+    REQUIRE_THROWS_AS(interpreter.prepare("missing"), UnknownVariable);
+    REQUIRE_THROWS_AS(interpreter.prepare("seven"), NotAFunction);
+    auto dist = interpreter.prepare("dist");
+    REQUIRE_THROWS_AS(dist(1), WrongArity);
+    REQUIRE_THROWS_AS(dist(1, 2, 3), WrongArity);
+    REQUIRE_THROWS_AS(interpreter.prepare("curried")(1), NotANumber);
+    REQUIRE_THROWS_AS(interpreter.prepare("arrays")(3), NotANumber);
+    // Errors leave the environments as they were
+    REQUIRE(dist(1, 4) == 3);
+    REQUIRE(interpreter.get("dist") != nullptr);
+  }
+
+  SECTION("Limits apply to each call") {
+    interpreter.load("let count = fn n ( ( fold add ) 0 ) ( range n )");
+    interpreter.get_evaluator().set_limits({.fuel = 1000});
+    auto count = interpreter.prepare("count");
+    REQUIRE_NOTHROW(count(50));
+    REQUIRE_NOTHROW(count(50));
+    REQUIRE_THROWS_AS(count(5000), OutOfFuel);
+    REQUIRE(count(10) == 45);
+  }
+}
+
+TEST_CASE("Test batch evaluation", "[batch]") {
+  Interpreter interpreter;
+  interpreter.load("let collatz = fn n { let steps = fn ( self , n , count ) "
+                   "if n < 2 then count "
+                   "else if ( ( mod n ) 2 ) == 0 "
+                   "then ( ( self self ) ( ( div n ) 2 ) ) ( count + 1 ) "
+                   "else ( ( self self ) ( ( ( mul 3 ) n ) + 1 ) ) "
+                   "( count + 1 ) ; ( ( steps steps ) n ) 0 }\n"
+                   "let double = fn x x + x\n"
+                   "let at = fn i ( get ( range 10 ) ) i\n"
+                   "let two = fn ( a , b ) a");
+  std::vector<uint32_t> inputs(10000);
+  for (size_t i = 0; i < inputs.size(); ++i)
+    inputs[i] = uint32_t(i * 7);
+
+  SECTION("Same results in the same order as one at a time") {
+    // collatz makes nested calls, and is slow, so gets fewer inputs
+    for (auto [name, count] : {std::pair{"double", inputs.size()},
+                               std::pair{"collatz", size_t(1000)}}) {
+      std::span<const uint32_t> some(inputs.data(), count);
+      auto function = interpreter.prepare(name);
+      std::vector<uint32_t> expected;
+      for (auto input : some)
+        expected.push_back(function(input));
+      for (size_t threads : {1, 2, 4}) {
+        ThreadPool pool(threads);
+        REQUIRE(pool.size() == threads);
+        REQUIRE(batch_map(interpreter, name, some, pool) == expected);
+        // The pool can be reused
+        REQUIRE(batch_map(interpreter, name, some, pool) == expected);
+      }
+    }
+    ThreadPool pool(2);
+    REQUIRE(batch_map(interpreter, "double", {}, pool).empty());
+  }
+
+  SECTION("Errors") {
+    ThreadPool pool(3);
+    REQUIRE_THROWS_AS(batch_map(interpreter, "missing", inputs, pool),
+                      UnknownVariable);
+    REQUIRE_THROWS_AS(batch_map(interpreter, "two", inputs, pool),
+                      WrongArity);
+    REQUIRE_THROWS_AS(batch_map(interpreter, "at", inputs, pool),
+                      IndexOutOfRange);
+    std::vector<uint32_t> small = {1, 2, 3};
+    REQUIRE(batch_map(interpreter, "at", small, pool) == small);
+  }
+
+  SECTION("Limits apply to each call") {
+    interpreter.get_evaluator().set_limits({.fuel = 200});
+    ThreadPool pool(2);
+    std::vector<uint32_t> small = {1, 2, 3, 6, 7};
+    REQUIRE(batch_map(interpreter, "collatz", small, pool) ==
+            std::vector<uint32_t>{0, 1, 7, 8, 16});
+    std::vector<uint32_t> large = {27};
+    REQUIRE_THROWS_AS(batch_map(interpreter, "collatz", large, pool),
+                      OutOfFuel);
+  }
+}
+
+namespace compile_time {
+
+constexpr const char *SUM_N =
+    "let Y = fn f { ( fn x { f ( fn a { ( x x ) a } ) } ) "
+    "( fn x { f ( fn a { ( x x ) a } ) } ) }\n"
+    "let sum_n = Y ( fn sum_n { fn n { "
+    "if n == 0 then 0 else n + sum_n ( n - 1 ) } } )\n"
+    "sum_n 10";
+constexpr const char *CURRIED = "( ( fn ( a , b ) a - b ) 7 ) 3";
+constexpr const char *BLOCK = "{ let x = 2 ; if x < 3 then x + 1 else 0 }";
+// A let in a block binds for the rest of the function body
+constexpr const char *LET_IN_BLOCK = "let f = fn x { { let y = x ; 0 } ; y }\n"
+                                     "\n"
+                                     "f 5";
+// Closures capture the environment when they are created
+constexpr const char *CAPTURE = "let a = 1\n"
+                                "let g = fn x { x + a }\n"
+                                "let a = 10\n"
+                                "( g 1 ) + a";
+constexpr const char *INFIX = "1 + 2 - 3 + 4 ; 0 - 1";
+constexpr const char *CLOSURE_IS_TRUE = "if ( fn x x ) then 1 else 2";
+
+static_assert(tiny::eval(SUM_N) == 55);
+static_assert(tiny::eval(CURRIED) == 4);
+static_assert(tiny::eval(BLOCK) == 3);
+static_assert(tiny::eval(LET_IN_BLOCK) == 5);
+static_assert(tiny::eval(CAPTURE) == 12);
+static_assert(tiny::eval(INFIX) == -1);
+static_assert(tiny::eval(CLOSURE_IS_TRUE) == 1);
+
+using namespace tiny::literals;
+static_assert("( fn x { x + 1 } ) 41"_tiny == 42);
+
+} // namespace compile_time
+
+TEST_CASE("Test compile-time evaluation", "[static]") {
+  using namespace compile_time;
+
+  SECTION("Same results at runtime, and as EvalVisitor") {
+    for (auto script : {SUM_N, CURRIED, BLOCK, LET_IN_BLOCK, CAPTURE, INFIX,
+                        CLOSURE_IS_TRUE}) {
+      EvalVisitor evaluator;
+      for (auto &node : parse_lines(script))
+        node->accept(evaluator);
+      auto expected = dynamic_pointer_cast<NumberValue>(evaluator.get_last());
+      // Not a constant expression, so evaluated at runtime
+      std::string source = script;
+      REQUIRE(tiny::eval(source) == expected->get_value());
+    }
+    REQUIRE(tiny::eval(std::string(SUM_N)) == tiny::eval(SUM_N));
+  }
+
+  SECTION("Errors") {
+    auto eval = [](std::string source) { return tiny::eval(source); };
+    REQUIRE_THROWS_AS(eval("x"), UnknownVariable);
+    REQUIRE_THROWS_AS(eval("1 +"), ParseError);
+    REQUIRE_THROWS_AS(eval("( 1 ) 2"), NotAFunction);
+    REQUIRE_THROWS_AS(eval("1 + ( fn x x )"), NotANumber);
+    REQUIRE_THROWS_AS(eval("fn x x"), NotANumber);
+    // Keywords, as with parse, even those of loops
+    REQUIRE_THROWS_AS(parse("let loop = 1 ; loop + 1"), ParseError);
+    REQUIRE_THROWS_AS(eval("let loop = 1 ; loop + 1"), ParseError);
+    REQUIRE_THROWS_AS(eval("let do = 1"), ParseError);
+    REQUIRE_THROWS_AS(eval("loop i = 0 while i < 3 do i + 1"), ParseError);
+  }
+}
+
+TEST_CASE("Test metrics", "[metrics]") {
+  using metrics::Counter, metrics::Error, metrics::Timing;
+  // Other tests run first and add to the same counters, so this only looks at
+  // differences
+  auto before = metrics::snapshot();
+
+  SECTION("Parse and eval errors by type") {
+    REQUIRE_THROWS(parse("1 +"));
+    REQUIRE_THROWS(parse("( 1"));
+    EvalVisitor evaluator;
+    for (auto line : {"let x = 1000", "x + y", "1 + ( fn x x )"}) {
+      auto program = parse(line);
+      try {
+        evaluator.evaluate(*program[0]);
+      } catch (const EvalError &) {
+      }
+    }
+    REQUIRE_THROWS_AS(evaluator.evaluate(*parse("( div 1 ) 0")[0]),
+                      DivisionByZero);
+
+    auto after = metrics::snapshot();
+    auto delta = [&](auto which) { return after.get(which) - before.get(which); };
+    REQUIRE(delta(Error::EofToken) + delta(Error::ParseError) == 2);
+    REQUIRE(delta(Error::UnknownVariable) == 1);
+    REQUIRE(delta(Error::NotANumber) == 1);
+    REQUIRE(delta(Error::DivisionByZero) == 1);
+    REQUIRE(delta(Error::EvalError) == 0);
+    REQUIRE(delta(Counter::Statements) == 4);
+    REQUIRE(delta(Counter::Closures) == 1);
+    REQUIRE(delta(Counter::Values) >= 2);
+    REQUIRE(delta(Counter::Bytes) > 0);
+    REQUIRE(after.get(Timing::Parse).count - before.get(Timing::Parse).count ==
+            6);
+    REQUIRE(after.get(Timing::Eval).count - before.get(Timing::Eval).count ==
+            4);
+  }
+
+  SECTION("Counts from threads that have exited") {
+    std::thread thread([] {
+      EvalVisitor evaluator;
+      for (auto &node : parse("let f = fn x x + 1 ; f 1 ; f 2"))
+        evaluator.evaluate(*node);
+    });
+    thread.join();
+    auto after = metrics::snapshot();
+    REQUIRE(after.get(Counter::Statements) - before.get(Counter::Statements) ==
+            3);
+    REQUIRE(after.get(Counter::Steps) - before.get(Counter::Steps) == 2);
+  }
+
+  SECTION("Prometheus format") {
+    metrics::Snapshot snapshot;
+    snapshot.counters[size_t(Counter::Statements)] = 5;
+    snapshot.errors[size_t(Error::EofToken)] = 2;
+    snapshot.errors[size_t(Error::OutOfFuel)] = 1;
+    auto &eval = snapshot.timings[size_t(Timing::Eval)];
+    // Under 2us, and under 4us
+    eval.buckets[1] = 3;
+    eval.buckets[2] = 1;
+    eval.count = 4;
+    eval.sum_ns = 7000;
+
+    auto text = metrics::prometheus(snapshot);
+    auto contains = [&](std::string line) {
+      return text.find(line + "\n") != std::string::npos;
+    };
+    REQUIRE(contains("# TYPE tiny_interp_statements_total counter"));
+    REQUIRE(contains("tiny_interp_statements_total 5"));
+    REQUIRE(contains(
+        "tiny_interp_errors_total{phase=\"parse\",type=\"EofToken\"} 2"));
+    REQUIRE(contains(
+        "tiny_interp_errors_total{phase=\"eval\",type=\"OutOfFuel\"} 1"));
+    REQUIRE(contains("# TYPE tiny_interp_eval_seconds histogram"));
+    REQUIRE(contains("tiny_interp_eval_seconds_bucket{le=\"1.024e-06\"} 0"));
+    REQUIRE(contains("tiny_interp_eval_seconds_bucket{le=\"2.048e-06\"} 3"));
+    REQUIRE(contains("tiny_interp_eval_seconds_bucket{le=\"4.096e-06\"} 4"));
+    REQUIRE(contains("tiny_interp_eval_seconds_bucket{le=\"+Inf\"} 4"));
+    REQUIRE(contains("tiny_interp_eval_seconds_sum 7e-06"));
+    REQUIRE(contains("tiny_interp_eval_seconds_count 4"));
+    REQUIRE(contains("tiny_interp_parse_seconds_count 0"));
+  }
+
+  SECTION("Dumper") {
+    auto path = std::filesystem::temp_directory_path() / "tiny-interp.prom";
+    std::filesystem::remove(path);
+    {
+      metrics::Dumper dumper(path, std::chrono::hours(1));
+      REQUIRE_FALSE(std::filesystem::exists(path));
+      dumper.dump();
+      REQUIRE(std::filesystem::exists(path));
+      std::filesystem::remove(path);
+    }
+    // Once more when destroyed
+    std::ifstream file(path);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    REQUIRE(contents.str().find("tiny_interp_statements_total ") !=
+            std::string::npos);
+    std::filesystem::remove(path);
+  }
+}
+
+TEST_CASE("Test capture and replay", "[replay]") {
+  auto path = std::filesystem::temp_directory_path() / "tiny-interp.log";
+  std::vector<std::string> lines = {"let f = fn x x + 1", "f 41", "f y",
+                                    "1 +", "let y = 2 ; f y"};
+  std::vector<Record> captured;
+  {
+    Session session;
+    std::ostringstream errors;
+    LogWriter writer(path);
+    for (size_t i = 0; i < lines.size(); ++i) {
+      auto record = run_line(session, lines[i], errors);
+      record.line = lines[i];
+      record.at = std::chrono::microseconds(i);
+      writer.write(record);
+      captured.push_back(record);
+    }
+    REQUIRE(errors.str().find("Unknown variable") != std::string::npos);
+  }
+  REQUIRE(captured[1].result != 0);
+  REQUIRE(captured[1].result != captured[4].result);
+  REQUIRE(captured[2].error == metrics::Error::UnknownVariable);
+  REQUIRE(captured[3].error == metrics::Error::ParseError);
+  REQUIRE_FALSE(captured[4].error);
+
+  SECTION("Round trip") {
+    auto log = read_log(path);
+    REQUIRE(log.size() == lines.size());
+    for (size_t i = 0; i < log.size(); ++i) {
+      REQUIRE(log[i].line == lines[i]);
+      REQUIRE(log[i].at == captured[i].at);
+      REQUIRE(log[i].parse == captured[i].parse);
+      REQUIRE(log[i].eval == captured[i].eval);
+      REQUIRE(log[i].result == captured[i].result);
+      REQUIRE(log[i].error == captured[i].error);
+    }
+  }
+
+  SECTION("Replaying matches") {
+    auto log = read_log(path);
+    auto replayed = replay(log, true);
+    REQUIRE(replayed.size() == lines.size());
+    std::ostringstream out;
+    REQUIRE(report(replayed, out));
+    REQUIRE(out.str().find("5 lines, 0 mismatched") != std::string::npos);
+  }
+
+  SECTION("Mismatches and regressions") {
+    auto log = read_log(path);
+    log[1].result ^= 1;
+    log[2].error.reset();
+    // Captured as instant, so any line slower than the threshold regressed
+    log[0].parse = log[0].eval = std::chrono::nanoseconds(0);
+    auto replayed = replay(log, false);
+    replayed[0].replayed.eval = std::chrono::milliseconds(1);
+
+    std::ostringstream out;
+    REQUIRE_FALSE(report(replayed, out));
+    auto text = out.str();
+    REQUIRE(text.find("line 2: result differs: f 41\n") != std::string::npos);
+    REQUIRE(text.find("line 3: no error when captured, UnknownVariable now") !=
+            std::string::npos);
+    REQUIRE(text.find("line 1: 0ms -> ") != std::string::npos);
+    REQUIRE(text.find("2 mismatched, 1 slower") != std::string::npos);
+  }
+
+  SECTION("Bad logs") {
+    {
+      std::ofstream file(path, std::ios::binary | std::ios::app);
+      file.put('\x05');
+    }
+    REQUIRE_THROWS_AS(read_log(path), BadLog);
+    {
+      std::ofstream file(path, std::ios::binary | std::ios::trunc);
+      file << "TINY";
+    }
+    REQUIRE_THROWS_AS(read_log(path), BadLog);
+    REQUIRE_THROWS_AS(read_log(path.string() + ".missing"), BadLog);
+  }
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("Test compiling to C++", "[codegen]") {
+  std::vector<std::string> programs = {
+      "1 + 2",
+      "let Y = fn f { ( fn x { f ( fn a { ( x x ) a } ) } ) "
+      "( fn x { f ( fn a { ( x x ) a } ) } ) } ; "
+      "let sum_n = Y ( fn sum_n { fn n { "
+      "if n == 0 then 0 else n + sum_n ( n - 1 ) } } ) ; sum_n 100",
+      "let count_down = fn ( self , n ) "
+      "if n == 0 then 7 else ( self self ) ( n - 1 ) ; "
+      "( count_down count_down ) 1000",
+      // Closures copy their environment when made
+      "let a = 5 ; let f = fn x x + a ; let a = 10 ; f 1",
+      "let a = 3 ; let f = fn x fn y x + y + a ; ( f 1 ) 2",
+      "let f = fn x y ; let y = 2 ; f 1",
+      "let f = fn ( a , b ) a + b ; f 1",
+      "( ( fn ( x , x ) x ) 1 ) 2",
+      // Builtins, and shadowing them
+      "add 1",
+      "( ( add 1 ) 2 ) + ( ( mul 3 ) 4 )",
+      "let h = fn x add ; let add = 5 ; ( ( h 0 ) 1 ) 2",
+      "let add = 5 ; add + 1",
+      // Arrays
+      "( map ( fn x x + 1 ) ) ( range 5 )",
+      "( filter ( fn x x > 2 ) ) ( range 5 )",
+      "( ( fold add ) 0 ) ( range 5 )",
+      "( ( range 3 ) + ( range 3 ) ) - 1",
+      "( range 3 ) < ( 0 - 1 )",
+      "( 1 + ( range 3 ) ) == ( range 3 )",
+      "range 0",
+      "( get ( range 4 ) ) 2",
+      "sum ( len ( range 4 ) + ( range 4 ) )",
+      "sum ( range 100000 )",
+      // Where `let`s bind
+      "let c = 0 ; if c then { let y = 1 } else { let y = 2 } ; y",
+      "{ let z = 3 } ; z",
+      "let g = fn x { let w = x ; w } ; g 3 ; w",
+      "{ }",
+      "if { } then 1 else 2",
+      // Loops and inlined applications
+      "loop ( n , acc ) = ( 10 , 0 ) while n do ( n - 1 , acc + n )",
+      "( loop ( i , f ) = ( 0 , 0 ) while 3 > i do "
+      "( i + 1 , fn x x + i ) ) 10",
+      "let t = 1 ; loop i = 0 while 3 > i do { let t = i ; i + 1 } ; t",
+      "let a = 1 ; ( ( fn a { let b = a ; b + 1 } ) 5 ) + a",
+      "( ( fn ( a , b ) a - b ) 10 ) 3",
+      // Tuples
+      "let p = ( 1 , ( 2 , 3 ) ) ; ( p . 1 . 0 + p . 0 , p )",
+      "let swap = fn ( ( a , b ) ) ( b , a ) ; swap ( 1 , fn x x )",
+      "let ( a , b ) = ( 4 , 5 ) ; { let ( a , c ) = ( b , a ) } ; a + c",
+      // Integers
+      "9223372036854775807 + 1",
+      "( ( mul 4294967296 ) 4294967296 ) - 1",
+      "( ( div ( 0 - 7 ) ) 2 , ( mod ( 0 - 7 ) ) 2 )",
+      "( ( shl 1 ) 100 ) - 100000000000000000000000000000000",
+      "( range 3 ) + 4294967297",
+      // Errors
+      "x",
+      "1 + ( fn x x )",
+      "( div 1 ) 0",
+      "1 2",
+      "( get ( range 2 ) ) 5",
+      "( range 2 ) + ( range 3 )",
+      "( map ( fn x fn y y ) ) ( range 2 )",
+      "len 1",
+      "1 . 0",
+      "( 1 , 2 ) . 2",
+      "( band 1 ) ( ( shl 1 ) 64 )",
+      "let ( a , b ) = ( 1 , 2 , 3 )",
+  };
+  auto interpret = [](const std::string &source) -> std::string {
+    try {
+      EvalVisitor evaluator;
+      for (auto &node : parse(source))
+        evaluator.evaluate(*node);
+      std::string text;
+      auto output = [&](std::string_view str) { text += str; };
+      FmtAst ast_formatter(output);
+      FmtValue value_formatter(ast_formatter, output);
+      if (evaluator.get_last())
+        evaluator.get_last()->accept(value_formatter);
+      return text;
+    } catch (const std::exception &e) {
+      return std::string("error: ") + e.what();
+    }
+  };
+  auto dir = make_temp_directory("tiny-interp-codegen");
+  auto build = [&](const std::string &name, const std::string &source) {
+    auto path = dir / name;
+    std::ofstream(path.string() + ".cpp") << source;
+    auto command = std::string(TINY_INTERP_CXX) + " -std=c++20 -I " +
+                   TINY_INTERP_RUNTIME_DIR + " " + path.string() + ".cpp -o " +
+                   path.string();
+    REQUIRE(std::system(command.c_str()) == 0);
+    return path.string();
+  };
+  auto read = [](const std::filesystem::path &path) {
+    std::ifstream file(path);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+  };
+
+  SECTION("Same results as the interpreter") {
+    // All in one unit, so that there is only one compile
+    std::string source = "#include \"runtime.hpp\"\n#include <iostream>\n\n";
+    std::string runs;
+    for (size_t i = 0; i < programs.size(); ++i) {
+      CodeGen codegen("p" + std::to_string(i));
+      for (auto &node : parse(programs[i]))
+        codegen.add(*node);
+      source += codegen.program();
+      runs += "p" + std::to_string(i) + "::run, ";
+    }
+    source += "int main(void) {\n"
+              "  for (auto run : {" + runs + "}) {\n"
+              "    try {\n"
+              "      std::string out;\n"
+              "      tiny::format(run(), out);\n"
+              "      std::cout << out << std::endl;\n"
+              "    } catch (const std::exception &e) {\n"
+              "      std::cout << \"error: \" << e.what() << std::endl;\n"
+              "    }\n"
+              "  }\n"
+              "}\n";
+    auto binary = build("programs", source);
+    REQUIRE(std::system((binary + " > " + binary + ".out").c_str()) == 0);
+
+    std::istringstream results(read(binary + ".out"));
+    for (auto &program : programs) {
+      std::string result;
+      REQUIRE(std::getline(results, result));
+      INFO(program);
+      REQUIRE(result == interpret(program));
+    }
+  }
+
+  SECTION("Whole units, with tail calls in constant stack") {
+    auto binary =
+        build("unit", compile(parse("let count_down = fn ( self , n ) "
+                                    "if n == 0 then 7 else "
+                                    "( self self ) ( n - 1 ) ; "
+                                    "( count_down count_down ) 1000000")));
+    REQUIRE(std::system((binary + " > " + binary + ".out").c_str()) == 0);
+    REQUIRE(read(binary + ".out") == "7\n");
+
+    binary = build("error", compile(parse("let x = 1 ; x + y")));
+    REQUIRE(std::system((binary + " 2> " + binary + ".out").c_str()) != 0);
+    REQUIRE(read(binary + ".out") == "Unknown variable\n");
+  }
+  std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Test sharing nodes", "[nodes]") {
+  NodeTable nodes;
+
+  SECTION("Repeated subtrees are one node") {
+    auto program = parse("( fn x x + 1 ) 2 ; ( fn x x + 1 ) 3", &nodes);
+    auto &first = dynamic_cast<const App &>(*program[0]);
+    auto &second = dynamic_cast<const App &>(*program[1]);
+    REQUIRE(&first.get_lhs() == &second.get_lhs());
+    REQUIRE(first.get_lhs().get_id() != 0);
+    REQUIRE(first.get_lhs().get_id() == second.get_lhs().get_id());
+    REQUIRE(first.get_rhs().get_id() != second.get_rhs().get_id());
+    // Top-level statements are not shared
+    REQUIRE(&first != &second);
+    REQUIRE(first.get_id() == 0);
+
+    // Nor is anything parsed without the table
+    auto unshared = parse("( fn x x + 1 ) 2 ; ( fn x x + 1 ) 2");
+    auto &lhs = dynamic_cast<const App &>(*unshared[0]).get_lhs();
+    REQUIRE(&lhs != &dynamic_cast<const App &>(*unshared[1]).get_lhs());
+    REQUIRE(lhs.get_id() == 0);
+
+    // Nor are later parses of the same text, once no longer in use
+    auto later = parse("( fn x x + 1 ) 4", &nodes);
+    REQUIRE(&dynamic_cast<const App &>(*later[0]).get_lhs() ==
+            &first.get_lhs());
+    program.clear();
+    later.clear();
+    REQUIRE(nodes.size() == 0);
+  }
+
+  SECTION("Stats") {
+    // `x`, `1`, `x + 1`, `fn x x + 1` and `2`, then the first four and `1`
+    // again
+    parse("( fn x x + 1 ) 2 ; ( fn x x + 1 ) 1", &nodes);
+    REQUIRE(nodes.get_stats().parsed == 10);
+    REQUIRE(nodes.get_stats().shared == 5);
+    REQUIRE(nodes.get_stats().shared_bytes <
+            nodes.get_stats().parsed_bytes);
+  }
+
+  SECTION("Same results as unshared trees") {
+    std::string formatted;
+    FmtAst ast_formatter([&](auto s) { formatted += s; });
+    FmtValue value_formatter(ast_formatter, [&](auto s) { formatted += s; });
+    auto run = [&](const std::vector<std::unique_ptr<Ast>> &program) {
+      EvalVisitor evaluator;
+      TypeChecker checker;
+      for (auto &node : program)
+        evaluate_checked(checker, evaluator, *node);
+      formatted = "";
+      evaluator.get_last()->accept(value_formatter);
+      return formatted;
+    };
+    std::string script =
+        "let g = fn ( x , y ) { let z = x + y ; z - 1 }\n"
+        "let h = fn ( x , y ) { let z = x + y ; z - 1 }\n"
+        "let a = ( ( fn ( a , b ) a + b ) 1 ) 2 + "
+        "( ( fn ( a , b ) a + b ) 1 ) 2\n"
+        "let n = loop ( i , n ) = ( 0 , 1 ) while i < 3 do ( i + 1 , n + n )\n"
+        "( ( map ( fn x ( g x ) 1 ) ) ( range 4 ) ) + ( ( h a ) n )";
+    REQUIRE(run(parse_lines(script)) == run(parse_lines(script, &nodes)));
+    REQUIRE("[ 13 , 14 , 15 , 16 ]" == formatted);
+  }
+
+  SECTION("Annotations hold wherever a node is shared") {
+    // The same `x`, a number in one function and a function in the other
+    auto program = parse("fn x x + 1 ; fn x x 1", &nodes);
+    auto &number = dynamic_cast<const Binop &>(
+        *dynamic_cast<const Fn &>(*program[0]).get_body());
+    auto &function = dynamic_cast<const App &>(
+        *dynamic_cast<const Fn &>(*program[1]).get_body());
+    REQUIRE(&number.get_lhs() == &function.get_lhs());
+
+    TypeChecker checker;
+    checker.check(*program[0]);
+    REQUIRE(number.get_lhs().get_proven() == Proven::Number);
+    checker.check(*program[1]);
+    REQUIRE(number.get_lhs().get_proven() == Proven::Unknown);
+    REQUIRE(number.get_rhs().get_proven() == Proven::Number);
+  }
+}
+
+TEST_CASE("Test lazy parsing", "[lazy]") {
+  std::string formatted;
+  FmtAst ast_formatter([&](auto s) { formatted += s; });
+  FmtValue value_formatter(ast_formatter, [&](auto s) { formatted += s; });
+  auto format = [&](const Rc<Value> &value) {
+    formatted = "";
+    value->accept(value_formatter);
+    return formatted;
+  };
+  auto body = [](const Ast &statement) -> const Ast & {
+    auto &let = dynamic_cast<const Assignment &>(statement);
+    return *dynamic_cast<const Fn &>(let.get_body()).get_body();
+  };
+  std::string script =
+      "let f = fn x { let y = x + 1 ; fn z { y + z } }\n"
+      "let g = fn ( a , b ) { ( f a ) b }\n"
+      "let unused = fn x { x x }\n"
+      "let applied = fn x { fn y y } x\n"
+      "let added = fn x { x } + 1\n"
+      "let projected = fn x { ( x , 2 ) } . 1\n"
+      "( g 1 ) 2 + applied 3 + added 2 + projected 5";
+
+  SECTION("Bodies are parsed when first called") {
+    auto program = parse_lines(script, nullptr, true);
+    auto &lazy = dynamic_cast<const LazyBody &>(body(*program[0]));
+    REQUIRE(lazy.get_source() == "{ let y = x + 1 ; fn z { y + z } }");
+    REQUIRE_FALSE(lazy.is_parsed());
+    // Only blocks which are all of the body
+    REQUIRE(dynamic_cast<const LazyBody *>(&body(*program[3])) == nullptr);
+    REQUIRE(dynamic_cast<const LazyBody *>(&body(*program[4])) == nullptr);
+    REQUIRE(dynamic_cast<const LazyBody *>(&body(*program[5])) == nullptr);
+
+    EvalVisitor evaluator;
+    for (auto &node : program)
+      evaluator.evaluate(*node);
+    REQUIRE(format(evaluator.get_last()) == "12");
+    REQUIRE(lazy.is_parsed());
+    REQUIRE(dynamic_cast<const LazyBody &>(body(*program[1])).is_parsed());
+    REQUIRE_FALSE(
+        dynamic_cast<const LazyBody &>(body(*program[2])).is_parsed());
+  }
+
+  SECTION("Same results as parsing eagerly") {
+    auto eager = parse_lines(script);
+    auto lazy = parse_lines(script, nullptr, true);
+    EvalVisitor expected, evaluator;
+    TypeChecker checker;
+    CekMachine machine;
+    for (size_t i = 0; i < eager.size(); ++i) {
+      expected.evaluate(*eager[i]);
+      // Not checked, so evaluated without types
+      evaluate_checked(checker, evaluator, *lazy[i]);
+      machine.evaluate(*lazy[i]);
+      REQUIRE(format(evaluator.get_last()) == format(expected.get_last()));
+      REQUIRE(format(machine.get_last()) == format(expected.get_last()));
+    }
+    REQUIRE_THROWS_AS(checker.check(*lazy[0]), TypeError);
+
+    Task task(*lazy.back(), evaluator.get_environment(), 1);
+    while (!task.resume()) {
+    }
+    REQUIRE(format(task.get_result()) == "12");
+
+    // Formatting shows the parsed body
+    auto &unused = dynamic_cast<const Assignment &>(*lazy[2]).get_body();
+    formatted = "";
+    unused.accept(ast_formatter);
+    auto shown = formatted;
+    formatted = "";
+    dynamic_cast<const Assignment &>(*eager[2]).get_body().accept(
+        ast_formatter);
+    REQUIRE(shown == formatted);
+  }
+
+  SECTION("Errors in bodies are found when called") {
+    auto program = parse("let broken = fn x { x + } ; 1", nullptr, true);
+    EvalVisitor evaluator;
+    evaluator.evaluate(*program[0]);
+    evaluator.evaluate(*program[1]);
+    REQUIRE_THROWS_AS(evaluator.evaluate(*parse("broken 1")[0]), ParseError);
+    // Unbalanced braces are found up front
+    REQUIRE_THROWS_AS(parse("fn x { x", nullptr, true), ParseError);
+  }
+}
+
+TEST_CASE("Test tuples", "[tuple]") {
+  std::string formatted;
+  FmtAst ast_formatter([&](auto s) { formatted += s; });
+  FmtValue value_formatter(ast_formatter, [&](auto s) { formatted += s; });
+  auto format = [&](const Ast &ast) {
+    formatted = "";
+    ast.accept(ast_formatter);
+    return formatted;
+  };
+  auto show = [&](const Rc<Value> &value) {
+    formatted = "";
+    value->accept(value_formatter);
+    return formatted;
+  };
+  auto run = [&](const std::string &script) {
+    EvalVisitor evaluator;
+    for (auto &node : parse(script))
+      evaluator.evaluate(*node);
+    return show(evaluator.get_last());
+  };
+
+  SECTION("Parsing") {
+    REQUIRE(format(*parse("( 1 , x + 2 ) . 1")[0]) ==
+            "( ( ( 1 ) , ( ( x ) + ( 2 ) ) ) ) . 1");
+    REQUIRE(format(*parse("let ( a , b ) = p")[0]) == "let ( a , b ) = p");
+    // Projection binds tighter than application
+    REQUIRE(format(*parse("f p . 0")[0]) == "( f ) ( ( p ) . 0 )");
+    REQUIRE_NOTHROW(parse("( 1 , 2 , 3 , 4 , 5 , 6 , 7 , 8 )"));
+    REQUIRE_THROWS_AS(parse("( 1 , 2 , 3 , 4 , 5 , 6 , 7 , 8 , 9 )"),
+                      ParseError);
+    REQUIRE_THROWS_AS(parse("p . x"), ParseError);
+    REQUIRE_THROWS_AS(parse("let ( a ) = p"), ParseError);
+    REQUIRE_THROWS_AS(parse("fn ( ( a ) , b ) a"), ParseError);
+  }
+
+  SECTION("Evaluation") {
+    REQUIRE(run("( 1 , ( 2 , 3 ) )") == "( 1 , ( 2 , 3 ) )");
+    REQUIRE(run("let p = ( 1 , ( 2 , 3 ) ) ; p . 1 . 0 + p . 0") == "3");
+    REQUIRE(run("let ( a , b ) = ( 4 , 5 ) ; b - a") == "1");
+    REQUIRE(run("let swap = fn ( ( a , b ) ) ( b , a ) ; swap ( 1 , 2 )") ==
+            "( 2 , 1 )");
+    REQUIRE(run("let f = fn ( ( a , b ) , c ) a + b + c ; ( f ( 1 , 2 ) ) 3") ==
+            "6");
+    // Names bound by destructuring in a body are local to it
+    REQUIRE(run("let a = 7 ; let f = fn p { let ( a , b ) = p ; b } ; "
+                "f ( 1 , 2 ) + a") == "9");
+    REQUIRE_THROWS_AS(run("1 . 0"), NotATuple);
+    REQUIRE_THROWS_AS(run("( 1 , 2 ) . 2"), IndexOutOfRange);
+    REQUIRE_THROWS_AS(run("let ( a , b ) = ( 1 , 2 , 3 )"), NotATuple);
+  }
+
+  SECTION("Fields are inline") {
+    EvalVisitor evaluator;
+    evaluator.evaluate(*parse("( 1 , 2 , 3 )")[0]);
+    auto tuple =
+        dynamic_cast<const InlineTuple<3> *>(evaluator.get_last().get());
+    REQUIRE(tuple != nullptr);
+    REQUIRE(tuple->size() == 3);
+    REQUIRE(show(tuple->get(2)) == "3");
+  }
+
+  SECTION("Same results from every evaluator") {
+    std::string script = "let swap = fn ( ( a , b ) ) ( b , a )\n"
+                         "let ( x , y ) = swap ( 1 , ( 2 , 3 ) )\n"
+                         "( x . 1 , y , swap x ) . 2";
+    auto program = parse_lines(script);
+    EvalVisitor expected, checked;
+    TypeChecker checker;
+    CekMachine machine;
+    for (auto &node : program) {
+      expected.evaluate(*node);
+      evaluate_checked(checker, checked, *node);
+      machine.evaluate(*node);
+      REQUIRE(show(checked.get_last()) == show(expected.get_last()));
+      REQUIRE(show(machine.get_last()) == show(expected.get_last()));
+    }
+    REQUIRE(show(expected.get_last()) == "( 3 , 2 )");
+
+    Task task(*program.back(), expected.get_environment(), 1);
+    while (!task.resume()) {
+    }
+    REQUIRE(show(task.get_result()) == "( 3 , 2 )");
+
+    auto copy = deserialise(serialise(program, 0), 0);
+    for (size_t i = 0; i < program.size(); ++i)
+      REQUIRE(format(*copy[i]) == format(*program[i]));
+  }
+
+  SECTION("Types") {
+    TypeChecker checker;
+    auto type = [&](const std::string &source) {
+      return TypeChecker::format(checker.check(*parse(source)[0]));
+    };
+    REQUIRE(type("( 1 , fn x x )") == "( num , a -> a )");
+    REQUIRE(type("fn ( ( a , b ) ) ( b , a )") == "( a , b ) -> ( b , a )");
+    REQUIRE(type("( 1 , ( 2 , 3 ) ) . 1 . 0") == "num");
+    REQUIRE(type("let ( f , n ) = ( fn x x , 1 )") == "( a -> a , num )");
+    checker.commit();
+    // Polymorphic, as with `let`
+    REQUIRE(type("( f 1 , f f )") == "( num , a -> a )");
+    // The size of `p` is not known
+    REQUIRE_THROWS_AS(type("fn p p . 0"), TypeError);
+    REQUIRE_THROWS_AS(type("( 1 , 2 ) . 2"), TypeError);
+    REQUIRE_THROWS_AS(type("( 1 , 2 ) + 1"), TypeError);
+    REQUIRE(TypeChecker::format(TypeChecker::parse("( num , a ) -> a")) ==
+            "( num , a ) -> a");
+  }
+}
+
+TEST_CASE("Test integers", "[integer]") {
+  std::string formatted;
+  FmtAst ast_formatter([&](auto s) { formatted += s; });
+  FmtValue value_formatter(ast_formatter, [&](auto s) { formatted += s; });
+  auto show = [&](const Rc<Value> &value) {
+    formatted = "";
+    value->accept(value_formatter);
+    return formatted;
+  };
+  auto run = [&](const std::string &script) {
+    EvalVisitor evaluator;
+    for (auto &node : parse(script))
+      evaluator.evaluate(*node);
+    return show(evaluator.get_last());
+  };
+
+  SECTION("Arithmetic") {
+    Integer max = INT64_MAX, min = INT64_MIN;
+    REQUIRE((max + 1).to_string() == "9223372036854775808");
+    REQUIRE(!(max + 1).is_small());
+    REQUIRE((max + 1 - 1) == max);
+    REQUIRE((max + 1 - 1).is_small());
+    REQUIRE((min - 1).to_string() == "-9223372036854775809");
+    REQUIRE((min / -1).to_string() == "9223372036854775808");
+    REQUIRE((min % -1) == 0);
+    REQUIRE((max * max + 1).to_string() ==
+            "85070591730234615847396907784232501250");
+    auto big = Integer::parse("123456789012345678901234567890");
+    REQUIRE(big.to_string() == "123456789012345678901234567890");
+    REQUIRE((big * big / big) == big);
+    REQUIRE((big % 1000000007).to_string() == "197434842");
+    // Rounding towards zero, as in C++
+    REQUIRE(((Integer(0) - big) / 11).to_string() ==
+            "-11223344455667788991021324353");
+    REQUIRE(((Integer(0) - big) % 11) == -7);
+    REQUIRE(Integer(0) - big < min);
+    REQUIRE(big > max);
+    REQUIRE(big.low32() == uint32_t(0x4E3F0AD2));
+    REQUIRE(Integer::parse("00042") == 42);
+  }
+
+  SECTION("Evaluation") {
+    REQUIRE(run("99999999999999999999") == "99999999999999999999");
+    REQUIRE(run("9223372036854775807 + 1") == "9223372036854775808");
+    REQUIRE(run("0 - 1") == "-1");
+    REQUIRE(run("( 0 - 1 ) < 0") == "1");
+    REQUIRE(run("if 100000000000000000000 - 100000000000000000000 then 1 "
+                "else 2") == "2");
+    REQUIRE(run("( mul 4294967296 ) 4294967296") == "18446744073709551616");
+    REQUIRE(run("( shl 1 ) 64") == "18446744073709551616");
+    REQUIRE(run("( shr ( 0 - 8 ) ) 1") == "-4");
+    REQUIRE(run("( max 100000000000000000000 ) 1") == "100000000000000000000");
+    REQUIRE_THROWS_AS(run("( band 1 ) ( ( shl 1 ) 64 )"), NumberOutOfRange);
+    REQUIRE_THROWS_AS(run("( shl 1 ) 100000"), NumberOutOfRange);
+    REQUIRE_THROWS_AS(run("range ( 0 - 1 )"), NumberOutOfRange);
+    REQUIRE_THROWS_AS(run("( get ( range 2 ) ) ( 0 - 1 )"), IndexOutOfRange);
+    REQUIRE_THROWS_AS(run("( div 100000000000000000000 ) 0"), DivisionByZero);
+    // Arrays hold 32 bits, and wrap
+    REQUIRE(run("( range 2 ) - 1") == "[ 4294967295 , 0 ]");
+    REQUIRE(run("( map ( fn x x + 4294967296 ) ) ( range 2 )") == "[ 0 , 1 ]");
+    // But numbers operated on with them have to fit in them
+    REQUIRE(run("( range 2 ) + 4294967295") == "[ 4294967295 , 0 ]");
+    REQUIRE_THROWS_AS(run("( range 3 ) < ( 0 - 1 )"), NumberOutOfRange);
+    REQUIRE_THROWS_AS(run("4294967296 + ( range 3 )"), NumberOutOfRange);
+  }
+
+  SECTION("Same results from every evaluator") {
+    std::string script = "let fact = fn ( self , n ) if n == 0 then 1 "
+                         "else ( mul n ) ( ( self self ) ( n - 1 ) )\n"
+                         "( fact fact ) 30";
+    auto program = parse_lines(script);
+    EvalVisitor expected, checked;
+    TypeChecker checker;
+    CekMachine machine;
+    for (auto &node : program) {
+      expected.evaluate(*node);
+      evaluate_checked(checker, checked, *node);
+      machine.evaluate(*node);
+      REQUIRE(show(checked.get_last()) == show(expected.get_last()));
+      REQUIRE(show(machine.get_last()) == show(expected.get_last()));
+    }
+    REQUIRE(show(expected.get_last()) == "265252859812191058636308480000000");
+
+    Task task(*program.back(), expected.get_environment(), 1);
+    while (!task.resume()) {
+    }
+    REQUIRE(show(task.get_result()) == "265252859812191058636308480000000");
+  }
+
+  SECTION("Literals") {
+    auto program = parse("( 18446744073709551616 , 9223372036854775807 )");
+    std::string text;
+    FmtAst formatter([&](auto s) { text += s; });
+    program[0]->accept(formatter);
+    REQUIRE(text == "( ( 18446744073709551616 ) , ( 9223372036854775807 ) )");
+
+    auto copy = deserialise(serialise(program, 0), 0);
+    std::string copied;
+    FmtAst copy_formatter([&](auto s) { copied += s; });
+    copy[0]->accept(copy_formatter);
+    REQUIRE(copied == text);
+
+    // Too long for a varint or an int
+    REQUIRE_NOTHROW(parse("f . 4294967295"));
+    REQUIRE_THROWS_AS(parse("f . 4294967296"), ParseError);
+  }
+
+  SECTION("Limits elsewhere") {
+    Interpreter interpreter;
+    interpreter.load("let big = fn x ( mul x ) 4294967296");
+    auto big = interpreter.prepare("big");
+    REQUIRE(big(0) == 0);
+    REQUIRE_THROWS_AS(big(1), NumberOutOfRange);
+
+    REQUIRE(tiny::eval("9223372036854775806 + 1") == INT64_MAX);
+    REQUIRE_THROWS_AS(tiny::eval("9223372036854775807 + 1"), NumberOutOfRange);
+    REQUIRE_THROWS_AS(tiny::eval("9223372036854775808"), NumberOutOfRange);
+  }
+}
+
+TEST_CASE("Test reference counting", "[rc]") {
+  struct Tracked : RefCounted {
+    Tracked(bool &freed) : freed(freed) {}
+    ~Tracked() { freed = true; }
+    bool &freed;
+  };
+
+  SECTION("Freed with the last reference") {
+    bool freed = false;
+    auto a = make_rc<Tracked>(freed);
+    auto b = a;
+    Rc<RefCounted> c = std::move(a);
+    REQUIRE(a == nullptr);
+    REQUIRE(b == c);
+    b.reset();
+    REQUIRE(!freed);
+    c = nullptr;
+    REQUIRE(freed);
+  }
+
+  SECTION("Casts") {
+    Rc<Value> value = make_rc<NumberValue>(1);
+    REQUIRE(dynamic_pointer_cast<ClosureValue>(value) == nullptr);
+    REQUIRE(dynamic_pointer_cast<NumberValue>(value)->get_value() == 1);
+    REQUIRE(static_pointer_cast<NumberValue>(value) == value);
+  }
+
+  SECTION("Sharing a value shares what it refers to") {
+    EvalVisitor evaluator;
+    // Closures copy the environment they are made in, but not `b`
+    for (auto &node : parse_lines("let a = 1000\nlet f = fn x ( x + a , x )\n"
+                                  "let b = 2000"))
+      evaluator.evaluate(*node);
+    auto f = evaluator.lookup(Identifier("f"));
+    REQUIRE(!f->is_shared());
+    f->share();
+    REQUIRE(f->is_shared());
+    REQUIRE(evaluator.lookup(Identifier("a"))->is_shared());
+    REQUIRE(!evaluator.lookup(Identifier("b"))->is_shared());
+    // Values made from it later are not
+    auto result = evaluator.apply(f, evaluator.make_number(1));
+    REQUIRE(!result->is_shared());
+    REQUIRE(!as_tuple(result, 2).get(0)->is_shared());
+    // Builtins are used by evaluators on every thread
+    REQUIRE(evaluator.lookup(Identifier("add"))->is_shared());
+  }
+
+  SECTION("Shared values can be copied on many threads") {
+    bool freed = false;
+    auto shared = make_rc<Tracked>(freed);
+    shared->share();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+      threads.emplace_back([&] {
+        for (int j = 0; j < 100000; ++j) {
+          Rc<Tracked> copy = shared;
+        }
+      });
+    }
+    for (auto &thread : threads)
+      thread.join();
+    REQUIRE(!freed);
+    shared.reset();
+    REQUIRE(freed);
+  }
+}
+
+TEST_CASE("Test profiling", "[profile]") {
+  BuiltinRegistry registry = BuiltinRegistry::standard();
+  Profiler *profiler = nullptr;
+  // Samples where it is called, so that the stacks are known
+  registry.add("probe", 1, [&](auto &args, auto &) {
+    profiler->sample();
+    return args[0];
+  });
+  EvalVisitor evaluator(registry);
+  auto run = [&](const std::string &source) {
+    for (auto &node : parse_lines(source))
+      evaluator.evaluate(*node);
+  };
+
+  SECTION("Stacks of named and unnamed functions") {
+    run("let before = fn x probe x");
+    Profiler attached(evaluator);
+    profiler = &attached;
+    run("let f = fn x probe x\n"
+        "let g = fn x { f x ; f x }\n"
+        "g 1\n"
+        "probe 1\n"
+        "before 2\n"
+        "( fn y probe y ) 3");
+    REQUIRE(attached.get_samples() == 5);
+    REQUIRE(attached.collapsed() == "[top level] 1\n"
+                                    "before 1\n"
+                                    "g;f 2\n"
+                                    "fn y ( probe ) ( y ) 1\n");
+    REQUIRE(attached.top(2) == "5 samples\n"
+                               "  self   total  function\n"
+                               " 40.0%   40.0%  f\n"
+                               " 20.0%  100.0%  [top level]\n");
+    attached.clear();
+    REQUIRE(attached.get_samples() == 0);
+    REQUIRE(attached.collapsed().empty());
+  }
+
+  SECTION("Only the innermost calls are kept") {
+    Profiler attached(evaluator);
+    profiler = &attached;
+    run("let down = fn ( self , n ) "
+        "if n then ( self self ) ( n - 1 ) else probe 0\n"
+        "( down down ) 100");
+    std::string stack = "[...]";
+    for (size_t i = 0; i < SAMPLED_CALLS; ++i)
+      stack += ";down";
+    REQUIRE(attached.collapsed() == stack + " 1\n");
+  }
+
+  SECTION("Bodies outlive their statements") {
+    Profiler attached(evaluator);
+    profiler = &attached;
+    {
+      auto program = parse("( ( fn ( a , b ) probe b ) 1 ) 2");
+      evaluator.evaluate(*program[0]);
+    }
+    REQUIRE(attached.collapsed() == "fn ( a , b ) ( probe ) ( b ) 1\n");
+  }
+
+  SECTION("Sampling on a timer") {
+    Profiler attached(evaluator);
+    attached.start(10000);
+    EvalVisitor elsewhere;
+    Profiler other(elsewhere);
+    REQUIRE_THROWS_AS(other.start(), ProfilerError);
+    run("let spin = fn n loop i = n while i do i - 1");
+    // Some samples may land in the parser, but most should be in `spin`
+    for (int i = 0; i < 10000 && attached.get_samples() < 100; ++i)
+      run("spin 10000");
+    attached.stop();
+    REQUIRE(attached.get_samples() >= 100);
+    REQUIRE(attached.collapsed().find("spin") != std::string::npos);
+  }
+}
+
+TEST_CASE("Test history", "[history]") {
+  auto dir = make_temp_directory("tiny-interp-history");
+  auto path = (dir / "history").string();
+  auto lines = [](size_t from, size_t to) {
+    std::vector<std::string> lines;
+    for (size_t i = from; i < to; ++i)
+      lines.push_back("let x" + std::to_string(i) + " = " + std::to_string(i));
+    return lines;
+  };
+
+  SECTION("Appended lines are loaded back") {
+    REQUIRE(load_history(path).empty());
+    {
+      HistoryWriter writer(path);
+      for (auto &line : lines(0, 10))
+        writer.append(line);
+      writer.flush();
+      REQUIRE(load_history(path) == lines(0, 10));
+      writer.append("");
+      writer.append("last");
+    }
+    auto all = lines(0, 10);
+    all.push_back("");
+    all.push_back("last");
+    REQUIRE(load_history(path) == all);
+    REQUIRE(load_history(path, 2) == std::vector<std::string>{"", "last"});
+  }
+
+  SECTION("Only the end is loaded") {
+    // As written by readline's write_history, and without a last newline
+    std::ofstream file(path);
+    for (auto &line : lines(0, 100000))
+      file << line << "\n";
+    file << "no newline";
+    file.close();
+    auto expected = lines(100000 - HISTORY_LINES + 1, 100000);
+    expected.push_back("no newline");
+    REQUIRE(load_history(path) == expected);
+  }
+
+  SECTION("The file is rotated when full") {
+    std::string line(1000, 'x');
+    {
+      HistoryWriter writer(path);
+      for (size_t i = 0; i < HISTORY_MAX_BYTES / 1000 + 10; ++i)
+        writer.append(line);
+      writer.flush();
+      writer.append("after");
+    }
+    REQUIRE(std::filesystem::file_size(path + ".1") > HISTORY_MAX_BYTES);
+    REQUIRE(std::filesystem::file_size(path) < HISTORY_MAX_BYTES);
+    // The history goes on into the rotated file
+    auto loaded = load_history(path);
+    REQUIRE(loaded.size() == HISTORY_LINES);
+    REQUIRE(loaded.back() == "after");
+    REQUIRE(std::all_of(loaded.begin(), loaded.end() - 1,
+                        [&](auto &loaded) { return loaded == line; }));
+  }
+
+  SECTION("Reading lines from a pipe") {
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+    // Longer than the reader's buffer
+    std::string long_line(200000, 'y');
+    std::thread writer([&] {
+      std::string text = "one\n\n" + long_line + "\nlast";
+      for (size_t at = 0; at < text.size();) {
+        auto n = write(fds[1], text.data() + at, text.size() - at);
+        if (n <= 0)
+          break;
+        at += n;
+      }
+      close(fds[1]);
+    });
+    LineReader reader(fds[0]);
+    REQUIRE(reader.read() == "one");
+    REQUIRE(reader.read() == "");
+    REQUIRE(reader.read() == long_line);
+    REQUIRE(reader.read() == "last");
+    REQUIRE(reader.read() == std::nullopt);
+    REQUIRE(reader.read() == std::nullopt);
+    writer.join();
+    close(fds[0]);
+  }
+
+  std::filesystem::remove_all(dir);
+}